@@ -0,0 +1,42 @@
+###########################################################################
+#   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 #
+#                                                                         #
+#   This file is part of OCLToys.                                         #
+#                                                                         #
+#   OCLToys is free software; you can redistribute it and/or modify       #
+#   it under the terms of the GNU General Public License as published by  #
+#   the Free Software Foundation; either version 3 of the License, or     #
+#   (at your option) any later version.                                   #
+#                                                                         #
+#   OCLToys is distributed in the hope that it will be useful,            #
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of        #
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         #
+#   GNU General Public License for more details.                          #
+#                                                                         #
+#   You should have received a copy of the GNU General Public License     #
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>. #
+#                                                                         #
+#   OCLToys website: http://code.google.com/p/ocltoys                     #
+###########################################################################
+
+###########################################################################
+#
+# Definition of the function for embedding OpenCL kernels in the executables
+#
+###########################################################################
+
+# Generates ${CMAKE_CURRENT_BINARY_DIR}/embedded_${KERNEL}.cpp with the content
+# of the SOURCE file. The generated file has to be added to the sources of the
+# executable and the kernel is then returned by ReadSources(KERNEL, TOOL)
+# without reading any file.
+FUNCTION(EmbedOCLKernel TOOL KERNEL SOURCE)
+	MESSAGE(STATUS "Embedding OpenCL kernel: " ${KERNEL})
+
+	add_custom_command(
+		OUTPUT ${CMAKE_CURRENT_BINARY_DIR}/embedded_${KERNEL}.cpp
+		COMMAND ${CMAKE_COMMAND} -DTOOL=${TOOL} -DKERNEL=${KERNEL} -DSOURCE=${SOURCE}
+			-DOUTPUT=${CMAKE_CURRENT_BINARY_DIR}/embedded_${KERNEL}.cpp
+			-P ${OCLToys_SOURCE_DIR}/cmake/Utils/KernelToSource.cmake
+		DEPENDS ${SOURCE} ${OCLToys_SOURCE_DIR}/cmake/Utils/KernelToSource.cmake
+	)
+ENDFUNCTION(EmbedOCLKernel)
@@ -25,17 +25,38 @@
 #
 ###########################################################################
 
+# PreprocessOCLKernel(KERNEL [VARIANT DEFINES...]) writes preprocessed_${KERNEL}
+# or, for a variant, preprocessed_${VARIANT}_${KERNEL} preprocessed with the
+# DEFINES (i.e. -DPARAM_PREVIEW)
 FUNCTION(PreprocessOCLKernel KERNEL)
-	MESSAGE(STATUS "Preprocessing OpenCL kernel: " ${KERNEL})
+	IF(ARGC GREATER 1)
+		SET(OUTPUT_KERNEL preprocessed_${ARGV1}_${KERNEL})
+		SET(DEFINES ${ARGN})
+		LIST(REMOVE_AT DEFINES 0)
+	ELSE(ARGC GREATER 1)
+		SET(OUTPUT_KERNEL preprocessed_${KERNEL})
+		SET(DEFINES "")
+	ENDIF(ARGC GREATER 1)
+
+	MESSAGE(STATUS "Preprocessing OpenCL kernel: " ${KERNEL} " (" ${OUTPUT_KERNEL} ")")
 
 	IF(WIN32)
 		# TODO
 		MESSAGE(STATUS "ERROR: Kernel preprocessing is not available on Windows (TODO)")
+
+		# Use the preprocessed kernel of the sources
+		add_custom_command(
+			OUTPUT ${CMAKE_CURRENT_BINARY_DIR}/${OUTPUT_KERNEL}
+			COMMAND ${CMAKE_COMMAND} -E copy_if_different ${CMAKE_CURRENT_SOURCE_DIR}/${OUTPUT_KERNEL}
+				${CMAKE_CURRENT_BINARY_DIR}/${OUTPUT_KERNEL}
+			DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/${OUTPUT_KERNEL}
+		)
 	ELSE(WIN32)
 		add_custom_command(
-			OUTPUT preprocessed_${KERNEL}
-			COMMAND cpp -I. -I../common <${KERNEL} >preprocessed_${KERNEL}
-			MAIN_DEPENDENCY ${KERNEL}
+			OUTPUT ${CMAKE_CURRENT_BINARY_DIR}/${OUTPUT_KERNEL}
+			COMMAND cpp -I. -I../common ${DEFINES} <${KERNEL} >${CMAKE_CURRENT_BINARY_DIR}/${OUTPUT_KERNEL}
+			WORKING_DIRECTORY ${CMAKE_CURRENT_SOURCE_DIR}
+			DEPENDS ${CMAKE_CURRENT_SOURCE_DIR}/${KERNEL}
 		)
 	ENDIF(WIN32)
 ENDFUNCTION(PreprocessOCLKernel)
@@ -0,0 +1,57 @@
+###########################################################################
+#   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 #
+#                                                                         #
+#   This file is part of OCLToys.                                         #
+#                                                                         #
+#   OCLToys is free software; you can redistribute it and/or modify       #
+#   it under the terms of the GNU General Public License as published by  #
+#   the Free Software Foundation; either version 3 of the License, or     #
+#   (at your option) any later version.                                   #
+#                                                                         #
+#   OCLToys is distributed in the hope that it will be useful,            #
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of        #
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         #
+#   GNU General Public License for more details.                          #
+#                                                                         #
+#   You should have received a copy of the GNU General Public License     #
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>. #
+#                                                                         #
+#   OCLToys website: http://code.google.com/p/ocltoys                     #
+###########################################################################
+
+###########################################################################
+#
+# Script converting an OpenCL kernel in a C++ source file (see
+# KernelEmbed.cmake). It is run with:
+#
+#   cmake -DTOOL=<toy> -DKERNEL=<file name> -DSOURCE=<kernel path>
+#     -DOUTPUT=<C++ file> -P KernelToSource.cmake
+#
+###########################################################################
+
+# The kernel is written as an array of bytes: it avoids any escaping and the
+# length limits of string literals of some compilers
+file(READ ${SOURCE} KERNEL_HEX HEX)
+# 16 bytes for each line
+set(LINE_REGEX "")
+foreach(I RANGE 15)
+	set(LINE_REGEX "${LINE_REGEX}[0-9a-f][0-9a-f]")
+endforeach(I)
+string(REGEX REPLACE "(${LINE_REGEX})" "\\1\n\t" KERNEL_HEX "${KERNEL_HEX}")
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1, " KERNEL_BYTES "${KERNEL_HEX}")
+string(REPLACE ", \n" ",\n" KERNEL_BYTES "${KERNEL_BYTES}")
+
+string(REGEX REPLACE "[^A-Za-z0-9_]" "_" KERNEL_ID "${TOOL}_${KERNEL}")
+
+file(WRITE ${OUTPUT}
+"// Generated by cmake/Utils/KernelToSource.cmake from ${SOURCE}, do not edit
+
+#include \"embeddedkernels.h\"
+
+static const unsigned char ${KERNEL_ID}_source[] = {
+	${KERNEL_BYTES}0x00
+};
+
+static const OCLEmbeddedKernel ${KERNEL_ID}(\"${TOOL}\", \"${KERNEL}\",
+		(const char *)${KERNEL_ID}_source, sizeof(${KERNEL_ID}_source) - 1);
+")
@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+#include "asyncbuild.h"
+
+OCLAsyncProgramBuild::OCLAsyncProgramBuild(const boost::function<cl::Program ()> &compile) :
+		done(false), failed(false), oclError(false), errorCode(CL_SUCCESS) {
+	buildThread = new boost::thread(boost::bind(&OCLAsyncProgramBuild::BuildThreadImpl, this, compile));
+}
+
+OCLAsyncProgramBuild::~OCLAsyncProgramBuild() {
+	buildThread->join();
+	delete buildThread;
+}
+
+bool OCLAsyncProgramBuild::IsDone() const {
+	boost::unique_lock<boost::mutex> lock(doneMutex);
+	return done;
+}
+
+cl::Program OCLAsyncProgramBuild::Wait() {
+	boost::unique_lock<boost::mutex> lock(doneMutex);
+	while (!done)
+		doneCondition.wait(lock);
+
+	if (failed) {
+		if (oclError)
+			throw cl::Error(errorCode, errorMessage.c_str());
+		else
+			throw std::runtime_error(errorMessage);
+	}
+
+	return program;
+}
+
+void OCLAsyncProgramBuild::BuildThreadImpl(const boost::function<cl::Program ()> &compile) {
+	cl::Program prg;
+	bool buildFailed = false;
+	bool buildOCLError = false;
+	cl_int code = CL_SUCCESS;
+	std::string message;
+	try {
+		prg = compile();
+	} catch (cl::Error err) {
+		buildFailed = true;
+		buildOCLError = true;
+		code = err.err();
+		message = err.what();
+	} catch (std::exception &err) {
+		buildFailed = true;
+		message = err.what();
+	}
+
+	boost::unique_lock<boost::mutex> lock(doneMutex);
+	program = prg;
+	failed = buildFailed;
+	oclError = buildOCLError;
+	errorCode = code;
+	errorMessage = message;
+	done = true;
+	doneCondition.notify_all();
+}
@@ -0,0 +1,63 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef ASYNCBUILD_H
+#define	ASYNCBUILD_H
+
+#include "opencl.h"
+
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+// Runs the compilation of an OpenCL program in a background thread so the
+// programs for multiple devices can be built at the same time. The errors of
+// the compilation are thrown again by Wait().
+class OCLAsyncProgramBuild {
+public:
+	OCLAsyncProgramBuild(const boost::function<cl::Program ()> &compile);
+	// Waits for the end of the compilation
+	~OCLAsyncProgramBuild();
+
+	bool IsDone() const;
+	// Waits for the end of the compilation and returns the program. It is an
+	// interruption point of the calling thread.
+	cl::Program Wait();
+
+private:
+	void BuildThreadImpl(const boost::function<cl::Program ()> &compile);
+
+	mutable boost::mutex doneMutex;
+	boost::condition_variable doneCondition;
+	bool done;
+
+	cl::Program program;
+	// Set if the compilation has failed
+	bool failed, oclError;
+	cl_int errorCode;
+	std::string errorMessage;
+
+	boost::thread *buildThread;
+};
+
+#endif	/* ASYNCBUILD_H */
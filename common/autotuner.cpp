@@ -0,0 +1,248 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/format.hpp>
+
+#include "ocltoy.h"
+#include "autotuner.h"
+
+//------------------------------------------------------------------------------
+// OCLTuningStore
+//------------------------------------------------------------------------------
+
+OCLTuningStore::OCLTuningStore(const std::string &name) : fileName(name) {
+	std::ifstream file(fileName.c_str());
+	if (!file.is_open())
+		return;
+
+	// Each line is: <key><TAB><value>
+	std::string line;
+	while (std::getline(file, line)) {
+		const size_t sep = line.rfind('\t');
+		if ((line.length() == 0) || (line[0] == '#') || (sep == std::string::npos))
+			continue;
+
+		values[line.substr(0, sep)] = line.substr(sep + 1);
+	}
+}
+
+bool OCLTuningStore::Get(const std::string &key, std::string &value) const {
+	std::map<std::string, std::string>::const_iterator it = values.find(key);
+	if (it == values.end())
+		return false;
+
+	value = it->second;
+	return true;
+}
+
+void OCLTuningStore::Set(const std::string &key, const std::string &value) {
+	values[key] = value;
+
+	Save();
+}
+
+void OCLTuningStore::Save() const {
+	std::ofstream file(fileName.c_str(), std::ios::out | std::ios::trunc);
+	if (!file.is_open()) {
+		OCLTOY_LOG("Unable to write the autotuning file: " << fileName);
+		return;
+	}
+
+	file << "# OCLToys autotuning results" << std::endl;
+	for (std::map<std::string, std::string>::const_iterator it = values.begin(); it != values.end(); ++it)
+		file << it->first << "\t" << it->second << std::endl;
+}
+
+std::string OCLTuningStore::GetKey(const std::string &parameter, cl::Device &device,
+		const std::string &kernelName, const std::string &kernelSource,
+		const std::string &buildOpts) {
+	// The kernel source is too long to be part of the key so only its hash is used
+	std::string key = parameter + "|" + device.getInfo<CL_DEVICE_NAME>() + "|" +
+			device.getInfo<CL_DRIVER_VERSION>() + "|" + kernelName + "|" + buildOpts + "|" +
+			(boost::format("%016x") % OCLProgramCache::HashString(kernelSource, 0)).str();
+
+	// Tabs and new lines are used by the file format
+	for (size_t i = 0; i < key.length(); ++i) {
+		if ((key[i] == '\t') || (key[i] == '\n') || (key[i] == '\r'))
+			key[i] = ' ';
+	}
+
+	return key;
+}
+
+//------------------------------------------------------------------------------
+// OCLWorkGroupTuner
+//------------------------------------------------------------------------------
+
+double OCLWorkGroupTuner::Benchmark(cl::CommandQueue &queue, cl::Kernel &kernel,
+		const cl::NDRange &globalSize, const cl::NDRange &localSize) {
+	// Round up the global size to a multiple of the local size
+	cl::NDRange global = (globalSize.dimensions() == 1) ?
+		cl::NDRange(RoundUp(globalSize[0], localSize[0])) :
+		cl::NDRange(RoundUp(globalSize[0], localSize[0]), RoundUp(globalSize[1], localSize[1]));
+
+	// Warm up
+	queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, localSize);
+	queue.finish();
+
+	// Run the kernel at least 3 times and for at least 0.1 secs
+	const double startTime = WallClockTime();
+	unsigned int runs = 0;
+	double elapsedTime;
+	do {
+		queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, localSize);
+		queue.finish();
+		++runs;
+
+		elapsedTime = WallClockTime() - startTime;
+	} while ((runs < 3) || (elapsedTime < 0.1));
+
+	return elapsedTime / runs;
+}
+
+cl::NDRange OCLWorkGroupTuner::Tune(cl::CommandQueue &queue, cl::Device &device, cl::Kernel &kernel,
+		const cl::NDRange &globalSize, const double maxTime) {
+	const size_t maxSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+	const size_t multiple = std::max<size_t>(kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device), 1);
+
+	// The candidates are the multiples of the preferred size by a power of 2
+	// (and the max. size)
+	std::vector<cl::NDRange> candidates;
+	if (globalSize.dimensions() == 1) {
+		for (size_t size = multiple; size <= maxSize; size *= 2)
+			candidates.push_back(cl::NDRange(size));
+		if (candidates.empty() || (candidates.back()[0] != maxSize))
+			candidates.push_back(cl::NDRange(maxSize));
+	} else {
+		for (size_t size = multiple; size <= maxSize; size *= 2) {
+			for (size_t y = 1; y <= size; y *= 2) {
+				if (size % y == 0)
+					candidates.push_back(cl::NDRange(size / y, y));
+			}
+		}
+		if (candidates.empty())
+			candidates.push_back(cl::NDRange(maxSize, 1));
+	}
+
+	const double startTime = WallClockTime();
+	cl::NDRange bestSize = candidates[0];
+	double bestTime = -1.0;
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		try {
+			const double t = Benchmark(queue, kernel, globalSize, candidates[i]);
+			OCLTOY_LOG("  Work group size " << ToString(candidates[i]) << ": " << (t * 1000.0) << " ms");
+
+			if ((bestTime < 0.0) || (t < bestTime)) {
+				bestSize = candidates[i];
+				bestTime = t;
+			}
+		} catch (cl::Error err) {
+			// Some sizes may fail (i.e. CL_OUT_OF_RESOURCES)
+			OCLTOY_LOG("  Work group size " << ToString(candidates[i]) << ": " << err.what() <<
+					"(" << OCLErrorString(err.err()) << ")");
+		}
+
+		if (WallClockTime() - startTime > maxTime) {
+			OCLTOY_LOG("  Autotuning time limit reached");
+			break;
+		}
+	}
+
+	return bestSize;
+}
+
+std::string OCLWorkGroupTuner::ToString(const cl::NDRange &localSize) {
+	std::stringstream ss;
+	ss << localSize[0];
+	if (localSize.dimensions() == 2)
+		ss << "x" << localSize[1];
+
+	return ss.str();
+}
+
+cl::NDRange OCLWorkGroupTuner::FromString(const std::string &localSize) {
+	size_t x, y;
+	char sep;
+	std::stringstream ss(localSize);
+	ss >> x;
+	if (ss.fail())
+		throw std::runtime_error("Wrong work group size: " + localSize);
+	if (ss >> sep >> y)
+		return cl::NDRange(x, y);
+	else
+		return cl::NDRange(x);
+}
+
+//------------------------------------------------------------------------------
+// OCLBuildOptionsTuner
+//------------------------------------------------------------------------------
+
+std::vector<std::string> OCLBuildOptionsTuner::GetCandidates() {
+	static const char *fastMathOpts[] = {
+		"-cl-fast-relaxed-math",
+		"-cl-mad-enable",
+		"-cl-no-signed-zeros",
+		"-cl-denorms-are-zero"
+	};
+	const unsigned int optCount = sizeof(fastMathOpts) / sizeof(fastMathOpts[0]);
+
+	std::vector<std::string> candidates;
+	for (unsigned int mask = 1; mask < (1u << optCount); ++mask) {
+		std::string opts;
+		for (unsigned int i = 0; i < optCount; ++i) {
+			if (mask & (1u << i))
+				opts += (opts.length() ? " " : "") + std::string(fastMathOpts[i]);
+		}
+		candidates.push_back(opts);
+	}
+
+	return candidates;
+}
+
+double OCLBuildOptionsTuner::ImageRMSE(const std::vector<float> &a, const std::vector<float> &b) {
+	if ((a.size() != b.size()) || (a.size() == 0))
+		throw std::runtime_error("Unable to compare images of different size");
+
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		// NaNs are considered as the max. error
+		const double d = std::min(fabs((double)a[i] - (double)b[i]), 1.0);
+		sum += (d == d) ? (d * d) : 1.0;
+	}
+
+	return sqrt(sum / a.size());
+}
+
+double OCLBuildOptionsTuner::ImagePSNR(const std::vector<float> &a, const std::vector<float> &b) {
+	const double rmse = ImageRMSE(a, b);
+	if (rmse == 0.0)
+		return std::numeric_limits<double>::infinity();
+
+	return 20.0 * log10(1.0 / rmse);
+}
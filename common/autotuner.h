@@ -0,0 +1,87 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef AUTOTUNER_H
+#define	AUTOTUNER_H
+
+#include "opencl.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+// A text file of key/value pairs used to persist the results of the
+// autotuning between runs. The keys include the device, the driver, the
+// kernel and the build options (see GetKey()).
+class OCLTuningStore {
+public:
+	OCLTuningStore(const std::string &fileName);
+	~OCLTuningStore() { }
+
+	bool Get(const std::string &key, std::string &value) const;
+	// The file is written immediately
+	void Set(const std::string &key, const std::string &value);
+
+	static std::string GetKey(const std::string &parameter, cl::Device &device,
+			const std::string &kernelName, const std::string &kernelSource,
+			const std::string &buildOpts);
+
+private:
+	void Save() const;
+
+	std::string fileName;
+	std::map<std::string, std::string> values;
+};
+
+// Benchmarks a set of candidate work group sizes on a kernel with all its
+// arguments already set and returns the fastest one.
+class OCLWorkGroupTuner {
+public:
+	// The candidates are 2D if the global size is 2D. The tuning stops after
+	// maxTime seconds, keeping the best candidate found so far.
+	static cl::NDRange Tune(cl::CommandQueue &queue, cl::Device &device, cl::Kernel &kernel,
+			const cl::NDRange &globalSize, const double maxTime);
+
+	static std::string ToString(const cl::NDRange &localSize);
+	static cl::NDRange FromString(const std::string &localSize);
+
+private:
+	// Returns the average time of one kernel execution
+	static double Benchmark(cl::CommandQueue &queue, cl::Kernel &kernel,
+			const cl::NDRange &globalSize, const cl::NDRange &localSize);
+};
+
+// The fast math build options tested by the build options autotuning and the
+// metrics used to compare the images rendered with the ones of the strict
+// math build.
+class OCLBuildOptionsTuner {
+public:
+	// Returns all the combinations of the fast math build options
+	static std::vector<std::string> GetCandidates();
+
+	// Root mean square error, the pixel values are in the [0, 1] range
+	static double ImageRMSE(const std::vector<float> &a, const std::vector<float> &b);
+	// Peak signal to noise ratio in dB (infinite for identical images)
+	static double ImagePSNR(const std::vector<float> &a, const std::vector<float> &b);
+};
+
+#endif	/* AUTOTUNER_H */
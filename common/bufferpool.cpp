@@ -0,0 +1,193 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "ocltoy.h"
+#include "bufferpool.h"
+
+static std::string MemorySizeString(const size_t size) {
+	std::stringstream ss;
+	ss << (size < 10000 ? size : (size / 1024)) << (size < 10000 ? "bytes" : "Kbytes");
+
+	return ss.str();
+}
+
+// The alignment required by most of the OpenCL implementations for zero-copy
+// CL_MEM_USE_HOST_PTR buffers
+static const size_t hostMemoryAlignment = 4096;
+
+static void CL_CALLBACK FreeBlockHostMemory(cl_mem memobj, void *userData) {
+	delete[] (char *)userData;
+}
+
+OCLBufferPool::OCLBufferPool(const cl::Context &ctx, const size_t memBudget, const size_t maxSize,
+		const bool zc) : context(ctx), budget(memBudget), maxAllocSize(maxSize), zeroCopy(zc), usedMemory(0),
+		pooledMemory(0), highWaterMark(0), reusedBlockCount(0), newBlockCount(0) {
+}
+
+OCLBufferPool::~OCLBufferPool() {
+	for (std::map<cl::Buffer *, Allocation>::iterator it = allocations.begin(); it != allocations.end(); ++it) {
+		delete it->first;
+		delete it->second.block;
+	}
+
+	Trim();
+}
+
+size_t OCLBufferPool::GetSizeClass(const size_t size) {
+	// Size classes are 4 steps for each power of 2 (i.e. 1, 1.25, 1.5 and 1.75)
+	// so no more than 25% of the memory is wasted
+	const size_t minSize = 256;
+	if (size <= minSize)
+		return minSize;
+
+	size_t base = minSize;
+	while (base * 2 < size)
+		base *= 2;
+
+	const size_t step = base / 4;
+	return ((size + step - 1) / step) * step;
+}
+
+cl::Buffer *OCLBufferPool::Alloc(const cl_mem_flags flags, const size_t size, const std::string &desc) {
+	if (size > maxAllocSize) {
+		std::stringstream ss;
+		ss << "The " << desc << " buffer is too big (i.e. CL_DEVICE_MAX_MEM_ALLOC_SIZE=" << maxAllocSize << ")";
+		throw std::runtime_error(ss.str());
+	}
+
+	const size_t blockSize = std::min(GetSizeClass(size), maxAllocSize);
+
+	cl::Buffer *block;
+	std::multimap<size_t, cl::Buffer *>::iterator it = freeBlocks.find(blockSize);
+	if (it != freeBlocks.end()) {
+		// I can reuse a free block
+		block = it->second;
+		freeBlocks.erase(it);
+		++reusedBlockCount;
+	} else {
+		if (pooledMemory + blockSize > budget) {
+			// Try to release the free blocks before giving up
+			Trim();
+
+			if (pooledMemory + blockSize > budget) {
+				PrintReport("Buffer pool");
+
+				std::stringstream ss;
+				ss << "The " << desc << " buffer (" << MemorySizeString(size) <<
+						") exceeds the device memory budget of " << MemorySizeString(budget) <<
+						" (i.e. --oclmembudget option)";
+				throw std::runtime_error(ss.str());
+			}
+		}
+
+		block = NewBlock(blockSize);
+		pooledMemory += blockSize;
+		highWaterMark = std::max(highWaterMark, pooledMemory);
+		++newBlockCount;
+	}
+
+	// The sub-buffer has the exact size requested and the access flags
+	// of the buffer while the block is always read/write
+	cl_buffer_region region;
+	region.origin = 0;
+	region.size = size;
+	cl::Buffer *buff = new cl::Buffer(block->createSubBuffer(flags, CL_BUFFER_CREATE_TYPE_REGION, &region));
+
+	Allocation &alloc = allocations[buff];
+	alloc.block = block;
+	alloc.blockSize = blockSize;
+	alloc.size = size;
+	alloc.desc = desc;
+	alloc.hostPtr = zeroCopy ? block->getInfo<CL_MEM_HOST_PTR>() : NULL;
+	usedMemory += size;
+
+	return buff;
+}
+
+cl::Buffer *OCLBufferPool::NewBlock(const size_t blockSize) {
+	if (!zeroCopy)
+		return new cl::Buffer(context, CL_MEM_READ_WRITE, blockSize);
+
+	// The host memory is released by the OpenCL runtime callback when
+	// the block is really destroyed (i.e. after the last command using it)
+	char *hostMemory = new char[blockSize + hostMemoryAlignment];
+	char *alignedHostMemory = hostMemory + (hostMemoryAlignment - ((size_t)hostMemory % hostMemoryAlignment));
+
+	cl::Buffer *block;
+	try {
+		block = new cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, blockSize, alignedHostMemory);
+	} catch (cl::Error err) {
+		delete[] hostMemory;
+		throw err;
+	}
+	block->setDestructorCallback(FreeBlockHostMemory, hostMemory);
+
+	return block;
+}
+
+void *OCLBufferPool::GetHostPtr(cl::Buffer *buff) const {
+	std::map<cl::Buffer *, Allocation>::const_iterator it = allocations.find(buff);
+	if (it == allocations.end())
+		throw std::runtime_error("Buffer not allocated by the buffer pool");
+
+	return it->second.hostPtr;
+}
+
+void OCLBufferPool::Free(cl::Buffer *buff) {
+	std::map<cl::Buffer *, Allocation>::iterator it = allocations.find(buff);
+	if (it == allocations.end())
+		throw std::runtime_error("Freeing a buffer not allocated by the buffer pool");
+
+	const Allocation &alloc = it->second;
+	delete buff;
+	freeBlocks.insert(std::make_pair(alloc.blockSize, alloc.block));
+	usedMemory -= alloc.size;
+
+	allocations.erase(it);
+}
+
+void OCLBufferPool::Trim() {
+	for (std::multimap<size_t, cl::Buffer *>::iterator it = freeBlocks.begin(); it != freeBlocks.end(); ++it) {
+		pooledMemory -= it->first;
+		delete it->second;
+	}
+	freeBlocks.clear();
+}
+
+void OCLBufferPool::PrintReport(const std::string &header) const {
+	OCLTOY_LOG(header << (zeroCopy ? " (zero-copy)" : "") << " memory used: " << MemorySizeString(usedMemory) <<
+			" pooled: " << MemorySizeString(pooledMemory) <<
+			" high-water mark: " << MemorySizeString(highWaterMark) <<
+			" budget: " << MemorySizeString(budget));
+	OCLTOY_LOG("  Blocks reused: " << reusedBlockCount << " allocated: " << newBlockCount <<
+			" free: " << freeBlocks.size());
+
+	for (std::map<cl::Buffer *, Allocation>::const_iterator it = allocations.begin(); it != allocations.end(); ++it) {
+		const Allocation &alloc = it->second;
+		OCLTOY_LOG("  " << alloc.desc << " buffer: " << MemorySizeString(alloc.size) <<
+				" (block size: " << MemorySizeString(alloc.blockSize) << ")");
+	}
+}
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef BUFFERPOOL_H
+#define	BUFFERPOOL_H
+
+#include "opencl.h"
+
+#include <map>
+#include <string>
+
+// A pool of OpenCL buffers of a single device. The device memory is allocated
+// in blocks rounded up to a size class and the buffers returned are sub-buffers
+// of the blocks, so a freed block can be reused by any following allocation of
+// the same size class (i.e. after a window resize or a scene change). The total
+// amount of device memory held by the pool is limited by the budget.
+//
+// With zero-copy enabled (i.e. devices with CL_DEVICE_HOST_UNIFIED_MEMORY), the
+// blocks are created with CL_MEM_USE_HOST_PTR on page aligned host memory so the
+// host can access the content of a buffer without any copy (see GetHostPtr()).
+class OCLBufferPool {
+public:
+	OCLBufferPool(const cl::Context &context, const size_t budget, const size_t maxAllocSize,
+			const bool zeroCopy);
+	~OCLBufferPool();
+
+	cl::Buffer *Alloc(const cl_mem_flags flags, const size_t size, const std::string &desc);
+	void Free(cl::Buffer *buff);
+	// Returns the host memory of the buffer or NULL if zero-copy is disabled
+	void *GetHostPtr(cl::Buffer *buff) const;
+	// Releases all the free blocks
+	void Trim();
+
+	// The memory requested by the live buffers
+	size_t GetUsedMemory() const { return usedMemory; }
+	// The device memory allocated by the pool (live and free blocks)
+	size_t GetPooledMemory() const { return pooledMemory; }
+	size_t GetHighWaterMark() const { return highWaterMark; }
+	size_t GetBudget() const { return budget; }
+	bool IsZeroCopy() const { return zeroCopy; }
+
+	void PrintReport(const std::string &header) const;
+
+	static size_t GetSizeClass(const size_t size);
+
+private:
+	typedef struct {
+		cl::Buffer *block;
+		size_t blockSize, size;
+		std::string desc;
+		void *hostPtr;
+	} Allocation;
+
+	cl::Buffer *NewBlock(const size_t blockSize);
+
+	cl::Context context;
+	const size_t budget, maxAllocSize;
+	const bool zeroCopy;
+
+	std::multimap<size_t, cl::Buffer *> freeBlocks;
+	std::map<cl::Buffer *, Allocation> allocations;
+
+	size_t usedMemory, pooledMemory, highWaterMark;
+	unsigned int reusedBlockCount, newBlockCount;
+};
+
+#endif	/* BUFFERPOOL_H */
@@ -0,0 +1,40 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include "embeddedkernels.h"
+
+const OCLEmbeddedKernel *OCLEmbeddedKernel::head = NULL;
+
+OCLEmbeddedKernel::OCLEmbeddedKernel(const char *tn, const char *fn,
+		const char *src, const size_t s) : toolName(tn), fileName(fn), source(src), size(s) {
+	next = head;
+	head = this;
+}
+
+const OCLEmbeddedKernel *OCLEmbeddedKernel::Find(const std::string &toolName, const std::string &fileName) {
+	for (const OCLEmbeddedKernel *kernel = head; kernel; kernel = kernel->next) {
+		if ((toolName == kernel->toolName) && (fileName == kernel->fileName))
+			return kernel;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,55 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef EMBEDDEDKERNELS_H
+#define	EMBEDDEDKERNELS_H
+
+#include <string>
+
+// An OpenCL kernel source compiled in the executable. The instances are
+// defined in the sources generated by the EmbedOCLKernel() CMake function
+// (see cmake/KernelEmbed.cmake) and register themselves at start up.
+class OCLEmbeddedKernel {
+public:
+	OCLEmbeddedKernel(const char *toolName, const char *fileName,
+			const char *source, const size_t size);
+
+	const char *GetToolName() const { return toolName; }
+	const char *GetFileName() const { return fileName; }
+	std::string GetSource() const { return std::string(source, size); }
+
+	// Returns NULL if the kernel file has not been embedded
+	static const OCLEmbeddedKernel *Find(const std::string &toolName, const std::string &fileName);
+
+private:
+	const char *toolName;
+	const char *fileName;
+	const char *source;
+	const size_t size;
+
+	const OCLEmbeddedKernel *next;
+	// A plain pointer is zero initialized before any constructor is run so
+	// the registration doesn't depend on the static initialization order
+	static const OCLEmbeddedKernel *head;
+};
+
+#endif	/* EMBEDDEDKERNELS_H */
@@ -0,0 +1,225 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#if defined(WIN32)
+#include <windows.h>
+#endif
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include <boost/thread.hpp>
+
+#include "logger.h"
+
+//------------------------------------------------------------------------------
+// Atomic operations
+//------------------------------------------------------------------------------
+
+#if defined(WIN32)
+static inline bool CompareAndSwap(volatile long *ptr, const long oldValue, const long newValue) {
+	return InterlockedCompareExchange(ptr, newValue, oldValue) == oldValue;
+}
+
+static inline void MemoryFence() {
+	MemoryBarrier();
+}
+#else
+static inline bool CompareAndSwap(volatile long *ptr, const long oldValue, const long newValue) {
+	return __sync_bool_compare_and_swap(ptr, oldValue, newValue);
+}
+
+static inline void MemoryFence() {
+	__sync_synchronize();
+}
+#endif
+
+// The distance between 2 sequence numbers (they wrap around)
+static inline long SequenceDelta(const long a, const long b) {
+	return static_cast<long>(static_cast<unsigned long>(a) - static_cast<unsigned long>(b));
+}
+
+//------------------------------------------------------------------------------
+// OCLLogRing
+//------------------------------------------------------------------------------
+
+#define OCL_LOG_SLOT_COUNT 1024
+#define OCL_LOG_SLOT_SIZE 256
+
+// A bounded multi-producer ring buffer: each slot has a sequence number
+// telling if it is free for the producer of the position (sequence ==
+// position) or if it holds the message of the position (sequence ==
+// position + 1). The producers reserve a position with a compare-and-swap,
+// the messages are consumed under consumerMutex.
+class OCLLogRing {
+public:
+	OCLLogRing() : enqueuePos(0), dequeuePos(0) {
+		for (long i = 0; i < OCL_LOG_SLOT_COUNT; ++i)
+			slots[i].sequence = i;
+
+		// The flush thread is detached on purpose: it runs until the end of the
+		// process, like the ring itself (see GetLogRing())
+		boost::thread(&OCLLogRing::FlushThreadImpl, this).detach();
+	}
+
+	void Push(const OCLLogLevel level, const std::string &msg) {
+		if (msg.length() >= OCL_LOG_SLOT_SIZE) {
+			// Too long for a slot: written after the messages before it
+			boost::unique_lock<boost::mutex> lock(consumerMutex);
+			Drain();
+			WriteMessage(level, msg.c_str());
+			std::cerr.flush();
+			return;
+		}
+
+		for (;;) {
+			const long pos = enqueuePos;
+			Slot &slot = slots[pos & (OCL_LOG_SLOT_COUNT - 1)];
+			MemoryFence();
+			const long delta = SequenceDelta(slot.sequence, pos);
+
+			if (delta == 0) {
+				if (CompareAndSwap(&enqueuePos, pos, pos + 1)) {
+					slot.level = level;
+					memcpy(slot.text, msg.c_str(), msg.length() + 1);
+					MemoryFence();
+					slot.sequence = pos + 1;
+					return;
+				}
+			} else if (delta < 0) {
+				// The ring is full: empty it, unless the flush thread is already
+				// doing it
+				boost::unique_lock<boost::mutex> lock(consumerMutex, boost::try_to_lock);
+				if (lock.owns_lock())
+					Drain();
+				else
+					boost::this_thread::yield();
+			}
+			// Otherwise another producer has taken the position, try the next one
+		}
+	}
+
+	void Flush() {
+		boost::unique_lock<boost::mutex> lock(consumerMutex);
+		Drain();
+	}
+
+private:
+	typedef struct {
+		volatile long sequence;
+		OCLLogLevel level;
+		char text[OCL_LOG_SLOT_SIZE];
+	} Slot;
+
+	// Writes the messages in the ring, it must be called with consumerMutex locked
+	void Drain() {
+		bool written = false;
+		for (;;) {
+			Slot &slot = slots[dequeuePos & (OCL_LOG_SLOT_COUNT - 1)];
+			MemoryFence();
+			if (SequenceDelta(slot.sequence, dequeuePos + 1) != 0)
+				break;
+
+			WriteMessage(slot.level, slot.text);
+			written = true;
+
+			MemoryFence();
+			slot.sequence = dequeuePos + OCL_LOG_SLOT_COUNT;
+			++dequeuePos;
+		}
+
+		// The stream is flushed once for all the messages
+		if (written)
+			std::cerr.flush();
+	}
+
+	// The info messages have no level tag
+	void WriteMessage(const OCLLogLevel level, const char *msg) {
+		switch (level) {
+			case OCL_LOG_DEBUG:
+				std::cerr << "[OCLToy][DEBUG] ";
+				break;
+			case OCL_LOG_WARNING:
+				std::cerr << "[OCLToy][WARNING] ";
+				break;
+			case OCL_LOG_ERROR:
+				std::cerr << "[OCLToy][ERROR] ";
+				break;
+			default:
+				std::cerr << "[OCLToy] ";
+				break;
+		}
+		std::cerr << msg << "\n";
+	}
+
+	void FlushThreadImpl() {
+		// The thread runs until the end of the process
+		for (;;) {
+			Flush();
+			boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+		}
+	}
+
+	Slot slots[OCL_LOG_SLOT_COUNT];
+	volatile long enqueuePos;
+	// Protected by consumerMutex
+	long dequeuePos;
+	boost::mutex consumerMutex;
+};
+
+static OCLLogRing *logRing = NULL;
+
+static void FlushAtExit() {
+	logRing->Flush();
+}
+
+static OCLLogRing *GetLogRing() {
+	// The ring is created by the first message, logged by the main thread
+	// before any other thread is started. It is never destroyed: the other
+	// threads may log until the end of the process and the messages left are
+	// written by FlushAtExit().
+	if (!logRing) {
+		logRing = new OCLLogRing();
+		atexit(FlushAtExit);
+	}
+
+	return logRing;
+}
+
+//------------------------------------------------------------------------------
+// OCLLogger
+//------------------------------------------------------------------------------
+
+volatile int OCLLogger::minLevel = OCL_LOG_INFO;
+
+void OCLLogger::SetLevel(const OCLLogLevel level) {
+	minLevel = level;
+}
+
+void OCLLogger::Log(const OCLLogLevel level, const std::string &msg) {
+	GetLogRing()->Push(level, msg);
+}
+
+void OCLLogger::Flush() {
+	GetLogRing()->Flush();
+}
@@ -0,0 +1,64 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef LOGGER_H
+#define	LOGGER_H
+
+#include <sstream>
+#include <string>
+
+typedef enum {
+	OCL_LOG_DEBUG = 0, OCL_LOG_INFO, OCL_LOG_WARNING, OCL_LOG_ERROR
+} OCLLogLevel;
+
+// The messages of all threads are copied in a lock-free ring buffer and
+// written to std::cerr by a background thread, so the threads logging never
+// wait for the stream (unless the ring is full or the message doesn't fit in
+// one of its slots).
+class OCLLogger {
+public:
+	// The messages below the level are discarded (OCL_LOG_INFO by default)
+	static void SetLevel(const OCLLogLevel level);
+	static bool IsEnabled(const OCLLogLevel level) { return level >= minLevel; }
+
+	static void Log(const OCLLogLevel level, const std::string &msg);
+	// Writes all the messages logged so far (i.e. before the process is terminated)
+	static void Flush();
+
+private:
+	static volatile int minLevel;
+};
+
+#define OCLTOY_LOG_LEVEL(level, a) { if (OCLLogger::IsEnabled(level)) { std::stringstream _OCLTOY_LOG_LOCAL_SS; _OCLTOY_LOG_LOCAL_SS << a; OCLLogger::Log(level, _OCLTOY_LOG_LOCAL_SS.str()); } }
+
+#define OCLTOY_LOG(a) OCLTOY_LOG_LEVEL(OCL_LOG_INFO, a)
+#define OCLTOY_LOG_WARNING(a) OCLTOY_LOG_LEVEL(OCL_LOG_WARNING, a)
+#define OCLTOY_LOG_ERROR(a) OCLTOY_LOG_LEVEL(OCL_LOG_ERROR, a)
+// The debug messages are compiled only in the debug builds (or if
+// OCLTOY_DEBUG_LOG is defined)
+#if !defined(NDEBUG) || defined(OCLTOY_DEBUG_LOG)
+#define OCLTOY_LOG_DEBUG(a) OCLTOY_LOG_LEVEL(OCL_LOG_DEBUG, a)
+#else
+#define OCLTOY_LOG_DEBUG(a) { }
+#endif
+
+#endif	/* LOGGER_H */
@@ -0,0 +1,177 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <fstream>
+#include <stdexcept>
+
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "ocltoy.h"
+#include "oclprofiler.h"
+
+// The number of pending commands of a queue before checking the completed ones
+static const size_t maxPendingCommands = 256;
+
+static std::string JSONString(const std::string &s) {
+	std::string result = "\"";
+	for (size_t i = 0; i < s.length(); ++i) {
+		if ((s[i] == '"') || (s[i] == '\\'))
+			result += '\\';
+		if ((unsigned char)s[i] >= ' ')
+			result += s[i];
+	}
+
+	return result + "\"";
+}
+
+OCLProfiler::OCLProfiler() {
+	startTime = WallClockTime();
+}
+
+void OCLProfiler::AddDevice(const std::string &deviceName) {
+	boost::unique_lock<boost::mutex> lock(profilerMutex);
+
+	deviceNames.push_back(deviceName);
+	deviceClockOffsets.push_back(0.0);
+	deviceClockOffsetSet.push_back(false);
+}
+
+cl::Event *OCLProfiler::NewEvent(const unsigned int deviceIndex, const unsigned int queueIndex,
+		const std::string &name, const std::string &category) {
+	boost::unique_lock<boost::mutex> lock(profilerMutex);
+
+	const Track track(deviceIndex, queueIndex);
+	if (pendingCommands[track].size() >= maxPendingCommands)
+		CollectCommands(track, false);
+
+	std::list<PendingCommand> &pending = pendingCommands[track];
+	pending.push_back(PendingCommand());
+	PendingCommand &cmd = pending.back();
+	cmd.name = name;
+	cmd.category = category;
+	cmd.hostTime = WallClockTime();
+
+	// The list elements are never moved so the pointer is valid until
+	// the command is collected
+	return &cmd.event;
+}
+
+void OCLProfiler::AddEvent(const unsigned int deviceIndex, const unsigned int queueIndex,
+		const std::string &name, const std::string &category, const cl::Event &event) {
+	cl::Event *cmdEvent = NewEvent(deviceIndex, queueIndex, name, category);
+
+	boost::unique_lock<boost::mutex> lock(profilerMutex);
+	*cmdEvent = event;
+}
+
+void OCLProfiler::CollectCommands(const Track &track, const bool wait) {
+	std::list<PendingCommand> &pending = pendingCommands[track];
+
+	std::list<PendingCommand>::iterator it = pending.begin();
+	while (it != pending.end()) {
+		// The event may have not yet been set by the enqueue call
+		if (!it->event()) {
+			++it;
+			continue;
+		}
+
+		try {
+			if (wait)
+				it->event.wait();
+			else if (it->event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE) {
+				++it;
+				continue;
+			}
+
+			Command cmd;
+			cmd.name = it->name;
+			cmd.category = it->category;
+			cmd.deviceIndex = track.first;
+			cmd.queueIndex = track.second;
+			cmd.queued = it->event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+			cmd.submit = it->event.getProfilingInfo<CL_PROFILING_COMMAND_SUBMIT>();
+			cmd.start = it->event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+			cmd.end = it->event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+			commands.push_back(cmd);
+
+			// The device timers are aligned to the host clock with the time
+			// the first command has been queued
+			if (!deviceClockOffsetSet[track.first]) {
+				deviceClockOffsets[track.first] = cmd.queued - (it->hostTime - startTime) * 1000000000.0;
+				deviceClockOffsetSet[track.first] = true;
+			}
+		} catch (cl::Error err) {
+			OCLTOY_LOG("Unable to get the profiling information of " << it->name <<
+					": " << err.what() << "(" << OCLErrorString(err.err()) << ")");
+		}
+
+		it = pending.erase(it);
+	}
+}
+
+void OCLProfiler::WriteTrace(const std::string &fileName) {
+	boost::unique_lock<boost::mutex> lock(profilerMutex);
+
+	for (std::map<Track, std::list<PendingCommand> >::iterator it = pendingCommands.begin(); it != pendingCommands.end(); ++it)
+		CollectCommands(it->first, true);
+
+	std::ofstream file(fileName.c_str(), std::ios::out | std::ios::trunc);
+	if (!file.is_open())
+		throw std::runtime_error("Unable to open trace file: " + fileName);
+
+	file << "{\"traceEvents\":[" << std::endl;
+
+	// Device and queue names
+	bool first = true;
+	for (unsigned int i = 0; i < deviceNames.size(); ++i) {
+		file << (first ? "" : ",\n") << boost::format("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":%s}}") %
+				i % JSONString("Device " + boost::lexical_cast<std::string>(i) + ": " + deviceNames[i]);
+		first = false;
+	}
+	for (std::map<Track, std::list<PendingCommand> >::iterator it = pendingCommands.begin(); it != pendingCommands.end(); ++it) {
+		const std::string queueName = (it->first.second == 0) ? "Compute queue" :
+			((it->first.second == 1) ? "Transfer queue" :
+			((it->first.second == 2) ? "Out-of-order queue" : ("Queue " + boost::lexical_cast<std::string>(it->first.second))));
+		file << (first ? "" : ",\n") << boost::format("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":%s}}") %
+				it->first.first % it->first.second % JSONString(queueName);
+		first = false;
+	}
+
+	// The commands (timestamps are in microseconds)
+	for (size_t i = 0; i < commands.size(); ++i) {
+		const Command &cmd = commands[i];
+		const double offset = deviceClockOffsets[cmd.deviceIndex];
+
+		file << (first ? "" : ",\n") << boost::format("{\"name\":%s,\"cat\":%s,\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"queued_us\":%.3f,\"submitted_us\":%.3f}}") %
+				JSONString(cmd.name) % JSONString(cmd.category) % cmd.deviceIndex % cmd.queueIndex %
+				((cmd.start - offset) / 1000.0) % ((cmd.end - cmd.start) / 1000.0) %
+				((cmd.start - cmd.queued) / 1000.0) % ((cmd.start - cmd.submit) / 1000.0);
+		first = false;
+	}
+
+	file << std::endl << "]}" << std::endl;
+	file.close();
+
+	OCLTOY_LOG("OpenCL trace of " << commands.size() << " commands written to: " << fileName);
+}
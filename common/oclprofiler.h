@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef OCLPROFILER_H
+#define	OCLPROFILER_H
+
+#include "opencl.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/thread/mutex.hpp>
+
+// Records the timestamps of the OpenCL commands (the command queues must be
+// created with CL_QUEUE_PROFILING_ENABLE) and writes them as a Chrome trace
+// JSON file (it can be opened with chrome://tracing or ui.perfetto.dev) with
+// a process for each device and a thread for each command queue.
+class OCLProfiler {
+public:
+	OCLProfiler();
+	~OCLProfiler() { }
+
+	void AddDevice(const std::string &deviceName);
+
+	// Returns the event to pass to the enqueue call of the command. The
+	// category can be "kernel", "read", "write", etc.
+	cl::Event *NewEvent(const unsigned int deviceIndex, const unsigned int queueIndex,
+			const std::string &name, const std::string &category);
+	// Records a command with an event already owned by the caller
+	void AddEvent(const unsigned int deviceIndex, const unsigned int queueIndex,
+			const std::string &name, const std::string &category, const cl::Event &event);
+
+	void WriteTrace(const std::string &fileName);
+
+private:
+	typedef struct {
+		std::string name, category;
+		double hostTime;
+		cl::Event event;
+	} PendingCommand;
+
+	typedef struct {
+		std::string name, category;
+		unsigned int deviceIndex, queueIndex;
+		cl_ulong queued, submit, start, end;
+	} Command;
+
+	typedef std::pair<unsigned int, unsigned int> Track;
+
+	void CollectCommands(const Track &track, const bool wait);
+
+	boost::mutex profilerMutex;
+	double startTime;
+
+	std::vector<std::string> deviceNames;
+	// The difference (in nanoseconds) between the device and the host clock
+	std::vector<double> deviceClockOffsets;
+	std::vector<bool> deviceClockOffsetSet;
+
+	std::map<Track, std::list<PendingCommand> > pendingCommands;
+	std::vector<Command> commands;
+};
+
+#endif	/* OCLPROFILER_H */
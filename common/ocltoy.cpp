@@ -19,10 +19,13 @@
  *   OCLToys website: http://code.google.com/p/ocltoys                     *
  ***************************************************************************/
 
+#include <algorithm>
 #include <iostream>
 #include <stdexcept>
 #include <string>
 
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/regex.hpp>
 
@@ -70,6 +73,9 @@ void OCLToyTerminate(void) {
 		OCLTOY_LOG("  " << Demangle(strings[i]));
 
 	free(strings);
+
+	// The process is aborted without running the exit handlers
+	OCLLogger::Flush();
 }
 #endif
 
@@ -77,16 +83,26 @@ void OCLToyTerminate(void) {
 
 OCLToy *OCLToy::currentOCLToy = NULL;
 
-void OCLToyDebugHandler(const char *msg) {
-	std::cerr << "[OCLToy] " << msg << std::endl;
-}
-
-OCLToy::OCLToy(const std::string &winTitle) : windowTitle(winTitle),
+OCLToy::OCLToy(const std::string &winTitle) : programCache(NULL), profiler(NULL), tuningStore(NULL),
+		threadPool(NULL), windowTitle(winTitle),
 		windowWidth(800), windowHeight(600), millisTimerFunc(0), useIdleCallback(false),
-		printHelp(true) {
+		printHelp(true), headless(false) {
 	currentOCLToy = this;
 }
 
+OCLToy::~OCLToy() {
+	// The tasks may use any of the following resources
+	delete threadPool;
+
+	for (size_t i = 0; i < deviceBufferPools.size(); ++i)
+		delete deviceBufferPools[i];
+	for (size_t i = 0; i < deviceUploadRings.size(); ++i)
+		delete deviceUploadRings[i];
+	delete programCache;
+	delete profiler;
+	delete tuningStore;
+}
+
 int OCLToy::Run(int argc, char **argv) {
 #if defined(__GNUC__) && !defined(__CYGWIN__)
 	std::set_terminate(OCLToyTerminate);
@@ -99,7 +115,14 @@ int OCLToy::Run(int argc, char **argv) {
 		// Parse command line options
 		//----------------------------------------------------------------------
 
-		glutInit(&argc, argv);
+		// GLUT can not be initialized without a display so I have to check
+		// the headless mode before parsing the other options
+		for (int i = 1; i < argc; ++i) {
+			if (std::string(argv[i]) == "--headless")
+				headless = true;
+		}
+		if (!headless)
+			glutInit(&argc, argv);
 
 		boost::program_options::options_description genericOpts("Generic options");
 		genericOpts.add_options()
@@ -111,7 +134,55 @@ int OCLToy::Run(int argc, char **argv) {
 				"OpenCL device selection string. It can be ALL, ALL_GPUS, ALL_CPUS, FIRST_GPU, FIRST_CPU or a "
 				"binary string where 0 means disabled and 1 enabled (for instance, 1100 will use only the first "
 				"and second devices of the 4 available). NOTE: OpenCL accelerators are considered GPUs.")
-			("noscreenhelp,s", "Disable on screen help");
+			("nozerocopy", "Disable zero-copy buffers on devices with unified host memory (i.e. CPUs)")
+			("oclcpufission", boost::program_options::value<std::string>(),
+				"Split the selected CPU devices in sub-devices (OpenCL 1.2 is required). It can be NUMA (a "
+				"sub-device for each NUMA node) or the number of compute units of each sub-device.")
+			("sharedcontext", "Use a single OpenCL context for all the selected devices of the same platform, "
+				"so the buffers can be shared between the devices")
+			("inorderqueues", "Run the task graphs on the in-order compute and transfer queues even on the "
+				"devices supporting out-of-order queues")
+			("oclmembudget", boost::program_options::value<size_t>()->default_value(0),
+				"OpenCL device memory budget in MBytes for each device (0 means all the global memory)")
+			("kernelcachedir", boost::program_options::value<std::string>()->default_value("kernel_cache"),
+				"Directory of the OpenCL program binary cache")
+			("nokernelcache", "Disable the OpenCL program binary cache")
+			("autotune", boost::program_options::value<double>()->implicit_value(10.0),
+				"Benchmark the OpenCL work group sizes (for at most the given number of seconds for "
+				"each kernel, 10 by default) and store the fastest for the following runs")
+			("autotunebuild", "Benchmark the fast math OpenCL build options and store the fastest ones "
+				"rendering an image close enough to the strict math build")
+			("tuningmetric", boost::program_options::value<std::string>()->default_value("psnr"),
+				"Image error metric of the build options autotuning: psnr or rmse")
+			("tuningthreshold", boost::program_options::value<double>(),
+				"Min. PSNR in dB (40 by default) or max. RMSE (0.01 by default) accepted by the build "
+				"options autotuning")
+			("calibrate", "Benchmark the speed of each device and store it for the following runs (the "
+				"work is split between the devices according to their speed)")
+			("mindevicespeed", boost::program_options::value<double>()->default_value(0.1),
+				"Devices slower than this fraction of the speed of the fastest device are not used")
+			("tuningfile", boost::program_options::value<std::string>()->default_value("autotune.txt"),
+				"File of the autotuning results")
+			("threads", boost::program_options::value<unsigned int>(),
+				"Number of threads of the host thread pool (by default, the number of hardware threads "
+				"plus the number of devices; at least the number of devices plus one)")
+			("loglevel", boost::program_options::value<std::string>()->default_value("info"),
+				"Min. level of the messages logged (debug, info, warning or error; the debug messages "
+				"are available only in the debug builds)")
+			("timers", "Log the latency histograms (p50, p95, p99 and max.) of the timed sections, like "
+				"the kernel enqueues, the read backs and the display, at the end")
+			("trace", boost::program_options::value<std::string>(),
+				"Record all OpenCL commands and write a Chrome trace JSON file (it can be opened with "
+				"chrome://tracing or ui.perfetto.dev)")
+			("noscreenhelp,s", "Disable on screen help")
+			("headless", "Run without a window: render, save the image and exit")
+			("passes", boost::program_options::value<unsigned int>(),
+				"Number of passes (i.e. frames) to render in headless mode")
+			("seconds", boost::program_options::value<double>(),
+				"Number of seconds to render in headless mode (a single pass is rendered if "
+				"neither --passes nor --seconds is used)")
+			("output", boost::program_options::value<std::string>()->default_value("image.ppm"),
+				"Image file name written in headless mode");
 
 		boost::program_options::options_description toyOpts = GetOptionsDescriction();
 
@@ -125,19 +196,43 @@ int OCLToy::Run(int argc, char **argv) {
 			boost::program_options::store(boost::program_options::command_line_parser(argc, argv).
 				style(cmdstyle).options(opts).run(), commandLineOpts);
 
+			const std::string logLevel = commandLineOpts["loglevel"].as<std::string>();
+			if (logLevel == "debug")
+				OCLLogger::SetLevel(OCL_LOG_DEBUG);
+			else if (logLevel == "info")
+				OCLLogger::SetLevel(OCL_LOG_INFO);
+			else if (logLevel == "warning")
+				OCLLogger::SetLevel(OCL_LOG_WARNING);
+			else if (logLevel == "error")
+				OCLLogger::SetLevel(OCL_LOG_ERROR);
+			else
+				throw boost::program_options::invalid_option_value(logLevel);
+
 			windowWidth = commandLineOpts["width"].as<int>();
 			windowHeight = commandLineOpts["height"].as<int>();
 			if (commandLineOpts.count("directory"))
 				boost::filesystem::current_path(boost::filesystem::path(commandLineOpts["directory"].as<std::string>()));
 			if (commandLineOpts.count("noscreenhelp"))
 				printHelp = false;
+			if (!commandLineOpts.count("nokernelcache")) {
+				// The cache is optional: the toy runs without it if the
+				// directory can't be created (i.e. a read-only directory)
+				try {
+					programCache = new OCLProgramCache(commandLineOpts["kernelcachedir"].as<std::string>());
+				} catch (boost::filesystem::filesystem_error &err) {
+					OCLTOY_LOG_WARNING("Failed to create the kernel cache directory, the cache is disabled: " << err.what());
+				}
+			}
+			if (commandLineOpts.count("trace"))
+				profiler = new OCLProfiler();
+			tuningStore = new OCLTuningStore(commandLineOpts["tuningfile"].as<std::string>());
 
 			if (commandLineOpts.count("help")) {
 				OCLTOY_LOG("Command usage" << std::endl << opts);
 				exit(EXIT_SUCCESS);
 			}
 		} catch(boost::program_options::error &e) {
-			OCLTOY_LOG("COMMAND LINE ERROR: " << e.what() << std::endl << opts); 
+			OCLTOY_LOG_ERROR("COMMAND LINE ERROR: " << e.what() << std::endl << opts); 
 			exit(EXIT_FAILURE);
 		}
 
@@ -145,7 +240,8 @@ int OCLToy::Run(int argc, char **argv) {
 		// Initialize GLUT
 		//----------------------------------------------------------------------
 
-		InitGlut();
+		if (!headless)
+			InitGlut();
 
 		//----------------------------------------------------------------------
 		// Initialize OpenCL
@@ -154,19 +250,36 @@ int OCLToy::Run(int argc, char **argv) {
 		SelectOpenCLDevices();
 		InitOpenCLDevices();
 
+		// The threads are mostly waiting for the devices so there is one more
+		// for each device
+		unsigned int threadCount = commandLineOpts.count("threads") ?
+			commandLineOpts["threads"].as<unsigned int>() :
+			std::max(boost::thread::hardware_concurrency(), 1u) + static_cast<unsigned int>(selectedDevices.size());
+		// The rendering loops of the devices can run in the pool until they are
+		// cancelled: there must be a thread for each of them, plus one for the
+		// other tasks
+		const unsigned int minThreadCount = static_cast<unsigned int>(selectedDevices.size()) + 1;
+		if (threadCount < minThreadCount) {
+			OCLTOY_LOG_WARNING("Too few host threads for " << selectedDevices.size() << " devices, using " <<
+					minThreadCount << " threads instead of " << threadCount);
+			threadCount = minThreadCount;
+		}
+		threadPool = new OCLThreadPool(threadCount);
+		OCLTOY_LOG("Host thread pool: " << threadPool->GetThreadCount() << " threads");
+
 		//----------------------------------------------------------------------
 		// Run the application
 		//----------------------------------------------------------------------
 
 		return RunToy();
 	} catch (cl::Error err) {
-		OCLTOY_LOG("OpenCL ERROR: " << err.what() << "(" << OCLErrorString(err.err()) << ")");
+		OCLTOY_LOG_ERROR("OpenCL ERROR: " << err.what() << "(" << OCLErrorString(err.err()) << ")");
 		return EXIT_FAILURE;
 	} catch (std::runtime_error err) {
-		OCLTOY_LOG("RUNTIME ERROR: " << err.what());
+		OCLTOY_LOG_ERROR("RUNTIME ERROR: " << err.what());
 		return EXIT_FAILURE;
 	} catch (std::exception err) {
-		OCLTOY_LOG("ERROR: " << err.what());
+		OCLTOY_LOG_ERROR("ERROR: " << err.what());
 		return EXIT_FAILURE;
 	}
 }
@@ -222,11 +335,28 @@ void OCLToy::SelectOpenCLDevices() {
 					throw std::runtime_error("Syntax error in OpenCL select devices string (--ocldevices option)");
 			}
 
-			if (selected) {
+			// Each sub-device of a split CPU device is a device of its own
+			VECTOR_CLASS<cl::Device> subDevices;
+			const bool split = selected && commandLineOpts.count("oclcpufission") &&
+					(devices[j].getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) &&
+					CreateSubDevices(devices[j], &subDevices);
+
+			if (selected && split) {
+				for (size_t k = 0; k < subDevices.size(); ++k) {
+					if (selectedDevices.size() >= GetMaxDeviceCountSupported()) {
+						OCLTOY_LOG("    Sub-device " << k << " NOT SELECTED because this toy supports only " << GetMaxDeviceCountSupported() << " device");
+					} else {
+						selectedDevices.push_back(subDevices[k]);
+						selectedSubDevices.push_back(true);
+						OCLTOY_LOG("    Sub-device " << k << " (Units: " << subDevices[k].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << ") SELECTED");
+					}
+				}
+			} else if (selected) {
 				if (selectedDevices.size() >= GetMaxDeviceCountSupported()) {
 					OCLTOY_LOG("    NOT SELECTED because this toy supports only " << GetMaxDeviceCountSupported() << " device");
 				} else {
 					selectedDevices.push_back(devices[j]);
+					selectedSubDevices.push_back(false);
 					OCLTOY_LOG("    SELECTED");
 				}
 			} else
@@ -240,25 +370,138 @@ void OCLToy::SelectOpenCLDevices() {
 		throw std::runtime_error("Unable to find an OpenCL device");
 }
 
+bool OCLToy::CreateSubDevices(cl::Device &device, VECTOR_CLASS<cl::Device> *subDevices) {
+	const std::string fission = commandLineOpts["oclcpufission"].as<std::string>();
+
+#if defined(CL_VERSION_1_2)
+	// Device fission is available only on OpenCL 1.2 platforms
+	const std::string version = device.getInfo<CL_DEVICE_VERSION>();
+	if (!version.compare(0, 10, "OpenCL 1.0") || !version.compare(0, 10, "OpenCL 1.1")) {
+		OCLTOY_LOG("    Unable to split the device (OpenCL 1.2 is required)");
+		return false;
+	}
+
+	cl_device_partition_property props[3];
+	if (fission == "NUMA") {
+		props[0] = CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+		props[1] = CL_DEVICE_AFFINITY_DOMAIN_NUMA;
+	} else {
+		unsigned int units;
+		try {
+			units = boost::lexical_cast<unsigned int>(fission);
+		} catch (boost::bad_lexical_cast) {
+			throw std::runtime_error("Unknown CPU device fission (--oclcpufission option): " + fission);
+		}
+		props[0] = CL_DEVICE_PARTITION_EQUALLY;
+		props[1] = units;
+	}
+	props[2] = 0;
+
+	try {
+		device.createSubDevices(props, subDevices);
+	} catch (cl::Error err) {
+		OCLTOY_LOG("    Unable to split the device: " << err.what() << "(" << OCLErrorString(err.err()) << ")");
+		return false;
+	}
+
+	return subDevices->size() > 0;
+#else
+	OCLTOY_LOG("    Unable to split the device in " << fission << " sub-devices (OpenCL 1.2 is required)");
+	return false;
+#endif
+}
+
 void OCLToy::InitOpenCLDevices() {
+	const bool sharedContext = commandLineOpts.count("sharedcontext") > 0;
+
 	for (std::vector<cl::Device>::iterator dev = selectedDevices.begin(); dev < selectedDevices.end(); ++dev) {
-		// Allocate a context with the selected device
-		VECTOR_CLASS<cl::Device> devices;
-		devices.push_back(*dev);
+		const cl_platform_id platform = dev->getInfo<CL_DEVICE_PLATFORM>();
+
+		cl::Context ctx;
+		for (size_t i = 0; sharedContext && (i < deviceContexts.size()); ++i) {
+			// The context may have been already created by a device of the same platform
+			if (selectedDevices[i].getInfo<CL_DEVICE_PLATFORM>() == platform) {
+				ctx = deviceContexts[i];
+				break;
+			}
+		}
+
+		if (!ctx()) {
+			// Allocate a context with the selected device (or all the selected
+			// devices of the same platform)
+			VECTOR_CLASS<cl::Device> devices;
+			for (std::vector<cl::Device>::iterator d = dev; d < selectedDevices.end(); ++d) {
+				if ((d == dev) || (sharedContext && (d->getInfo<CL_DEVICE_PLATFORM>() == platform)))
+					devices.push_back(*d);
+			}
+			if (devices.size() > 1)
+				OCLTOY_LOG("Using a shared context for " << devices.size() << " devices of OpenCL platform " <<
+						cl::Platform(platform).getInfo<CL_PLATFORM_NAME>());
 
-		cl::Context ctx(devices);
+			ctx = cl::Context(devices);
+		}
 		deviceContexts.push_back(ctx);
 
-		// Allocate the queue for this device
-		cl::CommandQueue cmdQueue(ctx, *dev);
+		// Allocate the compute and transfer queues for this device
+		cl::CommandQueue cmdQueue(ctx, *dev, profiler ? CL_QUEUE_PROFILING_ENABLE : 0);
 		deviceQueues.push_back(cmdQueue);
-		
-		deviceUsedMemory.push_back(0);
+		cl::CommandQueue transferQueue(ctx, *dev, profiler ? CL_QUEUE_PROFILING_ENABLE : 0);
+		deviceTransferQueues.push_back(transferQueue);
+		cl::CommandQueue outOfOrderQueue;
+		if (!commandLineOpts.count("inorderqueues") &&
+				(dev->getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+			outOfOrderQueue = cl::CommandQueue(ctx, *dev,
+					CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | (profiler ? CL_QUEUE_PROFILING_ENABLE : 0));
+		}
+		deviceOutOfOrderQueues.push_back(outOfOrderQueue);
+		if (profiler)
+			profiler->AddDevice(dev->getInfo<CL_DEVICE_NAME>());
+
+		// Allocate the buffer pool for this device
+		size_t budget = commandLineOpts["oclmembudget"].as<size_t>() * 1024 * 1024;
+		if (budget == 0)
+			budget = dev->getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+		const bool zeroCopy = !commandLineOpts.count("nozerocopy") &&
+				dev->getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+		if (zeroCopy)
+			OCLTOY_LOG("Using zero-copy buffers on " << dev->getInfo<CL_DEVICE_NAME>() << " device");
+		deviceBufferPools.push_back(new OCLBufferPool(ctx, budget, dev->getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(),
+				zeroCopy));
+
+		// Allocate the upload ring for this device
+		deviceUploadRings.push_back(new OCLUploadRing(ctx, cmdQueue, 4, 64 * 1024));
 	}
+
+	// The speed of the devices is unknown until they are calibrated
+	deviceSpeeds.resize(selectedDevices.size(), 0.0);
 }
 
-void OCLToy::AllocOCLBufferRO(const unsigned int deviceIndex, cl::Buffer **buff,
-		void *src, const size_t size, const std::string &desc) {
+bool OCLToy::IsContextShared(const unsigned int deviceIndex0, const unsigned int deviceIndex1) const {
+	return deviceContexts[deviceIndex0]() == deviceContexts[deviceIndex1]();
+}
+
+void OCLToy::EnqueueMigrateOCLBuffers(const unsigned int deviceIndex, cl::CommandQueue &queue,
+		const VECTOR_CLASS<cl::Memory> &buffs, const VECTOR_CLASS<cl::Event> *waitEvents, cl::Event *event) {
+#if defined(CL_VERSION_1_2)
+	// clEnqueueMigrateMemObjects() is available only on OpenCL 1.2 platforms
+	const cl_platform_id platform = selectedDevices[deviceIndex].getInfo<CL_DEVICE_PLATFORM>();
+	const std::string version = cl::Platform(platform).getInfo<CL_PLATFORM_VERSION>();
+	if (version.compare(0, 10, "OpenCL 1.0") && version.compare(0, 10, "OpenCL 1.1")) {
+		queue.enqueueMigrateMemObjects(buffs, 0, waitEvents, event);
+		return;
+	}
+#endif
+
+	// The buffers are migrated by the OpenCL runtime when they are used, only
+	// the dependencies are required
+	if (waitEvents && (waitEvents->size() > 0))
+		queue.enqueueWaitForEvents(*waitEvents);
+	if (event)
+		queue.enqueueMarker(event);
+}
+
+void OCLToy::AllocOCLBuffer(const unsigned int deviceIndex, cl::Buffer **buff,
+		const cl_mem_flags flags, const size_t size, const std::string &desc) {
 	cl::Device &oclDevice = selectedDevices[deviceIndex];
 
 	// Check if the buffer is too big
@@ -273,104 +516,522 @@ void OCLToy::AllocOCLBufferRO(const unsigned int deviceIndex, cl::Buffer **buff,
 	if (*buff) {
 		// Check the size of the already allocated buffer
 		if (size == (*buff)->getInfo<CL_MEM_SIZE>()) {
-			// I can reuse the buffer; just update the content
-
-			deviceQueues[deviceIndex].enqueueWriteBuffer(**buff, CL_TRUE, 0, size, src);
+			// I can reuse the buffer
 			return;
 		} else {
-			// Free the buffer
-			deviceUsedMemory[deviceIndex] -= (*buff)->getInfo<CL_MEM_SIZE>();
-			delete *buff;
+			// Return the buffer to the pool
+			FreeOCLBuffer(deviceIndex, buff);
 		}
 	}
 
-	cl::Context &oclContext = deviceContexts[deviceIndex];
-
 	OCLTOY_LOG( desc << " buffer size: " <<
 			(size < 10000 ? size : (size / 1024)) << (size < 10000 ? "bytes" : "Kbytes"));
-	*buff = new cl::Buffer(oclContext,
-			CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-			size, src);
-	deviceUsedMemory[deviceIndex] += (*buff)->getInfo<CL_MEM_SIZE>();
+	*buff = deviceBufferPools[deviceIndex]->Alloc(flags, size, desc);
+}
+
+void OCLToy::AllocOCLBufferRO(const unsigned int deviceIndex, cl::Buffer **buff,
+		void *src, const size_t size, const std::string &desc) {
+	AllocOCLBuffer(deviceIndex, buff, CL_MEM_READ_ONLY, size, desc);
+
+	// Update the content
+	deviceQueues[deviceIndex].enqueueWriteBuffer(**buff, CL_TRUE, 0, size, src,
+			NULL, ProfileEvent(deviceIndex, desc, "write"));
 }
 
 void OCLToy::AllocOCLBufferRW(const unsigned int deviceIndex, cl::Buffer **buff,
 		const size_t size, const std::string &desc) {
-	cl::Device &oclDevice = selectedDevices[deviceIndex];
+	AllocOCLBuffer(deviceIndex, buff, CL_MEM_READ_WRITE, size, desc);
+}
 
-	// Check if the buffer is too big
-	if (oclDevice.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() < size) {
-		std::stringstream ss;
-		ss << "The " << desc << " buffer is too big for " << oclDevice.getInfo<CL_DEVICE_NAME>() << 
-				" device (i.e. CL_DEVICE_MAX_MEM_ALLOC_SIZE=" <<
-				oclDevice.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() << ")";
-		throw std::runtime_error(ss.str());
-	}
+void OCLToy::AllocOCLBufferWO(const unsigned int deviceIndex, cl::Buffer **buff,
+		const size_t size, const std::string &desc) {
+	AllocOCLBuffer(deviceIndex, buff, CL_MEM_WRITE_ONLY, size, desc);
+}
 
+void OCLToy::FreeOCLBuffer(const unsigned int deviceIndex, cl::Buffer **buff) {
 	if (*buff) {
+		deviceBufferPools[deviceIndex]->Free(*buff);
+		*buff = NULL;
+	}
+}
+
+void *OCLToy::AllocOCLStagingBuffer(const unsigned int deviceIndex, OCLStagingBuffer **staging,
+		const size_t size, const std::string &desc) {
+	if (*staging) {
 		// Check the size of the already allocated buffer
-		if (size == (*buff)->getInfo<CL_MEM_SIZE>()) {
-			// I can reuse the buffer
-			return;
-		} else {
-			// Free the buffer
-			deviceUsedMemory[deviceIndex] -= (*buff)->getInfo<CL_MEM_SIZE>();
-			delete *buff;
+		if (size == (*staging)->GetSize())
+			return (*staging)->GetPtr();
+		else
+			FreeOCLStagingBuffer(staging);
+	}
+
+	OCLTOY_LOG(desc << " staging buffer size: " <<
+			(size < 10000 ? size : (size / 1024)) << (size < 10000 ? "bytes" : "Kbytes"));
+	*staging = new OCLStagingBuffer(deviceContexts[deviceIndex], deviceQueues[deviceIndex], size,
+			selectedSubDevices[deviceIndex]);
+
+	return (*staging)->GetPtr();
+}
+
+void OCLToy::FreeOCLStagingBuffer(OCLStagingBuffer **staging) {
+	delete *staging;
+	*staging = NULL;
+}
+
+void *OCLToy::AllocOCLReadbackMemory(const unsigned int deviceIndex, cl::Buffer *buff,
+		OCLStagingBuffer **staging, const std::string &desc) {
+	void *hostPtr = deviceBufferPools[deviceIndex]->GetHostPtr(buff);
+	if (hostPtr) {
+		// Zero-copy, no staging buffer is required
+		FreeOCLStagingBuffer(staging);
+
+#if defined(CL_VERSION_1_2)
+		// The host memory of a CPU sub-device is zeroed by the device itself so
+		// its pages are allocated on the NUMA node of the device (first touch)
+		if (selectedSubDevices[deviceIndex]) {
+			deviceQueues[deviceIndex].enqueueFillBuffer<cl_uchar>(*buff, 0, 0, buff->getInfo<CL_MEM_SIZE>());
+			deviceQueues[deviceIndex].finish();
 		}
+#endif
+
+		return hostPtr;
 	}
 
-	cl::Context &oclContext = deviceContexts[deviceIndex];
+	return AllocOCLStagingBuffer(deviceIndex, staging, buff->getInfo<CL_MEM_SIZE>(), desc);
+}
 
-	OCLTOY_LOG( desc << " buffer size: " <<
-			(size < 10000 ? size : (size / 1024)) << (size < 10000 ? "bytes" : "Kbytes"));
-	*buff = new cl::Buffer(oclContext,
-			CL_MEM_READ_WRITE,
-			size);
-	deviceUsedMemory[deviceIndex] += (*buff)->getInfo<CL_MEM_SIZE>();
+void OCLToy::EnqueueReadOCLBuffer(const unsigned int deviceIndex, cl::CommandQueue &queue,
+		cl::Buffer *buff, const cl_bool blocking, void *dst,
+		const VECTOR_CLASS<cl::Event> *waitEvents, cl::Event *event) {
+	const size_t size = buff->getInfo<CL_MEM_SIZE>();
+
+	if (dst == deviceBufferPools[deviceIndex]->GetHostPtr(buff)) {
+		// The host already shares the memory of the buffer
+		void *ptr = queue.enqueueMapBuffer(*buff, blocking, CL_MAP_READ, 0, size, waitEvents);
+		queue.enqueueUnmapMemObject(*buff, ptr, NULL, event);
+	} else
+		queue.enqueueReadBuffer(*buff, blocking, 0, size, dst, waitEvents, event);
 }
 
-void OCLToy::AllocOCLBufferWO(const unsigned int deviceIndex, cl::Buffer **buff,
+void *OCLToy::AllocOCLFrameMemory(OCLStagingBuffer **staging, std::vector<char> *memory,
 		const size_t size, const std::string &desc) {
-	cl::Device &oclDevice = selectedDevices[deviceIndex];
+	if (size <= selectedDevices[0].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>()) {
+		std::vector<char>().swap(*memory);
+		return AllocOCLStagingBuffer(0, staging, size, desc);
+	}
 
-	// Check if the buffer is too big
-	if (oclDevice.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() < size) {
-		std::stringstream ss;
-		ss << "The " << desc << " buffer is too big for " << oclDevice.getInfo<CL_DEVICE_NAME>() << 
-				" device (i.e. CL_DEVICE_MAX_MEM_ALLOC_SIZE=" <<
-				oclDevice.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() << ")";
-		throw std::runtime_error(ss.str());
+	OCLTOY_LOG(desc << " frame memory size: " << (size / 1024) << "Kbytes");
+	FreeOCLStagingBuffer(staging);
+	memory->resize(size);
+
+	return &(*memory)[0];
+}
+
+void OCLToy::UploadOCLBuffer(const unsigned int deviceIndex, cl::Buffer &buff,
+		const void *src, const size_t size, const std::string &desc, cl::Event *event) {
+	OCLScopedTimer timer("Upload " + desc);
+
+	cl::Event uploadEvent;
+	deviceUploadRings[deviceIndex]->Upload(buff, src, size, &uploadEvent);
+	ProfileEvent(deviceIndex, uploadEvent, desc, "write");
+
+	if (event) {
+		*event = uploadEvent;
+		// The commands of the other queues may wait for this event
+		deviceQueues[deviceIndex].flush();
 	}
+}
 
-	if (*buff) {
-		// Check the size of the already allocated buffer
-		if (size == (*buff)->getInfo<CL_MEM_SIZE>()) {
-			// I can reuse the buffer
-			return;
-		} else {
-			// Free the buffer
-			deviceUsedMemory[deviceIndex] -= (*buff)->getInfo<CL_MEM_SIZE>();
-			delete *buff;
+OCLTaskGraph OCLToy::NewTaskGraph(const unsigned int deviceIndex) {
+	const OCLTaskGraphProfileFunc profile = profiler ?
+		boost::bind(&OCLProfiler::AddEvent, profiler, deviceIndex, _4, _2, _3, _1) :
+		OCLTaskGraphProfileFunc();
+
+	cl::CommandQueue &outOfOrderQueue = deviceOutOfOrderQueues[deviceIndex];
+	if (outOfOrderQueue())
+		return OCLTaskGraph(outOfOrderQueue, 2, outOfOrderQueue, 2, profile);
+	else
+		return OCLTaskGraph(deviceQueues[deviceIndex], 0, deviceTransferQueues[deviceIndex], 1, profile);
+}
+
+size_t OCLToy::GetTileSize(const size_t itemCount, const size_t bytesPerItem) const {
+	size_t tileSize = itemCount;
+	if (selectedDevices.size() > 1) {
+		const size_t tileCount = 8 * selectedDevices.size();
+		tileSize = RoundUp<size_t>((itemCount + tileCount - 1) / tileCount, 64);
+	}
+
+	// Each tile buffer must fit in a single allocation of all the devices
+	for (size_t i = 0; i < selectedDevices.size(); ++i) {
+		const size_t maxAllocSize = selectedDevices[i].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+		const size_t maxWorkGroupSize = selectedDevices[i].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+		const size_t maxItems = maxAllocSize / bytesPerItem;
+		if ((maxItems > maxWorkGroupSize + 64) && (tileSize > maxItems - maxWorkGroupSize))
+			tileSize = (maxItems - maxWorkGroupSize) / 64 * 64;
+	}
+
+	return std::min(tileSize, itemCount);
+}
+
+size_t OCLToy::GetTileBufferSize(const unsigned int deviceIndex, const size_t tileSize,
+		const size_t bytesPerItem) const {
+	return (tileSize + selectedDevices[deviceIndex].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()) * bytesPerItem;
+}
+
+void OCLToy::RenderTiles(OCLTileScheduler &scheduler, const OCLRenderTileFunc &renderTile) {
+	OCLScopedTimer timer("Frame");
+
+	// The devices too slow to be used don't render (or steal) any tile
+	std::vector<unsigned int> devices;
+	for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+		if (GetDeviceWeight(i) > 0.0)
+			devices.push_back(i);
+	}
+
+	if (devices.size() == 1) {
+		RenderDeviceTiles(devices[0], scheduler, renderTile);
+		return;
+	}
+
+	// The first device renders on the calling thread
+	std::vector<OCLTaskFuture> tasks(devices.size());
+	for (size_t i = 1; i < devices.size(); ++i) {
+		tasks[i] = threadPool->Submit(boost::bind(&OCLToy::RenderDeviceTiles,
+				this, devices[i], boost::ref(scheduler), renderTile));
+	}
+
+	// All the devices finish their frame before any error is thrown
+	std::vector<std::string> errors(devices.size());
+	for (size_t i = 0; i < devices.size(); ++i) {
+		try {
+			if (i == 0)
+				RenderDeviceTiles(devices[0], scheduler, renderTile);
+			else
+				tasks[i].Wait();
+		} catch (cl::Error err) {
+			errors[i] = std::string(err.what()) + "(" + OCLErrorString(err.err()) + ")";
+		} catch (std::exception &err) {
+			errors[i] = err.what();
+		}
+	}
+
+	for (size_t i = 0; i < errors.size(); ++i) {
+		if (errors[i].length() > 0)
+			throw std::runtime_error("Error while rendering the tiles on OpenCL device " +
+					boost::lexical_cast<std::string>(devices[i]) + ": " + errors[i]);
+	}
+}
+
+void OCLToy::RenderDeviceFrame(const unsigned int deviceIndex, OCLTileScheduler &scheduler,
+		const size_t itemCount, const size_t tileSize, const OCLRenderTileFunc &renderTile) {
+	std::vector<double> weights(selectedDevices.size(), 0.0);
+	weights[deviceIndex] = 1.0;
+
+	scheduler.Reset(weights, itemCount, tileSize);
+	RenderDeviceTiles(deviceIndex, scheduler, renderTile);
+}
+
+void OCLToy::RenderDeviceTiles(const unsigned int deviceIndex, OCLTileScheduler &scheduler,
+		const OCLRenderTileFunc &renderTile) {
+	// The events of the last tile rendered with each slot
+	cl::Event slotEvents[2];
+
+	OCLTile tile;
+	for (unsigned int i = 0; scheduler.NextTile(deviceIndex, &tile); ++i) {
+		const unsigned int slot = i % 2;
+		// Wait for the end of the read of the previous tile using the same buffers
+		if (slotEvents[slot]()) {
+			OCLScopedTimer timer("Tile readback wait");
+			slotEvents[slot].wait();
+		}
+
+		{
+			OCLScopedTimer timer("Tile enqueue");
+			renderTile(deviceIndex, slot, tile, &slotEvents[slot]);
 		}
+		// Start the execution of the tile while the next one is set up
+		deviceQueues[deviceIndex].flush();
+	}
+
+	// The tiles may be rendered with task graphs, out of the compute queue
+	for (unsigned int i = 0; i < 2; ++i) {
+		if (slotEvents[i]())
+			slotEvents[i].wait();
+	}
+	deviceQueues[deviceIndex].finish();
+}
+
+void OCLToy::PrintOCLBufferReport() const {
+	for (size_t i = 0; i < deviceBufferPools.size(); ++i) {
+		std::stringstream ss;
+		ss << "OpenCL device " << i;
+		deviceBufferPools[i]->PrintReport(ss.str());
 	}
+}
+
+cl::Event *OCLToy::ProfileEvent(const unsigned int deviceIndex, const std::string &name,
+		const std::string &category, const unsigned int queueIndex) {
+	if (profiler)
+		return profiler->NewEvent(deviceIndex, queueIndex, name, category);
+	else
+		return NULL;
+}
+
+void OCLToy::ProfileEvent(const unsigned int deviceIndex, const cl::Event &event, const std::string &name,
+		const std::string &category, const unsigned int queueIndex) {
+	if (profiler)
+		profiler->AddEvent(deviceIndex, queueIndex, name, category, event);
+}
+
+void OCLToy::Done() {
+	PrintOCLBufferReport();
+	if (commandLineOpts.count("timers"))
+		OCLTOY_LOG("Latencies (milliseconds):" << std::endl << OCLTimers::GetReport());
+
+	if (profiler)
+		profiler->WriteTrace(commandLineOpts["trace"].as<std::string>());
+}
 
+cl::Program OCLToy::CompileProgram(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts) {
+	cl::Device &oclDevice = selectedDevices[deviceIndex];
 	cl::Context &oclContext = deviceContexts[deviceIndex];
 
-	OCLTOY_LOG( desc << " buffer size: " <<
-			(size < 10000 ? size : (size / 1024)) << (size < 10000 ? "bytes" : "Kbytes"));
-	*buff = new cl::Buffer(oclContext,
-			CL_MEM_WRITE_ONLY,
-			size);
-	deviceUsedMemory[deviceIndex] += (*buff)->getInfo<CL_MEM_SIZE>();
+	const double startTime = WallClockTime();
+	if (programCache) {
+		bool cached, stored;
+		cl::Program program = programCache->Compile(oclContext, oclDevice, kernelSource, buildOpts, &cached, &stored);
+
+		OCLTOY_LOG("Kernel program " << (cached ? "loaded from the cache (warm start)" :
+				(stored ? "built and cached (cold start)" : "built but not cached (cold start)")) <<
+				" in " << (WallClockTime() - startTime) << " secs (Device " << deviceIndex << ")");
+		return program;
+	} else {
+		cl::Program program = OCLProgramCache::Build(oclContext, oclDevice, kernelSource, buildOpts);
+
+		OCLTOY_LOG("Kernel program built in " << (WallClockTime() - startTime) << " secs (Device " << deviceIndex << ")");
+		return program;
+	}
 }
 
-void OCLToy::FreeOCLBuffer(const unsigned int deviceIndex, cl::Buffer **buff) {
-	if (*buff) {
-		deviceUsedMemory[deviceIndex] += (*buff)->getInfo<CL_MEM_SIZE>();
+OCLAsyncProgramBuild *OCLToy::CompileProgramAsync(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts) {
+	return new OCLAsyncProgramBuild(boost::bind(&OCLToy::CompileProgram, this, deviceIndex, kernelSource, buildOpts));
+}
 
-		delete *buff;
-		*buff = NULL;
+std::vector<cl::Program> OCLToy::CompilePrograms(const std::string &kernelSource,
+		const std::vector<std::string> &deviceBuildOpts) {
+	std::vector<OCLAsyncProgramBuild *> builds(selectedDevices.size(), NULL);
+	std::vector<cl::Program> programs(selectedDevices.size());
+	try {
+		for (size_t i = 0; i < selectedDevices.size(); ++i)
+			builds[i] = CompileProgramAsync(i, kernelSource, deviceBuildOpts[i]);
+		for (size_t i = 0; i < selectedDevices.size(); ++i)
+			programs[i] = builds[i]->Wait();
+	} catch (...) {
+		// The other compilations are waited for by the destructors
+		for (size_t i = 0; i < builds.size(); ++i)
+			delete builds[i];
+		throw;
+	}
+	for (size_t i = 0; i < builds.size(); ++i)
+		delete builds[i];
+
+	return programs;
+}
+
+size_t OCLToy::GetKernelWorkGroupSize(const unsigned int deviceIndex, cl::Kernel &kernel,
+		const std::string &tuningKey) {
+	if (commandLineOpts.count("workgroupsize"))
+		return commandLineOpts["workgroupsize"].as<size_t>();
+
+	std::string value;
+	if (tuningStore->Get(tuningKey, value)) {
+		OCLTOY_LOG("Using the autotuned workgroup size (Device " << deviceIndex << ")");
+		return OCLWorkGroupTuner::FromString(value)[0];
+	}
+
+	return kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(selectedDevices[deviceIndex]);
+}
+
+size_t OCLToy::TuneKernelWorkGroupSize(const unsigned int deviceIndex, cl::Kernel &kernel,
+		const std::string &tuningKey, const size_t globalSize, const size_t workGroupSize) {
+	if (!commandLineOpts.count("autotune") || commandLineOpts.count("workgroupsize"))
+		return workGroupSize;
+
+	OCLTOY_LOG("Autotuning workgroup size: " << tuningKey);
+	const cl::NDRange best = OCLWorkGroupTuner::Tune(deviceQueues[deviceIndex], selectedDevices[deviceIndex],
+			kernel, cl::NDRange(globalSize), commandLineOpts["autotune"].as<double>());
+	tuningStore->Set(tuningKey, OCLWorkGroupTuner::ToString(best));
+	OCLTOY_LOG("Autotuned workgroup size (Device " << deviceIndex << "): " << best[0]);
+
+	return best[0];
+}
+
+std::string OCLToy::TuneBuildOptions(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts, const std::string &tuningKey) {
+	std::string tunedOpts;
+	if (!commandLineOpts.count("autotunebuild")) {
+		if (tuningStore->Get(tuningKey, tunedOpts) && (tunedOpts.length() > 0)) {
+			OCLTOY_LOG("Using the autotuned build options (Device " << deviceIndex << "): " << tunedOpts);
+			return buildOpts + " " + tunedOpts;
+		} else
+			return buildOpts;
 	}
+
+	const std::string metric = commandLineOpts["tuningmetric"].as<std::string>();
+	if ((metric != "psnr") && (metric != "rmse"))
+		throw std::runtime_error("Unknown image error metric (--tuningmetric option): " + metric);
+	const bool usePSNR = (metric == "psnr");
+	const double threshold = commandLineOpts.count("tuningthreshold") ?
+		commandLineOpts["tuningthreshold"].as<double>() : (usePSNR ? 40.0 : 0.01);
+
+	OCLTOY_LOG("Autotuning build options: " << tuningKey);
+	std::vector<float> referenceImage;
+	double bestTime = BenchmarkBuildOptions(deviceIndex, kernelSource, buildOpts, &referenceImage);
+	OCLTOY_LOG("  Strict math: " << (bestTime * 1000.0) << " ms");
+
+	const std::vector<std::string> candidates = OCLBuildOptionsTuner::GetCandidates();
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		try {
+			std::vector<float> image;
+			const double t = BenchmarkBuildOptions(deviceIndex, kernelSource, buildOpts + " " + candidates[i], &image);
+			const double error = usePSNR ? OCLBuildOptionsTuner::ImagePSNR(referenceImage, image) :
+				OCLBuildOptionsTuner::ImageRMSE(referenceImage, image);
+			const bool accepted = usePSNR ? (error >= threshold) : (error <= threshold);
+			OCLTOY_LOG("  " << candidates[i] << ": " << (t * 1000.0) << " ms, " << metric << " " << error <<
+					(accepted ? "" : " (rejected)"));
+
+			if (accepted && (t < bestTime)) {
+				tunedOpts = candidates[i];
+				bestTime = t;
+			}
+		} catch (cl::Error err) {
+			OCLTOY_LOG("  " << candidates[i] << ": " << err.what() << "(" << OCLErrorString(err.err()) << ")");
+		}
+	}
+
+	tuningStore->Set(tuningKey, tunedOpts);
+	OCLTOY_LOG("Autotuned build options (Device " << deviceIndex << "): " <<
+			(tunedOpts.length() > 0 ? tunedOpts : "strict math"));
+
+	return (tunedOpts.length() > 0) ? (buildOpts + " " + tunedOpts) : buildOpts;
+}
+
+double OCLToy::BenchmarkBuildOptions(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts, std::vector<float> *image) {
+	cl::Program program = CompileProgram(deviceIndex, kernelSource, buildOpts);
+
+	// Warm up
+	RenderWithProgram(deviceIndex, program, image);
+
+	return BenchmarkRender(boost::bind(&OCLToy::RenderWithProgram, this, deviceIndex,
+			boost::ref(program), (std::vector<float> *)NULL));
+}
+
+double OCLToy::BenchmarkRender(const boost::function<void ()> &render) {
+	// Render at least 3 times and for at least 0.2 secs
+	const double startTime = WallClockTime();
+	unsigned int runs = 0;
+	double elapsedTime;
+	do {
+		render();
+		++runs;
+
+		elapsedTime = WallClockTime() - startTime;
+	} while ((runs < 3) || (elapsedTime < 0.2));
+
+	return elapsedTime / runs;
+}
+
+double OCLToy::CalibrateDevice(const unsigned int deviceIndex, const std::string &calibrationKey,
+		const boost::function<void ()> &renderFrame, const double frameWorkItems) {
+	double speed = 0.0;
+	std::string value;
+	if (commandLineOpts.count("calibrate")) {
+		OCLTOY_LOG("Calibrating device speed: " << calibrationKey);
+
+		// Warm up
+		renderFrame();
+		speed = frameWorkItems / BenchmarkRender(renderFrame);
+		tuningStore->Set(calibrationKey, boost::lexical_cast<std::string>(speed));
+	} else if (tuningStore->Get(calibrationKey, value))
+		speed = boost::lexical_cast<double>(value);
+	else
+		return 0.0;
+
+	OCLTOY_LOG("Device " << deviceIndex << " speed: " << (speed / 1000000.0) << "M work items/sec");
+	boost::unique_lock<boost::mutex> lock(deviceSpeedsMutex);
+	deviceSpeeds[deviceIndex] = speed;
+
+	return speed;
+}
+
+double OCLToy::GetDeviceWeight(const unsigned int deviceIndex) const {
+	boost::unique_lock<boost::mutex> lock(deviceSpeedsMutex);
+
+	if (deviceSpeeds[deviceIndex] <= 0.0)
+		return 1.0;
+
+	const double maxSpeed = *std::max_element(deviceSpeeds.begin(), deviceSpeeds.end());
+	const double weight = deviceSpeeds[deviceIndex] / maxSpeed;
+
+	return (weight < commandLineOpts["mindevicespeed"].as<double>()) ? 0.0 : weight;
+}
+
+std::vector<double> OCLToy::GetDeviceWeights() const {
+	std::vector<double> weights(selectedDevices.size());
+	for (unsigned int i = 0; i < selectedDevices.size(); ++i)
+		weights[i] = GetDeviceWeight(i);
+
+	return weights;
+}
+
+void OCLToy::RenderWithProgram(const unsigned int deviceIndex, cl::Program &program,
+		std::vector<float> *image) {
+	throw std::runtime_error("The build options autotuning is not supported by this toy");
+}
+
+//------------------------------------------------------------------------------
+// Headless (batch) mode related code
+//------------------------------------------------------------------------------
+
+int OCLToy::RunHeadless() {
+	unsigned int maxPasses = 0;
+	if (commandLineOpts.count("passes"))
+		maxPasses = commandLineOpts["passes"].as<unsigned int>();
+	double maxTime = 0.0;
+	if (commandLineOpts.count("seconds"))
+		maxTime = commandLineOpts["seconds"].as<double>();
+	if ((maxPasses == 0) && (maxTime <= 0.0))
+		maxPasses = 1;
+
+	OCLTOY_LOG("Headless rendering: " << windowWidth << "x" << windowHeight <<
+			" (max. passes: " << maxPasses << ", max. time: " << maxTime << " secs)");
+
+	const double startTime = WallClockTime();
+	double elapsedTime = 0.0;
+	double samples = 0.0;
+	unsigned int pass = 0;
+	for (;;) {
+		if ((maxPasses > 0) && (pass >= maxPasses))
+			break;
+		if ((maxTime > 0.0) && (elapsedTime >= maxTime))
+			break;
+
+		samples += HeadlessPass();
+		++pass;
+		elapsedTime = WallClockTime() - startTime;
+	}
+
+	OCLTOY_LOG("Headless rendering done: " << pass << " passes in " << elapsedTime << " secs");
+	OCLTOY_LOG("  Passes/sec: " << (pass / elapsedTime));
+	OCLTOY_LOG("  Samples/sec: " << (samples / elapsedTime) / 1000000.0 << "M");
+
+	SaveImage(commandLineOpts["output"].as<std::string>());
+	Done();
+
+	return EXIT_SUCCESS;
 }
 
 //------------------------------------------------------------------------------
@@ -398,6 +1059,7 @@ void OCLToy::GlutReshapeFunc(int newWidth, int newHeight) {
 }
 
 void OCLToy::GlutDisplayFunc() {
+	OCLScopedTimer timer("Display");
 	currentOCLToy->DisplayCallBack();
 }
 
@@ -24,20 +24,27 @@
 
 #include "utils.h"
 #include "version.h"
+#include "logger.h"
+#include "programcache.h"
+#include "bufferpool.h"
+#include "oclprofiler.h"
+#include "stagingbuffer.h"
+#include "autotuner.h"
+#include "asyncbuild.h"
+#include "taskgraph.h"
+#include "threadpool.h"
+#include "timers.h"
+#include "tilescheduler.h"
 
 #include <sstream>
 #include <vector>
 
 #include <boost/program_options.hpp>
 
-extern void OCLToyDebugHandler(const char *msg);
-
-#define OCLTOY_LOG(a) { std::stringstream _OCLTOY_LOG_LOCAL_SS; _OCLTOY_LOG_LOCAL_SS << a; OCLToyDebugHandler(_OCLTOY_LOG_LOCAL_SS.str().c_str()); }
-
 class OCLToy {
 public:
 	OCLToy(const std::string &winTitle);
-	virtual ~OCLToy() { }
+	virtual ~OCLToy();
 
 	virtual int Run(int argc, char *argv[]);
 
@@ -57,6 +64,15 @@ protected:
 
 	virtual void InitGlut();
 
+	//--------------------------------------------------------------------------
+	// Headless (batch) mode related code
+	//--------------------------------------------------------------------------
+
+	virtual int RunHeadless();
+	// Renders a single pass (i.e. a frame) and returns the number of samples computed
+	virtual double HeadlessPass() = 0;
+	virtual void SaveImage(const std::string &fileName) = 0;
+
 	//--------------------------------------------------------------------------
 	// OpenCL related code
 	//--------------------------------------------------------------------------
@@ -64,7 +80,19 @@ protected:
 	virtual void SelectOpenCLDevices();
 	virtual void InitOpenCLDevices();
 	virtual unsigned int GetMaxDeviceCountSupported() const = 0;
+	// Splits a CPU device as requested by the --oclcpufission option, returns
+	// false if the device can not be split
+	bool CreateSubDevices(cl::Device &device, VECTOR_CLASS<cl::Device> *subDevices);
+	// Returns true if the devices use the same context (see the --sharedcontext
+	// option), so the buffers of one device can be used by the other
+	bool IsContextShared(const unsigned int deviceIndex0, const unsigned int deviceIndex1) const;
+	// Moves the buffers (allocated by any device of the same context) to the
+	// memory of the device of the queue, after the wait events
+	void EnqueueMigrateOCLBuffers(const unsigned int deviceIndex, cl::CommandQueue &queue,
+		const VECTOR_CLASS<cl::Memory> &buffs, const VECTOR_CLASS<cl::Event> *waitEvents, cl::Event *event);
 
+	void AllocOCLBuffer(const unsigned int deviceIndex, cl::Buffer **buff,
+		const cl_mem_flags flags, const size_t size, const std::string &desc);
 	void AllocOCLBufferRO(const unsigned int deviceIndex, cl::Buffer **buff,
 		void *src, const size_t size, const std::string &desc);
 	void AllocOCLBufferRW(const unsigned int deviceIndex, cl::Buffer **buff,
@@ -72,21 +100,146 @@ protected:
 	void AllocOCLBufferWO(const unsigned int deviceIndex, cl::Buffer **buff,
 		const size_t size, const std::string &desc);
 	void FreeOCLBuffer(const unsigned int deviceIndex, cl::Buffer **buff);
+	void PrintOCLBufferReport() const;
+
+	// Allocates (or reuses, if the size is the same) pinned host memory and returns its pointer
+	void *AllocOCLStagingBuffer(const unsigned int deviceIndex, OCLStagingBuffer **staging,
+		const size_t size, const std::string &desc);
+	void FreeOCLStagingBuffer(OCLStagingBuffer **staging);
+	// Returns the host memory to read the buffer back into: the memory of the
+	// buffer itself with zero-copy devices otherwise a staging buffer
+	void *AllocOCLReadbackMemory(const unsigned int deviceIndex, cl::Buffer *buff,
+		OCLStagingBuffer **staging, const std::string &desc);
+	// Reads the buffer back in the memory returned by AllocOCLReadbackMemory().
+	// Zero-copy buffers are only mapped and unmapped to synchronize the memory.
+	void EnqueueReadOCLBuffer(const unsigned int deviceIndex, cl::CommandQueue &queue,
+		cl::Buffer *buff, const cl_bool blocking, void *dst,
+		const VECTOR_CLASS<cl::Event> *waitEvents, cl::Event *event);
+	// Allocates the host memory of a frame assembled from tiles: pinned memory
+	// if the frame fits in a buffer of the first device otherwise plain memory
+	void *AllocOCLFrameMemory(OCLStagingBuffer **staging, std::vector<char> *memory,
+		const size_t size, const std::string &desc);
+	// Writes the buffer through the upload ring of the device (the call doesn't
+	// block), event is set to the one of the write (i.e. for a task graph)
+	void UploadOCLBuffer(const unsigned int deviceIndex, cl::Buffer &buff,
+		const void *src, const size_t size, const std::string &desc, cl::Event *event = NULL);
+	// Returns a new task graph of the device, on its out-of-order queue if it
+	// has one, otherwise on its compute and transfer queues
+	OCLTaskGraph NewTaskGraph(const unsigned int deviceIndex);
+
+	// Returns the number of work items of a tile: the whole frame with a single
+	// device (if the buffers fit in the device memory) otherwise about 8 tiles
+	// for each device, so the faster devices can steal the tiles of the slower
+	// ones. Each device has 2 tile buffers of bytesPerItem * tile size.
+	size_t GetTileSize(const size_t itemCount, const size_t bytesPerItem) const;
+	// Returns the size of a tile buffer: the global size of a tile is rounded up
+	// to the work group size so the work items past the end of the tile must be
+	// able to write in the buffer too
+	size_t GetTileBufferSize(const unsigned int deviceIndex, const size_t tileSize,
+		const size_t bytesPerItem) const;
+	// Renders all the tiles on all the selected devices, each one with its own
+	// thread of the pool, and waits for the end of the frame
+	void RenderTiles(OCLTileScheduler &scheduler, const OCLRenderTileFunc &renderTile);
+	// Renders tiles on the device until there are no more tiles to render
+	void RenderDeviceTiles(const unsigned int deviceIndex, OCLTileScheduler &scheduler,
+		const OCLRenderTileFunc &renderTile);
+	// Renders all the tiles of a frame on the device alone
+	void RenderDeviceFrame(const unsigned int deviceIndex, OCLTileScheduler &scheduler,
+		const size_t itemCount, const size_t tileSize, const OCLRenderTileFunc &renderTile);
+
+	// Returns the event to use for an OpenCL command so it is recorded in
+	// the trace or NULL if the tracing is disabled
+	cl::Event *ProfileEvent(const unsigned int deviceIndex, const std::string &name,
+		const std::string &category, const unsigned int queueIndex = 0);
+	void ProfileEvent(const unsigned int deviceIndex, const cl::Event &event, const std::string &name,
+		const std::string &category, const unsigned int queueIndex = 0);
+
+	cl::Program CompileProgram(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts);
+	// Starts the compilation of the program in a background thread, the
+	// returned object has to be deleted by the caller
+	OCLAsyncProgramBuild *CompileProgramAsync(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts);
+	// Compiles the program for all the devices at the same time (with the
+	// build options of each device) and waits for the end of the compilations
+	std::vector<cl::Program> CompilePrograms(const std::string &kernelSource,
+		const std::vector<std::string> &deviceBuildOpts);
+
+	// Returns the work group size of the kernel: the --workgroupsize option,
+	// the result of a previous autotuning or CL_KERNEL_WORK_GROUP_SIZE
+	size_t GetKernelWorkGroupSize(const unsigned int deviceIndex, cl::Kernel &kernel,
+		const std::string &tuningKey);
+	// With the --autotune option, benchmarks the work group sizes of the kernel
+	// (all its arguments must be set) and returns (and stores) the fastest one
+	size_t TuneKernelWorkGroupSize(const unsigned int deviceIndex, cl::Kernel &kernel,
+		const std::string &tuningKey, const size_t globalSize, const size_t workGroupSize);
+
+	// Returns the build options to use for the kernel: the base options plus the
+	// fast math options found by the build options autotuning. With the
+	// --autotunebuild option, the kernel is built with each combination of the
+	// fast math options and the fastest one rendering an image close enough to
+	// the one of the strict math build is stored.
+	std::string TuneBuildOptions(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts, const std::string &tuningKey);
+	// Renders an image with a kernel of the program (used by the build options
+	// autotuning). The image pixel values must be in the [0, 1] range and it
+	// is NULL if the image is not required. The rendering must be deterministic.
+	virtual void RenderWithProgram(const unsigned int deviceIndex, cl::Program &program,
+		std::vector<float> *image);
+	// Returns the average time of a rendering with the program built with the options
+	double BenchmarkBuildOptions(const unsigned int deviceIndex, const std::string &kernelSource,
+		const std::string &buildOpts, std::vector<float> *image);
+	// Returns the average time of a call of render (without any warm up)
+	double BenchmarkRender(const boost::function<void ()> &render);
+
+	// Returns the speed of the device in work items per second (0.0 if it is
+	// unknown): with the --calibrate option, it is measured by rendering
+	// frames of frameWorkItems work items on the device alone and stored for
+	// the following runs, otherwise the stored speed is used
+	double CalibrateDevice(const unsigned int deviceIndex, const std::string &calibrationKey,
+		const boost::function<void ()> &renderFrame, const double frameWorkItems);
+	// Returns the share of the work of the device: its speed relative to the
+	// fastest device (1.0 if its speed is unknown) or 0.0 if it is slower than
+	// the --mindevicespeed fraction of the fastest one and it must not be used
+	double GetDeviceWeight(const unsigned int deviceIndex) const;
+	std::vector<double> GetDeviceWeights() const;
 
 	virtual boost::program_options::options_description GetOptionsDescriction() = 0;
 	virtual int RunToy() = 0;
+	// Prints the reports and writes the trace file at the end of the run
+	void Done();
 
 	boost::program_options::variables_map commandLineOpts;
 	std::vector<cl::Device> selectedDevices;
+	// True for the sub-devices created by the --oclcpufission option
+	std::vector<bool> selectedSubDevices;
 	std::vector<cl::Context> deviceContexts;
 	std::vector<cl::CommandQueue> deviceQueues;
-	std::vector<size_t> deviceUsedMemory;
+	// A second queue for each device used to overlap the buffer transfers
+	// with the kernel execution (queue index 1 in the trace)
+	std::vector<cl::CommandQueue> deviceTransferQueues;
+	// The queue of the task graphs of each device (queue index 2 in the
+	// trace), a NULL queue if the device doesn't support out-of-order queues
+	std::vector<cl::CommandQueue> deviceOutOfOrderQueues;
+	std::vector<OCLBufferPool *> deviceBufferPools;
+	std::vector<OCLUploadRing *> deviceUploadRings;
+	// NULL if the program binary cache is disabled
+	OCLProgramCache *programCache;
+	// NULL if the tracing is disabled
+	OCLProfiler *profiler;
+	OCLTuningStore *tuningStore;
+	// Runs all the host side work in parallel (i.e. the rendering threads of
+	// the devices), it is created once the devices are initialized
+	OCLThreadPool *threadPool;
+	// The speeds measured (or stored) by CalibrateDevice(), 0.0 if unknown
+	std::vector<double> deviceSpeeds;
+	mutable boost::mutex deviceSpeedsMutex;
 
 	std::string windowTitle;
 	int windowWidth, windowHeight;
 
 	unsigned int millisTimerFunc;
-	bool useIdleCallback, printHelp;
+	bool useIdleCallback, printHelp, headless;
 
 	// It is possible to run only a single Toy at time
 	static OCLToy *currentOCLToy;
@@ -0,0 +1,193 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+
+#include "ocltoy.h"
+#include "programcache.h"
+
+OCLProgramCache::OCLProgramCache(const std::string &dir) : dirName(dir) {
+	boost::filesystem::create_directories(dirName);
+}
+
+cl::Program OCLProgramCache::Compile(cl::Context &context, cl::Device &device,
+		const std::string &kernelSource, const std::string &buildOpts,
+		bool *cached, bool *stored) {
+	// Two different hashes of the same key in order to make collisions negligible
+	const std::string key = GetKey(device, kernelSource, buildOpts);
+	const std::string keyHash = boost::str(boost::format("%016x%016x") %
+			HashString(key, 14695981039346656037ULL) %
+			HashString(key, 1099511628211ULL));
+	const std::string fileName = (boost::filesystem::path(dirName) / (keyHash + ".bin")).string();
+
+	VECTOR_CLASS<cl::Device> buildDevice;
+	buildDevice.push_back(device);
+
+	std::string binary;
+	if (LoadBinary(fileName, binary)) {
+		try {
+			cl::Program::Binaries binaries(1, std::make_pair((const void *)binary.data(), binary.size()));
+			cl::Program program(context, buildDevice, binaries);
+			program.build(buildDevice, buildOpts.c_str());
+
+			*cached = true;
+			*stored = true;
+			return program;
+		} catch (cl::Error err) {
+			// The driver has rejected the binary, it will be replaced
+			OCLTOY_LOG_WARNING("Failed to load the cached program binary " << fileName << ": " <<
+					err.what() << "(" << OCLErrorString(err.err()) << ")");
+		}
+	}
+
+	cl::Program program = Build(context, device, kernelSource, buildOpts);
+	*cached = false;
+	*stored = false;
+
+	// Retrieve the program binary. The C API is used because
+	// getInfo<CL_PROGRAM_BINARIES>() doesn't allocate the binary buffers.
+	// With a shared context, the program has all the devices of the context
+	// (it is built only for this one) and there is a binary for each of them.
+	cl_uint deviceCount = 0;
+	if (clGetProgramInfo(program(), CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &deviceCount, NULL) != CL_SUCCESS) {
+		OCLTOY_LOG_WARNING("Failed to retrieve the devices of the program, the binary is not cached");
+		return program;
+	}
+	std::vector<cl_device_id> programDevices(deviceCount);
+	std::vector<size_t> binarySizes(deviceCount, 0);
+	if ((deviceCount == 0) ||
+			(clGetProgramInfo(program(), CL_PROGRAM_DEVICES, sizeof(cl_device_id) * deviceCount, &programDevices[0], NULL) != CL_SUCCESS) ||
+			(clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * deviceCount, &binarySizes[0], NULL) != CL_SUCCESS)) {
+		OCLTOY_LOG_WARNING("Failed to retrieve the program binary sizes, the binary is not cached");
+		return program;
+	}
+
+	const size_t deviceIndex = std::find(programDevices.begin(), programDevices.end(), device()) - programDevices.begin();
+	if ((deviceIndex == deviceCount) || (binarySizes[deviceIndex] == 0)) {
+		OCLTOY_LOG_WARNING("The program has no binary for the device, the binary is not cached");
+		return program;
+	}
+
+	// Only the binary of the device is retrieved
+	binary.resize(binarySizes[deviceIndex]);
+	std::vector<unsigned char *> binaryPtrs(deviceCount, NULL);
+	binaryPtrs[deviceIndex] = (unsigned char *)&binary[0];
+	if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(unsigned char *) * deviceCount, &binaryPtrs[0], NULL) != CL_SUCCESS) {
+		OCLTOY_LOG_WARNING("Failed to retrieve the program binary, the binary is not cached");
+		return program;
+	}
+
+	*stored = SaveBinary(fileName, keyHash, binary);
+	return program;
+}
+
+cl::Program OCLProgramCache::Build(cl::Context &context, cl::Device &device,
+		const std::string &kernelSource, const std::string &buildOpts) {
+	cl::Program::Sources source(1, std::make_pair(kernelSource.c_str(), kernelSource.length()));
+	cl::Program program = cl::Program(context, source);
+	try {
+		VECTOR_CLASS<cl::Device> buildDevice;
+		buildDevice.push_back(device);
+		program.build(buildDevice, buildOpts.c_str());
+	} catch (cl::Error err) {
+		cl::STRING_CLASS strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+		OCLTOY_LOG_ERROR("Kernel compilation error:\n" << strError.c_str());
+
+		throw err;
+	}
+
+	return program;
+}
+
+std::string OCLProgramCache::GetKey(cl::Device &device,
+		const std::string &kernelSource, const std::string &buildOpts) {
+	cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+
+	std::stringstream ss;
+	ss << platform.getInfo<CL_PLATFORM_VENDOR>() << "\n" <<
+			platform.getInfo<CL_PLATFORM_NAME>() << "\n" <<
+			platform.getInfo<CL_PLATFORM_VERSION>() << "\n" <<
+			device.getInfo<CL_DEVICE_NAME>() << "\n" <<
+			device.getInfo<CL_DEVICE_VERSION>() << "\n" <<
+			device.getInfo<CL_DRIVER_VERSION>() << "\n" <<
+			buildOpts << "\n" <<
+			kernelSource;
+
+	return ss.str();
+}
+
+// FNV-1a hash
+unsigned long long OCLProgramCache::HashString(const std::string &s, const unsigned long long seed) {
+	unsigned long long hash = seed;
+	for (size_t i = 0; i < s.length(); ++i) {
+		hash ^= (unsigned char)s[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+bool OCLProgramCache::LoadBinary(const std::string &fileName, std::string &binary) const {
+	if (!boost::filesystem::exists(fileName))
+		return false;
+
+	std::ifstream ifs(fileName.c_str(), std::ifstream::in | std::ifstream::binary);
+	if (!ifs.good())
+		return false;
+
+	binary.assign((std::istreambuf_iterator<char>(ifs)), (std::istreambuf_iterator<char>()));
+	ifs.close();
+
+	return (binary.size() > 0);
+}
+
+bool OCLProgramCache::SaveBinary(const std::string &fileName, const std::string &keyHash,
+		const std::string &binary) const {
+	try {
+		// Write a temporary file and rename it so concurrent runs never read
+		// a partially written binary
+		const boost::filesystem::path tmpFileName = boost::filesystem::path(dirName) /
+				boost::filesystem::unique_path(keyHash + "-%%%%%%%%.tmp");
+
+		std::ofstream ofs(tmpFileName.string().c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+		if (!ofs.good())
+			throw std::runtime_error("Error while opening file: " + tmpFileName.string());
+		ofs.write(binary.data(), binary.size());
+		if (!ofs.good())
+			throw std::runtime_error("Error while writing file: " + tmpFileName.string());
+		ofs.close();
+
+		boost::filesystem::rename(tmpFileName, fileName);
+	} catch (std::exception &err) {
+		// A cache failure is not fatal
+		OCLTOY_LOG_WARNING("Failed to store the program binary in the cache: " << err.what());
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,66 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef PROGRAMCACHE_H
+#define	PROGRAMCACHE_H
+
+#include "opencl.h"
+
+#include <string>
+
+// A persistent on-disk cache of OpenCL program binaries. The binaries are
+// indexed by a hash of the kernel source, the build options and the platform,
+// device and driver. NOTE: the files included by the kernel source are not
+// part of the key, the toys use preprocessed kernels by default.
+class OCLProgramCache {
+public:
+	OCLProgramCache(const std::string &dirName);
+	~OCLProgramCache() { }
+
+	// Returns a program built for the device. The binary is loaded from the
+	// cache if available (cached is set to true) otherwise the program is
+	// built from the source and the binary is stored in the cache (stored is
+	// set to false if that fails).
+	cl::Program Compile(cl::Context &context, cl::Device &device,
+			const std::string &kernelSource, const std::string &buildOpts,
+			bool *cached, bool *stored);
+
+	// Builds the program from source (logging the compiler output on error)
+	static cl::Program Build(cl::Context &context, cl::Device &device,
+			const std::string &kernelSource, const std::string &buildOpts);
+
+	// FNV-1a 64bit hash
+	static unsigned long long HashString(const std::string &s, const unsigned long long seed);
+
+private:
+	static std::string GetKey(cl::Device &device,
+			const std::string &kernelSource, const std::string &buildOpts);
+
+	bool LoadBinary(const std::string &fileName, std::string &binary) const;
+	// Returns false (and logs a warning) if the binary can't be stored
+	bool SaveBinary(const std::string &fileName, const std::string &keyHash,
+		const std::string &binary) const;
+
+	std::string dirName;
+};
+
+#endif	/* PROGRAMCACHE_H */
@@ -0,0 +1,87 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <cstring>
+
+#include "ocltoy.h"
+#include "stagingbuffer.h"
+
+//------------------------------------------------------------------------------
+// OCLStagingBuffer
+//------------------------------------------------------------------------------
+
+OCLStagingBuffer::OCLStagingBuffer(const cl::Context &context, const cl::CommandQueue &q,
+		const size_t s, const bool deviceFirstTouch) : queue(q), size(s) {
+	buffer = new cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size);
+#if defined(CL_VERSION_1_2)
+	if (deviceFirstTouch)
+		queue.enqueueFillBuffer<cl_uchar>(*buffer, 0, 0, size);
+#endif
+	ptr = queue.enqueueMapBuffer(*buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size);
+}
+
+OCLStagingBuffer::~OCLStagingBuffer() {
+	try {
+		queue.enqueueUnmapMemObject(*buffer, ptr);
+		queue.finish();
+	} catch (cl::Error err) {
+		OCLTOY_LOG("Unable to unmap a staging buffer: " << err.what() << "(" << OCLErrorString(err.err()) << ")");
+	}
+
+	delete buffer;
+}
+
+//------------------------------------------------------------------------------
+// OCLUploadRing
+//------------------------------------------------------------------------------
+
+OCLUploadRing::OCLUploadRing(const cl::Context &context, const cl::CommandQueue &q,
+		const unsigned int slotCount, const size_t size) : queue(q), slotSize(size), nextSlot(0) {
+	for (unsigned int i = 0; i < slotCount; ++i)
+		slots.push_back(new OCLStagingBuffer(context, queue, slotSize));
+	slotEvents.resize(slotCount);
+}
+
+OCLUploadRing::~OCLUploadRing() {
+	for (unsigned int i = 0; i < slots.size(); ++i)
+		delete slots[i];
+}
+
+void OCLUploadRing::Upload(cl::Buffer &buff, const void *src, const size_t size, cl::Event *event) {
+	if (size > slotSize) {
+		queue.enqueueWriteBuffer(buff, CL_TRUE, 0, size, src, NULL, event);
+		return;
+	}
+
+	// Wait for the previous write from this slot
+	cl::Event &slotEvent = slotEvents[nextSlot];
+	if (slotEvent())
+		slotEvent.wait();
+
+	void *slotPtr = slots[nextSlot]->GetPtr();
+	memcpy(slotPtr, src, size);
+	queue.enqueueWriteBuffer(buff, CL_FALSE, 0, size, slotPtr, NULL, &slotEvent);
+	if (event)
+		*event = slotEvent;
+
+	nextSlot = (nextSlot + 1) % slots.size();
+}
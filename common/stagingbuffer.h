@@ -0,0 +1,74 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef STAGINGBUFFER_H
+#define	STAGINGBUFFER_H
+
+#include "opencl.h"
+
+#include <vector>
+
+// A host buffer allocated by the OpenCL runtime (CL_MEM_ALLOC_HOST_PTR) and
+// kept mapped for its whole life. The memory is usually pinned so the
+// transfers from/to device buffers can use DMA instead of the pageable
+// memory path of the driver. With deviceFirstTouch, the memory is zeroed by
+// the device of the queue before it is mapped, so the pages of a CPU
+// sub-device are allocated on its own NUMA node (first touch policy).
+class OCLStagingBuffer {
+public:
+	OCLStagingBuffer(const cl::Context &context, const cl::CommandQueue &queue, const size_t size,
+		const bool deviceFirstTouch = false);
+	~OCLStagingBuffer();
+
+	void *GetPtr() const { return ptr; }
+	size_t GetSize() const { return size; }
+
+private:
+	cl::CommandQueue queue;
+	cl::Buffer *buffer;
+	void *ptr;
+	size_t size;
+};
+
+// A ring of staging buffers used to upload small per-frame data (camera,
+// rendering configuration, scene, etc.) with non-blocking writes. A slot is
+// reused only after its previous write has been completed.
+class OCLUploadRing {
+public:
+	OCLUploadRing(const cl::Context &context, const cl::CommandQueue &queue,
+			const unsigned int slotCount, const size_t slotSize);
+	~OCLUploadRing();
+
+	// Copies the data in the next slot and enqueues the write of the buffer.
+	// Data bigger than a slot is written with a blocking write.
+	void Upload(cl::Buffer &buff, const void *src, const size_t size, cl::Event *event);
+
+private:
+	cl::CommandQueue queue;
+	const size_t slotSize;
+
+	std::vector<OCLStagingBuffer *> slots;
+	std::vector<cl::Event> slotEvents;
+	unsigned int nextSlot;
+};
+
+#endif	/* STAGINGBUFFER_H */
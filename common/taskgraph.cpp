@@ -0,0 +1,153 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include "taskgraph.h"
+
+OCLTaskGraph::OCLTaskGraph(cl::CommandQueue &kQueue, const unsigned int kQueueIndex,
+		cl::CommandQueue &tQueue, const unsigned int tQueueIndex, const OCLTaskGraphProfileFunc &prof) :
+		kernelQueue(kQueue), transferQueue(tQueue), kernelQueueIndex(kQueueIndex),
+		transferQueueIndex(tQueueIndex), singleQueue(kQueue() == tQueue()), profile(prof) {
+}
+
+OCLTaskGraph::Nodes OCLTaskGraph::After(const Node node) {
+	return Nodes(1, node);
+}
+
+OCLTaskGraph::Nodes OCLTaskGraph::After(const Node node0, const Node node1) {
+	Nodes deps(1, node0);
+	deps.push_back(node1);
+
+	return deps;
+}
+
+OCLTaskGraph::Node OCLTaskGraph::AddEvent(const cl::Event &event) {
+	NodeInfo node;
+	node.type = NODE_EVENT;
+	node.event = event;
+	nodes.push_back(node);
+
+	return nodes.size() - 1;
+}
+
+OCLTaskGraph::Node OCLTaskGraph::AddWrite(const Nodes &deps, const cl::Buffer &buff, const size_t offset,
+		const size_t size, const void *src, const std::string &name) {
+	const VECTOR_CLASS<cl::Event> waitEvents = GetWaitEvents(deps, NODE_TRANSFER);
+
+	cl::Event event;
+	GetQueue(NODE_TRANSFER).enqueueWriteBuffer(buff, CL_FALSE, offset, size, src,
+			waitEvents.empty() ? NULL : &waitEvents, &event);
+
+	return AddNode(NODE_TRANSFER, event, name, "write");
+}
+
+OCLTaskGraph::Node OCLTaskGraph::AddKernel(const Nodes &deps, const cl::Kernel &kernel,
+		const cl::NDRange &offset, const cl::NDRange &globalThreads, const cl::NDRange &localThreads,
+		const std::string &name) {
+	const VECTOR_CLASS<cl::Event> waitEvents = GetWaitEvents(deps, NODE_KERNEL);
+
+	cl::Event event;
+	GetQueue(NODE_KERNEL).enqueueNDRangeKernel(kernel, offset, globalThreads, localThreads,
+			waitEvents.empty() ? NULL : &waitEvents, &event);
+
+	return AddNode(NODE_KERNEL, event, name, "kernel");
+}
+
+OCLTaskGraph::Node OCLTaskGraph::AddCopy(const Nodes &deps, const cl::Buffer &src, const cl::Buffer &dst,
+		const size_t srcOffset, const size_t dstOffset, const size_t size, const std::string &name) {
+	const VECTOR_CLASS<cl::Event> waitEvents = GetWaitEvents(deps, NODE_TRANSFER);
+
+	cl::Event event;
+	GetQueue(NODE_TRANSFER).enqueueCopyBuffer(src, dst, srcOffset, dstOffset, size,
+			waitEvents.empty() ? NULL : &waitEvents, &event);
+
+	return AddNode(NODE_TRANSFER, event, name, "copy");
+}
+
+OCLTaskGraph::Node OCLTaskGraph::AddRead(const Nodes &deps, const cl::Buffer &buff, const size_t offset,
+		const size_t size, void *dst, const std::string &name) {
+	const VECTOR_CLASS<cl::Event> waitEvents = GetWaitEvents(deps, NODE_TRANSFER);
+
+	cl::Event event;
+	GetQueue(NODE_TRANSFER).enqueueReadBuffer(buff, CL_FALSE, offset, size, dst,
+			waitEvents.empty() ? NULL : &waitEvents, &event);
+
+	return AddNode(NODE_TRANSFER, event, name, "read");
+}
+
+void OCLTaskGraph::Flush() {
+	kernelQueue.flush();
+	if (!singleQueue)
+		transferQueue.flush();
+}
+
+void OCLTaskGraph::Wait() {
+	Flush();
+
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		if (nodes[i].event())
+			nodes[i].event.wait();
+	}
+}
+
+cl::CommandQueue &OCLTaskGraph::GetQueue(const NodeType type) {
+	return (type == NODE_KERNEL) ? kernelQueue : transferQueue;
+}
+
+VECTOR_CLASS<cl::Event> OCLTaskGraph::GetWaitEvents(const Nodes &deps, const NodeType type) {
+	bool flushKernelQueue = false;
+	bool flushTransferQueue = false;
+
+	VECTOR_CLASS<cl::Event> waitEvents;
+	for (size_t i = 0; i < deps.size(); ++i) {
+		const NodeInfo &dep = nodes[deps[i]];
+		if (!dep.event())
+			continue;
+
+		waitEvents.push_back(dep.event);
+		if (!singleQueue && (dep.type != NODE_EVENT) && (dep.type != type)) {
+			if (dep.type == NODE_KERNEL)
+				flushKernelQueue = true;
+			else
+				flushTransferQueue = true;
+		}
+	}
+
+	if (flushKernelQueue)
+		kernelQueue.flush();
+	if (flushTransferQueue)
+		transferQueue.flush();
+
+	return waitEvents;
+}
+
+OCLTaskGraph::Node OCLTaskGraph::AddNode(const NodeType type, const cl::Event &event, const std::string &name,
+		const std::string &category) {
+	if (profile)
+		profile(event, name, category, (type == NODE_KERNEL) ? kernelQueueIndex : transferQueueIndex);
+
+	NodeInfo node;
+	node.type = type;
+	node.event = event;
+	nodes.push_back(node);
+
+	return nodes.size() - 1;
+}
@@ -0,0 +1,106 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef TASKGRAPH_H
+#define	TASKGRAPH_H
+
+#include "opencl.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+// Records the event of a command enqueued by a task graph (see
+// OCLToy::ProfileEvent())
+typedef boost::function<void (const cl::Event &event, const std::string &name,
+		const std::string &category, const unsigned int queueIndex)> OCLTaskGraphProfileFunc;
+
+// A DAG of OpenCL commands (writes, kernels, copies and reads) of one device
+// where the only ordering between the commands are the explicit dependencies
+// of each node. The commands are enqueued as soon as their node is added (so
+// the kernel arguments are the ones set at that time) with the events of
+// their dependencies as wait list: on an out-of-order queue (the kernel and
+// the transfer queue are the same) the independent commands can run at the
+// same time, otherwise the kernels go on the kernel queue and the transfers
+// on the transfer queue so they still overlap. A graph is used by one single
+// thread at a time.
+class OCLTaskGraph {
+public:
+	typedef size_t Node;
+	typedef std::vector<Node> Nodes;
+
+	OCLTaskGraph(cl::CommandQueue &kernelQueue, const unsigned int kernelQueueIndex,
+		cl::CommandQueue &transferQueue, const unsigned int transferQueueIndex,
+		const OCLTaskGraphProfileFunc &profile = OCLTaskGraphProfileFunc());
+	~OCLTaskGraph() { }
+
+	static Nodes After(const Node node);
+	static Nodes After(const Node node0, const Node node1);
+
+	// A node done once the event is complete (i.e. a command enqueued out of
+	// the graph), the event can be a NULL event
+	Node AddEvent(const cl::Event &event);
+	Node AddWrite(const Nodes &deps, const cl::Buffer &buff, const size_t offset, const size_t size,
+		const void *src, const std::string &name);
+	Node AddKernel(const Nodes &deps, const cl::Kernel &kernel, const cl::NDRange &offset,
+		const cl::NDRange &globalThreads, const cl::NDRange &localThreads, const std::string &name);
+	Node AddCopy(const Nodes &deps, const cl::Buffer &src, const cl::Buffer &dst, const size_t srcOffset,
+		const size_t dstOffset, const size_t size, const std::string &name);
+	Node AddRead(const Nodes &deps, const cl::Buffer &buff, const size_t offset, const size_t size,
+		void *dst, const std::string &name);
+
+	const cl::Event &GetEvent(const Node node) const { return nodes[node].event; }
+
+	// Submits all the commands enqueued to the device
+	void Flush();
+	// Waits for the end of all the nodes
+	void Wait();
+
+private:
+	typedef enum {
+		NODE_EVENT, NODE_KERNEL, NODE_TRANSFER
+	} NodeType;
+
+	typedef struct {
+		NodeType type;
+		cl::Event event;
+	} NodeInfo;
+
+	cl::CommandQueue &GetQueue(const NodeType type);
+	// Returns the wait list of a command of the type, the queues of the
+	// dependencies on the other queue are flushed (the command would wait
+	// for ever for a command not submitted)
+	VECTOR_CLASS<cl::Event> GetWaitEvents(const Nodes &deps, const NodeType type);
+	Node AddNode(const NodeType type, const cl::Event &event, const std::string &name,
+		const std::string &category);
+
+	cl::CommandQueue &kernelQueue, &transferQueue;
+	const unsigned int kernelQueueIndex, transferQueueIndex;
+	// Set if the kernels and the transfers use the same (out-of-order) queue
+	const bool singleQueue;
+	OCLTaskGraphProfileFunc profile;
+
+	std::vector<NodeInfo> nodes;
+};
+
+#endif	/* TASKGRAPH_H */
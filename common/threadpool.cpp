@@ -0,0 +1,325 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <boost/bind.hpp>
+
+#include "threadpool.h"
+
+//------------------------------------------------------------------------------
+// OCLCancellationToken
+//------------------------------------------------------------------------------
+
+OCLCancellationToken::OCLCancellationToken() : state(new State()) {
+}
+
+void OCLCancellationToken::Cancel() {
+	std::vector<boost::function<void ()> > callbacks;
+	{
+		boost::unique_lock<boost::mutex> lock(state->cancelledMutex);
+		if (state->cancelled)
+			return;
+		state->cancelled = true;
+		callbacks.swap(state->cancelCallbacks);
+	}
+
+	// The callbacks lock the futures so they run without the token lock
+	for (size_t i = 0; i < callbacks.size(); ++i)
+		callbacks[i]();
+}
+
+void OCLCancellationToken::OnCancel(const boost::function<void ()> &func) {
+	{
+		boost::unique_lock<boost::mutex> lock(state->cancelledMutex);
+		if (!state->cancelled) {
+			state->cancelCallbacks.push_back(func);
+			return;
+		}
+	}
+
+	func();
+}
+
+bool OCLCancellationToken::IsCancelled() const {
+	boost::unique_lock<boost::mutex> lock(state->cancelledMutex);
+	return state->cancelled;
+}
+
+//------------------------------------------------------------------------------
+// OCLTaskFuture
+//------------------------------------------------------------------------------
+
+OCLTaskFuture::OCLTaskFuture() : state(new State()) {
+	state->done = true;
+}
+
+OCLTaskFuture::OCLTaskFuture(const OCLCancellationToken &token) : state(new State()) {
+	state->token = token;
+}
+
+bool OCLTaskFuture::IsDone() const {
+	boost::unique_lock<boost::mutex> lock(state->doneMutex);
+	return state->done;
+}
+
+bool OCLTaskFuture::IsCancelled() const {
+	boost::unique_lock<boost::mutex> lock(state->doneMutex);
+	return state->dropped || (!state->started && state->token.IsCancelled());
+}
+
+void OCLTaskFuture::Wait() const {
+	boost::unique_lock<boost::mutex> lock(state->doneMutex);
+	// A task cancelled before it started is done at once (see DropTask())
+	while (!state->done)
+		state->doneCondition.wait(lock);
+
+	if (state->failed) {
+		if (state->oclError)
+			throw cl::Error(state->errorCode, state->oclErrorString);
+		else
+			throw std::runtime_error(state->errorMessage);
+	}
+}
+
+//------------------------------------------------------------------------------
+// OCLThreadPool
+//------------------------------------------------------------------------------
+
+OCLThreadPool::OCLThreadPool(const unsigned int threadCount) : nextQueue(0), stopping(false) {
+	threadQueues.resize(std::max(threadCount, 1u));
+	for (unsigned int i = 0; i < threadQueues.size(); ++i)
+		threads.create_thread(boost::bind(&OCLThreadPool::WorkerThreadImpl, this, i));
+}
+
+OCLThreadPool::~OCLThreadPool() {
+	{
+		boost::unique_lock<boost::mutex> lock(queuesMutex);
+		stopping = true;
+		queuesCondition.notify_all();
+	}
+	threads.join_all();
+
+	// Drop the tasks left
+	for (size_t i = 0; i < threadQueues.size(); ++i) {
+		for (size_t j = 0; j < threadQueues[i].size(); ++j) {
+			OCLTaskFuture::State *state = threadQueues[i][j].future.state.get();
+
+			boost::unique_lock<boost::mutex> lock(state->doneMutex);
+			state->dropped = true;
+			state->done = true;
+			state->doneCondition.notify_all();
+		}
+	}
+}
+
+OCLTaskFuture OCLThreadPool::Submit(const boost::function<void ()> &task, const OCLCancellationToken &token) {
+	Task t;
+	t.func = task;
+	t.future = OCLTaskFuture(token);
+
+	// The waits for the task must not last until a pool thread pops it
+	// once the token is cancelled
+	OCLCancellationToken taskToken(token);
+	taskToken.OnCancel(boost::bind(&OCLThreadPool::DropTask,
+			boost::weak_ptr<OCLTaskFuture::State>(t.future.state)));
+
+	boost::unique_lock<boost::mutex> lock(queuesMutex);
+	const unsigned int *threadIndex = threadIndexPtr.get();
+	if (threadIndex)
+		threadQueues[*threadIndex].push_back(t);
+	else {
+		threadQueues[nextQueue].push_back(t);
+		nextQueue = (nextQueue + 1) % threadQueues.size();
+	}
+	queuesCondition.notify_one();
+
+	return t.future;
+}
+
+void OCLThreadPool::ParallelFor(const size_t begin, const size_t end, const size_t grainSize,
+		const boost::function<void (const size_t, const size_t)> &func) {
+	const size_t chunkCount = (end - begin + grainSize - 1) / grainSize;
+	if (chunkCount == 0)
+		return;
+
+	boost::mutex chunkMutex;
+	size_t chunkBegin = begin;
+
+	OCLCancellationToken token;
+	std::vector<OCLTaskFuture> helpers;
+	for (size_t i = 1; i < std::min<size_t>(chunkCount, threadQueues.size() + 1); ++i) {
+		helpers.push_back(Submit(boost::bind(&OCLThreadPool::ParallelForImpl,
+				&chunkMutex, &chunkBegin, end, grainSize, func), token));
+	}
+
+	try {
+		ParallelForImpl(&chunkMutex, &chunkBegin, end, grainSize, func);
+	} catch (...) {
+		// Stop handing out the chunks left
+		boost::unique_lock<boost::mutex> lock(chunkMutex);
+		chunkBegin = end;
+		lock.unlock();
+
+		token.Cancel();
+		WaitAll(helpers);
+		throw;
+	}
+
+	// All the chunks have been handed out, the helpers not started yet have
+	// nothing left to do
+	token.Cancel();
+	WaitAll(helpers);
+	// Throw the errors of the helpers (they are all done)
+	for (size_t i = 0; i < helpers.size(); ++i)
+		helpers[i].Wait();
+}
+
+void OCLThreadPool::WaitAll(const std::vector<OCLTaskFuture> &futures) {
+	for (size_t i = 0; i < futures.size(); ++i) {
+		try {
+			futures[i].Wait();
+		} catch (...) {
+			// Waiting for the others comes first
+		}
+	}
+}
+
+void OCLThreadPool::ParallelForImpl(boost::mutex *chunkMutex, size_t *chunkBegin, const size_t end,
+		const size_t grainSize, const boost::function<void (const size_t, const size_t)> &func) {
+	for (;;) {
+		size_t first;
+		{
+			boost::unique_lock<boost::mutex> lock(*chunkMutex);
+			if (*chunkBegin >= end)
+				return;
+
+			first = *chunkBegin;
+			*chunkBegin = std::min(first + grainSize, end);
+		}
+
+		func(first, std::min(first + grainSize, end));
+	}
+}
+
+bool OCLThreadPool::PopTask(const unsigned int threadIndex, Task *task) {
+	boost::unique_lock<boost::mutex> lock(queuesMutex);
+
+	for (;;) {
+		if (stopping)
+			return false;
+
+		// The newest task of its own queue
+		std::deque<Task> &queue = threadQueues[threadIndex];
+		if (queue.size() > 0) {
+			*task = queue.back();
+			queue.pop_back();
+			return true;
+		}
+
+		// Otherwise steal the oldest task of the longest queue
+		size_t longest = threadIndex;
+		for (size_t i = 0; i < threadQueues.size(); ++i) {
+			if (threadQueues[i].size() > threadQueues[longest].size())
+				longest = i;
+		}
+		if (threadQueues[longest].size() > 0) {
+			*task = threadQueues[longest].front();
+			threadQueues[longest].pop_front();
+			return true;
+		}
+
+		queuesCondition.wait(lock);
+	}
+}
+
+void OCLThreadPool::WorkerThreadImpl(const unsigned int threadIndex) {
+	threadIndexPtr.reset(new unsigned int(threadIndex));
+
+	Task task;
+	while (PopTask(threadIndex, &task)) {
+		RunTask(task);
+		// Release the resources bound to the task
+		task.func.clear();
+	}
+}
+
+void OCLThreadPool::RunTask(Task &task) {
+	OCLTaskFuture::State *state = task.future.state.get();
+	{
+		boost::unique_lock<boost::mutex> lock(state->doneMutex);
+		// Already dropped by DropTask()
+		if (state->done)
+			return;
+		if (state->token.IsCancelled()) {
+			state->dropped = true;
+			state->done = true;
+			state->doneCondition.notify_all();
+			return;
+		}
+		state->started = true;
+	}
+
+	bool failed = false;
+	bool oclError = false;
+	cl_int code = CL_SUCCESS;
+	const char *oclErrorString = NULL;
+	std::string message;
+	try {
+		task.func();
+	} catch (cl::Error err) {
+		failed = true;
+		oclError = true;
+		code = err.err();
+		oclErrorString = err.what();
+	} catch (std::exception &err) {
+		failed = true;
+		message = err.what();
+	} catch (...) {
+		// The waits for the task must not hang whatever the task throws
+		failed = true;
+		message = "Unknown error in a thread pool task";
+	}
+
+	boost::unique_lock<boost::mutex> lock(state->doneMutex);
+	state->failed = failed;
+	state->oclError = oclError;
+	state->errorCode = code;
+	state->oclErrorString = oclErrorString;
+	state->errorMessage = message;
+	state->done = true;
+	state->doneCondition.notify_all();
+}
+
+void OCLThreadPool::DropTask(const boost::weak_ptr<OCLTaskFuture::State> &futureState) {
+	boost::shared_ptr<OCLTaskFuture::State> state = futureState.lock();
+	if (!state)
+		return;
+
+	boost::unique_lock<boost::mutex> lock(state->doneMutex);
+	if (!state->started && !state->done) {
+		state->dropped = true;
+		state->done = true;
+		state->doneCondition.notify_all();
+	}
+}
@@ -0,0 +1,156 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef THREADPOOL_H
+#define	THREADPOOL_H
+
+#include "opencl.h"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+// Cancels a group of tasks: the tasks not started yet are dropped and the
+// running ones are expected to check IsCancelled() from time to time. The
+// copies of a token share the same state.
+class OCLCancellationToken {
+public:
+	OCLCancellationToken();
+
+	void Cancel();
+	bool IsCancelled() const;
+
+private:
+	friend class OCLThreadPool;
+
+	// Calls func once the token is cancelled (at once if it already is)
+	void OnCancel(const boost::function<void ()> &func);
+
+	struct State {
+		State() : cancelled(false) { }
+
+		boost::mutex cancelledMutex;
+		bool cancelled;
+		std::vector<boost::function<void ()> > cancelCallbacks;
+	};
+
+	boost::shared_ptr<State> state;
+};
+
+// The result of a task submitted to an OCLThreadPool. The errors of the task
+// are thrown again by Wait(). The copies of a future share the same state.
+class OCLTaskFuture {
+public:
+	// A future of no task (it is already done)
+	OCLTaskFuture();
+
+	bool IsDone() const;
+	// Set if the task has been cancelled before it started (so it will never run)
+	bool IsCancelled() const;
+	// Waits for the end of the task, or for its cancellation if it has not
+	// started yet
+	void Wait() const;
+
+private:
+	friend class OCLThreadPool;
+
+	struct State {
+		State() : started(false), done(false), dropped(false), failed(false), oclError(false),
+				errorCode(CL_SUCCESS), oclErrorString(NULL) { }
+
+		mutable boost::mutex doneMutex;
+		boost::condition_variable doneCondition;
+		OCLCancellationToken token;
+		// Dropped is set if the task is done without running
+		bool started, done, dropped;
+
+		// Set if the task has thrown an exception
+		bool failed, oclError;
+		cl_int errorCode;
+		// cl::Error keeps a pointer to a string literal
+		const char *oclErrorString;
+		std::string errorMessage;
+	};
+
+	OCLTaskFuture(const OCLCancellationToken &token);
+
+	boost::shared_ptr<State> state;
+};
+
+// A fixed set of threads, created once and shared by all the host side work
+// of a toy. Each thread has its own queue of tasks: it runs its newest task
+// first and, once its queue is empty, steals the oldest task of the longest
+// queue of the other threads. The tasks submitted by a pool thread go in its
+// own queue, the others are spread over all the queues.
+class OCLThreadPool {
+public:
+	OCLThreadPool(const unsigned int threadCount);
+	// Drops the tasks not started yet and waits for the end of the running ones
+	~OCLThreadPool();
+
+	unsigned int GetThreadCount() const { return static_cast<unsigned int>(threadQueues.size()); }
+
+	OCLTaskFuture Submit(const boost::function<void ()> &task,
+		const OCLCancellationToken &token = OCLCancellationToken());
+	// Runs func(chunkBegin, chunkEnd) for the chunks of grainSize items of
+	// [begin, end) on the pool threads and the calling thread and returns once
+	// all the chunks are done. The calling thread runs all the chunks left, so
+	// it never waits for a busy pool (or for itself if it is a pool thread).
+	void ParallelFor(const size_t begin, const size_t end, const size_t grainSize,
+		const boost::function<void (const size_t, const size_t)> &func);
+
+private:
+	typedef struct {
+		boost::function<void ()> func;
+		OCLTaskFuture future;
+	} Task;
+
+	// Returns false once the pool is destroyed
+	bool PopTask(const unsigned int threadIndex, Task *task);
+	void WorkerThreadImpl(const unsigned int threadIndex);
+
+	static void RunTask(Task &task);
+	// Completes the task of the future if it has not started yet
+	static void DropTask(const boost::weak_ptr<OCLTaskFuture::State> &futureState);
+	// Waits for the end of all the futures, ignoring their errors
+	static void WaitAll(const std::vector<OCLTaskFuture> &futures);
+	static void ParallelForImpl(boost::mutex *chunkMutex, size_t *chunkBegin, const size_t end,
+		const size_t grainSize, const boost::function<void (const size_t, const size_t)> &func);
+
+	boost::mutex queuesMutex;
+	boost::condition_variable queuesCondition;
+	std::vector<std::deque<Task> > threadQueues;
+	size_t nextQueue;
+	bool stopping;
+
+	// The index of the calling thread if it is one of the pool threads
+	boost::thread_specific_ptr<unsigned int> threadIndexPtr;
+	boost::thread_group threads;
+};
+
+#endif	/* THREADPOOL_H */
@@ -0,0 +1,75 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <algorithm>
+
+#include "tilescheduler.h"
+
+void OCLTileScheduler::Reset(const std::vector<double> &deviceWeights, const size_t itemCount, const size_t tileSize) {
+	boost::unique_lock<boost::mutex> lock(queuesMutex);
+
+	double totalWeight = 0.0;
+	for (size_t i = 0; i < deviceWeights.size(); ++i)
+		totalWeight += deviceWeights[i];
+
+	const size_t tileCount = (itemCount + tileSize - 1) / tileSize;
+	deviceQueues.clear();
+	deviceQueues.resize(deviceWeights.size());
+	size_t device = 0;
+	double deviceEnd = deviceWeights[0];
+	for (size_t i = 0; i < tileCount; ++i) {
+		OCLTile tile;
+		tile.start = i * tileSize;
+		tile.count = std::min(tileSize, itemCount - tile.start);
+
+		// Each device starts with a contiguous block of tiles, the devices
+		// with a weight of 0 have none
+		const double position = (i + .5) * totalWeight / tileCount;
+		while ((device + 1 < deviceWeights.size()) && (position >= deviceEnd))
+			deviceEnd += deviceWeights[++device];
+		deviceQueues[device].push_back(tile);
+	}
+}
+
+bool OCLTileScheduler::NextTile(const unsigned int deviceIndex, OCLTile *tile) {
+	boost::unique_lock<boost::mutex> lock(queuesMutex);
+
+	std::deque<OCLTile> &queue = deviceQueues[deviceIndex];
+	if (queue.size() > 0) {
+		*tile = queue.front();
+		queue.pop_front();
+		return true;
+	}
+
+	// Steal a tile from the device with the most work left
+	std::deque<OCLTile> *victim = NULL;
+	for (size_t i = 0; i < deviceQueues.size(); ++i) {
+		if ((deviceQueues[i].size() > 0) && (!victim || (deviceQueues[i].size() > victim->size())))
+			victim = &deviceQueues[i];
+	}
+	if (!victim)
+		return false;
+
+	*tile = victim->back();
+	victim->pop_back();
+	return true;
+}
@@ -0,0 +1,67 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef TILESCHEDULER_H
+#define	TILESCHEDULER_H
+
+#include "opencl.h"
+
+#include <deque>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+
+// A range of work items of a frame
+typedef struct {
+	size_t start, count;
+} OCLTile;
+
+// Hands out the tiles of a frame to multiple devices. Each device starts with
+// its own queue of contiguous tiles (as many as its weight allows) and, once
+// it is empty, steals the tiles from the end of the longest queue of the
+// other devices, so the faster devices end up rendering more tiles.
+class OCLTileScheduler {
+public:
+	OCLTileScheduler() { }
+	~OCLTileScheduler() { }
+
+	// Splits a new frame of itemCount work items in tiles of tileSize items,
+	// the tiles are assigned in proportion to the weights of the devices
+	void Reset(const std::vector<double> &deviceWeights, const size_t itemCount, const size_t tileSize);
+	// Returns false if all the tiles of the frame have been handed out
+	bool NextTile(const unsigned int deviceIndex, OCLTile *tile);
+
+private:
+	boost::mutex queuesMutex;
+	std::vector<std::deque<OCLTile> > deviceQueues;
+};
+
+// Enqueues the rendering of the tile on the device (i.e. the kernel with the
+// global work offset set to the start of the tile) and the non-blocking read
+// of the result in the frame. The event has to be set to the one of the
+// read. There are at most 2 tiles in flight on each device and slot (0 or 1)
+// tells which one of the 2 device buffers can be used for the tile.
+typedef boost::function<void (const unsigned int deviceIndex, const unsigned int slot,
+		const OCLTile &tile, cl::Event *event)> OCLRenderTileFunc;
+
+#endif	/* TILESCHEDULER_H */
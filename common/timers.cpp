@@ -0,0 +1,117 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include <algorithm>
+#include <sstream>
+
+#include <boost/format.hpp>
+
+#include "timers.h"
+
+//------------------------------------------------------------------------------
+// OCLLatencyHistogram
+//------------------------------------------------------------------------------
+
+OCLLatencyHistogram::OCLLatencyHistogram() : count(0), maxValue(0), sum(0.0) {
+	std::fill(buckets, buckets + BUCKET_COUNT, 0ull);
+}
+
+void OCLLatencyHistogram::Add(const unsigned long long ns) {
+	++buckets[GetBucket(ns)];
+	++count;
+	maxValue = std::max(maxValue, ns);
+	sum += ns;
+}
+
+unsigned long long OCLLatencyHistogram::GetPercentile(const double p) const {
+	if (count == 0)
+		return 0;
+
+	const unsigned long long rank = std::max(1ull, static_cast<unsigned long long>(p * count + .5));
+	unsigned long long n = 0;
+	for (unsigned int i = 0; i < BUCKET_COUNT; ++i) {
+		n += buckets[i];
+		if (n >= rank)
+			return std::min(GetBucketUpperBound(i), maxValue);
+	}
+
+	return maxValue;
+}
+
+unsigned int OCLLatencyHistogram::GetBucket(const unsigned long long ns) {
+	// The values below 8 have their own bucket, the others have 8 buckets
+	// for each power of 2
+	if (ns < 8)
+		return static_cast<unsigned int>(ns);
+
+	unsigned int log2 = 3;
+	while ((log2 < 63) && ((ns >> (log2 + 1)) != 0))
+		++log2;
+	const unsigned int sub = static_cast<unsigned int>((ns >> (log2 - 3)) & 7);
+
+	return std::min(8 * (log2 - 2) + sub, BUCKET_COUNT - 1);
+}
+
+unsigned long long OCLLatencyHistogram::GetBucketUpperBound(const unsigned int bucket) {
+	if (bucket < 8)
+		return bucket;
+
+	const unsigned int log2 = bucket / 8 + 2;
+	const unsigned long long sub = bucket % 8;
+
+	return ((8 + sub + 1) << (log2 - 3)) - 1;
+}
+
+//------------------------------------------------------------------------------
+// OCLTimers
+//------------------------------------------------------------------------------
+
+boost::mutex OCLTimers::histogramsMutex;
+std::map<std::string, OCLLatencyHistogram> OCLTimers::histograms;
+
+void OCLTimers::Add(const std::string &label, const unsigned long long ns) {
+	boost::unique_lock<boost::mutex> lock(histogramsMutex);
+	histograms[label].Add(ns);
+}
+
+std::string OCLTimers::GetReport() {
+	boost::unique_lock<boost::mutex> lock(histogramsMutex);
+
+	std::stringstream ss;
+	ss << boost::format("%-32s %10s %10s %10s %10s %10s %10s") % "Timer" % "Count" % "Mean" %
+			"p50" % "p95" % "p99" % "Max";
+	for (std::map<std::string, OCLLatencyHistogram>::const_iterator it = histograms.begin();
+			it != histograms.end(); ++it) {
+		const OCLLatencyHistogram &h = it->second;
+		ss << std::endl << boost::format("%-32s %10d %10.3f %10.3f %10.3f %10.3f %10.3f") % it->first %
+				h.GetCount() % (h.GetMean() / 1000000.0) % (h.GetPercentile(.5) / 1000000.0) %
+				(h.GetPercentile(.95) / 1000000.0) % (h.GetPercentile(.99) / 1000000.0) %
+				(h.GetMax() / 1000000.0);
+	}
+
+	return ss.str();
+}
+
+void OCLTimers::Reset() {
+	boost::unique_lock<boost::mutex> lock(histogramsMutex);
+	histograms.clear();
+}
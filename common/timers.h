@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef TIMERS_H
+#define	TIMERS_H
+
+#include "utils.h"
+
+#include <map>
+#include <string>
+
+#include <boost/thread.hpp>
+
+// The distribution of the latencies of a section of code, in buckets of
+// about 1/8 of a power of 2 of nanoseconds, so the percentiles are within
+// 12.5% of the exact values
+class OCLLatencyHistogram {
+public:
+	OCLLatencyHistogram();
+
+	void Add(const unsigned long long ns);
+
+	unsigned long long GetCount() const { return count; }
+	unsigned long long GetMax() const { return maxValue; }
+	double GetMean() const { return count ? (sum / count) : 0.0; }
+	// Returns the upper bound of the bucket of the percentile (p in [0, 1])
+	unsigned long long GetPercentile(const double p) const;
+
+private:
+	static unsigned int GetBucket(const unsigned long long ns);
+	static unsigned long long GetBucketUpperBound(const unsigned int bucket);
+
+	static const unsigned int BUCKET_COUNT = 8 * 62;
+
+	unsigned long long buckets[BUCKET_COUNT];
+	unsigned long long count, maxValue;
+	double sum;
+};
+
+// The latency histograms of all the timed sections, by label. They are
+// shared by all threads.
+class OCLTimers {
+public:
+	static void Add(const std::string &label, const unsigned long long ns);
+	// Returns one line for each label with the count, the mean and the
+	// p50/p95/p99/max latencies in milliseconds
+	static std::string GetReport();
+	static void Reset();
+
+private:
+	static boost::mutex histogramsMutex;
+	static std::map<std::string, OCLLatencyHistogram> histograms;
+};
+
+// Adds the time between its construction and its destruction to the
+// histogram of the label
+class OCLScopedTimer {
+public:
+	OCLScopedTimer(const std::string &timerLabel) : label(timerLabel), startTime(MonotonicTime()) { }
+	~OCLScopedTimer() { OCLTimers::Add(label, MonotonicTime() - startTime); }
+
+private:
+	const std::string label;
+	const unsigned long long startTime;
+};
+
+#endif	/* TIMERS_H */
@@ -27,6 +27,7 @@
 #include "opencl.h"
 #include "utils.h"
 #include "version.h"
+#include "embeddedkernels.h"
 
 // Helper function to get error string
 std::string OCLErrorString(cl_int error) {
@@ -180,6 +181,11 @@ void PrintHelpString(const unsigned int x, const unsigned int y,
 }
 
 std::string ReadSources(const std::string &fileName, const std::string &toolName) {
+    // Check if the sources are embedded in the executable
+    const OCLEmbeddedKernel *kernel = OCLEmbeddedKernel::Find(toolName, fileName);
+    if (kernel)
+        return kernel->GetSource();
+
     // Check if the sources are in the current directory
     std::string fileFullPath = fileName;
     if (!boost::filesystem::exists(fileFullPath)) {
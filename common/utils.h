@@ -25,9 +25,12 @@
 #include "opencl.h"
 
 #include <string>
-#if defined(__linux__) || defined(__APPLE__) || defined(__CYGWIN__) || defined(__OpenBSD__) || defined(__FreeBSD__)
+#if defined(__APPLE__)
 #include <stddef.h>
-#include <sys/time.h>
+#include <mach/mach_time.h>
+#elif defined(__linux__) || defined(__CYGWIN__) || defined(__OpenBSD__) || defined(__FreeBSD__)
+#include <stddef.h>
+#include <time.h>
 #elif defined (WIN32)
 #include <windows.h>
 #else
@@ -49,25 +52,40 @@ extern void PrintHelpString(const unsigned int x, const unsigned int y,
 		const char *key, const char *msg);
 extern std::string ReadSources(const std::string &fileName, const std::string &toolName);
 
-inline double WallClockTime() {
-#if defined(__linux__) || defined(__APPLE__) || defined(__CYGWIN__) || defined(__OpenBSD__) || defined(__FreeBSD__)
-	struct timeval t;
-	gettimeofday(&t, NULL);
+// Returns the time in nanoseconds of a monotonic clock (it doesn't jump
+// when the system time is changed), from an arbitrary origin
+inline unsigned long long MonotonicTime() {
+#if defined(__APPLE__)
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#elif defined(__linux__) || defined(__CYGWIN__) || defined(__OpenBSD__) || defined(__FreeBSD__)
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
 
-	return t.tv_sec + t.tv_usec / 1000000.0;
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
 #elif defined (WIN32)
 	LARGE_INTEGER freq;
-    QueryPerformanceFrequency(&freq);
+	QueryPerformanceFrequency(&freq);
 	LARGE_INTEGER ts;
 	QueryPerformanceCounter(&ts);
-	return ts.QuadPart / (double)freq.QuadPart;
 
-	//return GetTickCount() / 1000.0;
+	// Split to avoid the overflow of ts * 10^9
+	const unsigned long long secs = ts.QuadPart / freq.QuadPart;
+	const unsigned long long rest = ts.QuadPart % freq.QuadPart;
+	return secs * 1000000000ull + rest * 1000000000ull / freq.QuadPart;
 #else
 #error "Unsupported Platform !!!"
 #endif
 }
 
+// Returns the time in seconds of the monotonic clock
+inline double WallClockTime() {
+	return MonotonicTime() / 1000000000.0;
+}
+
 template <class T> inline T RoundUp(const T a, const T b) {
         const T r = a % b;
         if (r == 0)
@@ -21,6 +21,8 @@
 
 #include <fstream>
 #include <iostream>
+#include <limits>
+#include <boost/bind.hpp>
 #include <boost/format.hpp>
 
 #include "ocltoy.h"
@@ -33,20 +35,14 @@ struct PixelRGBA8888 {
 };
 
 struct Bitmap {
-  PixelRGBA8888* pixels;
+  PixelRGBA8888* pixels; // not owned, the frame memory of the toy
   int width;
   int height;
   
-  Bitmap(int Width, int Height) {
+  Bitmap(int Width, int Height, PixelRGBA8888 *Pixels) {
     width = Width;
     height = Height;
-    pixels = new PixelRGBA8888[Width * Height];
-    if (pixels == NULL)
-		throw std::runtime_error("Out of memory for pixels");
-  }
-  
-  ~Bitmap() {
-    delete[] pixels;
+    pixels = Pixels;
   }
 
   void draw(void) {
@@ -63,8 +59,8 @@ public:
 		bitmap = NULL;
 		scene = NULL;
 		animCamera = true;
-		pixelsBuff = NULL;
-		sceneBuff = NULL;
+		pixelsStaging = NULL;
+		tileSize = 0;
 
 		frameSec = 0.0;
 	}
@@ -89,13 +85,14 @@ protected:
 
 	virtual int RunToy() {
 		// set up buffers
-		bitmap = new Bitmap(windowWidth, windowHeight);
 		scene = new Scene;
 
 		// set up scene
 		setupAnim(scene, windowWidth, windowHeight);
 
 		SetUpOpenCL();
+		if (headless)
+			return RunHeadless();
 
 		glutMainLoop();
 
@@ -162,11 +159,7 @@ protected:
 		glOrtho(-.5f, windowWidth - .5f,
 				-.5f, windowHeight - .5f, -1.f, 1.f);
 
-		delete bitmap;
-		bitmap = new Bitmap(windowWidth, windowHeight);
-		const unsigned int pixelCount = windowWidth * windowHeight;
-		AllocOCLBufferWO(0, &pixelsBuff, pixelCount * sizeof(PixelRGBA8888), "PixelsBuffer");
-		kernelsJugCLer.setArg(1, *pixelsBuff);
+		AllocateBitmap();
 
 		setupAnim(scene, windowWidth, windowHeight);
 
@@ -179,35 +172,14 @@ protected:
 		bool needRedisplay = true;
 
 		switch (key) {
-			case 'p': {
-				// Write image to PPM file
-				std::ofstream f("image.ppm", std::ofstream::trunc);
-				if (!f.good()) {
-					OCLTOY_LOG("Failed to open image file: image.ppm");
-				} else {
-					f << "P3" << std::endl;
-					f << windowWidth << " " << windowHeight << std::endl;
-					f << "255" << std::endl;
-
-					for (int y = windowHeight - 1; y >= 0; --y) {
-						const PixelRGBA8888 *p = &bitmap->pixels[y * windowWidth];
-						for (int x = 0; x < windowWidth; ++x, p++) {
-							const std::string r = boost::lexical_cast<std::string>((unsigned int)p->r);
-							const std::string g = boost::lexical_cast<std::string>((unsigned int)p->g);
-							const std::string b = boost::lexical_cast<std::string>((unsigned int)p->b);
-							f << r << " " << g << " " << b << std::endl;
-						}
-					}
-				}
-				f.close();
-				OCLTOY_LOG("Saved framebuffer in image.ppm");
-
+			case 'p':
+				SaveImage("image.ppm");
 				needRedisplay = false;
 				break;
-			}
 			case 27: // Escape key
 			case 'q':
 			case 'Q':
+				Done();
 				OCLTOY_LOG("Done");
 
 				exit(EXIT_SUCCESS);
@@ -335,12 +307,71 @@ protected:
 		glutTimerFunc(millisTimerFunc, &OCLToy::GlutTimerFunc, 0);
 	}
 
+	//--------------------------------------------------------------------------
+	// Headless mode related code
+	//--------------------------------------------------------------------------
+
+	virtual double HeadlessPass() {
+		animatePositions(scene, animCamera);
+		ComputeImage();
+
+		return windowWidth * windowHeight;
+	}
+
+	virtual void SaveImage(const std::string &fileName) {
+		// Write image to PPM file
+		std::ofstream f(fileName.c_str(), std::ofstream::trunc);
+		if (!f.good()) {
+			OCLTOY_LOG_ERROR("Failed to open image file: " << fileName);
+		} else {
+			f << "P3" << std::endl;
+			f << windowWidth << " " << windowHeight << std::endl;
+			f << "255" << std::endl;
+
+			for (int y = windowHeight - 1; y >= 0; --y) {
+				const PixelRGBA8888 *p = &bitmap->pixels[y * windowWidth];
+				for (int x = 0; x < windowWidth; ++x, p++) {
+					const std::string r = boost::lexical_cast<std::string>((unsigned int)p->r);
+					const std::string g = boost::lexical_cast<std::string>((unsigned int)p->g);
+					const std::string b = boost::lexical_cast<std::string>((unsigned int)p->b);
+					f << r << " " << g << " " << b << std::endl;
+				}
+			}
+		}
+		f.close();
+		OCLTOY_LOG("Saved framebuffer in " << fileName);
+	}
+
 	//--------------------------------------------------------------------------
 	// OpenCL related code
 	//--------------------------------------------------------------------------
 
 	virtual unsigned int GetMaxDeviceCountSupported() const {
-		return 1;
+		return std::numeric_limits<unsigned int>::max();
+	}
+
+	virtual void RenderWithProgram(const unsigned int deviceIndex, cl::Program &program,
+			std::vector<float> *image) {
+		kernelsJugCLer[deviceIndex] = cl::Kernel(program, "render_gpu");
+		kernelsWorkGroupSize[deviceIndex] = kernelsJugCLer[deviceIndex].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(
+				selectedDevices[deviceIndex]);
+
+		// The device renders all the tiles
+		UploadOCLBuffer(deviceIndex, *sceneBuffs[deviceIndex], scene, sizeof(Scene), "SceneBuffer",
+				&sceneUploadEvents[deviceIndex]);
+		RenderDeviceFrame(deviceIndex, tileScheduler, windowWidth * windowHeight, tileSize,
+				boost::bind(&JugCLer::RenderTile, this, _1, _2, _3, _4));
+
+		if (image) {
+			const int pixelCount = windowWidth * windowHeight;
+			image->resize(pixelCount * 3);
+			for (int i = 0; i < pixelCount; ++i) {
+				const PixelRGBA8888 &p = bitmap->pixels[i];
+				(*image)[i * 3] = p.r / 255.f;
+				(*image)[i * 3 + 1] = p.g / 255.f;
+				(*image)[i * 3 + 2] = p.b / 255.f;
+			}
+		}
 	}
 
 private:
@@ -348,30 +379,13 @@ private:
 	void ComputeImage() {
 		const double t0 = WallClockTime();
 
-		// copy scene from host to device
-		cl::CommandQueue &oclQueue = deviceQueues[0];
-		oclQueue.enqueueWriteBuffer(*sceneBuff,
-				CL_FALSE,
-				0,
-				sceneBuff->getInfo<CL_MEM_SIZE>(),
-				scene);
-
-		size_t globalThreads = windowWidth * windowHeight;
-		if (globalThreads % kernelsWorkGroupSize != 0)
-			globalThreads = (globalThreads / kernelsWorkGroupSize + 1) * kernelsWorkGroupSize;
-
-		// Enqueue a kernel run
-		oclQueue.enqueueNDRangeKernel(kernelsJugCLer, cl::NullRange,
-				cl::NDRange(globalThreads), cl::NDRange(kernelsWorkGroupSize));
+		// copy scene from host to devices
+		for (size_t i = 0; i < selectedDevices.size(); ++i)
+			UploadOCLBuffer(i, *sceneBuffs[i], scene, sizeof(Scene), "SceneBuffer", &sceneUploadEvents[i]);
 
-		// Read back the result
-		oclQueue.enqueueReadBuffer(
-				*(pixelsBuff),
-				CL_FALSE,
-				0,
-				pixelsBuff->getInfo<CL_MEM_SIZE>(),
-				bitmap->pixels);
-		oclQueue.finish();
+		// Render the tiles on all the devices
+		tileScheduler.Reset(GetDeviceWeights(), windowWidth * windowHeight, tileSize);
+		RenderTiles(tileScheduler, boost::bind(&JugCLer::RenderTile, this, _1, _2, _3, _4));
 		const double t1 = WallClockTime();
 
 		// A simple trick to smooth sample/sec value
@@ -379,7 +393,35 @@ private:
 		frameSec = (1.0 - k) * frameSec + k * (1.0 / (t1 -t0));
 	}
 
+	void RenderTile(const unsigned int deviceIndex, const unsigned int slot,
+			const OCLTile &tile, cl::Event *event) {
+		cl::Kernel &kernel = kernelsJugCLer[deviceIndex];
+		cl::Buffer *tileBuff = tileBuffs[2 * deviceIndex + slot];
+		kernel.setArg(0, *sceneBuffs[deviceIndex]);
+		kernel.setArg(1, *tileBuff);
+
+		// Enqueue a kernel run, after the upload of the scene
+		OCLTaskGraph graph = NewTaskGraph(deviceIndex);
+		const OCLTaskGraph::Node sceneNode = graph.AddEvent(sceneUploadEvents[deviceIndex]);
+		const size_t workGroupSize = kernelsWorkGroupSize[deviceIndex];
+		const OCLTaskGraph::Node kernelNode = graph.AddKernel(OCLTaskGraph::After(sceneNode), kernel,
+				cl::NDRange(tile.start), cl::NDRange(RoundUp(tile.count, workGroupSize)),
+				cl::NDRange(workGroupSize), "JugCLer");
+
+		// Read back the result
+		const OCLTaskGraph::Node readNode = graph.AddRead(OCLTaskGraph::After(kernelNode), *tileBuff, 0,
+				tile.count * sizeof(PixelRGBA8888), &bitmap->pixels[tile.start], "PixelsBuffer");
+		graph.Flush();
+		*event = graph.GetEvent(readNode);
+	}
+
 	void SetUpOpenCL() {
+		//----------------------------------------------------------------------
+		// Allocate buffer
+		//----------------------------------------------------------------------
+
+		AllocateBuffers();
+
 		//----------------------------------------------------------------------
 		// Compile kernel
 		//----------------------------------------------------------------------
@@ -390,53 +432,78 @@ private:
 		// Read the kernel
 		const std::string kernelSource = ReadSources(kernelFileName, "jugCLer");
 
-		// Create the kernel program
-		cl::Device &oclDevice = selectedDevices[0];
-		cl::Context &oclContext = deviceContexts[0];
-		cl::Program program = cl::Program(oclContext, kernelSource);
-		try {
-			VECTOR_CLASS<cl::Device> buildDevice;
-			buildDevice.push_back(oclDevice);
-			program.build(buildDevice);
-		} catch (cl::Error err) {
-			cl::STRING_CLASS strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(oclDevice);
-			OCLTOY_LOG("Kernel compilation error:\n" << strError.c_str());
-
-			throw err;
+		kernelsJugCLer.resize(selectedDevices.size());
+		kernelsWorkGroupSize.resize(selectedDevices.size());
+
+		// Create the kernel programs, the devices compile at the same time
+		std::vector<std::string> deviceOpts(selectedDevices.size());
+		for (size_t i = 0; i < selectedDevices.size(); ++i) {
+			const std::string buildKey = OCLTuningStore::GetKey("buildoptions", selectedDevices[i], "render_gpu", kernelSource, "");
+			deviceOpts[i] = TuneBuildOptions(i, kernelSource, "", buildKey);
 		}
+		const std::vector<cl::Program> programs = CompilePrograms(kernelSource, deviceOpts);
 
-		kernelsJugCLer = cl::Kernel(program, "render_gpu");
-		kernelsJugCLer.getWorkGroupInfo<size_t>(oclDevice, CL_KERNEL_WORK_GROUP_SIZE, &kernelsWorkGroupSize);
-		if (commandLineOpts.count("workgroupsize"))
-			kernelsWorkGroupSize = commandLineOpts["workgroupsize"].as<size_t>();
-		OCLTOY_LOG("Using workgroup size: " << kernelsWorkGroupSize);
+		const OCLRenderTileFunc renderTile = boost::bind(&JugCLer::RenderTile, this, _1, _2, _3, _4);
+		for (size_t i = 0; i < selectedDevices.size(); ++i) {
+			cl::Device &oclDevice = selectedDevices[i];
+			const std::string &opts = deviceOpts[i];
 
-		//----------------------------------------------------------------------
-		// Allocate buffer
-		//----------------------------------------------------------------------
+			kernelsJugCLer[i] = cl::Kernel(programs[i], "render_gpu");
+			const std::string tuningKey = OCLTuningStore::GetKey("workgroupsize", oclDevice, "render_gpu", kernelSource, opts);
+			kernelsWorkGroupSize[i] = GetKernelWorkGroupSize(i, kernelsJugCLer[i], tuningKey);
 
-		AllocateBuffers();
+			//------------------------------------------------------------------
+			// Set kernel arguments
+			//------------------------------------------------------------------
 
-		//----------------------------------------------------------------------
-		// Set kernel arguments
-		//----------------------------------------------------------------------
+			kernelsJugCLer[i].setArg(0, *sceneBuffs[i]);
+			kernelsJugCLer[i].setArg(1, *tileBuffs[2 * i]);
+
+			kernelsWorkGroupSize[i] = TuneKernelWorkGroupSize(i, kernelsJugCLer[i], tuningKey,
+					tileSize, kernelsWorkGroupSize[i]);
+			OCLTOY_LOG("Using workgroup size (Device " << i << "): " << kernelsWorkGroupSize[i]);
 
-		kernelsJugCLer.setArg(0, *sceneBuff);
-		kernelsJugCLer.setArg(1, *pixelsBuff);
+			// The frames are split according to the speed of the devices
+			const std::string calibrationKey = OCLTuningStore::GetKey("calibration", oclDevice, "render_gpu", kernelSource, opts);
+			CalibrateDevice(i, calibrationKey, boost::bind(&JugCLer::RenderDeviceFrame, this, i,
+					boost::ref(tileScheduler), windowWidth * windowHeight, tileSize, renderTile),
+					windowWidth * windowHeight);
+		}
 	}
 
 	void FreeBuffers() {
-		FreeOCLBuffer(0, &pixelsBuff);
-		FreeOCLBuffer(0, &sceneBuff);
+		for (size_t i = 0; i < tileBuffs.size(); ++i)
+			FreeOCLBuffer(i / 2, &tileBuffs[i]);
+		FreeOCLStagingBuffer(&pixelsStaging);
+		std::vector<char>().swap(pixelsMemory);
+		for (size_t i = 0; i < sceneBuffs.size(); ++i)
+			FreeOCLBuffer(i, &sceneBuffs[i]);
 	}
 
-	void AllocateBuffers() {
-		// Allocate the pixels buffer
+	void AllocateBitmap() {
+		// Each device has 2 tile buffers, one for the tile being rendered and
+		// one for the tile being read back
 		const unsigned int pixelCount = windowWidth * windowHeight;
-		AllocOCLBufferWO(0, &pixelsBuff, pixelCount * sizeof(PixelRGBA8888), "PixelsBuffer");
+		tileSize = GetTileSize(pixelCount, sizeof(PixelRGBA8888));
+		tileBuffs.resize(2 * selectedDevices.size(), NULL);
+		for (size_t i = 0; i < tileBuffs.size(); ++i)
+			AllocOCLBufferWO(i / 2, &tileBuffs[i], GetTileBufferSize(i / 2, tileSize, sizeof(PixelRGBA8888)), "TileBuffer");
+
+		PixelRGBA8888 *pixels = (PixelRGBA8888 *)AllocOCLFrameMemory(&pixelsStaging, &pixelsMemory,
+				pixelCount * sizeof(PixelRGBA8888), "PixelsBuffer");
+		delete bitmap;
+		bitmap = new Bitmap(windowWidth, windowHeight, pixels);
+	}
 
-		// Allocate the scene buffer
-		AllocOCLBufferRO(0, &sceneBuff, scene, sizeof(Scene), "SceneBuffer");
+	void AllocateBuffers() {
+		// Allocate the pixels buffer and the bitmap
+		AllocateBitmap();
+
+		// Allocate the scene buffers
+		sceneBuffs.resize(selectedDevices.size(), NULL);
+		sceneUploadEvents.resize(selectedDevices.size());
+		for (size_t i = 0; i < selectedDevices.size(); ++i)
+			AllocOCLBufferRO(i, &sceneBuffs[i], scene, sizeof(Scene), "SceneBuffer");
 	}
 
 	void PrintHelp() {
@@ -475,11 +542,20 @@ private:
 	Scene *scene;
 	bool animCamera;
 
-	cl::Buffer *pixelsBuff;
-	cl::Buffer *sceneBuff;
+	OCLStagingBuffer *pixelsStaging;
+	// Used instead of pixelsStaging if the frame is too big for a single buffer
+	std::vector<char> pixelsMemory;
+	// The 2 tile buffers of each device
+	std::vector<cl::Buffer *> tileBuffs;
+	std::vector<cl::Buffer *> sceneBuffs;
+	// The last upload of the scene, the tiles are rendered after it
+	std::vector<cl::Event> sceneUploadEvents;
+
+	std::vector<cl::Kernel> kernelsJugCLer;
+	std::vector<size_t> kernelsWorkGroupSize;
 
-	cl::Kernel kernelsJugCLer;
-	size_t kernelsWorkGroupSize;
+	OCLTileScheduler tileScheduler;
+	size_t tileSize;
 	
 	double frameSec;
 };
@@ -301,8 +301,10 @@ void render_gpu(__global const struct Scene* restrict scene, __global uchar4* re
 	const int imgHeight = scene->cam.imgHeight;
 
 	const int gid = get_global_id(0);
-	if (gid > imgWidth * imgHeight)
+	if (gid >= imgWidth * imgHeight)
 		return;
+	// The image buffer holds only the pixels of the tile
+	const int index = gid - get_global_offset(0);
 
 	const int x = gid % imgWidth;
 	const int y = gid / imgWidth;
@@ -313,10 +315,10 @@ void render_gpu(__global const struct Scene* restrict scene, __global uchar4* re
 
 	// apply 2x2 ordered dithering during conversion from float to uchar
 	float dither = (float) ((((x^y) & 1) << 1) + (y & 1)) * 0.25f;
-	Image[y * imgWidth + x].x =
+	Image[index].x =
 			(unsigned char) (fmin(color.x, 1.0f) * 255.125f + dither);
-	Image[y * imgWidth + x].y =
+	Image[index].y =
 			(unsigned char) (fmin(color.y, 1.0f) * 255.125f + dither);
-	Image[y * imgWidth + x].z =
+	Image[index].z =
 			(unsigned char) (fmin(color.z, 1.0f) * 255.125f + dither);
 }
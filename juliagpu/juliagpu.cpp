@@ -31,7 +31,9 @@
 #include <fstream>
 #include <string>
 #include <algorithm>
+#include <limits>
 
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
@@ -43,7 +45,7 @@ public:
 	JuliaGPU() : OCLToy("JuliaGPU v" OCLTOYS_VERSION_MAJOR "." OCLTOYS_VERSION_MINOR " (OCLToys: http://code.google.com/p/ocltoys)"),
 			mouseButton0(false), mouseButton2(false), shiftMouseButton0(false), muMouseButton0(false),
 			mouseGrabLastX(0), mouseGrabLastY(0),
-			pixels(NULL), pixelsBuff(NULL), configBuff(NULL), workGroupSize(64) {
+			pixels(NULL), pixelsStaging(NULL), tileSize(0) {
 		config.width = windowWidth;
 		config.height = windowHeight;
 		config.enableShadow = 1;
@@ -72,6 +74,7 @@ public:
 	}
 
 	virtual ~JuliaGPU() {
+		DeleteProgramBuilds();
 		FreeBuffers();
 	}
 
@@ -82,13 +85,25 @@ protected:
 		opts.add_options()
 			("kernel,k", boost::program_options::value<std::string>()->default_value("preprocessed_rendering_kernel.cl"),
 				"OpenCL kernel file name")
+			("previewkernel", boost::program_options::value<std::string>()->default_value("preprocessed_preview_rendering_kernel.cl"),
+				"OpenCL kernel file name of the preview rendered while the kernel is compiling")
+			("nopreview", "Don't render the preview while the kernel is compiling")
 			("workgroupsize,z", boost::program_options::value<size_t>(), "OpenCL workgroup size");
 
 		return opts;
 	}
 
 	virtual int RunToy() {
+		config.width = windowWidth;
+		config.height = windowHeight;
+		UpdateCamera();
+
 		SetUpOpenCL();
+		if (headless) {
+			// Always render at full quality
+			config.activateFastRendering = 0;
+			return RunHeadless();
+		}
 		UpdateJulia();
 
 		glutMainLoop();
@@ -268,38 +283,14 @@ protected:
 		bool needRedisplay = true;
 
 		switch (key) {
-			case 'p': {
-				// Write image to PPM file
-				std::ofstream f("image.ppm", std::ofstream::trunc);
-				if (!f.good()) {
-					OCLTOY_LOG("Failed to open image file: image.ppm");
-				} else {
-					f << "P3" << std::endl;
-					f << config.width << " " << config.height << std::endl;
-					f << "255" << std::endl;
-
-					for (int y = (int)config.height - 1; y >= 0; --y) {
-						const float *p = &pixels[y * config.width * 3];
-						for (int x = 0; x < (int)config.width; ++x) {
-							const float rv = std::min(std::max(*p++, 0.f), 1.f);
-							const std::string r = boost::lexical_cast<std::string>((int)(rv * 255.f + .5f));
-							const float gv = std::min(std::max(*p++, 0.f), 1.f);
-							const std::string g = boost::lexical_cast<std::string>((int)(gv * 255.f + .5f));
-							const float bv = std::min(std::max(*p++, 0.f), 1.f);
-							const std::string b = boost::lexical_cast<std::string>((int)(bv * 255.f + .5f));
-							f << r << " " << g << " " << b << std::endl;
-						}
-					}
-				}			
-				f.close();
-				OCLTOY_LOG("Saved framebuffer in image.ppm");
-
+			case 'p':
+				SaveImage("image.ppm");
 				needRedisplay = false;
 				break;
-			}
 			case 27: // Escape key
 			case 'q':
 			case 'Q':
+				Done();
 				OCLTOY_LOG("Done");
 				exit(EXIT_SUCCESS);
 				break;
@@ -570,6 +561,10 @@ protected:
 	}
 
 	void TimerCallBack(int id) {
+		// Switch from the preview to the full kernel when it is compiled
+		if (SwapCompiledKernels(false))
+			glutPostRedisplay();
+
 		// Check the time since last screen update
 		const double elapsedTime = WallClockTime() - lastUserInputTime;
 
@@ -586,11 +581,74 @@ protected:
 		glutTimerFunc(millisTimerFunc, &OCLToy::GlutTimerFunc, 0);
 	}
 
+	//--------------------------------------------------------------------------
+	// Headless mode related code
+	//--------------------------------------------------------------------------
+
+	virtual double HeadlessPass() {
+		UpdateJulia();
+
+		double samples = config.width * config.height;
+		if (!config.activateFastRendering && (config.superSamplingSize > 1))
+			samples *= config.superSamplingSize * config.superSamplingSize;
+
+		return samples;
+	}
+
+	virtual void SaveImage(const std::string &fileName) {
+		// Write image to PPM file
+		std::ofstream f(fileName.c_str(), std::ofstream::trunc);
+		if (!f.good()) {
+			OCLTOY_LOG_ERROR("Failed to open image file: " << fileName);
+		} else {
+			f << "P3" << std::endl;
+			f << config.width << " " << config.height << std::endl;
+			f << "255" << std::endl;
+
+			for (int y = (int)config.height - 1; y >= 0; --y) {
+				const float *p = &pixels[y * config.width * 3];
+				for (int x = 0; x < (int)config.width; ++x) {
+					const float rv = std::min(std::max(*p++, 0.f), 1.f);
+					const std::string r = boost::lexical_cast<std::string>((int)(rv * 255.f + .5f));
+					const float gv = std::min(std::max(*p++, 0.f), 1.f);
+					const std::string g = boost::lexical_cast<std::string>((int)(gv * 255.f + .5f));
+					const float bv = std::min(std::max(*p++, 0.f), 1.f);
+					const std::string b = boost::lexical_cast<std::string>((int)(bv * 255.f + .5f));
+					f << r << " " << g << " " << b << std::endl;
+				}
+			}
+		}
+		f.close();
+		OCLTOY_LOG("Saved framebuffer in " << fileName);
+	}
+
 	//--------------------------------------------------------------------------
 	// OpenCL related code
 	//--------------------------------------------------------------------------
 
-	virtual unsigned int GetMaxDeviceCountSupported() const { return 1; }
+	virtual unsigned int GetMaxDeviceCountSupported() const {
+		return std::numeric_limits<unsigned int>::max();
+	}
+
+	virtual void RenderWithProgram(const unsigned int deviceIndex, cl::Program &program,
+			std::vector<float> *image) {
+		kernelsJulia[deviceIndex] = cl::Kernel(program, "JuliaGPU");
+		workGroupSizes[deviceIndex] = kernelsJulia[deviceIndex].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(
+				selectedDevices[deviceIndex]);
+
+		// The device renders all the tiles
+		UploadOCLBuffer(deviceIndex, *configBuffs[deviceIndex], &config, sizeof(RenderingConfig), "RenderingConfig",
+				&configUploadEvents[deviceIndex]);
+		RenderDeviceFrame(deviceIndex, tileScheduler, config.width * config.height, tileSize,
+				boost::bind(&JuliaGPU::RenderTile, this, _1, _2, _3, _4));
+
+		if (image) {
+			const size_t size = config.width * config.height * 3;
+			image->resize(size);
+			for (size_t i = 0; i < size; ++i)
+				(*image)[i] = std::min(std::max(pixels[i], 0.f), 1.f);
+		}
+	}
 
 private:
 	void SetUpOpenCL() {
@@ -610,65 +668,192 @@ private:
 		// Read the kernel
 		const std::string kernelSource = ReadSources(kernelFileName, "juliagpu");
 
-		// Create the kernel program
-		cl::Device &oclDevice = selectedDevices[0];
-		cl::Context &oclContext = deviceContexts[0];
-		cl::Program::Sources source(1, std::make_pair(kernelSource.c_str(), kernelSource.length()));
-		cl::Program program = cl::Program(oclContext, source);
+		// Create the kernel programs, the devices compile at the same time
+		kernelsJulia.resize(selectedDevices.size());
+		workGroupSizes.resize(selectedDevices.size());
+		tuningKeys.resize(selectedDevices.size());
+		calibrationKeys.resize(selectedDevices.size());
+		programBuilds.resize(selectedDevices.size(), NULL);
+		for (size_t i = 0; i < selectedDevices.size(); ++i) {
+			cl::Device &oclDevice = selectedDevices[i];
+			const std::string buildKey = OCLTuningStore::GetKey("buildoptions", oclDevice, "JuliaGPU", kernelSource, "-I. -I../common");
+			const std::string opts = TuneBuildOptions(i, kernelSource, "-I. -I../common", buildKey);
+			tuningKeys[i] = OCLTuningStore::GetKey("workgroupsize", oclDevice, "JuliaGPU", kernelSource, opts);
+			calibrationKeys[i] = OCLTuningStore::GetKey("calibration", oclDevice, "JuliaGPU", kernelSource, opts);
+			programBuilds[i] = CompileProgramAsync(i, kernelSource, opts);
+		}
+
+		// In the meantime, render the preview kernel without shadows and AO
+		// (it compiles in a fraction of the time). The headless mode renders
+		// only the full kernel.
+		if (!headless && !commandLineOpts.count("nopreview") && !AreProgramsBuilt()) {
+			const std::string &previewFileName = commandLineOpts["previewkernel"].as<std::string>();
+			const std::string previewSource = ReadSources(previewFileName, "juliagpu");
+
+			for (size_t i = 0; i < selectedDevices.size(); ++i) {
+				cl::Program program = CompileProgram(i, previewSource, "-I. -I../common");
+				SetUpKernel(i, program, true);
+			}
+			OCLTOY_LOG("Rendering the preview kernel");
+		} else
+			SwapCompiledKernels(true);
+	}
+
+	bool AreProgramsBuilt() const {
+		for (size_t i = 0; i < programBuilds.size(); ++i) {
+			if (programBuilds[i] && !programBuilds[i]->IsDone())
+				return false;
+		}
+
+		return true;
+	}
+
+	// Replaces the preview kernels with the full kernels once the compilation
+	// is done on all the devices (so all the tiles of a frame are rendered with
+	// the same kernel). Returns false if the full kernels are not available
+	// yet (or they are already in use). If a compilation fails while the
+	// preview is rendered (wait is false), the preview kernels are kept,
+	// otherwise the error is thrown.
+	bool SwapCompiledKernels(const bool wait) {
+		if (!programBuilds[0] || (!wait && !AreProgramsBuilt()))
+			return false;
+
+		std::vector<cl::Program> programs(programBuilds.size());
 		try {
-			VECTOR_CLASS<cl::Device> buildDevice;
-			buildDevice.push_back(oclDevice);
-			program.build(buildDevice, "-I. -I../common");
+			for (size_t i = 0; i < programBuilds.size(); ++i)
+				programs[i] = programBuilds[i]->Wait();
 		} catch (cl::Error err) {
-			cl::STRING_CLASS strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(oclDevice);
-			OCLTOY_LOG("Kernel compilation error:\n" << strError.c_str());
+			if (wait)
+				throw;
+			OCLTOY_LOG_ERROR("Full kernel compilation failed, the preview kernel is kept: " <<
+					err.what() << "(" << OCLErrorString(err.err()) << ")");
+			DeleteProgramBuilds();
+			return false;
+		} catch (std::exception &err) {
+			if (wait)
+				throw;
+			OCLTOY_LOG_ERROR("Full kernel compilation failed, the preview kernel is kept: " << err.what());
+			DeleteProgramBuilds();
+			return false;
+		}
+		DeleteProgramBuilds();
+
+		for (size_t i = 0; i < programs.size(); ++i)
+			SetUpKernel(i, programs[i], false);
 
-			throw err;
+		// The frames are split according to the speed of the devices
+		const OCLRenderTileFunc renderTile = boost::bind(&JuliaGPU::RenderTile, this, _1, _2, _3, _4);
+		for (size_t i = 0; i < programBuilds.size(); ++i) {
+			CalibrateDevice(i, calibrationKeys[i], boost::bind(&JuliaGPU::RenderDeviceFrame, this, i,
+					boost::ref(tileScheduler), config.width * config.height, tileSize, renderTile),
+					config.width * config.height);
 		}
 
-		kernelJulia = cl::Kernel(program, "JuliaGPU");
-		kernelJulia.getWorkGroupInfo<size_t>(oclDevice, CL_KERNEL_WORK_GROUP_SIZE, &workGroupSize);
-		if (commandLineOpts.count("workgroupsize"))
-			workGroupSize = commandLineOpts["workgroupsize"].as<size_t>();
-		OCLTOY_LOG("Using workgroup size: " << workGroupSize);
+		return true;
 	}
 
-	void FreeBuffers() {
-		FreeOCLBuffer(0, &pixelsBuff);
-		delete[] pixels;
+	void DeleteProgramBuilds() {
+		for (size_t i = 0; i < programBuilds.size(); ++i) {
+			delete programBuilds[i];
+			programBuilds[i] = NULL;
+		}
+	}
 
-		FreeOCLBuffer(0, &configBuff);
+	void SetUpKernel(const unsigned int deviceIndex, cl::Program &program, const bool preview) {
+		cl::Kernel &kernel = kernelsJulia[deviceIndex];
+		size_t &workGroupSize = workGroupSizes[deviceIndex];
+
+		kernel = cl::Kernel(program, "JuliaGPU");
+		if (preview) {
+			// The tuned work group size is the one of the full kernel
+			workGroupSize = commandLineOpts.count("workgroupsize") ?
+				commandLineOpts["workgroupsize"].as<size_t>() :
+				kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(selectedDevices[deviceIndex]);
+			return;
+		}
+		workGroupSize = GetKernelWorkGroupSize(deviceIndex, kernel, tuningKeys[deviceIndex]);
+
+		// Tune with the arguments of a single sample pass
+		kernel.setArg(0, *tileBuffs[2 * deviceIndex]);
+		kernel.setArg(1, *configBuffs[deviceIndex]);
+		kernel.setArg(2, 0);
+		kernel.setArg(3, 1);
+		kernel.setArg(4, 0.f);
+		kernel.setArg(5, 0.f);
+		workGroupSize = TuneKernelWorkGroupSize(deviceIndex, kernel, tuningKeys[deviceIndex], tileSize, workGroupSize);
+		OCLTOY_LOG("Using workgroup size (Device " << deviceIndex << "): " << workGroupSize);
+	}
+
+	void FreeBuffers() {
+		for (size_t i = 0; i < tileBuffs.size(); ++i)
+			FreeOCLBuffer(i / 2, &tileBuffs[i]);
+		FreeOCLStagingBuffer(&pixelsStaging);
+		std::vector<char>().swap(pixelsMemory);
+		pixels = NULL;
+
+		for (size_t i = 0; i < configBuffs.size(); ++i)
+			FreeOCLBuffer(i, &configBuffs[i]);
 	}
 
 	void AllocateBuffers() {
-		delete[] pixels;
+		// Each device has 2 tile buffers, one for the tile being rendered and
+		// one for the tile being read back
 		const size_t size = config.width * config.height;
-		pixels = new float[size * 3];
-		std::fill(&pixels[0], &pixels[size * 3], 0.f);
+		tileSize = GetTileSize(size, sizeof(float) * 3);
+		tileBuffs.resize(2 * selectedDevices.size(), NULL);
+		for (size_t i = 0; i < tileBuffs.size(); ++i)
+			AllocOCLBufferWO(i / 2, &tileBuffs[i], GetTileBufferSize(i / 2, tileSize, sizeof(float) * 3), "TileBuffer");
 
-		AllocOCLBufferWO(0, &pixelsBuff, size * sizeof(float) * 3, "FrameBuffer");
+		pixels = (float *)AllocOCLFrameMemory(&pixelsStaging, &pixelsMemory, size * sizeof(float) * 3, "FrameBuffer");
+		std::fill(&pixels[0], &pixels[size * 3], 0.f);
 
-		AllocOCLBufferRO(0, &configBuff, &config, sizeof(RenderingConfig), "RenderingConfig");
+		configBuffs.resize(selectedDevices.size(), NULL);
+		configUploadEvents.resize(selectedDevices.size());
+		for (size_t i = 0; i < selectedDevices.size(); ++i)
+			AllocOCLBufferRO(i, &configBuffs[i], &config, sizeof(RenderingConfig), "RenderingConfig");
 	}
 
 	void UpdateJulia() {
 		const double startTime = WallClockTime();
 
-		// Send the new configuration to the OpenCL device
-		cl::CommandQueue &oclQueue = deviceQueues[0];
-		oclQueue.enqueueWriteBuffer(*configBuff, CL_FALSE, 0, configBuff->getInfo<CL_MEM_SIZE>(), &config);
+		// Send the new configuration to the OpenCL devices
+		for (size_t i = 0; i < selectedDevices.size(); ++i)
+			UploadOCLBuffer(i, *configBuffs[i], &config, sizeof(RenderingConfig), "RenderingConfig",
+					&configUploadEvents[i]);
+
+		// Render the tiles on all the devices
+		tileScheduler.Reset(GetDeviceWeights(), config.width * config.height, tileSize);
+		RenderTiles(tileScheduler, boost::bind(&JuliaGPU::RenderTile, this, _1, _2, _3, _4));
+
+		const double elapsedTime = WallClockTime() - startTime;
+		double sampleSec = config.width * config.height / elapsedTime;
+		if (!config.activateFastRendering && (config.superSamplingSize > 1))
+			sampleSec *= config.superSamplingSize * config.superSamplingSize;
+		captionString = boost::str(boost::format("Rendering time: %.3f secs (Sample/sec %.1fK)") %
+			elapsedTime % (sampleSec / 1000.0));
+	}
+
+	void RenderTile(const unsigned int deviceIndex, const unsigned int slot,
+			const OCLTile &tile, cl::Event *event) {
+		cl::Kernel &kernel = kernelsJulia[deviceIndex];
+		cl::Buffer *tileBuff = tileBuffs[2 * deviceIndex + slot];
+
+		// The kernels run after the upload of the configuration and each
+		// supersampling pass after the previous one
+		OCLTaskGraph graph = NewTaskGraph(deviceIndex);
+		OCLTaskGraph::Node lastNode = graph.AddEvent(configUploadEvents[deviceIndex]);
 
 		// Set kernel arguments
-		kernelJulia.setArg(0, *pixelsBuff);
-		kernelJulia.setArg(1, *configBuff);
+		kernel.setArg(0, *tileBuff);
+		kernel.setArg(1, *configBuffs[deviceIndex]);
 
 		// Enqueue a kernel run
-		size_t globalThreads = config.width * config.height;
-		if (globalThreads % workGroupSize != 0)
-			globalThreads = (globalThreads / workGroupSize + 1) * workGroupSize;
+		const size_t workGroupSize = workGroupSizes[deviceIndex];
+		const cl::NDRange offset(tile.start);
+		const cl::NDRange globalThreads(RoundUp(tile.count, workGroupSize));
 
 		if (!config.activateFastRendering && (config.superSamplingSize > 1)) {
-			kernelJulia.setArg(3, config.superSamplingSize * config.superSamplingSize);
+			kernel.setArg(3, config.superSamplingSize * config.superSamplingSize);
 
 			int x, y;
 			for (y = 0; y < config.superSamplingSize; ++y) {
@@ -678,40 +863,31 @@ private:
 
 					// First pass
 					if ((x == 0) && (y == 0))
-						kernelJulia.setArg(2, 0);
+						kernel.setArg(2, 0);
 					else
-						kernelJulia.setArg(2, 1);
-					kernelJulia.setArg(4, sampleX);
-					kernelJulia.setArg(5, sampleY);
+						kernel.setArg(2, 1);
+					kernel.setArg(4, sampleX);
+					kernel.setArg(5, sampleY);
 
-					oclQueue.enqueueNDRangeKernel(kernelJulia, cl::NullRange,
-							cl::NDRange(globalThreads), cl::NDRange(workGroupSize));
+					lastNode = graph.AddKernel(OCLTaskGraph::After(lastNode), kernel, offset,
+							globalThreads, cl::NDRange(workGroupSize), "JuliaGPU");
 				}
 			}
 		} else {
-			kernelJulia.setArg(2, 0);
-			kernelJulia.setArg(3, 1);
-			kernelJulia.setArg(4, 0.f);
-			kernelJulia.setArg(5, 0.f);
+			kernel.setArg(2, 0);
+			kernel.setArg(3, 1);
+			kernel.setArg(4, 0.f);
+			kernel.setArg(5, 0.f);
 
-			oclQueue.enqueueNDRangeKernel(kernelJulia, cl::NullRange,
-					cl::NDRange(globalThreads), cl::NDRange(workGroupSize));
+			lastNode = graph.AddKernel(OCLTaskGraph::After(lastNode), kernel, offset,
+					globalThreads, cl::NDRange(workGroupSize), "JuliaGPU");
 		}
 
 		// Read back the result
-		oclQueue.enqueueReadBuffer(
-				*pixelsBuff,
-				CL_TRUE,
-				0,
-				pixelsBuff->getInfo<CL_MEM_SIZE>(),
-				pixels);
-
-		const double elapsedTime = WallClockTime() - startTime;
-		double sampleSec = config.width * config.height / elapsedTime;
-		if (!config.activateFastRendering && (config.superSamplingSize > 1))
-			sampleSec *= config.superSamplingSize * config.superSamplingSize;
-		captionString = boost::str(boost::format("Rendering time: %.3f secs (Sample/sec %.1fK)") %
-			elapsedTime % (sampleSec / 1000.0));
+		lastNode = graph.AddRead(OCLTaskGraph::After(lastNode), *tileBuff, 0, tile.count * sizeof(float) * 3,
+				&pixels[tile.start * 3], "FrameBuffer");
+		graph.Flush();
+		*event = graph.GetEvent(lastNode);
 	}
 
 	void PrintHelp() {
@@ -757,14 +933,28 @@ private:
 	int mouseGrabLastX, mouseGrabLastY;
 	double lastUserInputTime;
 
+	// It points to the pinned memory of pixelsStaging or, if the frame is too
+	// big for a single buffer, to pixelsMemory
 	float *pixels;
-	cl::Buffer *pixelsBuff;
+	OCLStagingBuffer *pixelsStaging;
+	std::vector<char> pixelsMemory;
+	// The 2 tile buffers of each device
+	std::vector<cl::Buffer *> tileBuffs;
 
 	RenderingConfig config;
-	cl::Buffer *configBuff;
-
-	cl::Kernel kernelJulia;
-	size_t workGroupSize;
+	std::vector<cl::Buffer *> configBuffs;
+	// The last upload of the configuration, the tiles are rendered after it
+	std::vector<cl::Event> configUploadEvents;
+
+	std::vector<cl::Kernel> kernelsJulia;
+	std::vector<size_t> workGroupSizes;
+	std::vector<std::string> tuningKeys;
+	std::vector<std::string> calibrationKeys;
+	// The compilation of the full kernels, NULL once they are in use
+	std::vector<OCLAsyncProgramBuild *> programBuilds;
+
+	OCLTileScheduler tileScheduler;
+	size_t tileSize;
 
 	std::string captionString;
 };
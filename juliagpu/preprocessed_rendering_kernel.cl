@@ -315,6 +315,9 @@ __kernel void JuliaGPU(
 
  if (doShade) {
   float shadowFactor = 1.f;
+
+
+
   if (config->enableShadow) {
    float4 L = normalize(light - hitPoint);
    float4 rO = hitPoint + n * 1e-2f;
@@ -343,6 +346,7 @@ __kernel void JuliaGPU(
 
 
 
+
   color = Phong(light, eyeRayOrig, hitPoint, n, diffuse) * shadowFactor;
  }
 
@@ -350,7 +354,8 @@ __kernel void JuliaGPU(
 
 
 
- int offset = 3 * (x + y * width);
+
+ int offset = 3 * (gid - get_global_offset(0));
  color = clamp(color, (float4)(0.f, 0.f ,0.f, 0.f), (float4)(1.f, 1.f ,1.f, 0.f));
  color /= sampleCount;
  if (enableAccumulation) {
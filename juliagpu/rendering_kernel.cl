@@ -301,6 +301,9 @@ __kernel void JuliaGPU(
 
 	if (doShade) {
 		float shadowFactor = 1.f;
+#if !defined(PARAM_PREVIEW)
+		// The preview kernel, rendered while the full kernel is compiling,
+		// has no shadow and no ambient occlusion
 		if (config->enableShadow) {
 			float4 L = normalize(light -  hitPoint);
 			float4 rO = hitPoint + n * 1e-2f;
@@ -324,6 +327,7 @@ __kernel void JuliaGPU(
 			} else
 				shadowDistSet = -1.f;
 		}
+#endif
 
 		//--------------------------------------------------------------------------
 		// Direct lighting of hit point
@@ -336,7 +340,8 @@ __kernel void JuliaGPU(
 	// Write pixel
 	//--------------------------------------------------------------------------
 
-	int offset = 3 * (x + y * width);
+	// The frame buffer holds only the pixels of the tile
+	int offset = 3 * (gid - get_global_offset(0));
 	color = clamp(color, (float4)(0.f, 0.f ,0.f, 0.f), (float4)(1.f, 1.f ,1.f, 0.f));
 	color /= sampleCount;
 	if (enableAccumulation) {
@@ -22,9 +22,11 @@
 #include "ocltoy.h"
 
 #include <iostream>
+#include <limits>
 #include <fstream>
 #include <string>
 
+#include <boost/bind.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
@@ -34,7 +36,7 @@ public:
 	MandelGPU() : OCLToy("MandelGPU v" OCLTOYS_VERSION_MAJOR "." OCLTOYS_VERSION_MINOR " (OCLToys: http://code.google.com/p/ocltoys)"),
 			scale(3.5f), offsetX(-.5f), offsetY(0.f), maxIterations(256),
 			mouseButton0(false), mouseButton2(false), mouseGrabLastX(0), mouseGrabLastY(0),
-			pixels(NULL), pixelsBuff(NULL), workGroupSize(64) {
+			pixels(NULL), pixelsStaging(NULL), tileSize(0) {
 	}
 	virtual ~MandelGPU() {
 		FreeBuffers();
@@ -57,7 +59,13 @@ protected:
 	virtual int RunToy() {
 		maxIterations = commandLineOpts["iterations"].as<unsigned int>();
 
+		// Width must be a multiple of 4
+		if (windowWidth % 4 != 0)
+			windowWidth = (windowWidth / 4 + 1) * 4;
+
 		SetUpOpenCL();
+		if (headless)
+			return RunHeadless();
 		UpdateMandel();
 
 		glutMainLoop();
@@ -127,33 +135,14 @@ protected:
 		bool needRedisplay = true;
 
 		switch (key) {
-			case 'p': {
-				// Write image to PPM file
-				std::ofstream f("image.ppm", std::ofstream::trunc);
-				if (!f.good()) {
-					OCLTOY_LOG("Failed to open image file: image.ppm");
-				} else {
-					f << "P3" << std::endl;
-					f << windowWidth << " " << windowHeight << std::endl;
-					f << "255" << std::endl;
-
-					for (int y = windowHeight - 1; y >= 0; --y) {
-						const unsigned char *p = (unsigned char *)(&pixels[y * windowWidth / 4]);
-						for (int x = 0; x < windowWidth; ++x, p++) {
-							const std::string value = boost::lexical_cast<std::string>((unsigned int)(*p));
-							f << value << " " << value << " " << value << std::endl;
-						}
-					}
-				}				
-				f.close();
-				OCLTOY_LOG("Saved framebuffer in image.ppm");
-
+			case 'p':
+				SaveImage("image.ppm");
 				needRedisplay = false;
 				break;
-			}
 			case 27: // Escape key
 			case 'q':
 			case 'Q':
+				Done();
 				OCLTOY_LOG("Done");
 				exit(EXIT_SUCCESS);
 				break;
@@ -262,11 +251,63 @@ protected:
 			glutPostRedisplay();
 	}
 
+	//--------------------------------------------------------------------------
+	// Headless mode related code
+	//--------------------------------------------------------------------------
+
+	virtual double HeadlessPass() {
+		UpdateMandel();
+
+		return windowWidth * windowHeight;
+	}
+
+	virtual void SaveImage(const std::string &fileName) {
+		// Write image to PPM file
+		std::ofstream f(fileName.c_str(), std::ofstream::trunc);
+		if (!f.good()) {
+			OCLTOY_LOG_ERROR("Failed to open image file: " << fileName);
+		} else {
+			f << "P3" << std::endl;
+			f << windowWidth << " " << windowHeight << std::endl;
+			f << "255" << std::endl;
+
+			for (int y = windowHeight - 1; y >= 0; --y) {
+				const unsigned char *p = (unsigned char *)(&pixels[y * windowWidth / 4]);
+				for (int x = 0; x < windowWidth; ++x, p++) {
+					const std::string value = boost::lexical_cast<std::string>((unsigned int)(*p));
+					f << value << " " << value << " " << value << std::endl;
+				}
+			}
+		}
+		f.close();
+		OCLTOY_LOG("Saved framebuffer in " << fileName);
+	}
+
 	//--------------------------------------------------------------------------
 	// OpenCL related code
 	//--------------------------------------------------------------------------
 
-	virtual unsigned int GetMaxDeviceCountSupported() const { return 1; }
+	virtual unsigned int GetMaxDeviceCountSupported() const {
+		return std::numeric_limits<unsigned int>::max();
+	}
+
+	virtual void RenderWithProgram(const unsigned int deviceIndex, cl::Program &program,
+			std::vector<float> *image) {
+		kernelsMandel[deviceIndex] = cl::Kernel(program, "mandelGPU");
+		workGroupSizes[deviceIndex] = kernelsMandel[deviceIndex].getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(
+				selectedDevices[deviceIndex]);
+
+		RenderDeviceFrame(deviceIndex, tileScheduler, GetWorkItemCount(), tileSize,
+				boost::bind(&MandelGPU::RenderTile, this, _1, _2, _3, _4));
+
+		if (image) {
+			const int pixelCount = windowWidth * windowHeight;
+			const unsigned char *p = (unsigned char *)pixels;
+			image->resize(pixelCount);
+			for (int i = 0; i < pixelCount; ++i)
+				(*image)[i] = p[i] / 255.f;
+		}
+	}
 
 private:
 	void SetUpOpenCL() {
@@ -286,71 +327,81 @@ private:
 		// Read the kernel
 		const std::string kernelSource = ReadSources(kernelFileName, "mandelgpu");
 
-		// Create the kernel program
-		cl::Device &oclDevice = selectedDevices[0];
-		cl::Context &oclContext = deviceContexts[0];
-		cl::Program::Sources source(1, std::make_pair(kernelSource.c_str(), kernelSource.length()));
-		cl::Program program = cl::Program(oclContext, source);
-		try {
-			VECTOR_CLASS<cl::Device> buildDevice;
-			buildDevice.push_back(oclDevice);
-			program.build(buildDevice);
-		} catch (cl::Error err) {
-			cl::STRING_CLASS strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(oclDevice);
-			OCLTOY_LOG("Kernel compilation error:\n" << strError.c_str());
-
-			throw err;
+		kernelsMandel.resize(selectedDevices.size());
+		workGroupSizes.resize(selectedDevices.size());
+
+		// Create the kernel programs, the devices compile at the same time
+		std::vector<std::string> deviceOpts(selectedDevices.size());
+		for (size_t i = 0; i < selectedDevices.size(); ++i) {
+			const std::string buildKey = OCLTuningStore::GetKey("buildoptions", selectedDevices[i], "mandelGPU", kernelSource, "");
+			deviceOpts[i] = TuneBuildOptions(i, kernelSource, "", buildKey);
 		}
+		const std::vector<cl::Program> programs = CompilePrograms(kernelSource, deviceOpts);
 
-		kernelMandel = cl::Kernel(program, "mandelGPU");
-		kernelMandel.getWorkGroupInfo<size_t>(oclDevice, CL_KERNEL_WORK_GROUP_SIZE, &workGroupSize);
-		if (commandLineOpts.count("workgroupsize"))
-			workGroupSize = commandLineOpts["workgroupsize"].as<size_t>();
-		OCLTOY_LOG("Using workgroup size: " << workGroupSize);
+		const OCLRenderTileFunc renderTile = boost::bind(&MandelGPU::RenderTile, this, _1, _2, _3, _4);
+		for (size_t i = 0; i < selectedDevices.size(); ++i) {
+			cl::Device &oclDevice = selectedDevices[i];
+			const std::string &opts = deviceOpts[i];
+
+			kernelsMandel[i] = cl::Kernel(programs[i], "mandelGPU");
+			const std::string tuningKey = OCLTuningStore::GetKey("workgroupsize", oclDevice, "mandelGPU", kernelSource, opts);
+			workGroupSizes[i] = GetKernelWorkGroupSize(i, kernelsMandel[i], tuningKey);
+
+			SetKernelArgs(i, 0);
+			workGroupSizes[i] = TuneKernelWorkGroupSize(i, kernelsMandel[i], tuningKey, tileSize, workGroupSizes[i]);
+			OCLTOY_LOG("Using workgroup size (Device " << i << "): " << workGroupSizes[i]);
+
+			// The frames are split according to the speed of the devices
+			const std::string calibrationKey = OCLTuningStore::GetKey("calibration", oclDevice, "mandelGPU", kernelSource, opts);
+			CalibrateDevice(i, calibrationKey, boost::bind(&MandelGPU::RenderDeviceFrame, this, i,
+					boost::ref(tileScheduler), GetWorkItemCount(), tileSize, renderTile), GetWorkItemCount());
+		}
 	}
 
 	void FreeBuffers() {
-		FreeOCLBuffer(0, &pixelsBuff);
-		delete[] pixels;
+		for (size_t i = 0; i < tileBuffs.size(); ++i)
+			FreeOCLBuffer(i / 2, &tileBuffs[i]);
+		FreeOCLStagingBuffer(&pixelsStaging);
+		std::vector<char>().swap(pixelsMemory);
+		pixels = NULL;
 	}
 
 	void AllocateBuffers() {
-		delete[] pixels;
-		const int pixelCount = windowWidth * windowHeight;
-		const size_t size = pixelCount / 4 + 1;
-		pixels = new unsigned int[size];
+		// Each device has 2 tile buffers, one for the tile being rendered and
+		// one for the tile being read back
+		tileSize = GetTileSize(GetWorkItemCount(), sizeof(unsigned int));
+		tileBuffs.resize(2 * selectedDevices.size(), NULL);
+		for (size_t i = 0; i < tileBuffs.size(); ++i)
+			AllocOCLBufferWO(i / 2, &tileBuffs[i], GetTileBufferSize(i / 2, tileSize, sizeof(unsigned int)), "TileBuffer");
+
+		const size_t size = GetWorkItemCount();
+		pixels = (unsigned int *)AllocOCLFrameMemory(&pixelsStaging, &pixelsMemory,
+				size * sizeof(unsigned int), "FrameBuffer");
 		std::fill(&pixels[0], &pixels[size], 0);
+	}
 
-		AllocOCLBufferWO(0, &pixelsBuff, size * sizeof(unsigned int), "FrameBuffer");
+	void SetKernelArgs(const unsigned int deviceIndex, const unsigned int slot) {
+		cl::Kernel &kernel = kernelsMandel[deviceIndex];
+		kernel.setArg(0, *tileBuffs[2 * deviceIndex + slot]);
+		kernel.setArg(1, windowWidth);
+		kernel.setArg(2, windowHeight);
+		kernel.setArg(3, scale);
+		kernel.setArg(4, offsetX);
+		kernel.setArg(5, offsetY);
+		kernel.setArg(6, maxIterations);
+	}
+
+	size_t GetWorkItemCount() const {
+		// Each work item renders 4 pixels
+		return RoundUp(windowWidth * windowHeight, 4) / 4;
 	}
 
 	void UpdateMandel() {
 		const double startTime = WallClockTime();
 
-		// Set kernel arguments
-		kernelMandel.setArg(0, *pixelsBuff);
-		kernelMandel.setArg(1, windowWidth);
-		kernelMandel.setArg(2, windowHeight);
-		kernelMandel.setArg(3, scale);
-		kernelMandel.setArg(4, offsetX);
-		kernelMandel.setArg(5, offsetY);
-		kernelMandel.setArg(6, maxIterations);
-
-		// Enqueue a kernel run
-		cl::CommandQueue &oclQueue = deviceQueues[0];
-		// Each work item renders 4 pixels
-		const size_t workItemCount = RoundUp(windowWidth * windowHeight, 4) / 4;
-		const size_t globalThreads = RoundUp(workItemCount, workGroupSize);
-		oclQueue.enqueueNDRangeKernel(kernelMandel, cl::NullRange,
-				cl::NDRange(globalThreads), cl::NDRange(workGroupSize));
-
-		// Read back the result
-		oclQueue.enqueueReadBuffer(
-				*pixelsBuff,
-				CL_TRUE,
-				0,
-				pixelsBuff->getInfo<CL_MEM_SIZE>(),
-				pixels);
+		// Render the tiles on all the devices
+		tileScheduler.Reset(GetDeviceWeights(), GetWorkItemCount(), tileSize);
+		RenderTiles(tileScheduler, boost::bind(&MandelGPU::RenderTile, this, _1, _2, _3, _4));
 
 		const double elapsedTime = WallClockTime() - startTime;
 		const double sampleSec = windowHeight * windowWidth / elapsedTime;
@@ -358,6 +409,26 @@ private:
 			elapsedTime % (sampleSec / 1000.0) % maxIterations);
 	}
 
+	void RenderTile(const unsigned int deviceIndex, const unsigned int slot,
+			const OCLTile &tile, cl::Event *event) {
+		// Set kernel arguments
+		SetKernelArgs(deviceIndex, slot);
+
+		// Enqueue a kernel run
+		OCLTaskGraph graph = NewTaskGraph(deviceIndex);
+		const size_t workGroupSize = workGroupSizes[deviceIndex];
+		const OCLTaskGraph::Node kernelNode = graph.AddKernel(OCLTaskGraph::Nodes(), kernelsMandel[deviceIndex],
+				cl::NDRange(tile.start), cl::NDRange(RoundUp(tile.count, workGroupSize)),
+				cl::NDRange(workGroupSize), "MandelGPU");
+
+		// Read back the result
+		const OCLTaskGraph::Node readNode = graph.AddRead(OCLTaskGraph::After(kernelNode),
+				*tileBuffs[2 * deviceIndex + slot], 0, tile.count * sizeof(unsigned int),
+				&pixels[tile.start], "FrameBuffer");
+		graph.Flush();
+		*event = graph.GetEvent(readNode);
+	}
+
 	void PrintHelp() {
 		glEnable(GL_BLEND);
 		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -394,11 +465,19 @@ private:
 	bool mouseButton0, mouseButton2;
 	int mouseGrabLastX, mouseGrabLastY;
 
+	// It points to the pinned memory of pixelsStaging or, if the frame is too
+	// big for a single buffer, to pixelsMemory
 	unsigned int *pixels;
-	cl::Buffer *pixelsBuff;
+	OCLStagingBuffer *pixelsStaging;
+	std::vector<char> pixelsMemory;
+	// The 2 tile buffers of each device
+	std::vector<cl::Buffer *> tileBuffs;
+
+	std::vector<cl::Kernel> kernelsMandel;
+	std::vector<size_t> workGroupSizes;
 
-	cl::Kernel kernelMandel;
-	size_t workGroupSize;
+	OCLTileScheduler tileScheduler;
+	size_t tileSize;
 
 	std::string captionString;
 };
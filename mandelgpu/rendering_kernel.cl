@@ -70,7 +70,7 @@ __kernel void mandelGPU(
 		}
 	}
 
-	pixels[gid] = iter[0] |
+	pixels[gid - get_global_offset(0)] = iter[0] |
 			(iter[1] << 8) |
 			(iter[2] << 16) |
 			(iter[3] << 24);
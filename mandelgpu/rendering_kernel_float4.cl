@@ -97,5 +97,5 @@ __kernel void mandelGPU(
 	const int s2 = colormap(maxIterations, iter.s2);
 	const int s3 = colormap(maxIterations, iter.s3);
 
-	pixels[gid] = s0 | (s1 << 8) | (s2 << 16) | (s3 << 24);
+	pixels[gid - get_global_offset(0)] = s0 | (s1 << 8) | (s2 << 16) | (s3 << 24);
 }
@@ -38,6 +38,8 @@ typedef enum {
 	MATTE, MIRROR, GLASS, MATTETRANSLUCENT, GLOSSY, GLOSSYTRANSLUCENT
 } MaterialType; /* material types, used in radiance() */
 
+#define MATERIAL_COUNT 6
+
 typedef struct {
 	float rad; /* radius */
 	Vec p; // Position, emission
@@ -73,5 +75,31 @@ typedef struct {
 	};
 } Sphere;
 
+// A node of the sphere BVH. The nodes are stored in depth first order: the
+// left child of an inner node (count == 0) is the next node and first is the
+// index of the right child. The spheres of a leaf are the count indices
+// starting at first in the sphere index array.
+typedef struct {
+	Vec bboxMin;
+	unsigned int first;
+	Vec bboxMax;
+	unsigned int count;
+} BVHNode;
+
+// An emissive sphere sampled by the next event estimation. The lights are
+// picked according to their power: cdf is the power of the lights up to this
+// one (included) divided by the power of all lights.
+typedef struct {
+	unsigned int sphereIndex;
+	float cdf;
+} Light;
+
+// The (relative) power of an emissive sphere
+#define SPHERE_POWER(s) (((s).e.x + (s).e.y + (s).e.z) * (s).rad * (s).rad)
+
+// The size of the traversal stack of the rendering kernel: the max. depth of
+// the BVH
+#define BVH_STACK_SIZE 32
+
 #endif	/* _GEOM_H */
 
@@ -0,0 +1,564 @@
+# 1 "<stdin>"
+# 1 "<command-line>"
+# 1 "<stdin>"
+# 22 "<stdin>"
+# 1 "../common/camera.h" 1
+# 25 "../common/camera.h"
+# 1 "../common/vec.h" 1
+# 25 "../common/vec.h"
+typedef struct {
+ float x, y, z;
+} Vec;
+# 26 "../common/camera.h" 2
+
+typedef struct {
+
+ Vec orig, target;
+
+ Vec dir, x, y;
+} Camera;
+# 23 "<stdin>" 2
+# 1 "geom.h" 1
+# 25 "geom.h"
+# 1 "../common/vec.h" 1
+# 26 "geom.h" 2
+
+
+
+
+typedef struct {
+ Vec o, d;
+} Ray;
+
+
+
+
+typedef enum {
+ MATTE, MIRROR, GLASS, MATTETRANSLUCENT, GLOSSY, GLOSSYTRANSLUCENT
+} MaterialType;
+
+
+
+typedef struct {
+ float rad;
+ Vec p;
+ Vec e;
+ MaterialType matType;
+ union {
+  struct {
+   Vec c;
+  } matte;
+  struct {
+   Vec c;
+  } mirror;
+  struct {
+   Vec c;
+   float ior;
+   float sigmaS, sigmaA;
+  } glass;
+  struct {
+   Vec c;
+   float transparency;
+   float sigmaS, sigmaA;
+  } mattertranslucent;
+  struct {
+   Vec c;
+   float exponent;
+  } glossy;
+  struct {
+   Vec c;
+   float exponent;
+   float transparency;
+   float sigmaS, sigmaA;
+  } glossytranslucent;
+ };
+} Sphere;
+
+
+
+
+
+typedef struct {
+ Vec bboxMin;
+ unsigned int first;
+ Vec bboxMax;
+ unsigned int count;
+} BVHNode;
+
+
+
+
+typedef struct {
+ unsigned int sphereIndex;
+ float cdf;
+} Light;
+# 24 "<stdin>" 2
+# 49 "<stdin>"
+typedef struct {
+
+ unsigned int key;
+ unsigned int sample;
+ unsigned int bounceDimension, dimension;
+} Sampler;
+
+
+void InitSampler(Sampler *sampler, const unsigned int seed, const unsigned int pixel,
+  const unsigned int pixelCount, const unsigned int sample) {
+ sampler->key = seed * pixelCount + pixel;
+ sampler->sample = sample;
+ sampler->bounceDimension = 0;
+ sampler->dimension = 0;
+}
+
+void SamplerStartBounce(Sampler *sampler, const unsigned int depth) {
+ sampler->bounceDimension = 2 + depth * 12;
+ sampler->dimension = sampler->bounceDimension;
+}
+
+void SamplerSetOffset(Sampler *sampler, const unsigned int offset) {
+ sampler->dimension = sampler->bounceDimension + offset;
+}
+
+
+unsigned int Philox(unsigned int key, unsigned int counter0, unsigned int counter1) {
+ for (unsigned int i = 0; i < 10; ++i) {
+  const unsigned int hi = mul_hi(0xd256d193u, counter0);
+  const unsigned int lo = 0xd256d193u * counter0;
+  counter0 = hi ^ key ^ counter1;
+  counter1 = lo;
+  key += 0x9e3779b9u;
+ }
+
+ return counter0;
+}
+
+unsigned int Hash(unsigned int x) {
+ x ^= x >> 16;
+ x *= 0x7feb352du;
+ x ^= x >> 15;
+ x *= 0x846ca68bu;
+ x ^= x >> 16;
+
+ return x;
+}
+
+unsigned int ReverseBits(unsigned int x) {
+ x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+ x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+ x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+ x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+
+ return (x >> 16) | (x << 16);
+}
+
+
+unsigned int OwenScramble(unsigned int x, const unsigned int seed) {
+ x = ReverseBits(x);
+ x += seed;
+ x ^= x * 0x6c50b47cu;
+ x ^= x * 0xb82f1e52u;
+ x ^= x * 0xc7afe638u;
+ x ^= x * 0x8d22f6e6u;
+
+ return ReverseBits(x);
+}
+
+
+
+unsigned int SobolOwen(const unsigned int key, const unsigned int sample, const unsigned int dimension) {
+ const unsigned int pairSeed = Hash(key ^ Hash(dimension >> 1));
+ unsigned int index = OwenScramble(sample, pairSeed);
+
+ unsigned int x;
+ if (dimension & 1) {
+
+  x = 0;
+  for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+   if (index & 1)
+    x ^= v;
+  }
+ } else
+  x = ReverseBits(index);
+
+ return OwenScramble(x, Hash(pairSeed + 1 + (dimension & 1)));
+}
+
+float GetRandom(Sampler *sampler) {
+ const unsigned int dimension = sampler->dimension++;
+
+ const unsigned int r = (PARAM_SOBOL && (dimension < (2 + 12))) ?
+  SobolOwen(sampler->key, sampler->sample, dimension) :
+  Philox(sampler->key, sampler->sample, dimension);
+
+
+ return (r >> 8) * (1.f / 16777216.f);
+}
+
+float SphereIntersect(
+ __global const Sphere *s,
+ const Ray *r) {
+ Vec op;
+ { (op).x = (s->p).x - (r->o).x; (op).y = (s->p).y - (r->o).y; (op).z = (s->p).z - (r->o).z; };
+
+ float b = ((op).x * (r->d).x + (op).y * (r->d).y + (op).z * (r->d).z);
+ float det = b * b - ((op).x * (op).x + (op).y * (op).y + (op).z * (op).z) + s->rad * s->rad;
+ if (det < 0.f)
+  return 0.f;
+ else
+  det = sqrt(det);
+
+ float t = b - det;
+ if (t > 0.01f)
+  return t;
+ else {
+  t = b + det;
+
+  if (t > 0.01f)
+   return t;
+  else
+   return 0.f;
+ }
+}
+
+int BBoxIntersect(
+ __global const BVHNode *node,
+ const Ray *r,
+ const Vec *invDir,
+ const float maxT) {
+ const float tx0 = (node->bboxMin.x - r->o.x) * invDir->x;
+ const float tx1 = (node->bboxMax.x - r->o.x) * invDir->x;
+ const float ty0 = (node->bboxMin.y - r->o.y) * invDir->y;
+ const float ty1 = (node->bboxMax.y - r->o.y) * invDir->y;
+ const float tz0 = (node->bboxMin.z - r->o.z) * invDir->z;
+ const float tz1 = (node->bboxMax.z - r->o.z) * invDir->z;
+
+ const float tNear = fmax(fmax(fmin(tx0, tx1), fmin(ty0, ty1)), fmax(fmin(tz0, tz1), 0.f));
+ const float tFar = fmin(fmin(fmax(tx0, tx1), fmax(ty0, ty1)), fmin(fmax(tz0, tz1), maxT));
+
+ return (tNear <= tFar);
+}
+
+
+
+int Intersect(
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes,
+ __global const unsigned int *bvhSphereIndices,
+ const Ray *r,
+ float *t,
+ unsigned int *id) {
+ float inf = (*t) = 1e20f;
+
+ Vec invDir;
+ { (invDir).x = 1.f / r->d.x; (invDir).y = 1.f / r->d.y; (invDir).z = 1.f / r->d.z; };
+
+ unsigned int stack[32];
+ unsigned int stackSize = 0;
+ unsigned int nodeIndex = 0;
+ for (;;) {
+  __global const BVHNode *node = &bvhNodes[nodeIndex];
+
+  if (BBoxIntersect(node, r, &invDir, *t)) {
+   if (node->count == 0) {
+
+    stack[stackSize++] = node->first;
+    ++nodeIndex;
+    continue;
+   }
+
+   for (unsigned int i = node->first; i < node->first + node->count; ++i) {
+    const unsigned int sphereIndex = bvhSphereIndices[i];
+    const float d = SphereIntersect(&spheres[sphereIndex], r);
+    if ((d != 0.f) && (d < *t)) {
+     *t = d;
+     *id = sphereIndex;
+    }
+   }
+  }
+
+  if (stackSize == 0)
+   break;
+  nodeIndex = stack[--stackSize];
+ }
+
+ return (*t < inf);
+}
+
+void CoordinateSystem(const Vec *v1, Vec *v2, Vec *v3) {
+ if (fabs(v1->x) > fabs(v1->y)) {
+  float invLen = 1.f / sqrt(v1->x * v1->x + v1->z * v1->z);
+  v2->x = -v1->z * invLen;
+  v2->y = 0.f;
+  v2->z = v1->x * invLen;
+ } else {
+  float invLen = 1.f / sqrt(v1->y * v1->y + v1->z * v1->z);
+  v2->x = 0.f;
+  v2->y = v1->z * invLen;
+  v2->z = -v1->y * invLen;
+ }
+
+ { (*v3).x = (*v1).y * (*v2).z - (*v1).z * (*v2).y; (*v3).y = (*v1).z * (*v2).x - (*v1).x * (*v2).z; (*v3).z = (*v1).x * (*v2).y - (*v1).y * (*v2).x; };
+}
+
+float SampleSegment(const float epsilon, const float sigma, const float smax) {
+ return -log(1.f - epsilon * (1.f - exp(-sigma * smax))) / sigma;
+}
+
+void SampleHG(const float g, const float e1, const float e2, Vec *dir) {
+ const float s = 1.f - 2.f * e1;
+ const float cost = (s + 2.f * g * g * g * (-1.f + e1) * e1 + g * g * s + 2.f * g * (1.f - e1 + e1 * e1)) / ((1.f + g * s)*(1.f + g * s));
+ const float sint = sqrt(1.f - cost * cost);
+
+ dir->x = cos(2.f * 3.14159265358979323846f * e2) * sint;
+ dir->y = sin(2.f * 3.14159265358979323846f * e2) * sint;
+ dir->z = cost;
+}
+
+float Scatter(const Ray *currentRay, const float distance, Ray *scatterRay,
+  float *scatterDistance, Sampler *sampler, const float sigmaS) {
+ *scatterDistance = SampleSegment(GetRandom(sampler), sigmaS, distance - 0.01f) + 0.01f;
+
+ Vec scatterPoint;
+ { float k = (*scatterDistance); { (scatterPoint).x = k * (currentRay->d).x; (scatterPoint).y = k * (currentRay->d).y; (scatterPoint).z = k * (currentRay->d).z; } };
+ { (scatterPoint).x = (currentRay->o).x + (scatterPoint).x; (scatterPoint).y = (currentRay->o).y + (scatterPoint).y; (scatterPoint).z = (currentRay->o).z + (scatterPoint).z; };
+
+
+ Vec dir;
+ SampleHG(-.5f, GetRandom(sampler), GetRandom(sampler), &dir);
+
+ Vec u, v;
+ CoordinateSystem(&currentRay->d, &u, &v);
+
+ Vec scatterDir;
+ scatterDir.x = u.x * dir.x + v.x * dir.y + currentRay->d.x * dir.z;
+ scatterDir.y = u.y * dir.x + v.y * dir.y + currentRay->d.y * dir.z;
+ scatterDir.z = u.z * dir.x + v.z * dir.y + currentRay->d.z * dir.z;
+
+ { { ((*scatterRay).o).x = (scatterPoint).x; ((*scatterRay).o).y = (scatterPoint).y; ((*scatterRay).o).z = (scatterPoint).z; }; { ((*scatterRay).d).x = (scatterDir).x; ((*scatterRay).d).y = (scatterDir).y; ((*scatterRay).d).z = (scatterDir).z; }; };
+
+ return (1.f - exp(-sigmaS * (distance - 0.01f)));
+}
+
+void SpecularReflection(const Vec *wi, Vec *wo, const Vec *normal) {
+ { float k = (2.f * ((*normal).x * (*wi).x + (*normal).y * (*wi).y + (*normal).z * (*wi).z)); { (*wo).x = k * (*normal).x; (*wo).y = k * (*normal).y; (*wo).z = k * (*normal).z; } };
+ { (*wo).x = (*wi).x - (*wo).x; (*wo).y = (*wi).y - (*wo).y; (*wo).z = (*wi).z - (*wo).z; };
+}
+
+void GlossyReflection(const Vec *wi, Vec *wo, const Vec *normal, const float exponent,
+  const float u0, const float u1) {
+ const float phi = 2.f * 3.14159265358979323846f * u0;
+ const float sinTheta = pow(1.f - u1, exponent);
+ const float cosTheta = sqrt(1.f - sinTheta * sinTheta);
+ const float x = cos(phi) * sinTheta;
+ const float y = sin(phi) * sinTheta;
+ const float z = cosTheta;
+
+ Vec specDir;
+ SpecularReflection(wi, &specDir, normal);
+
+ Vec u, v;
+ CoordinateSystem(&specDir, &u, &v);
+
+ wo->x = x * u.x + y * v.x + z * specDir.x;
+ wo->y = x * u.y + y * v.y + z * specDir.y;
+ wo->z = x * u.z + y * v.z + z * specDir.z;
+}
+
+void GlossyTransmission(const Vec *wi, Vec *wo, const Vec *normal, const float exponent,
+  const float u0, const float u1) {
+ const float phi = 2.f * 3.14159265358979323846f * u0;
+ const float sinTheta = pow(1.f - u1, exponent);
+ const float cosTheta = sqrt(1.f - sinTheta * sinTheta);
+ const float x = cos(phi) * sinTheta;
+ const float y = sin(phi) * sinTheta;
+ const float z = cosTheta;
+
+ Vec specDir = *wi;
+ Vec u, v;
+ CoordinateSystem(&specDir, &u, &v);
+
+ wo->x = x * u.x + y * v.x + z * specDir.x;
+ wo->y = x * u.y + y * v.y + z * specDir.y;
+ wo->z = x * u.z + y * v.z + z * specDir.z;
+}
+
+
+
+
+
+
+void Radiance(
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes,
+ __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ const Ray *startRay,
+ Sampler *sampler,
+ Vec *result) {
+ float t;
+ unsigned int id = 0;
+ if (!Intersect(spheres, bvhNodes, bvhSphereIndices, startRay, &t, &id)) {
+  { (*result).x = 0.f; (*result).y = 0.f; (*result).z = 0.f; };
+  return;
+ }
+
+ __global const Sphere *obj = &spheres[id];
+
+
+ Vec eCol; { (eCol).x = (obj->e).x; (eCol).y = (obj->e).y; (eCol).z = (obj->e).z; };
+ if (!(((eCol).x == 0.f) && ((eCol).x == 0.f) && ((eCol).z == 0.f))) {
+  { (*result).x = (eCol).x; (*result).y = (eCol).y; (*result).z = (eCol).z; };
+  return;
+ }
+
+ Vec hitPoint;
+ { float k = (t); { (hitPoint).x = k * (startRay->d).x; (hitPoint).y = k * (startRay->d).y; (hitPoint).z = k * (startRay->d).z; } };
+ { (hitPoint).x = (startRay->o).x + (hitPoint).x; (hitPoint).y = (startRay->o).y + (hitPoint).y; (hitPoint).z = (startRay->o).z + (hitPoint).z; };
+
+ Vec normal;
+ { (normal).x = (hitPoint).x - (obj->p).x; (normal).y = (hitPoint).y - (obj->p).y; (normal).z = (hitPoint).z - (obj->p).z; };
+ { float l = 1.f / sqrt(((normal).x * (normal).x + (normal).y * (normal).y + (normal).z * (normal).z)); { float k = (l); { (normal).x = k * (normal).x; (normal).y = k * (normal).y; (normal).z = k * (normal).z; } }; };
+
+
+ { float k = (fabs(((normal).x * (startRay->d).x + (normal).y * (startRay->d).y + (normal).z * (startRay->d).z))); { (*result).x = k * (obj->matte.c).x; (*result).y = k * (obj->matte.c).y; (*result).z = k * (obj->matte.c).z; } };
+}
+# 864 "<stdin>"
+void GenerateCameraRay(__global const Camera *camera,
+  Sampler *sampler,
+  const int width, const int height, const int x, const int y, Ray *ray) {
+ const float invWidth = 1.f / width;
+ const float invHeight = 1.f / height;
+ const float r1 = GetRandom(sampler) - .5f;
+ const float r2 = GetRandom(sampler) - .5f;
+ const float kcx = (x + r1) * invWidth - .5f;
+ const float kcy = (y + r2) * invHeight - .5f;
+
+ Vec rdir;
+ { (rdir).x = camera->x.x * kcx + camera->y.x * kcy + camera->dir.x; (rdir).y = camera->x.y * kcx + camera->y.y * kcy + camera->dir.y; (rdir).z = camera->x.z * kcx + camera->y.z * kcy + camera->dir.z; }
+
+
+                                                         ;
+
+ Vec rorig;
+ { float k = (0.1f); { (rorig).x = k * (rdir).x; (rorig).y = k * (rdir).y; (rorig).z = k * (rdir).z; } };
+ { (rorig).x = (rorig).x + (camera->orig).x; (rorig).y = (rorig).y + (camera->orig).y; (rorig).z = (rorig).z + (camera->orig).z; }
+
+ { float l = 1.f / sqrt(((rdir).x * (rdir).x + (rdir).y * (rdir).y + (rdir).z * (rdir).z)); { float k = (l); { (rdir).x = k * (rdir).x; (rdir).y = k * (rdir).y; (rdir).z = k * (rdir).z; } }; };
+ { { ((*ray).o).x = (rorig).x; ((*ray).o).y = (rorig).y; ((*ray).o).z = (rorig).z; }; { ((*ray).d).x = (rdir).x; ((*ray).d).y = (rdir).y; ((*ray).d).z = (rdir).z; }; };
+}
+
+__kernel void SmallPTGPU(
+    __global Vec *samples, const unsigned int seed,
+ __global const Camera *camera,
+ __global const Sphere *sphere,
+ __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ const unsigned int width, const unsigned int height,
+ const unsigned int currentSample) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ const int scrX = gid % width;
+ const int scrY = gid / width;
+
+ Sampler sampler;
+ InitSampler(&sampler, seed, gid, width * height, currentSample);
+
+ Ray ray;
+ GenerateCameraRay(camera, &sampler, width, height, scrX, scrY, &ray);
+
+ Vec r;
+ Radiance(sphere, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+   &ray, &sampler, &r);
+
+ __global Vec *sample = &samples[gid];
+ if (currentSample == 0)
+  *sample = r;
+ else {
+  const float k1 = currentSample;
+  const float k2 = 1.f / (currentSample + 1.f);
+  sample->x = (sample->x * k1 + r.x) * k2;
+  sample->y = (sample->y * k1 + r.y) * k2;
+  sample->z = (sample->z * k1 + r.z) * k2;
+ }
+}
+
+
+
+__kernel void ToneMapping(
+ __global Vec *samples, __global Vec *pixels,
+ const unsigned int width, const unsigned int height) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ __global Vec *sample = &samples[gid];
+ __global Vec *pixel = &pixels[gid];
+ pixel->x = (pow(clamp(sample->x, 0.f, 1.f), 1.f / 2.2f));
+ pixel->y = (pow(clamp(sample->y, 0.f, 1.f), 1.f / 2.2f));
+ pixel->z = (pow(clamp(sample->z, 0.f, 1.f), 1.f / 2.2f));
+}
+
+
+
+__kernel void MergeSamples(
+ __global Vec *samples, __global Vec *mergedSamples,
+ const unsigned int width, const unsigned int height, const int first,
+ const float weight) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ __global Vec *sample = &samples[gid];
+ __global Vec *mergedSample = &mergedSamples[gid];
+ if (first) {
+  mergedSample->x = weight * sample->x;
+  mergedSample->y = weight * sample->y;
+  mergedSample->z = weight * sample->z;
+ } else {
+  mergedSample->x += weight * sample->x;
+  mergedSample->y += weight * sample->y;
+  mergedSample->z += weight * sample->z;
+ }
+}
+
+__kernel void MergeToneMapping(
+ __global Vec *mergedSamples, __global Vec *pixels,
+ const unsigned int width, const unsigned int height, const float scale) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ __global Vec *sample = &mergedSamples[gid];
+ __global Vec *pixel = &pixels[gid];
+ pixel->x = (pow(clamp(scale * sample->x, 0.f, 1.f), 1.f / 2.2f));
+ pixel->y = (pow(clamp(scale * sample->y, 0.f, 1.f), 1.f / 2.2f));
+ pixel->z = (pow(clamp(scale * sample->z, 0.f, 1.f), 1.f / 2.2f));
+}
+
+__kernel void WebCLToneMapping(
+ __global Vec *samples, __global int *pixels,
+ const unsigned int width, const unsigned int height) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ __global Vec *sample = &samples[gid];
+
+ const unsigned int x = gid % width;
+ const unsigned int y = height - gid / width - 1;
+ __global int *pixel = &pixels[x + y * width];
+ const float r = (pow(clamp(sample->x, 0.f, 1.f), 1.f / 2.2f));
+ const float g = (pow(clamp(sample->y, 0.f, 1.f), 1.f / 2.2f));
+ const float b = (pow(clamp(sample->z, 0.f, 1.f), 1.f / 2.2f));
+ const int ur = (int)(r * 255.f + .5f);
+ const int ug = (int)(g * 255.f + .5f);
+ const int ub = (int)(b * 255.f + .5f);
+ *pixel = ur | (ug << 8) | (ub << 16) | (0xff << 24);
+}
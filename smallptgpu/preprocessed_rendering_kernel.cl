@@ -37,6 +37,8 @@ typedef enum {
  MATTE, MIRROR, GLASS, MATTETRANSLUCENT, GLOSSY, GLOSSYTRANSLUCENT
 } MaterialType;
 
+
+
 typedef struct {
  float rad;
  Vec p;
@@ -71,27 +73,125 @@ typedef struct {
   } glossytranslucent;
  };
 } Sphere;
+
+
+
+
+
+typedef struct {
+ Vec bboxMin;
+ unsigned int first;
+ Vec bboxMax;
+ unsigned int count;
+} BVHNode;
+
+
+
+
+typedef struct {
+ unsigned int sphereIndex;
+ float cdf;
+} Light;
 # 24 "<stdin>" 2
+# 49 "<stdin>"
+typedef struct {
 
+ unsigned int key;
+ unsigned int sample;
+ unsigned int bounceDimension, dimension;
+} Sampler;
 
 
+void InitSampler(Sampler *sampler, const unsigned int seed, const unsigned int pixel,
+  const unsigned int pixelCount, const unsigned int sample) {
+ sampler->key = seed * pixelCount + pixel;
+ sampler->sample = sample;
+ sampler->bounceDimension = 0;
+ sampler->dimension = 0;
+}
 
+void SamplerStartBounce(Sampler *sampler, const unsigned int depth) {
+ sampler->bounceDimension = 2 + depth * 12;
+ sampler->dimension = sampler->bounceDimension;
+}
 
+void SamplerSetOffset(Sampler *sampler, const unsigned int offset) {
+ sampler->dimension = sampler->bounceDimension + offset;
+}
 
-float GetRandom(unsigned int *seed0, unsigned int *seed1) {
- *seed0 = 36969 * ((*seed0) & 65535) + ((*seed0) >> 16);
- *seed1 = 18000 * ((*seed1) & 65535) + ((*seed1) >> 16);
 
- unsigned int ires = ((*seed0) << 16) + (*seed1);
+unsigned int Philox(unsigned int key, unsigned int counter0, unsigned int counter1) {
+ for (unsigned int i = 0; i < 10; ++i) {
+  const unsigned int hi = mul_hi(0xd256d193u, counter0);
+  const unsigned int lo = 0xd256d193u * counter0;
+  counter0 = hi ^ key ^ counter1;
+  counter1 = lo;
+  key += 0x9e3779b9u;
+ }
 
+ return counter0;
+}
+
+unsigned int Hash(unsigned int x) {
+ x ^= x >> 16;
+ x *= 0x7feb352du;
+ x ^= x >> 15;
+ x *= 0x846ca68bu;
+ x ^= x >> 16;
+
+ return x;
+}
+
+unsigned int ReverseBits(unsigned int x) {
+ x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+ x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+ x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+ x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+
+ return (x >> 16) | (x << 16);
+}
+
+
+unsigned int OwenScramble(unsigned int x, const unsigned int seed) {
+ x = ReverseBits(x);
+ x += seed;
+ x ^= x * 0x6c50b47cu;
+ x ^= x * 0xb82f1e52u;
+ x ^= x * 0xc7afe638u;
+ x ^= x * 0x8d22f6e6u;
+
+ return ReverseBits(x);
+}
+
+
+
+unsigned int SobolOwen(const unsigned int key, const unsigned int sample, const unsigned int dimension) {
+ const unsigned int pairSeed = Hash(key ^ Hash(dimension >> 1));
+ unsigned int index = OwenScramble(sample, pairSeed);
+
+ unsigned int x;
+ if (dimension & 1) {
+
+  x = 0;
+  for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+   if (index & 1)
+    x ^= v;
+  }
+ } else
+  x = ReverseBits(index);
+
+ return OwenScramble(x, Hash(pairSeed + 1 + (dimension & 1)));
+}
+
+float GetRandom(Sampler *sampler) {
+ const unsigned int dimension = sampler->dimension++;
+
+ const unsigned int r = (PARAM_SOBOL && (dimension < (2 + 12))) ?
+  SobolOwen(sampler->key, sampler->sample, dimension) :
+  Philox(sampler->key, sampler->sample, dimension);
 
- union {
-  float f;
-  unsigned int ui;
- } res;
- res.ui = (ires & 0x007fffff) | 0x40000000;
 
- return (res.f - 2.f) / 2.f;
+ return (r >> 8) * (1.f / 16777216.f);
 }
 
 float SphereIntersect(
@@ -120,21 +220,65 @@ float SphereIntersect(
  }
 }
 
+int BBoxIntersect(
+ __global const BVHNode *node,
+ const Ray *r,
+ const Vec *invDir,
+ const float maxT) {
+ const float tx0 = (node->bboxMin.x - r->o.x) * invDir->x;
+ const float tx1 = (node->bboxMax.x - r->o.x) * invDir->x;
+ const float ty0 = (node->bboxMin.y - r->o.y) * invDir->y;
+ const float ty1 = (node->bboxMax.y - r->o.y) * invDir->y;
+ const float tz0 = (node->bboxMin.z - r->o.z) * invDir->z;
+ const float tz1 = (node->bboxMax.z - r->o.z) * invDir->z;
+
+ const float tNear = fmax(fmax(fmin(tx0, tx1), fmin(ty0, ty1)), fmax(fmin(tz0, tz1), 0.f));
+ const float tFar = fmin(fmin(fmax(tx0, tx1), fmax(ty0, ty1)), fmin(fmax(tz0, tz1), maxT));
+
+ return (tNear <= tFar);
+}
+
+
+
 int Intersect(
  __global const Sphere *spheres,
- const unsigned int sphereCount,
+ __global const BVHNode *bvhNodes,
+ __global const unsigned int *bvhSphereIndices,
  const Ray *r,
  float *t,
  unsigned int *id) {
  float inf = (*t) = 1e20f;
 
- unsigned int i = sphereCount;
- for (; i--;) {
-  const float d = SphereIntersect(&spheres[i], r);
-  if ((d != 0.f) && (d < *t)) {
-   *t = d;
-   *id = i;
+ Vec invDir;
+ { (invDir).x = 1.f / r->d.x; (invDir).y = 1.f / r->d.y; (invDir).z = 1.f / r->d.z; };
+
+ unsigned int stack[32];
+ unsigned int stackSize = 0;
+ unsigned int nodeIndex = 0;
+ for (;;) {
+  __global const BVHNode *node = &bvhNodes[nodeIndex];
+
+  if (BBoxIntersect(node, r, &invDir, *t)) {
+   if (node->count == 0) {
+
+    stack[stackSize++] = node->first;
+    ++nodeIndex;
+    continue;
+   }
+
+   for (unsigned int i = node->first; i < node->first + node->count; ++i) {
+    const unsigned int sphereIndex = bvhSphereIndices[i];
+    const float d = SphereIntersect(&spheres[sphereIndex], r);
+    if ((d != 0.f) && (d < *t)) {
+     *t = d;
+     *id = sphereIndex;
+    }
+   }
   }
+
+  if (stackSize == 0)
+   break;
+  nodeIndex = stack[--stackSize];
  }
 
  return (*t < inf);
@@ -171,8 +315,8 @@ void SampleHG(const float g, const float e1, const float e2, Vec *dir) {
 }
 
 float Scatter(const Ray *currentRay, const float distance, Ray *scatterRay,
-  float *scatterDistance, unsigned int *seed0, unsigned int *seed1, const float sigmaS) {
- *scatterDistance = SampleSegment(GetRandom(seed0, seed1), sigmaS, distance - 0.01f) + 0.01f;
+  float *scatterDistance, Sampler *sampler, const float sigmaS) {
+ *scatterDistance = SampleSegment(GetRandom(sampler), sigmaS, distance - 0.01f) + 0.01f;
 
  Vec scatterPoint;
  { float k = (*scatterDistance); { (scatterPoint).x = k * (currentRay->d).x; (scatterPoint).y = k * (currentRay->d).y; (scatterPoint).z = k * (currentRay->d).z; } };
@@ -180,7 +324,7 @@ float Scatter(const Ray *currentRay, const float distance, Ray *scatterRay,
 
 
  Vec dir;
- SampleHG(-.5f, GetRandom(seed0, seed1), GetRandom(seed0, seed1), &dir);
+ SampleHG(-.5f, GetRandom(sampler), GetRandom(sampler), &dir);
 
  Vec u, v;
  CoordinateSystem(&currentRay->d, &u, &v);
@@ -237,269 +381,496 @@ void GlossyTransmission(const Vec *wi, Vec *wo, const Vec *normal, const float e
  wo->y = x * u.y + y * v.y + z * specDir.y;
  wo->z = x * u.z + y * v.z + z * specDir.z;
 }
+# 382 "<stdin>"
+bool ScatterVolume(Ray *currentRay, const float distance, Vec *throughput,
+  const float currentSigmaS, const float currentSigmaT,
+  Sampler *sampler) {
+ Ray scatterRay;
+ float scatterDistance;
+ const float scatteringProbability = Scatter(currentRay, distance, &scatterRay,
+   &scatterDistance, sampler, currentSigmaS);
 
-void Radiance(
- __global const Sphere *spheres,
- const unsigned int sphereCount,
- const Ray *startRay,
- unsigned int *seed0, unsigned int *seed1,
- Vec *result) {
- float currentSigmaS = PARAM_DEFAULT_SIGMA_S;
- float currentSigmaA = PARAM_DEFAULT_SIGMA_A;
- float currentSigmaT = currentSigmaS + currentSigmaA;
 
- Ray currentRay; { { ((currentRay).o).x = ((*startRay).o).x; ((currentRay).o).y = ((*startRay).o).y; ((currentRay).o).z = ((*startRay).o).z; }; { ((currentRay).d).x = ((*startRay).d).x; ((currentRay).d).y = ((*startRay).d).y; ((currentRay).d).z = ((*startRay).d).z; }; };
- Vec rad; { (rad).x = 0.f; (rad).y = 0.f; (rad).z = 0.f; };
+ if ((scatteringProbability > 0.f) && (GetRandom(sampler) < scatteringProbability)) {
 
- Vec throughput; { (throughput).x = 1.f; (throughput).y = 1.f; (throughput).z = 1.f; };
+  { { ((*currentRay).o).x = ((scatterRay).o).x; ((*currentRay).o).y = ((scatterRay).o).y; ((*currentRay).o).z = ((scatterRay).o).z; }; { ((*currentRay).d).x = ((scatterRay).d).x; ((*currentRay).d).y = ((scatterRay).d).y; ((*currentRay).d).z = ((scatterRay).d).z; }; };
 
- unsigned int depth = 0;
- for (;; ++depth) {
 
-  if (depth > PARAM_MAX_DEPTH) {
-   *result = rad;
-   return;
-  }
+  const float absorption = exp(-currentSigmaT * scatterDistance);
+  { float k = (absorption); { (*throughput).x = k * (*throughput).x; (*throughput).y = k * (*throughput).y; (*throughput).z = k * (*throughput).z; } };
+  return true;
+ }
 
-  float t;
-  unsigned int id = 0;
-  const bool hit = Intersect(spheres, sphereCount, &currentRay, &t, &id);
+ return false;
+}
 
-  if (currentSigmaS > 0.f) {
 
-   Ray scatterRay;
-   float scatterDistance;
-   const float scatteringProbability = Scatter(&currentRay, hit ? t : 999.f, &scatterRay,
-     &scatterDistance, seed0, seed1, currentSigmaS);
 
 
-   if ((scatteringProbability > 0.f) && (GetRandom(seed0, seed1) < scatteringProbability)) {
+bool SampleMaterial(
+ __global const Sphere *obj,
+ const Vec *hitPoint,
+ const Vec *normal,
+ Ray *currentRay,
+ Vec *throughput,
+ float *currentSigmaS, float *currentSigmaA,
+ Sampler *sampler) {
 
-    { { ((currentRay).o).x = ((scatterRay).o).x; ((currentRay).o).y = ((scatterRay).o).y; ((currentRay).o).z = ((scatterRay).o).z; }; { ((currentRay).d).x = ((scatterRay).d).x; ((currentRay).d).y = ((scatterRay).d).y; ((currentRay).d).z = ((scatterRay).d).z; }; };
+ const bool into = (((*normal).x * (currentRay->d).x + (*normal).y * (currentRay->d).y + (*normal).z * (currentRay->d).z) < 0.f);
+ Vec shadeNormal;
+ { float k = (into ? 1.f : -1.f); { (shadeNormal).x = k * (*normal).x; (shadeNormal).y = k * (*normal).y; (shadeNormal).z = k * (*normal).z; } };
 
+ switch (obj->matType) {
+  case MATTE: {
+   { (*throughput).x = (*throughput).x * (obj->matte.c).x; (*throughput).y = (*throughput).y * (obj->matte.c).y; (*throughput).z = (*throughput).z * (obj->matte.c).z; };
 
-    const float absorption = exp(-currentSigmaT * scatterDistance);
-    { float k = (absorption); { (throughput).x = k * (throughput).x; (throughput).y = k * (throughput).y; (throughput).z = k * (throughput).z; } };
-    continue;
-   }
+   const float r1 = 2.f * 3.14159265358979323846f * GetRandom(sampler);
+   const float r2 = GetRandom(sampler);
+   const float r2s = sqrt(r2);
+
+   Vec w = shadeNormal;
+   Vec u, v;
+   CoordinateSystem(&w, &u, &v);
+
+   Vec newDir;
+   { float k = (cos(r1) * r2s); { (u).x = k * (u).x; (u).y = k * (u).y; (u).z = k * (u).z; } };
+   { float k = (sin(r1) * r2s); { (v).x = k * (v).x; (v).y = k * (v).y; (v).z = k * (v).z; } };
+   { (newDir).x = (u).x + (v).x; (newDir).y = (u).y + (v).y; (newDir).z = (u).z + (v).z; };
+   { float k = (sqrt(1 - r2)); { (w).x = k * (w).x; (w).y = k * (w).y; (w).z = k * (w).z; } };
+   { (newDir).x = (newDir).x + (w).x; (newDir).y = (newDir).y + (w).y; (newDir).z = (newDir).z + (w).z; };
+
+   { { ((*currentRay).o).x = (*hitPoint).x; ((*currentRay).o).y = (*hitPoint).y; ((*currentRay).o).z = (*hitPoint).z; }; { ((*currentRay).d).x = (newDir).x; ((*currentRay).d).y = (newDir).y; ((*currentRay).d).z = (newDir).z; }; };
+   break;
   }
+  case MIRROR: {
+   { (*throughput).x = (*throughput).x * (obj->mirror.c).x; (*throughput).y = (*throughput).y * (obj->mirror.c).y; (*throughput).z = (*throughput).z * (obj->mirror.c).z; };
+
+   Vec newDir;
+   SpecularReflection(&currentRay->d, &newDir, &shadeNormal);
 
-  if (!hit) {
-   *result = rad;
-   return;
+   { { ((*currentRay).o).x = (*hitPoint).x; ((*currentRay).o).y = (*hitPoint).y; ((*currentRay).o).z = (*hitPoint).z; }; { ((*currentRay).d).x = (newDir).x; ((*currentRay).d).y = (newDir).y; ((*currentRay).d).z = (newDir).z; }; };
+   break;
   }
+  case GLASS: {
+   Vec newDir;
+   { float k = (2.f * ((*normal).x * (currentRay->d).x + (*normal).y * (currentRay->d).y + (*normal).z * (currentRay->d).z)); { (newDir).x = k * (*normal).x; (newDir).y = k * (*normal).y; (newDir).z = k * (*normal).z; } };
+   { (newDir).x = (currentRay->d).x - (newDir).x; (newDir).y = (currentRay->d).y - (newDir).y; (newDir).z = (currentRay->d).z - (newDir).z; };
 
+   Ray reflRay; { { ((reflRay).o).x = (*hitPoint).x; ((reflRay).o).y = (*hitPoint).y; ((reflRay).o).z = (*hitPoint).z; }; { ((reflRay).d).x = (newDir).x; ((reflRay).d).y = (newDir).y; ((reflRay).d).z = (newDir).z; }; };
 
-  const float absorption = exp(-currentSigmaT * t);
-  { float k = (absorption); { (throughput).x = k * (throughput).x; (throughput).y = k * (throughput).y; (throughput).z = k * (throughput).z; } };
+   const float nc = 1.f;
+   const float nt = obj->glass.ior;
+   const float nnt = into ? nc / nt : nt / nc;
+   const float ddn = ((currentRay->d).x * (shadeNormal).x + (currentRay->d).y * (shadeNormal).y + (currentRay->d).z * (shadeNormal).z);
+   const float cos2t = 1.f - nnt * nnt * (1.f - ddn * ddn);
 
-  __global const Sphere *obj = &spheres[id];
+   if (cos2t < 0.f) {
+    { (*throughput).x = (*throughput).x * (obj->glass.c).x; (*throughput).y = (*throughput).y * (obj->glass.c).y; (*throughput).z = (*throughput).z * (obj->glass.c).z; };
 
-  Vec hitPoint;
-  { float k = (t); { (hitPoint).x = k * (currentRay.d).x; (hitPoint).y = k * (currentRay.d).y; (hitPoint).z = k * (currentRay.d).z; } };
-  { (hitPoint).x = (currentRay.o).x + (hitPoint).x; (hitPoint).y = (currentRay.o).y + (hitPoint).y; (hitPoint).z = (currentRay.o).z + (hitPoint).z; };
+    { { ((*currentRay).o).x = ((reflRay).o).x; ((*currentRay).o).y = ((reflRay).o).y; ((*currentRay).o).z = ((reflRay).o).z; }; { ((*currentRay).d).x = ((reflRay).d).x; ((*currentRay).d).y = ((reflRay).d).y; ((*currentRay).d).z = ((reflRay).d).z; }; };
+    return true;
+   }
 
-  Vec normal;
-  { (normal).x = (hitPoint).x - (obj->p).x; (normal).y = (hitPoint).y - (obj->p).y; (normal).z = (hitPoint).z - (obj->p).z; };
-  { float l = 1.f / sqrt(((normal).x * (normal).x + (normal).y * (normal).y + (normal).z * (normal).z)); { float k = (l); { (normal).x = k * (normal).x; (normal).y = k * (normal).y; (normal).z = k * (normal).z; } }; };
+   const float kk = (into ? 1 : -1) * (ddn * nnt + sqrt(cos2t));
+   Vec nkk;
+   { float k = (kk); { (nkk).x = k * (*normal).x; (nkk).y = k * (*normal).y; (nkk).z = k * (*normal).z; } };
+   Vec transDir;
+   { float k = (nnt); { (transDir).x = k * (currentRay->d).x; (transDir).y = k * (currentRay->d).y; (transDir).z = k * (currentRay->d).z; } };
+   { (transDir).x = (transDir).x - (nkk).x; (transDir).y = (transDir).y - (nkk).y; (transDir).z = (transDir).z - (nkk).z; };
+   { float l = 1.f / sqrt(((transDir).x * (transDir).x + (transDir).y * (transDir).y + (transDir).z * (transDir).z)); { float k = (l); { (transDir).x = k * (transDir).x; (transDir).y = k * (transDir).y; (transDir).z = k * (transDir).z; } }; };
+
+   const float a = nt - nc;
+   const float b = nt + nc;
+   const float R0 = a * a / (b * b);
+   const float c = 1 - (into ? -ddn : ((transDir).x * (*normal).x + (transDir).y * (*normal).y + (transDir).z * (*normal).z));
+
+   const float Re = R0 + (1 - R0) * c * c * c * c*c;
+   const float Tr = 1.f - Re;
+   const float P = .25f + .5f * Re;
+   const float RP = Re / P;
+   const float TP = Tr / (1.f - P);
+
+   if (GetRandom(sampler) < P) {
+    { float k = (RP); { (*throughput).x = k * (*throughput).x; (*throughput).y = k * (*throughput).y; (*throughput).z = k * (*throughput).z; } };
+    { (*throughput).x = (*throughput).x * (obj->glass.c).x; (*throughput).y = (*throughput).y * (obj->glass.c).y; (*throughput).z = (*throughput).z * (obj->glass.c).z; };
+
+    { { ((*currentRay).o).x = ((reflRay).o).x; ((*currentRay).o).y = ((reflRay).o).y; ((*currentRay).o).z = ((reflRay).o).z; }; { ((*currentRay).d).x = ((reflRay).d).x; ((*currentRay).d).y = ((reflRay).d).y; ((*currentRay).d).z = ((reflRay).d).z; }; };
+   } else {
+    { float k = (TP); { (*throughput).x = k * (*throughput).x; (*throughput).y = k * (*throughput).y; (*throughput).z = k * (*throughput).z; } };
+    { (*throughput).x = (*throughput).x * (obj->glass.c).x; (*throughput).y = (*throughput).y * (obj->glass.c).y; (*throughput).z = (*throughput).z * (obj->glass.c).z; };
+
+    { { ((*currentRay).o).x = (*hitPoint).x; ((*currentRay).o).y = (*hitPoint).y; ((*currentRay).o).z = (*hitPoint).z; }; { ((*currentRay).d).x = (transDir).x; ((*currentRay).d).y = (transDir).y; ((*currentRay).d).z = (transDir).z; }; };
+
+    if (into) {
+     *currentSigmaS = obj->glass.sigmaS;
+     *currentSigmaA = obj->glass.sigmaA;
+    } else {
+     *currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+     *currentSigmaA = PARAM_DEFAULT_SIGMA_A;
+    }
+   }
+   break;
+  }
+  case MATTETRANSLUCENT: {
+   { (*throughput).x = (*throughput).x * (obj->mattertranslucent.c).x; (*throughput).y = (*throughput).y * (obj->mattertranslucent.c).y; (*throughput).z = (*throughput).z * (obj->mattertranslucent.c).z; };
 
 
-  const bool into = (((normal).x * (currentRay.d).x + (normal).y * (currentRay.d).y + (normal).z * (currentRay.d).z) < 0.f);
-  Vec shadeNormal;
-  { float k = (into ? 1.f : -1.f); { (shadeNormal).x = k * (normal).x; (shadeNormal).y = k * (normal).y; (shadeNormal).z = k * (normal).z; } };
+   bool transmit;
+   if (GetRandom(sampler) < obj->mattertranslucent.transparency) {
+    if (into) {
+     *currentSigmaS = obj->mattertranslucent.sigmaS;
+     *currentSigmaA = obj->mattertranslucent.sigmaA;
+    } else {
+     *currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+     *currentSigmaA = PARAM_DEFAULT_SIGMA_A;
+    }
 
+    transmit = true;
+   } else
+    transmit = false;
 
-  Vec eCol; { (eCol).x = (obj->e).x; (eCol).y = (obj->e).y; (eCol).z = (obj->e).z; };
-  if (!(((eCol).x == 0.f) && ((eCol).x == 0.f) && ((eCol).z == 0.f))) {
-   { (eCol).x = (throughput).x * (eCol).x; (eCol).y = (throughput).y * (eCol).y; (eCol).z = (throughput).z * (eCol).z; };
-   { (rad).x = (rad).x + (eCol).x; (rad).y = (rad).y + (eCol).y; (rad).z = (rad).z + (eCol).z; };
+   const float r1 = 2.f * 3.14159265358979323846f * GetRandom(sampler);
+   const float r2 = GetRandom(sampler);
+   const float r2s = sqrt(r2);
 
-   *result = rad;
-   return;
+   Vec u, v;
+   CoordinateSystem(&shadeNormal, &u, &v);
+
+   Vec newDir;
+   { float k = (cos(r1) * r2s); { (u).x = k * (u).x; (u).y = k * (u).y; (u).z = k * (u).z; } };
+   { float k = (sin(r1) * r2s); { (v).x = k * (v).x; (v).y = k * (v).y; (v).z = k * (v).z; } };
+   { (newDir).x = (u).x + (v).x; (newDir).y = (u).y + (v).y; (newDir).z = (u).z + (v).z; };
+   Vec w;
+   { float k = ((transmit ? -1.f : 1.) * sqrt(1 - r2)); { (w).x = k * (shadeNormal).x; (w).y = k * (shadeNormal).y; (w).z = k * (shadeNormal).z; } };
+   { (newDir).x = (newDir).x + (w).x; (newDir).y = (newDir).y + (w).y; (newDir).z = (newDir).z + (w).z; };
+
+   { { ((*currentRay).o).x = (*hitPoint).x; ((*currentRay).o).y = (*hitPoint).y; ((*currentRay).o).z = (*hitPoint).z; }; { ((*currentRay).d).x = (newDir).x; ((*currentRay).d).y = (newDir).y; ((*currentRay).d).z = (newDir).z; }; };
+   break;
   }
+  case GLOSSY: {
+   { (*throughput).x = (*throughput).x * (obj->glossy.c).x; (*throughput).y = (*throughput).y * (obj->glossy.c).y; (*throughput).z = (*throughput).z * (obj->glossy.c).z; };
 
-  switch (obj->matType) {
-   case MATTE: {
-    { (throughput).x = (throughput).x * (obj->matte.c).x; (throughput).y = (throughput).y * (obj->matte.c).y; (throughput).z = (throughput).z * (obj->matte.c).z; };
+   Vec newDir;
+   GlossyReflection(&currentRay->d, &newDir, &shadeNormal,
+     obj->glossy.exponent,
+     GetRandom(sampler), GetRandom(sampler));
 
-    const float r1 = 2.f * 3.14159265358979323846f * GetRandom(seed0, seed1);
-    const float r2 = GetRandom(seed0, seed1);
-    const float r2s = sqrt(r2);
+   { { ((*currentRay).o).x = (*hitPoint).x; ((*currentRay).o).y = (*hitPoint).y; ((*currentRay).o).z = (*hitPoint).z; }; { ((*currentRay).d).x = (newDir).x; ((*currentRay).d).y = (newDir).y; ((*currentRay).d).z = (newDir).z; }; };
+   break;
+  }
+  case GLOSSYTRANSLUCENT: {
 
-    Vec w = shadeNormal;
-    Vec u, v;
-    CoordinateSystem(&w, &u, &v);
+   Vec newDir;
+   if (GetRandom(sampler) < obj->glossytranslucent.transparency) {
+    { (*throughput).x = (*throughput).x * (obj->glossytranslucent.c).x; (*throughput).y = (*throughput).y * (obj->glossytranslucent.c).y; (*throughput).z = (*throughput).z * (obj->glossytranslucent.c).z; };
+
+    if (into) {
+     *currentSigmaS = obj->glossytranslucent.sigmaS;
+     *currentSigmaA = obj->glossytranslucent.sigmaA;
+    } else {
+     *currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+     *currentSigmaA = PARAM_DEFAULT_SIGMA_A;
+    }
 
-    Vec newDir;
-    { float k = (cos(r1) * r2s); { (u).x = k * (u).x; (u).y = k * (u).y; (u).z = k * (u).z; } };
-    { float k = (sin(r1) * r2s); { (v).x = k * (v).x; (v).y = k * (v).y; (v).z = k * (v).z; } };
-    { (newDir).x = (u).x + (v).x; (newDir).y = (u).y + (v).y; (newDir).z = (u).z + (v).z; };
-    { float k = (sqrt(1 - r2)); { (w).x = k * (w).x; (w).y = k * (w).y; (w).z = k * (w).z; } };
-    { (newDir).x = (newDir).x + (w).x; (newDir).y = (newDir).y + (w).y; (newDir).z = (newDir).z + (w).z; };
+    GlossyTransmission(&currentRay->d, &newDir, &shadeNormal,
+      obj->glossytranslucent.exponent,
+      GetRandom(sampler), GetRandom(sampler));
+   } else {
 
-    { { ((currentRay).o).x = (hitPoint).x; ((currentRay).o).y = (hitPoint).y; ((currentRay).o).z = (hitPoint).z; }; { ((currentRay).d).x = (newDir).x; ((currentRay).d).y = (newDir).y; ((currentRay).d).z = (newDir).z; }; };
-    break;
+    GlossyReflection(&currentRay->d, &newDir, &shadeNormal,
+      obj->glossytranslucent.exponent,
+      GetRandom(sampler), GetRandom(sampler));
    }
-   case MIRROR: {
-    { (throughput).x = (throughput).x * (obj->mirror.c).x; (throughput).y = (throughput).y * (obj->mirror.c).y; (throughput).z = (throughput).z * (obj->mirror.c).z; };
 
-    Vec newDir;
-    SpecularReflection(&currentRay.d, &newDir, &shadeNormal);
+   { { ((*currentRay).o).x = (*hitPoint).x; ((*currentRay).o).y = (*hitPoint).y; ((*currentRay).o).z = (*hitPoint).z; }; { ((*currentRay).d).x = (newDir).x; ((*currentRay).d).y = (newDir).y; ((*currentRay).d).z = (newDir).z; }; };
+   break;
+  }
+  default:
+   return false;
+ }
 
-    { { ((currentRay).o).x = (hitPoint).x; ((currentRay).o).y = (hitPoint).y; ((currentRay).o).z = (hitPoint).z; }; { ((currentRay).d).x = (newDir).x; ((currentRay).d).y = (newDir).y; ((currentRay).d).z = (newDir).z; }; };
-    break;
-   }
-   case GLASS: {
-    Vec newDir;
-    { float k = (2.f * ((normal).x * (currentRay.d).x + (normal).y * (currentRay.d).y + (normal).z * (currentRay.d).z)); { (newDir).x = k * (normal).x; (newDir).y = k * (normal).y; (newDir).z = k * (normal).z; } };
-    { (newDir).x = (currentRay.d).x - (newDir).x; (newDir).y = (currentRay.d).y - (newDir).y; (newDir).z = (currentRay.d).z - (newDir).z; };
+ return true;
+}
 
-    Ray reflRay; { { ((reflRay).o).x = (hitPoint).x; ((reflRay).o).y = (hitPoint).y; ((reflRay).o).z = (hitPoint).z; }; { ((reflRay).d).x = (newDir).x; ((reflRay).d).y = (newDir).y; ((reflRay).d).z = (newDir).z; }; };
 
-    const float nc = 1.f;
-    const float nt = obj->glass.ior;
-    const float nnt = into ? nc / nt : nt / nc;
-    const float ddn = ((currentRay.d).x * (shadeNormal).x + (currentRay.d).y * (shadeNormal).y + (currentRay.d).z * (shadeNormal).z);
-    const float cos2t = 1.f - nnt * nnt * (1.f - ddn * ddn);
+unsigned int PickLight(__global const Light *lights, const unsigned int lightCount, const float u) {
+ unsigned int first = 0;
+ unsigned int last = lightCount - 1;
+ while (first < last) {
+  const unsigned int middle = (first + last) / 2;
+  if (u < lights[middle].cdf)
+   last = middle;
+  else
+   first = middle + 1;
+ }
 
-    if (cos2t < 0.f) {
-     { (throughput).x = (throughput).x * (obj->glass.c).x; (throughput).y = (throughput).y * (obj->glass.c).y; (throughput).z = (throughput).z * (obj->glass.c).z; };
+ return lights[first].sphereIndex;
+}
 
-     { { ((currentRay).o).x = ((reflRay).o).x; ((currentRay).o).y = ((reflRay).o).y; ((currentRay).o).z = ((reflRay).o).z; }; { ((currentRay).d).x = ((reflRay).d).x; ((currentRay).d).y = ((reflRay).d).y; ((currentRay).d).z = ((reflRay).d).z; }; };
-     continue;
-    }
 
-    const float kk = (into ? 1 : -1) * (ddn * nnt + sqrt(cos2t));
-    Vec nkk;
-    { float k = (kk); { (nkk).x = k * (normal).x; (nkk).y = k * (normal).y; (nkk).z = k * (normal).z; } };
-    Vec transDir;
-    { float k = (nnt); { (transDir).x = k * (currentRay.d).x; (transDir).y = k * (currentRay.d).y; (transDir).z = k * (currentRay.d).z; } };
-    { (transDir).x = (transDir).x - (nkk).x; (transDir).y = (transDir).y - (nkk).y; (transDir).z = (transDir).z - (nkk).z; };
-    { float l = 1.f / sqrt(((transDir).x * (transDir).x + (transDir).y * (transDir).y + (transDir).z * (transDir).z)); { float k = (l); { (transDir).x = k * (transDir).x; (transDir).y = k * (transDir).y; (transDir).z = k * (transDir).z; } }; };
-
-    const float a = nt - nc;
-    const float b = nt + nc;
-    const float R0 = a * a / (b * b);
-    const float c = 1 - (into ? -ddn : ((transDir).x * (normal).x + (transDir).y * (normal).y + (transDir).z * (normal).z));
-
-    const float Re = R0 + (1 - R0) * c * c * c * c*c;
-    const float Tr = 1.f - Re;
-    const float P = .25f + .5f * Re;
-    const float RP = Re / P;
-    const float TP = Tr / (1.f - P);
-
-    if (GetRandom(seed0, seed1) < P) {
-     { float k = (RP); { (throughput).x = k * (throughput).x; (throughput).y = k * (throughput).y; (throughput).z = k * (throughput).z; } };
-     { (throughput).x = (throughput).x * (obj->glass.c).x; (throughput).y = (throughput).y * (obj->glass.c).y; (throughput).z = (throughput).z * (obj->glass.c).z; };
-
-     { { ((currentRay).o).x = ((reflRay).o).x; ((currentRay).o).y = ((reflRay).o).y; ((currentRay).o).z = ((reflRay).o).z; }; { ((currentRay).d).x = ((reflRay).d).x; ((currentRay).d).y = ((reflRay).d).y; ((currentRay).d).z = ((reflRay).d).z; }; };
-    } else {
-     { float k = (TP); { (throughput).x = k * (throughput).x; (throughput).y = k * (throughput).y; (throughput).z = k * (throughput).z; } };
-     { (throughput).x = (throughput).x * (obj->glass.c).x; (throughput).y = (throughput).y * (obj->glass.c).y; (throughput).z = (throughput).z * (obj->glass.c).z; };
-
-     { { ((currentRay).o).x = (hitPoint).x; ((currentRay).o).y = (hitPoint).y; ((currentRay).o).z = (hitPoint).z; }; { ((currentRay).d).x = (transDir).x; ((currentRay).d).y = (transDir).y; ((currentRay).d).z = (transDir).z; }; };
-
-     if (into) {
-      currentSigmaS = obj->glass.sigmaS;
-      currentSigmaA = obj->glass.sigmaA;
-     } else {
-      currentSigmaS = PARAM_DEFAULT_SIGMA_S;
-      currentSigmaA = PARAM_DEFAULT_SIGMA_A;
-     }
-     currentSigmaT = currentSigmaS + currentSigmaA;
-    }
-    break;
-   }
-   case MATTETRANSLUCENT: {
-    { (throughput).x = (throughput).x * (obj->mattertranslucent.c).x; (throughput).y = (throughput).y * (obj->mattertranslucent.c).y; (throughput).z = (throughput).z * (obj->mattertranslucent.c).z; };
-
-
-    bool transmit;
-    if (GetRandom(seed0, seed1) < obj->mattertranslucent.transparency) {
-     if (into) {
-      currentSigmaS = obj->mattertranslucent.sigmaS;
-      currentSigmaA = obj->mattertranslucent.sigmaA;
-     } else {
-      currentSigmaS = PARAM_DEFAULT_SIGMA_S;
-      currentSigmaA = PARAM_DEFAULT_SIGMA_A;
-     }
-     currentSigmaT = currentSigmaS + currentSigmaA;
-
-     transmit = true;
-    } else
-     transmit = false;
-
-    const float r1 = 2.f * 3.14159265358979323846f * GetRandom(seed0, seed1);
-    const float r2 = GetRandom(seed0, seed1);
-    const float r2s = sqrt(r2);
-
-    Vec u, v;
-    CoordinateSystem(&shadeNormal, &u, &v);
-
-    Vec newDir;
-    { float k = (cos(r1) * r2s); { (u).x = k * (u).x; (u).y = k * (u).y; (u).z = k * (u).z; } };
-    { float k = (sin(r1) * r2s); { (v).x = k * (v).x; (v).y = k * (v).y; (v).z = k * (v).z; } };
-    { (newDir).x = (u).x + (v).x; (newDir).y = (u).y + (v).y; (newDir).z = (u).z + (v).z; };
-    Vec w;
-    { float k = ((transmit ? -1.f : 1.) * sqrt(1 - r2)); { (w).x = k * (shadeNormal).x; (w).y = k * (shadeNormal).y; (w).z = k * (shadeNormal).z; } };
-    { (newDir).x = (newDir).x + (w).x; (newDir).y = (newDir).y + (w).y; (newDir).z = (newDir).z + (w).z; };
-
-    { { ((currentRay).o).x = (hitPoint).x; ((currentRay).o).y = (hitPoint).y; ((currentRay).o).z = (hitPoint).z; }; { ((currentRay).d).x = (newDir).x; ((currentRay).d).y = (newDir).y; ((currentRay).d).z = (newDir).z; }; };
-    break;
-   }
-   case GLOSSY: {
-    { (throughput).x = (throughput).x * (obj->glossy.c).x; (throughput).y = (throughput).y * (obj->glossy.c).y; (throughput).z = (throughput).z * (obj->glossy.c).z; };
 
-    Vec newDir;
-    GlossyReflection(&currentRay.d, &newDir, &shadeNormal,
-      obj->glossy.exponent,
-      GetRandom(seed0, seed1), GetRandom(seed0, seed1));
+float LightPdf(__global const Sphere *light, const float lightsPower, const Vec *point) {
+ Vec toCenter;
+ { (toCenter).x = (light->p).x - (*point).x; (toCenter).y = (light->p).y - (*point).y; (toCenter).z = (light->p).z - (*point).z; };
+ const float sin2ThetaMax = light->rad * light->rad / ((toCenter).x * (toCenter).x + (toCenter).y * (toCenter).y + (toCenter).z * (toCenter).z);
+ if (sin2ThetaMax >= 1.f)
+  return 0.f;
 
-    { { ((currentRay).o).x = (hitPoint).x; ((currentRay).o).y = (hitPoint).y; ((currentRay).o).z = (hitPoint).z; }; { ((currentRay).d).x = (newDir).x; ((currentRay).d).y = (newDir).y; ((currentRay).d).z = (newDir).z; }; };
-    break;
-   }
-   case GLOSSYTRANSLUCENT: {
-
-    Vec newDir;
-    if (GetRandom(seed0, seed1) < obj->glossytranslucent.transparency) {
-     { (throughput).x = (throughput).x * (obj->glossytranslucent.c).x; (throughput).y = (throughput).y * (obj->glossytranslucent.c).y; (throughput).z = (throughput).z * (obj->glossytranslucent.c).z; };
-
-     if (into) {
-      currentSigmaS = obj->glossytranslucent.sigmaS;
-      currentSigmaA = obj->glossytranslucent.sigmaA;
-     } else {
-      currentSigmaS = PARAM_DEFAULT_SIGMA_S;
-      currentSigmaA = PARAM_DEFAULT_SIGMA_A;
-     }
-     currentSigmaT = currentSigmaS + currentSigmaA;
-
-     GlossyTransmission(&currentRay.d, &newDir, &shadeNormal,
-       obj->glossytranslucent.exponent,
-       GetRandom(seed0, seed1), GetRandom(seed0, seed1));
-    } else {
 
-     GlossyReflection(&currentRay.d, &newDir, &shadeNormal,
-       obj->glossytranslucent.exponent,
-       GetRandom(seed0, seed1), GetRandom(seed0, seed1));
-    }
+ const float cosThetaMaxComplement = sin2ThetaMax / (1.f + sqrt(1.f - sin2ThetaMax));
 
-    { { ((currentRay).o).x = (hitPoint).x; ((currentRay).o).y = (hitPoint).y; ((currentRay).o).z = (hitPoint).z; }; { ((currentRay).d).x = (newDir).x; ((currentRay).d).y = (newDir).y; ((currentRay).d).z = (newDir).z; }; };
-    break;
-   }
-   default:
-    *result = rad;
-    return;
+ return (((*light).e.x + (*light).e.y + (*light).e.z) * (*light).rad * (*light).rad) / (lightsPower * 2.f * 3.14159265358979323846f * cosThetaMaxComplement);
+}
+
+
+void SampleLight(__global const Sphere *light, const Vec *point,
+  const float u0, const float u1, Vec *dir) {
+ Vec w;
+ { (w).x = (light->p).x - (*point).x; (w).y = (light->p).y - (*point).y; (w).z = (light->p).z - (*point).z; };
+ const float sin2ThetaMax = light->rad * light->rad / ((w).x * (w).x + (w).y * (w).y + (w).z * (w).z);
+ const float cosThetaMaxComplement = sin2ThetaMax / (1.f + sqrt(1.f - sin2ThetaMax));
+ { float l = 1.f / sqrt(((w).x * (w).x + (w).y * (w).y + (w).z * (w).z)); { float k = (l); { (w).x = k * (w).x; (w).y = k * (w).y; (w).z = k * (w).z; } }; };
+
+ const float cosTheta = 1.f - u1 * cosThetaMaxComplement;
+ const float sinTheta = sqrt(fmax(1.f - cosTheta * cosTheta, 0.f));
+ const float phi = 2.f * 3.14159265358979323846f * u0;
+
+ Vec u, v;
+ CoordinateSystem(&w, &u, &v);
+
+ dir->x = cos(phi) * sinTheta * u.x + sin(phi) * sinTheta * v.x + cosTheta * w.x;
+ dir->y = cos(phi) * sinTheta * u.y + sin(phi) * sinTheta * v.y + cosTheta * w.y;
+ dir->z = cos(phi) * sinTheta * u.z + sin(phi) * sinTheta * v.z + cosTheta * w.z;
+}
+
+
+
+float MaterialPdf(__global const Sphere *obj, const Vec *wi, const Vec *shadeNormal, const Vec *wo) {
+ const float cosNormal = ((*wo).x * (*shadeNormal).x + (*wo).y * (*shadeNormal).y + (*wo).z * (*shadeNormal).z);
+ if (cosNormal <= 0.f)
+  return 0.f;
+
+ switch (obj->matType) {
+  case MATTE:
+   return cosNormal / 3.14159265358979323846f;
+  case GLOSSY: {
+   Vec specDir;
+   SpecularReflection(wi, &specDir, shadeNormal);
+   const float cosTheta = ((*wo).x * (specDir).x + (*wo).y * (specDir).y + (*wo).z * (specDir).z);
+   if (cosTheta <= 0.f)
+    return 0.f;
+
+
+   const float exponent = obj->glossy.exponent;
+   const float sinTheta = sqrt(fmax(1.f - cosTheta * cosTheta, 1e-8f));
+   return cosTheta * pow(sinTheta, 1.f / exponent - 2.f) / (2.f * 3.14159265358979323846f * exponent);
   }
+  default:
+   return 0.f;
+ }
+}
+
+float PowerHeuristic(const float pdf0, const float pdf1) {
+ return (pdf0 * pdf0) / (pdf0 * pdf0 + pdf1 * pdf1);
+}
+
+
+
+void DirectLight(
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes,
+ __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ __global const Sphere *obj,
+ const Vec *hitPoint, const Vec *wi, const Vec *shadeNormal,
+ const Vec *throughput,
+ const float currentSigmaS, const float currentSigmaT,
+ Vec *rad,
+ Sampler *sampler) {
+ const float u0 = GetRandom(sampler);
+ const float u1 = GetRandom(sampler);
+ const unsigned int lightIndex = PickLight(lights, lightCount, GetRandom(sampler));
+ __global const Sphere *light = &spheres[lightIndex];
+
+ const float lightPdf = LightPdf(light, lightsPower, hitPoint);
+ if (lightPdf == 0.f)
+  return;
+
+ Vec dir;
+ SampleLight(light, hitPoint, u0, u1, &dir);
+ const float materialPdf = MaterialPdf(obj, wi, shadeNormal, &dir);
+ if (materialPdf == 0.f)
+  return;
+
+ Ray shadowRay;
+ { { ((shadowRay).o).x = (*hitPoint).x; ((shadowRay).o).y = (*hitPoint).y; ((shadowRay).o).z = (*hitPoint).z; }; { ((shadowRay).d).x = (dir).x; ((shadowRay).d).y = (dir).y; ((shadowRay).d).z = (dir).z; }; };
+ float t;
+ unsigned int id = 0;
+ if (!Intersect(spheres, bvhNodes, bvhSphereIndices, &shadowRay, &t, &id) || (id != lightIndex))
+  return;
+
+
+
+ const float transmittance = (currentSigmaS > 0.f) ?
+  exp(-currentSigmaS * (t - 0.01f) - currentSigmaT * t) : exp(-currentSigmaT * t);
+
+
+
+
+ const float k = materialPdf * PowerHeuristic(lightPdf, materialPdf) * transmittance / lightPdf;
+ Vec eCol;
+ { (eCol).x = (*throughput).x * (obj->matte.c).x; (eCol).y = (*throughput).y * (obj->matte.c).y; (eCol).z = (*throughput).z * (obj->matte.c).z; };
+ { (eCol).x = (eCol).x * (light->e).x; (eCol).y = (eCol).y * (light->e).y; (eCol).z = (eCol).z * (light->e).z; };
+ { float k = (k); { (eCol).x = k * (eCol).x; (eCol).y = k * (eCol).y; (eCol).z = k * (eCol).z; } };
+ { (*rad).x = (*rad).x + (eCol).x; (*rad).y = (*rad).y + (eCol).y; (*rad).z = (*rad).z + (eCol).z; };
+}
+
+
+
+
+float EmissionWeight(__global const Sphere *light, const float lightsPower,
+  const Vec *rayOrigin, const float lastMaterialPdf) {
+ if (lastMaterialPdf == 0.f)
+  return 1.f;
+
+ return PowerHeuristic(lastMaterialPdf, LightPdf(light, lightsPower, rayOrigin));
+}
+
+
+
+
+bool ShadeHit(
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes,
+ __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ __global const Sphere *obj,
+ const Vec *hitPoint,
+ const Vec *normal,
+ Ray *currentRay,
+ Vec *throughput,
+ Vec *rad,
+ float *currentSigmaS, float *currentSigmaA,
+ float *lastMaterialPdf,
+ Sampler *sampler) {
+ const Vec wi = currentRay->d;
+ Vec shadeNormal;
+ { float k = ((((*normal).x * (wi).x + (*normal).y * (wi).y + (*normal).z * (wi).z) < 0.f) ? 1.f : -1.f); { (shadeNormal).x = k * (*normal).x; (shadeNormal).y = k * (*normal).y; (shadeNormal).z = k * (*normal).z; } };
+
+ const bool nextEvent = (lightCount > 0) && ((obj->matType == MATTE) || (obj->matType == GLOSSY));
+ if (nextEvent) {
+  SamplerSetOffset(sampler, 4);
+  DirectLight(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+    obj, hitPoint, &wi, &shadeNormal, throughput,
+    *currentSigmaS, *currentSigmaS + *currentSigmaA, rad, sampler);
  }
+
+ SamplerSetOffset(sampler, 8);
+ if (!SampleMaterial(obj, hitPoint, normal, currentRay, throughput,
+   currentSigmaS, currentSigmaA, sampler))
+  return false;
+
+ *lastMaterialPdf = nextEvent ? MaterialPdf(obj, &wi, &shadeNormal, &currentRay->d) : 0.f;
+ return true;
+}
+
+
+
+bool PathBounce(
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes,
+ __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ Ray *currentRay,
+ Vec *throughput,
+ Vec *rad,
+ float *currentSigmaS, float *currentSigmaA,
+ float *lastMaterialPdf,
+ Sampler *sampler) {
+ const float currentSigmaT = *currentSigmaS + *currentSigmaA;
+
+ float t;
+ unsigned int id = 0;
+ const bool hit = Intersect(spheres, bvhNodes, bvhSphereIndices, currentRay, &t, &id);
+
+ SamplerSetOffset(sampler, 0);
+ if ((*currentSigmaS > 0.f) && ScatterVolume(currentRay, hit ? t : 999.f, throughput,
+   *currentSigmaS, currentSigmaT, sampler)) {
+  *lastMaterialPdf = 0.f;
+  return true;
+ }
+
+ if (!hit)
+  return false;
+
+
+ const float absorption = exp(-currentSigmaT * t);
+ { float k = (absorption); { (*throughput).x = k * (*throughput).x; (*throughput).y = k * (*throughput).y; (*throughput).z = k * (*throughput).z; } };
+
+ __global const Sphere *obj = &spheres[id];
+
+ Vec hitPoint;
+ { float k = (t); { (hitPoint).x = k * (currentRay->d).x; (hitPoint).y = k * (currentRay->d).y; (hitPoint).z = k * (currentRay->d).z; } };
+ { (hitPoint).x = (currentRay->o).x + (hitPoint).x; (hitPoint).y = (currentRay->o).y + (hitPoint).y; (hitPoint).z = (currentRay->o).z + (hitPoint).z; };
+
+ Vec normal;
+ { (normal).x = (hitPoint).x - (obj->p).x; (normal).y = (hitPoint).y - (obj->p).y; (normal).z = (hitPoint).z - (obj->p).z; };
+ { float l = 1.f / sqrt(((normal).x * (normal).x + (normal).y * (normal).y + (normal).z * (normal).z)); { float k = (l); { (normal).x = k * (normal).x; (normal).y = k * (normal).y; (normal).z = k * (normal).z; } }; };
+
+
+ Vec eCol; { (eCol).x = (obj->e).x; (eCol).y = (obj->e).y; (eCol).z = (obj->e).z; };
+ if (!(((eCol).x == 0.f) && ((eCol).x == 0.f) && ((eCol).z == 0.f))) {
+  { (eCol).x = (*throughput).x * (eCol).x; (eCol).y = (*throughput).y * (eCol).y; (eCol).z = (*throughput).z * (eCol).z; };
+  { float k = (EmissionWeight(obj, lightsPower, &currentRay->o, *lastMaterialPdf)); { (eCol).x = k * (eCol).x; (eCol).y = k * (eCol).y; (eCol).z = k * (eCol).z; } };
+  { (*rad).x = (*rad).x + (eCol).x; (*rad).y = (*rad).y + (eCol).y; (*rad).z = (*rad).z + (eCol).z; };
+
+  return false;
+ }
+
+ return ShadeHit(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+   obj, &hitPoint, &normal, currentRay, throughput, rad,
+   currentSigmaS, currentSigmaA, lastMaterialPdf, sampler);
+}
+
+void Radiance(
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes,
+ __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ const Ray *startRay,
+ Sampler *sampler,
+ Vec *result) {
+ float currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+ float currentSigmaA = PARAM_DEFAULT_SIGMA_A;
+ float lastMaterialPdf = 0.f;
+
+ Ray currentRay; { { ((currentRay).o).x = ((*startRay).o).x; ((currentRay).o).y = ((*startRay).o).y; ((currentRay).o).z = ((*startRay).o).z; }; { ((currentRay).d).x = ((*startRay).d).x; ((currentRay).d).y = ((*startRay).d).y; ((currentRay).d).z = ((*startRay).d).z; }; };
+ Vec rad; { (rad).x = 0.f; (rad).y = 0.f; (rad).z = 0.f; };
+
+ Vec throughput; { (throughput).x = 1.f; (throughput).y = 1.f; (throughput).z = 1.f; };
+
+
+
+ for (unsigned int depth = 0; depth <= PARAM_MAX_DEPTH; ++depth) {
+  SamplerStartBounce(sampler, depth);
+  if (!PathBounce(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+    &currentRay, &throughput, &rad, &currentSigmaS, &currentSigmaA, &lastMaterialPdf,
+    sampler))
+   break;
+ }
+
+ *result = rad;
 }
 
+
+
 void GenerateCameraRay(__global const Camera *camera,
-  unsigned int *seed0, unsigned int *seed1,
+  Sampler *sampler,
   const int width, const int height, const int x, const int y, Ray *ray) {
  const float invWidth = 1.f / width;
  const float invHeight = 1.f / height;
- const float r1 = GetRandom(seed0, seed1) - .5f;
- const float r2 = GetRandom(seed0, seed1) - .5f;
+ const float r1 = GetRandom(sampler) - .5f;
+ const float r2 = GetRandom(sampler) - .5f;
  const float kcx = (x + r1) * invWidth - .5f;
  const float kcy = (y + r2) * invHeight - .5f;
 
@@ -518,9 +889,11 @@ void GenerateCameraRay(__global const Camera *camera,
 }
 
 __kernel void SmallPTGPU(
-    __global Vec *samples, __global unsigned int *seedsInput,
+    __global Vec *samples, const unsigned int seed,
  __global const Camera *camera,
- const unsigned int sphereCount, __global const Sphere *sphere,
+ __global const Sphere *sphere,
+ __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
  const unsigned int width, const unsigned int height,
  const unsigned int currentSample) {
  const int gid = get_global_id(0);
@@ -531,15 +904,15 @@ __kernel void SmallPTGPU(
  const int scrX = gid % width;
  const int scrY = gid / width;
 
-
- unsigned int seed0 = seedsInput[2 * gid];
- unsigned int seed1 = seedsInput[2 * gid + 1];
+ Sampler sampler;
+ InitSampler(&sampler, seed, gid, width * height, currentSample);
 
  Ray ray;
- GenerateCameraRay(camera, &seed0, &seed1, width, height, scrX, scrY, &ray);
+ GenerateCameraRay(camera, &sampler, width, height, scrX, scrY, &ray);
 
  Vec r;
- Radiance(sphere, sphereCount, &ray, &seed0, &seed1, &r);
+ Radiance(sphere, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+   &ray, &sampler, &r);
 
  __global Vec *sample = &samples[gid];
  if (currentSample == 0)
@@ -551,9 +924,6 @@ __kernel void SmallPTGPU(
   sample->y = (sample->y * k1 + r.y) * k2;
   sample->z = (sample->z * k1 + r.z) * k2;
  }
-
- seedsInput[2 * gid] = seed0;
- seedsInput[2 * gid + 1] = seed1;
 }
 
 
@@ -573,6 +943,45 @@ __kernel void ToneMapping(
  pixel->z = (pow(clamp(sample->z, 0.f, 1.f), 1.f / 2.2f));
 }
 
+
+
+__kernel void MergeSamples(
+ __global Vec *samples, __global Vec *mergedSamples,
+ const unsigned int width, const unsigned int height, const int first,
+ const float weight) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ __global Vec *sample = &samples[gid];
+ __global Vec *mergedSample = &mergedSamples[gid];
+ if (first) {
+  mergedSample->x = weight * sample->x;
+  mergedSample->y = weight * sample->y;
+  mergedSample->z = weight * sample->z;
+ } else {
+  mergedSample->x += weight * sample->x;
+  mergedSample->y += weight * sample->y;
+  mergedSample->z += weight * sample->z;
+ }
+}
+
+__kernel void MergeToneMapping(
+ __global Vec *mergedSamples, __global Vec *pixels,
+ const unsigned int width, const unsigned int height, const float scale) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ __global Vec *sample = &mergedSamples[gid];
+ __global Vec *pixel = &pixels[gid];
+ pixel->x = (pow(clamp(scale * sample->x, 0.f, 1.f), 1.f / 2.2f));
+ pixel->y = (pow(clamp(scale * sample->y, 0.f, 1.f), 1.f / 2.2f));
+ pixel->z = (pow(clamp(scale * sample->z, 0.f, 1.f), 1.f / 2.2f));
+}
+
 __kernel void WebCLToneMapping(
  __global Vec *samples, __global int *pixels,
  const unsigned int width, const unsigned int height) {
@@ -594,3 +1003,289 @@ __kernel void WebCLToneMapping(
  const int ub = (int)(b * 255.f + .5f);
  *pixel = ur | (ug << 8) | (ub << 16) | (0xff << 24);
 }
+# 1017 "<stdin>"
+__kernel void SmallPTGPUPersistent(
+    __global Vec *samples, const unsigned int seed,
+ __global const Camera *camera,
+ __global const Sphere *sphere,
+ __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ const unsigned int width, const unsigned int height,
+ const unsigned int currentSample,
+ __global unsigned int *workCounters, const unsigned int workCounterIndex) {
+ if (get_global_id(0) == 0)
+  workCounters[1 - workCounterIndex] = 0;
+
+ const unsigned int pixelCount = width * height;
+ __global unsigned int *workCounter = &workCounters[workCounterIndex];
+
+ unsigned int pixel = atomic_inc(workCounter);
+ if (pixel >= pixelCount)
+  return;
+
+ Sampler sampler;
+ Ray currentRay;
+ Vec throughput, rad;
+ float currentSigmaS, currentSigmaA, lastMaterialPdf;
+ unsigned int depth;
+ bool newPath = true;
+ for (;;) {
+  if (newPath) {
+   InitSampler(&sampler, seed, pixel, pixelCount, currentSample);
+   GenerateCameraRay(camera, &sampler, width, height, pixel % width, pixel / width, &currentRay);
+   { (throughput).x = 1.f; (throughput).y = 1.f; (throughput).z = 1.f; };
+   { (rad).x = 0.f; (rad).y = 0.f; (rad).z = 0.f; };
+   currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+   currentSigmaA = PARAM_DEFAULT_SIGMA_A;
+   lastMaterialPdf = 0.f;
+   depth = 0;
+   newPath = false;
+  }
+
+  SamplerStartBounce(&sampler, depth);
+  bool pathEnd = !PathBounce(sphere, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+    &currentRay, &throughput, &rad, &currentSigmaS, &currentSigmaA, &lastMaterialPdf,
+    &sampler);
+  ++depth;
+
+  if (!pathEnd && (depth >= 3)) {
+
+   SamplerSetOffset(&sampler, 11);
+   const float p = fmin(fmax(throughput.x, fmax(throughput.y, throughput.z)), 1.f);
+   if (GetRandom(&sampler) < p) {
+    { float k = (1.f / p); { (throughput).x = k * (throughput).x; (throughput).y = k * (throughput).y; (throughput).z = k * (throughput).z; } };
+   } else
+    pathEnd = true;
+  }
+
+  if (pathEnd || (depth > PARAM_MAX_DEPTH)) {
+   __global Vec *sample = &samples[pixel];
+   if (currentSample == 0)
+    *sample = rad;
+   else {
+    const float k1 = currentSample;
+    const float k2 = 1.f / (currentSample + 1.f);
+    sample->x = (sample->x * k1 + rad.x) * k2;
+    sample->y = (sample->y * k1 + rad.y) * k2;
+    sample->z = (sample->z * k1 + rad.z) * k2;
+   }
+
+
+   pixel = atomic_inc(workCounter);
+   if (pixel >= pixelCount)
+    return;
+   newPath = true;
+  }
+ }
+}
+# 1104 "<stdin>"
+__kernel void WavefrontGenerate(
+ const unsigned int seed,
+ __global const Camera *camera,
+ const unsigned int width, const unsigned int height,
+ __global Vec *pathOrigins, __global Vec *pathDirections,
+ __global Vec *pathThroughputs, __global Vec *pathRadiances,
+ __global float *pathSigmas, __global float *pathMaterialPdfs,
+ __global unsigned int *rayQueues, __global unsigned int *queueCounters,
+ const unsigned int currentSample) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+
+ if (gid == 0)
+  queueCounters[(0)] = width * height;
+
+ const int scrX = gid % width;
+ const int scrY = gid / width;
+
+ Sampler sampler;
+ InitSampler(&sampler, seed, gid, width * height, currentSample);
+
+ Ray ray;
+ GenerateCameraRay(camera, &sampler, width, height, scrX, scrY, &ray);
+
+ pathOrigins[gid] = ray.o;
+ pathDirections[gid] = ray.d;
+ { (pathThroughputs[gid]).x = 1.f; (pathThroughputs[gid]).y = 1.f; (pathThroughputs[gid]).z = 1.f; };
+ { (pathRadiances[gid]).x = 0.f; (pathRadiances[gid]).y = 0.f; (pathRadiances[gid]).z = 0.f; };
+ pathSigmas[2 * gid] = PARAM_DEFAULT_SIGMA_S;
+ pathSigmas[2 * gid + 1] = PARAM_DEFAULT_SIGMA_A;
+ pathMaterialPdfs[gid] = 0.f;
+ rayQueues[gid] = gid;
+}
+
+
+__kernel void WavefrontResetQueues(
+ __global unsigned int *queueCounters, const unsigned int outputQueue) {
+ if (get_global_id(0) == 0) {
+  queueCounters[(outputQueue)] = 0;
+  for (unsigned int i = 0; i < 6; ++i)
+   queueCounters[(2 + (i))] = 0;
+ }
+}
+
+
+
+
+__kernel void WavefrontIntersect(
+ const unsigned int seed,
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+ const float lightsPower,
+ const unsigned int width, const unsigned int height,
+ __global Vec *pathOrigins, __global Vec *pathDirections,
+ __global Vec *pathThroughputs, __global Vec *pathRadiances,
+ __global float *pathSigmas, __global float *pathMaterialPdfs,
+ __global float *pathHitDistances, __global unsigned int *pathHitSpheres,
+ __global unsigned int *rayQueues, __global unsigned int *materialQueues,
+ __global unsigned int *queueCounters, const unsigned int inputQueue,
+ const unsigned int currentSample, const unsigned int depth) {
+ const int gid = get_global_id(0);
+
+ if (gid >= queueCounters[(inputQueue)])
+  return;
+
+ const unsigned int pathCount = width * height;
+ const unsigned int outputQueue = 1 - inputQueue;
+ const unsigned int pathIndex = rayQueues[inputQueue * pathCount + gid];
+
+ Sampler sampler;
+ InitSampler(&sampler, seed, pathIndex, pathCount, currentSample);
+ SamplerStartBounce(&sampler, depth);
+ SamplerSetOffset(&sampler, 0);
+
+ Ray currentRay;
+ { { ((currentRay).o).x = (pathOrigins[pathIndex]).x; ((currentRay).o).y = (pathOrigins[pathIndex]).y; ((currentRay).o).z = (pathOrigins[pathIndex]).z; }; { ((currentRay).d).x = (pathDirections[pathIndex]).x; ((currentRay).d).y = (pathDirections[pathIndex]).y; ((currentRay).d).z = (pathDirections[pathIndex]).z; }; };
+ Vec throughput = pathThroughputs[pathIndex];
+ const float currentSigmaS = pathSigmas[2 * pathIndex];
+ const float currentSigmaT = currentSigmaS + pathSigmas[2 * pathIndex + 1];
+
+ float t;
+ unsigned int id = 0;
+ const bool hit = Intersect(spheres, bvhNodes, bvhSphereIndices, &currentRay, &t, &id);
+
+ if ((currentSigmaS > 0.f) && ScatterVolume(&currentRay, hit ? t : 999.f, &throughput,
+   currentSigmaS, currentSigmaT, &sampler)) {
+  pathOrigins[pathIndex] = currentRay.o;
+  pathDirections[pathIndex] = currentRay.d;
+  pathThroughputs[pathIndex] = throughput;
+  pathMaterialPdfs[pathIndex] = 0.f;
+
+  rayQueues[outputQueue * pathCount + atomic_inc(&queueCounters[(outputQueue)])] = pathIndex;
+ } else if (hit) {
+
+  const float absorption = exp(-currentSigmaT * t);
+  { float k = (absorption); { (throughput).x = k * (throughput).x; (throughput).y = k * (throughput).y; (throughput).z = k * (throughput).z; } };
+
+  __global const Sphere *obj = &spheres[id];
+
+
+  Vec eCol; { (eCol).x = (obj->e).x; (eCol).y = (obj->e).y; (eCol).z = (obj->e).z; };
+  if (!(((eCol).x == 0.f) && ((eCol).x == 0.f) && ((eCol).z == 0.f))) {
+   { (eCol).x = (throughput).x * (eCol).x; (eCol).y = (throughput).y * (eCol).y; (eCol).z = (throughput).z * (eCol).z; };
+   { float k = (EmissionWeight(obj, lightsPower, &currentRay.o, pathMaterialPdfs[pathIndex])); { (eCol).x = k * (eCol).x; (eCol).y = k * (eCol).y; (eCol).z = k * (eCol).z; } };
+   { (pathRadiances[pathIndex]).x = (pathRadiances[pathIndex]).x + (eCol).x; (pathRadiances[pathIndex]).y = (pathRadiances[pathIndex]).y + (eCol).y; (pathRadiances[pathIndex]).z = (pathRadiances[pathIndex]).z + (eCol).z; };
+  } else if (obj->matType < 6) {
+   pathThroughputs[pathIndex] = throughput;
+   pathHitDistances[pathIndex] = t;
+   pathHitSpheres[pathIndex] = id;
+
+   materialQueues[obj->matType * pathCount + atomic_inc(&queueCounters[(2 + (obj->matType))])] = pathIndex;
+  }
+ }
+}
+
+
+
+void WavefrontShade(
+ const MaterialType matType,
+ const unsigned int seed,
+ __global const Sphere *spheres,
+ __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+ __global const Light *lights, const unsigned int lightCount, const float lightsPower,
+ const unsigned int width, const unsigned int height,
+ __global Vec *pathOrigins, __global Vec *pathDirections,
+ __global Vec *pathThroughputs, __global Vec *pathRadiances,
+ __global float *pathSigmas, __global float *pathMaterialPdfs,
+ __global const float *pathHitDistances, __global const unsigned int *pathHitSpheres,
+ __global unsigned int *rayQueues, __global const unsigned int *materialQueues,
+ __global unsigned int *queueCounters, const unsigned int outputQueue,
+ const unsigned int currentSample, const unsigned int depth) {
+ const int gid = get_global_id(0);
+
+ if (gid >= queueCounters[(2 + (matType))])
+  return;
+
+ const unsigned int pathCount = width * height;
+ const unsigned int pathIndex = materialQueues[matType * pathCount + gid];
+
+ Sampler sampler;
+ InitSampler(&sampler, seed, pathIndex, pathCount, currentSample);
+ SamplerStartBounce(&sampler, depth);
+
+ Ray currentRay;
+ { { ((currentRay).o).x = (pathOrigins[pathIndex]).x; ((currentRay).o).y = (pathOrigins[pathIndex]).y; ((currentRay).o).z = (pathOrigins[pathIndex]).z; }; { ((currentRay).d).x = (pathDirections[pathIndex]).x; ((currentRay).d).y = (pathDirections[pathIndex]).y; ((currentRay).d).z = (pathDirections[pathIndex]).z; }; };
+ Vec throughput = pathThroughputs[pathIndex];
+ Vec rad = pathRadiances[pathIndex];
+ float currentSigmaS = pathSigmas[2 * pathIndex];
+ float currentSigmaA = pathSigmas[2 * pathIndex + 1];
+ float lastMaterialPdf = 0.f;
+
+ __global const Sphere *obj = &spheres[pathHitSpheres[pathIndex]];
+
+ Vec hitPoint;
+ { float k = (pathHitDistances[pathIndex]); { (hitPoint).x = k * (currentRay.d).x; (hitPoint).y = k * (currentRay.d).y; (hitPoint).z = k * (currentRay.d).z; } };
+ { (hitPoint).x = (currentRay.o).x + (hitPoint).x; (hitPoint).y = (currentRay.o).y + (hitPoint).y; (hitPoint).z = (currentRay.o).z + (hitPoint).z; };
+
+ Vec normal;
+ { (normal).x = (hitPoint).x - (obj->p).x; (normal).y = (hitPoint).y - (obj->p).y; (normal).z = (hitPoint).z - (obj->p).z; };
+ { float l = 1.f / sqrt(((normal).x * (normal).x + (normal).y * (normal).y + (normal).z * (normal).z)); { float k = (l); { (normal).x = k * (normal).x; (normal).y = k * (normal).y; (normal).z = k * (normal).z; } }; };
+
+ const bool pathContinues = ShadeHit(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+   obj, &hitPoint, &normal, &currentRay, &throughput, &rad,
+   &currentSigmaS, &currentSigmaA, &lastMaterialPdf, &sampler);
+ pathRadiances[pathIndex] = rad;
+
+ if (pathContinues) {
+  pathOrigins[pathIndex] = currentRay.o;
+  pathDirections[pathIndex] = currentRay.d;
+  pathThroughputs[pathIndex] = throughput;
+  pathSigmas[2 * pathIndex] = currentSigmaS;
+  pathSigmas[2 * pathIndex + 1] = currentSigmaA;
+  pathMaterialPdfs[pathIndex] = lastMaterialPdf;
+
+  rayQueues[outputQueue * pathCount + atomic_inc(&queueCounters[(outputQueue)])] = pathIndex;
+ }
+}
+# 1309 "<stdin>"
+__kernel void WavefrontShadeMatte( const unsigned int seed, __global const Sphere *spheres, __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices, __global const Light *lights, const unsigned int lightCount, const float lightsPower, const unsigned int width, const unsigned int height, __global Vec *pathOrigins, __global Vec *pathDirections, __global Vec *pathThroughputs, __global Vec *pathRadiances, __global float *pathSigmas, __global float *pathMaterialPdfs, __global const float *pathHitDistances, __global const unsigned int *pathHitSpheres, __global unsigned int *rayQueues, __global const unsigned int *materialQueues, __global unsigned int *queueCounters, const unsigned int outputQueue, const unsigned int currentSample, const unsigned int depth) { WavefrontShade(MATTE, seed, spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower, width, height, pathOrigins, pathDirections, pathThroughputs, pathRadiances, pathSigmas, pathMaterialPdfs, pathHitDistances, pathHitSpheres, rayQueues, materialQueues, queueCounters, outputQueue, currentSample, depth); }
+__kernel void WavefrontShadeMirror( const unsigned int seed, __global const Sphere *spheres, __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices, __global const Light *lights, const unsigned int lightCount, const float lightsPower, const unsigned int width, const unsigned int height, __global Vec *pathOrigins, __global Vec *pathDirections, __global Vec *pathThroughputs, __global Vec *pathRadiances, __global float *pathSigmas, __global float *pathMaterialPdfs, __global const float *pathHitDistances, __global const unsigned int *pathHitSpheres, __global unsigned int *rayQueues, __global const unsigned int *materialQueues, __global unsigned int *queueCounters, const unsigned int outputQueue, const unsigned int currentSample, const unsigned int depth) { WavefrontShade(MIRROR, seed, spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower, width, height, pathOrigins, pathDirections, pathThroughputs, pathRadiances, pathSigmas, pathMaterialPdfs, pathHitDistances, pathHitSpheres, rayQueues, materialQueues, queueCounters, outputQueue, currentSample, depth); }
+__kernel void WavefrontShadeGlass( const unsigned int seed, __global const Sphere *spheres, __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices, __global const Light *lights, const unsigned int lightCount, const float lightsPower, const unsigned int width, const unsigned int height, __global Vec *pathOrigins, __global Vec *pathDirections, __global Vec *pathThroughputs, __global Vec *pathRadiances, __global float *pathSigmas, __global float *pathMaterialPdfs, __global const float *pathHitDistances, __global const unsigned int *pathHitSpheres, __global unsigned int *rayQueues, __global const unsigned int *materialQueues, __global unsigned int *queueCounters, const unsigned int outputQueue, const unsigned int currentSample, const unsigned int depth) { WavefrontShade(GLASS, seed, spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower, width, height, pathOrigins, pathDirections, pathThroughputs, pathRadiances, pathSigmas, pathMaterialPdfs, pathHitDistances, pathHitSpheres, rayQueues, materialQueues, queueCounters, outputQueue, currentSample, depth); }
+__kernel void WavefrontShadeMatteTranslucent( const unsigned int seed, __global const Sphere *spheres, __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices, __global const Light *lights, const unsigned int lightCount, const float lightsPower, const unsigned int width, const unsigned int height, __global Vec *pathOrigins, __global Vec *pathDirections, __global Vec *pathThroughputs, __global Vec *pathRadiances, __global float *pathSigmas, __global float *pathMaterialPdfs, __global const float *pathHitDistances, __global const unsigned int *pathHitSpheres, __global unsigned int *rayQueues, __global const unsigned int *materialQueues, __global unsigned int *queueCounters, const unsigned int outputQueue, const unsigned int currentSample, const unsigned int depth) { WavefrontShade(MATTETRANSLUCENT, seed, spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower, width, height, pathOrigins, pathDirections, pathThroughputs, pathRadiances, pathSigmas, pathMaterialPdfs, pathHitDistances, pathHitSpheres, rayQueues, materialQueues, queueCounters, outputQueue, currentSample, depth); }
+__kernel void WavefrontShadeGlossy( const unsigned int seed, __global const Sphere *spheres, __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices, __global const Light *lights, const unsigned int lightCount, const float lightsPower, const unsigned int width, const unsigned int height, __global Vec *pathOrigins, __global Vec *pathDirections, __global Vec *pathThroughputs, __global Vec *pathRadiances, __global float *pathSigmas, __global float *pathMaterialPdfs, __global const float *pathHitDistances, __global const unsigned int *pathHitSpheres, __global unsigned int *rayQueues, __global const unsigned int *materialQueues, __global unsigned int *queueCounters, const unsigned int outputQueue, const unsigned int currentSample, const unsigned int depth) { WavefrontShade(GLOSSY, seed, spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower, width, height, pathOrigins, pathDirections, pathThroughputs, pathRadiances, pathSigmas, pathMaterialPdfs, pathHitDistances, pathHitSpheres, rayQueues, materialQueues, queueCounters, outputQueue, currentSample, depth); }
+__kernel void WavefrontShadeGlossyTranslucent( const unsigned int seed, __global const Sphere *spheres, __global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices, __global const Light *lights, const unsigned int lightCount, const float lightsPower, const unsigned int width, const unsigned int height, __global Vec *pathOrigins, __global Vec *pathDirections, __global Vec *pathThroughputs, __global Vec *pathRadiances, __global float *pathSigmas, __global float *pathMaterialPdfs, __global const float *pathHitDistances, __global const unsigned int *pathHitSpheres, __global unsigned int *rayQueues, __global const unsigned int *materialQueues, __global unsigned int *queueCounters, const unsigned int outputQueue, const unsigned int currentSample, const unsigned int depth) { WavefrontShade(GLOSSYTRANSLUCENT, seed, spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower, width, height, pathOrigins, pathDirections, pathThroughputs, pathRadiances, pathSigmas, pathMaterialPdfs, pathHitDistances, pathHitSpheres, rayQueues, materialQueues, queueCounters, outputQueue, currentSample, depth); }
+
+
+__kernel void WavefrontAccumulate(
+ __global Vec *samples, __global const Vec *pathRadiances,
+ const unsigned int width, const unsigned int height,
+ const unsigned int currentSample) {
+ const int gid = get_global_id(0);
+
+ if (gid >= width * height)
+  return;
+
+ const Vec r = pathRadiances[gid];
+ __global Vec *sample = &samples[gid];
+ if (currentSample == 0)
+  *sample = r;
+ else {
+  const float k1 = currentSample;
+  const float k2 = 1.f / (currentSample + 1.f);
+  sample->x = (sample->x * k1 + r.x) * k2;
+  sample->y = (sample->y * k1 + r.y) * k2;
+  sample->z = (sample->z * k1 + r.z) * k2;
+ }
+}
@@ -26,21 +26,124 @@
 //  PARAM_MAX_DEPTH
 //  PARAM_DEFAULT_SIGMA_S
 //  PARAM_DEFAULT_SIGMA_A
+//  PARAM_SOBOL (1 to use Owen scrambled Sobol samples for the camera and the
+//   first bounce, 0 otherwise)
+
+//------------------------------------------------------------------------------
+// Random numbers: there is no state in memory, each random number is a hash of
+// its pixel, its sample index and its dimension. The dimensions of a path are
+// laid out in a fixed way (the camera, then SAMPLER_BOUNCE_DIMENSIONS for each
+// bounce) so all rendering modes use the same numbers for the same decisions.
+//------------------------------------------------------------------------------
+
+#define SAMPLER_CAMERA_DIMENSIONS 2
+#define SAMPLER_BOUNCE_DIMENSIONS 12
+// The offsets of the dimensions used in a bounce
+#define SAMPLER_VOLUME_OFFSET 0
+#define SAMPLER_LIGHT_OFFSET 4
+#define SAMPLER_MATERIAL_OFFSET 8
+#define SAMPLER_RR_OFFSET 11
+
+#define SOBOL_DIMENSIONS (SAMPLER_CAMERA_DIMENSIONS + SAMPLER_BOUNCE_DIMENSIONS)
+
+typedef struct {
+	// The pixel, offset by the stream of the device
+	unsigned int key;
+	unsigned int sample;
+	unsigned int bounceDimension, dimension;
+} Sampler;
+
+// The seed selects the stream of random numbers of a device
+void InitSampler(Sampler *sampler, const unsigned int seed, const unsigned int pixel,
+		const unsigned int pixelCount, const unsigned int sample) {
+	sampler->key = seed * pixelCount + pixel;
+	sampler->sample = sample;
+	sampler->bounceDimension = 0;
+	sampler->dimension = 0;
+}
 
-float GetRandom(unsigned int *seed0, unsigned int *seed1) {
-	*seed0 = 36969 * ((*seed0) & 65535) + ((*seed0) >> 16);
-	*seed1 = 18000 * ((*seed1) & 65535) + ((*seed1) >> 16);
+void SamplerStartBounce(Sampler *sampler, const unsigned int depth) {
+	sampler->bounceDimension = SAMPLER_CAMERA_DIMENSIONS + depth * SAMPLER_BOUNCE_DIMENSIONS;
+	sampler->dimension = sampler->bounceDimension;
+}
 
-	unsigned int ires = ((*seed0) << 16) + (*seed1);
+void SamplerSetOffset(Sampler *sampler, const unsigned int offset) {
+	sampler->dimension = sampler->bounceDimension + offset;
+}
+
+// Philox2x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+unsigned int Philox(unsigned int key, unsigned int counter0, unsigned int counter1) {
+	for (unsigned int i = 0; i < 10; ++i) {
+		const unsigned int hi = mul_hi(0xd256d193u, counter0);
+		const unsigned int lo = 0xd256d193u * counter0;
+		counter0 = hi ^ key ^ counter1;
+		counter1 = lo;
+		key += 0x9e3779b9u;
+	}
 
-	/* Convert to float */
-	union {
-		float f;
-		unsigned int ui;
-	} res;
-	res.ui = (ires & 0x007fffff) | 0x40000000;
+	return counter0;
+}
+
+unsigned int Hash(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+
+	return x;
+}
+
+unsigned int ReverseBits(unsigned int x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+
+	return (x >> 16) | (x << 16);
+}
+
+// Hash based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling")
+unsigned int OwenScramble(unsigned int x, const unsigned int seed) {
+	x = ReverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+
+	return ReverseBits(x);
+}
+
+// The dimensions are used in pairs, each pair is a 2D Sobol sequence with the
+// index shuffled and the values scrambled by the pixel and the pair
+unsigned int SobolOwen(const unsigned int key, const unsigned int sample, const unsigned int dimension) {
+	const unsigned int pairSeed = Hash(key ^ Hash(dimension >> 1));
+	unsigned int index = OwenScramble(sample, pairSeed);
+
+	unsigned int x;
+	if (dimension & 1) {
+		// The second dimension of Sobol
+		x = 0;
+		for (unsigned int v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+			if (index & 1)
+				x ^= v;
+		}
+	} else
+		x = ReverseBits(index);
 
-	return (res.f - 2.f) / 2.f;
+	return OwenScramble(x, Hash(pairSeed + 1 + (dimension & 1)));
+}
+
+float GetRandom(Sampler *sampler) {
+	const unsigned int dimension = sampler->dimension++;
+
+	const unsigned int r = (PARAM_SOBOL && (dimension < SOBOL_DIMENSIONS)) ?
+		SobolOwen(sampler->key, sampler->sample, dimension) :
+		Philox(sampler->key, sampler->sample, dimension);
+
+	/* Convert to float in [0, 1) */
+	return (r >> 8) * (1.f / 16777216.f);
 }
 
 float SphereIntersect(
@@ -69,21 +172,65 @@ float SphereIntersect(
 	}
 }
 
+int BBoxIntersect(
+	__global const BVHNode *node,
+	const Ray *r,
+	const Vec *invDir,
+	const float maxT) {
+	const float tx0 = (node->bboxMin.x - r->o.x) * invDir->x;
+	const float tx1 = (node->bboxMax.x - r->o.x) * invDir->x;
+	const float ty0 = (node->bboxMin.y - r->o.y) * invDir->y;
+	const float ty1 = (node->bboxMax.y - r->o.y) * invDir->y;
+	const float tz0 = (node->bboxMin.z - r->o.z) * invDir->z;
+	const float tz1 = (node->bboxMax.z - r->o.z) * invDir->z;
+
+	const float tNear = fmax(fmax(fmin(tx0, tx1), fmin(ty0, ty1)), fmax(fmin(tz0, tz1), 0.f));
+	const float tFar = fmin(fmin(fmax(tx0, tx1), fmax(ty0, ty1)), fmin(fmax(tz0, tz1), maxT));
+
+	return (tNear <= tFar);
+}
+
+// Traverses the sphere BVH with a short stack of the right children still to
+// visit
 int Intersect(
 	__global const Sphere *spheres,
-	const unsigned int sphereCount,
+	__global const BVHNode *bvhNodes,
+	__global const unsigned int *bvhSphereIndices,
 	const Ray *r,
 	float *t,
 	unsigned int *id) {
 	float inf = (*t) = 1e20f;
 
-	unsigned int i = sphereCount;
-	for (; i--;) {
-		const float d = SphereIntersect(&spheres[i], r);
-		if ((d != 0.f) && (d < *t)) {
-			*t = d;
-			*id = i;
+	Vec invDir;
+	vinit(invDir, 1.f / r->d.x, 1.f / r->d.y, 1.f / r->d.z);
+
+	unsigned int stack[BVH_STACK_SIZE];
+	unsigned int stackSize = 0;
+	unsigned int nodeIndex = 0;
+	for (;;) {
+		__global const BVHNode *node = &bvhNodes[nodeIndex];
+
+		if (BBoxIntersect(node, r, &invDir, *t)) {
+			if (node->count == 0) {
+				// Visit the left child first
+				stack[stackSize++] = node->first;
+				++nodeIndex;
+				continue;
+			}
+
+			for (unsigned int i = node->first; i < node->first + node->count; ++i) {
+				const unsigned int sphereIndex = bvhSphereIndices[i];
+				const float d = SphereIntersect(&spheres[sphereIndex], r);
+				if ((d != 0.f) && (d < *t)) {
+					*t = d;
+					*id = sphereIndex;
+				}
+			}
 		}
+
+		if (stackSize == 0)
+			break;
+		nodeIndex = stack[--stackSize];
 	}
 
 	return (*t < inf);
@@ -120,8 +267,8 @@ void SampleHG(const float g, const float e1, const float e2, Vec *dir) {
 }
 
 float Scatter(const Ray *currentRay, const float distance, Ray *scatterRay,
-		float *scatterDistance, unsigned int *seed0, unsigned int *seed1, const float sigmaS) {
-	*scatterDistance = SampleSegment(GetRandom(seed0, seed1), sigmaS, distance - EPSILON) + EPSILON;
+		float *scatterDistance, Sampler *sampler, const float sigmaS) {
+	*scatterDistance = SampleSegment(GetRandom(sampler), sigmaS, distance - EPSILON) + EPSILON;
 
 	Vec scatterPoint;
 	vsmul(scatterPoint, *scatterDistance, currentRay->d);
@@ -129,7 +276,7 @@ float Scatter(const Ray *currentRay, const float distance, Ray *scatterRay,
 
 	// Sample a direction ~ Henyey-Greenstein's phase function
 	Vec dir;
-	SampleHG(-.5f, GetRandom(seed0, seed1), GetRandom(seed0, seed1), &dir);
+	SampleHG(-.5f, GetRandom(sampler), GetRandom(sampler), &dir);
 
 	Vec u, v;
 	CoordinateSystem(&currentRay->d, &u, &v);
@@ -187,268 +334,540 @@ void GlossyTransmission(const Vec *wi, Vec *wo, const Vec *normal, const float e
 	wo->z = x * u.z + y * v.z + z * specDir.z;
 }
 
+#if defined(PARAM_PREVIEW)
+
+// The preview kernel shades only the first hit, lit from the camera. It
+// compiles much faster than the path tracer and it is rendered while the
+// full kernel is compiling.
 void Radiance(
 	__global const Sphere *spheres,
-	const unsigned int sphereCount,
+	__global const BVHNode *bvhNodes,
+	__global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
 	const Ray *startRay,
-	unsigned int *seed0, unsigned int *seed1,
+	Sampler *sampler,
 	Vec *result) {
-	float currentSigmaS = PARAM_DEFAULT_SIGMA_S;
-	float currentSigmaA = PARAM_DEFAULT_SIGMA_A;
-	float currentSigmaT = currentSigmaS + currentSigmaA;
+	float t; /* distance to intersection */
+	unsigned int id = 0; /* id of intersected object */
+	if (!Intersect(spheres, bvhNodes, bvhSphereIndices, startRay, &t, &id)) {
+		vclr(*result);
+		return;
+	}
 
-	Ray currentRay; rassign(currentRay, *startRay);
-	Vec rad; vinit(rad, 0.f, 0.f, 0.f);
+	__global const Sphere *obj = &spheres[id]; /* the hit object */
 
-	Vec throughput; vinit(throughput, 1.f, 1.f, 1.f);
+	/* Emitted light */
+	Vec eCol; vassign(eCol, obj->e);
+	if (!viszero(eCol)) {
+		vassign(*result, eCol);
+		return;
+	}
 
-	unsigned int depth = 0;
-	for (;; ++depth) {
-		// Removed Russian Roulette in order to improve execution on SIMT
-		if (depth > PARAM_MAX_DEPTH) {
-			*result = rad;
-			return;
-		}
+	Vec hitPoint;
+	vsmul(hitPoint, t, startRay->d);
+	vadd(hitPoint, startRay->o, hitPoint);
 
-		float t; /* distance to intersection */
-		unsigned int id = 0; /* id of intersected object */
-		const bool hit = Intersect(spheres, sphereCount, &currentRay, &t, &id);
-
-		if (currentSigmaS > 0.f) {
-			// Check if there is a scattering event
-			Ray scatterRay;
-			float scatterDistance;
-			const float scatteringProbability = Scatter(&currentRay, hit ? t : 999.f, &scatterRay,
-					&scatterDistance, seed0, seed1, currentSigmaS);
-
-			// Is there the scatter event ?
-			if ((scatteringProbability > 0.f) && (GetRandom(seed0, seed1) < scatteringProbability)) {
-				// There is, sample the volume
-				rassign(currentRay, scatterRay);
-
-				// Absorption
-				const float absorption = exp(-currentSigmaT * scatterDistance);
-				vsmul(throughput, absorption, throughput);
-				continue;
-			}
-		}
-			
-		if (!hit) {
-			*result = rad; /* if miss, return */
-			return;
-		}
+	Vec normal;
+	vsub(normal, hitPoint, obj->p);
+	vnorm(normal);
 
-		// Absorption
-		const float absorption = exp(-currentSigmaT * t);
-		vsmul(throughput, absorption, throughput);
+	/* All materials have the color as first field */
+	vsmul(*result, fabs(vdot(normal, startRay->d)), obj->matte.c);
+}
 
-		__global const Sphere *obj = &spheres[id]; /* the hit object */
+#else
 
-		Vec hitPoint;
-		vsmul(hitPoint, t, currentRay.d);
-		vadd(hitPoint, currentRay.o, hitPoint);
+// Checks if there is a scattering event in the volume before the hit point,
+// the path continues from the scattering point if there is one
+bool ScatterVolume(Ray *currentRay, const float distance, Vec *throughput,
+		const float currentSigmaS, const float currentSigmaT,
+		Sampler *sampler) {
+	Ray scatterRay;
+	float scatterDistance;
+	const float scatteringProbability = Scatter(currentRay, distance, &scatterRay,
+			&scatterDistance, sampler, currentSigmaS);
 
-		Vec normal;
-		vsub(normal, hitPoint, obj->p);
-		vnorm(normal);
+	// Is there the scatter event ?
+	if ((scatteringProbability > 0.f) && (GetRandom(sampler) < scatteringProbability)) {
+		// There is, sample the volume
+		rassign(*currentRay, scatterRay);
 
-		// Ray from outside going in ?
-		const bool into = (vdot(normal, currentRay.d) < 0.f);
-		Vec shadeNormal;
-		vsmul(shadeNormal, into ? 1.f : -1.f, normal);
+		// Absorption
+		const float absorption = exp(-currentSigmaT * scatterDistance);
+		vsmul(*throughput, absorption, *throughput);
+		return true;
+	}
 
-		/* Add emitted light */
-		Vec eCol; vassign(eCol, obj->e);
-		if (!viszero(eCol)) {
-			vmul(eCol, throughput, eCol);
-			vadd(rad, rad, eCol);
+	return false;
+}
 
-			*result = rad;
-			return;
+// Samples the next ray of the path at a hit point of a not emissive sphere
+// and updates the throughput and the volume of the path. Returns false if
+// the path ends there.
+bool SampleMaterial(
+	__global const Sphere *obj,
+	const Vec *hitPoint,
+	const Vec *normal,
+	Ray *currentRay,
+	Vec *throughput,
+	float *currentSigmaS, float *currentSigmaA,
+	Sampler *sampler) {
+	// Ray from outside going in ?
+	const bool into = (vdot(*normal, currentRay->d) < 0.f);
+	Vec shadeNormal;
+	vsmul(shadeNormal, into ? 1.f : -1.f, *normal);
+
+	switch (obj->matType) {
+		case MATTE: {
+			vmul(*throughput, *throughput, obj->matte.c);
+
+			const float r1 = 2.f * FLOAT_PI * GetRandom(sampler);
+			const float r2 = GetRandom(sampler);
+			const float r2s = sqrt(r2);
+
+			Vec w = shadeNormal;
+			Vec u, v;
+			CoordinateSystem(&w, &u, &v);
+
+			Vec newDir;
+			vsmul(u, cos(r1) * r2s, u);
+			vsmul(v, sin(r1) * r2s, v);
+			vadd(newDir, u, v);
+			vsmul(w, sqrt(1 - r2), w);
+			vadd(newDir, newDir, w);
+
+			rinit(*currentRay, *hitPoint, newDir);
+			break;
 		}
+		case MIRROR: {
+			vmul(*throughput, *throughput, obj->mirror.c);
+
+			Vec newDir;
+			SpecularReflection(&currentRay->d, &newDir, &shadeNormal);
 
-		switch (obj->matType) {
-			case MATTE: {
-				vmul(throughput, throughput, obj->matte.c);
+			rinit(*currentRay, *hitPoint, newDir);
+			break;
+		}
+		case GLASS: {
+			Vec newDir;
+			vsmul(newDir,  2.f * vdot(*normal, currentRay->d), *normal);
+			vsub(newDir, currentRay->d, newDir);
 
-				const float r1 = 2.f * FLOAT_PI * GetRandom(seed0, seed1);
-				const float r2 = GetRandom(seed0, seed1);
-				const float r2s = sqrt(r2);
+			Ray reflRay; rinit(reflRay, *hitPoint, newDir); /* Ideal dielectric REFRACTION */
 
-				Vec w = shadeNormal;
-				Vec u, v;
-				CoordinateSystem(&w, &u, &v);
+			const float nc = 1.f;
+			const float nt = obj->glass.ior;
+			const float nnt = into ? nc / nt : nt / nc;
+			const float ddn = vdot(currentRay->d, shadeNormal);
+			const float cos2t = 1.f - nnt * nnt * (1.f - ddn * ddn);
 
-				Vec newDir;
-				vsmul(u, cos(r1) * r2s, u);
-				vsmul(v, sin(r1) * r2s, v);
-				vadd(newDir, u, v);
-				vsmul(w, sqrt(1 - r2), w);
-				vadd(newDir, newDir, w);
+			if (cos2t < 0.f)  { /* Total internal reflection */
+				vmul(*throughput, *throughput, obj->glass.c);
 
-				rinit(currentRay, hitPoint, newDir);
-				break;
+				rassign(*currentRay, reflRay);
+				return true;
 			}
-			case MIRROR: {
-				vmul(throughput, throughput, obj->mirror.c);
-
-				Vec newDir;
-				SpecularReflection(&currentRay.d, &newDir, &shadeNormal);
 
-				rinit(currentRay, hitPoint, newDir);
-				break;
+			const float kk = (into ? 1 : -1) * (ddn * nnt + sqrt(cos2t));
+			Vec nkk;
+			vsmul(nkk, kk, *normal);
+			Vec transDir;
+			vsmul(transDir, nnt, currentRay->d);
+			vsub(transDir, transDir, nkk);
+			vnorm(transDir);
+
+			const float a = nt - nc;
+			const float b = nt + nc;
+			const float R0 = a * a / (b * b);
+			const float c = 1 - (into ? -ddn : vdot(transDir, *normal));
+
+			const float Re = R0 + (1 - R0) * c * c * c * c*c;
+			const float Tr = 1.f - Re;
+			const float P = .25f + .5f * Re;
+			const float RP = Re / P;
+			const float TP = Tr / (1.f - P);
+
+			if (GetRandom(sampler) < P) { /* R.R. */
+				vsmul(*throughput, RP, *throughput);
+				vmul(*throughput, *throughput, obj->glass.c);
+
+				rassign(*currentRay, reflRay);
+			} else {
+				vsmul(*throughput, TP, *throughput);
+				vmul(*throughput, *throughput, obj->glass.c);
+
+				rinit(*currentRay, *hitPoint, transDir);
+
+				if (into) {
+					*currentSigmaS = obj->glass.sigmaS;
+					*currentSigmaA = obj->glass.sigmaA;
+				} else {
+					*currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+					*currentSigmaA = PARAM_DEFAULT_SIGMA_A;					
+				}
 			}
-			case GLASS: {
-				Vec newDir;
-				vsmul(newDir,  2.f * vdot(normal, currentRay.d), normal);
-				vsub(newDir, currentRay.d, newDir);
+			break;
+		}
+		case MATTETRANSLUCENT: {
+			vmul(*throughput, *throughput, obj->mattertranslucent.c);
+
+			// Transmitted or reflect ?
+			bool transmit;
+			if (GetRandom(sampler) < obj->mattertranslucent.transparency) {
+				if (into) {
+					*currentSigmaS = obj->mattertranslucent.sigmaS;
+					*currentSigmaA = obj->mattertranslucent.sigmaA;
+				} else {
+					*currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+					*currentSigmaA = PARAM_DEFAULT_SIGMA_A;					
+				}
 
-				Ray reflRay; rinit(reflRay, hitPoint, newDir); /* Ideal dielectric REFRACTION */
+				transmit = true;
+			} else
+				transmit = false;
 
-				const float nc = 1.f;
-				const float nt = obj->glass.ior;
-				const float nnt = into ? nc / nt : nt / nc;
-				const float ddn = vdot(currentRay.d, shadeNormal);
-				const float cos2t = 1.f - nnt * nnt * (1.f - ddn * ddn);
+			const float r1 = 2.f * FLOAT_PI * GetRandom(sampler);
+			const float r2 = GetRandom(sampler);
+			const float r2s = sqrt(r2);
 
-				if (cos2t < 0.f)  { /* Total internal reflection */
-					vmul(throughput, throughput, obj->glass.c);
+			Vec u, v;
+			CoordinateSystem(&shadeNormal, &u, &v);
 
-					rassign(currentRay, reflRay);
-					continue;
-				}
+			Vec newDir;
+			vsmul(u, cos(r1) * r2s, u);
+			vsmul(v, sin(r1) * r2s, v);
+			vadd(newDir, u, v);
+			Vec w;
+			vsmul(w, (transmit ? -1.f : 1.) * sqrt(1 - r2), shadeNormal);
+			vadd(newDir, newDir, w);
 
-				const float kk = (into ? 1 : -1) * (ddn * nnt + sqrt(cos2t));
-				Vec nkk;
-				vsmul(nkk, kk, normal);
-				Vec transDir;
-				vsmul(transDir, nnt, currentRay.d);
-				vsub(transDir, transDir, nkk);
-				vnorm(transDir);
-
-				const float a = nt - nc;
-				const float b = nt + nc;
-				const float R0 = a * a / (b * b);
-				const float c = 1 - (into ? -ddn : vdot(transDir, normal));
-
-				const float Re = R0 + (1 - R0) * c * c * c * c*c;
-				const float Tr = 1.f - Re;
-				const float P = .25f + .5f * Re;
-				const float RP = Re / P;
-				const float TP = Tr / (1.f - P);
-
-				if (GetRandom(seed0, seed1) < P) { /* R.R. */
-					vsmul(throughput, RP, throughput);
-					vmul(throughput, throughput, obj->glass.c);
-
-					rassign(currentRay, reflRay);
-				} else {
-					vsmul(throughput, TP, throughput);
-					vmul(throughput, throughput, obj->glass.c);
-
-					rinit(currentRay, hitPoint, transDir);
-
-					if (into) {
-						currentSigmaS = obj->glass.sigmaS;
-						currentSigmaA = obj->glass.sigmaA;
-					} else {
-						currentSigmaS = PARAM_DEFAULT_SIGMA_S;
-						currentSigmaA = PARAM_DEFAULT_SIGMA_A;					
-					}
-					currentSigmaT = currentSigmaS + currentSigmaA;
-				}
-				break;
-			}
-			case MATTETRANSLUCENT: {
-				vmul(throughput, throughput, obj->mattertranslucent.c);
-
-				// Transmitted or reflect ?
-				bool transmit;
-				if (GetRandom(seed0, seed1) < obj->mattertranslucent.transparency) {
-					if (into) {
-						currentSigmaS = obj->mattertranslucent.sigmaS;
-						currentSigmaA = obj->mattertranslucent.sigmaA;
-					} else {
-						currentSigmaS = PARAM_DEFAULT_SIGMA_S;
-						currentSigmaA = PARAM_DEFAULT_SIGMA_A;					
-					}
-					currentSigmaT = currentSigmaS + currentSigmaA;
-
-					transmit = true;
-				} else
-					transmit = false;
-
-				const float r1 = 2.f * FLOAT_PI * GetRandom(seed0, seed1);
-				const float r2 = GetRandom(seed0, seed1);
-				const float r2s = sqrt(r2);
-
-				Vec u, v;
-				CoordinateSystem(&shadeNormal, &u, &v);
-
-				Vec newDir;
-				vsmul(u, cos(r1) * r2s, u);
-				vsmul(v, sin(r1) * r2s, v);
-				vadd(newDir, u, v);
-				Vec w;
-				vsmul(w, (transmit ? -1.f : 1.) * sqrt(1 - r2), shadeNormal);
-				vadd(newDir, newDir, w);
-
-				rinit(currentRay, hitPoint, newDir);
-				break;
-			}
-			case GLOSSY: {
-				vmul(throughput, throughput, obj->glossy.c);
+			rinit(*currentRay, *hitPoint, newDir);
+			break;
+		}
+		case GLOSSY: {
+			vmul(*throughput, *throughput, obj->glossy.c);
 
-				Vec newDir;
-				GlossyReflection(&currentRay.d, &newDir, &shadeNormal,
-						obj->glossy.exponent,
-						GetRandom(seed0, seed1), GetRandom(seed0, seed1));
+			Vec newDir;
+			GlossyReflection(&currentRay->d, &newDir, &shadeNormal,
+					obj->glossy.exponent,
+					GetRandom(sampler), GetRandom(sampler));
 
-				rinit(currentRay, hitPoint, newDir);
-				break;
-			}
-			case GLOSSYTRANSLUCENT: {
-				// Transmitted or reflect ?
-				Vec newDir;
-				if (GetRandom(seed0, seed1) < obj->glossytranslucent.transparency) {
-					vmul(throughput, throughput, obj->glossytranslucent.c);
-
-					if (into) {
-						currentSigmaS = obj->glossytranslucent.sigmaS;
-						currentSigmaA = obj->glossytranslucent.sigmaA;
-					} else {
-						currentSigmaS = PARAM_DEFAULT_SIGMA_S;
-						currentSigmaA = PARAM_DEFAULT_SIGMA_A;					
-					}
-					currentSigmaT = currentSigmaS + currentSigmaA;
-
-					GlossyTransmission(&currentRay.d, &newDir, &shadeNormal,
-							obj->glossytranslucent.exponent,
-							GetRandom(seed0, seed1), GetRandom(seed0, seed1));
+			rinit(*currentRay, *hitPoint, newDir);
+			break;
+		}
+		case GLOSSYTRANSLUCENT: {
+			// Transmitted or reflect ?
+			Vec newDir;
+			if (GetRandom(sampler) < obj->glossytranslucent.transparency) {
+				vmul(*throughput, *throughput, obj->glossytranslucent.c);
+
+				if (into) {
+					*currentSigmaS = obj->glossytranslucent.sigmaS;
+					*currentSigmaA = obj->glossytranslucent.sigmaA;
 				} else {
-					// Using white reflections
-					GlossyReflection(&currentRay.d, &newDir, &shadeNormal,
-							obj->glossytranslucent.exponent,
-							GetRandom(seed0, seed1), GetRandom(seed0, seed1));
+					*currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+					*currentSigmaA = PARAM_DEFAULT_SIGMA_A;					
 				}
 
-				rinit(currentRay, hitPoint, newDir);
-				break;
+				GlossyTransmission(&currentRay->d, &newDir, &shadeNormal,
+						obj->glossytranslucent.exponent,
+						GetRandom(sampler), GetRandom(sampler));
+			} else {
+				// Using white reflections
+				GlossyReflection(&currentRay->d, &newDir, &shadeNormal,
+						obj->glossytranslucent.exponent,
+						GetRandom(sampler), GetRandom(sampler));
 			}
-			default:
-				*result = rad;
-				return;
+
+			rinit(*currentRay, *hitPoint, newDir);
+			break;
 		}
+		default:
+			return false;
+	}
+
+	return true;
+}
+
+// Picks a light according to the power of the lights
+unsigned int PickLight(__global const Light *lights, const unsigned int lightCount, const float u) {
+	unsigned int first = 0;
+	unsigned int last = lightCount - 1;
+	while (first < last) {
+		const unsigned int middle = (first + last) / 2;
+		if (u < lights[middle].cdf)
+			last = middle;
+		else
+			first = middle + 1;
 	}
+
+	return lights[first].sphereIndex;
 }
 
+// The solid angle pdf of sampling a direction towards the light from the
+// point with PickLight() and SampleLight() (0 if the point is inside the light)
+float LightPdf(__global const Sphere *light, const float lightsPower, const Vec *point) {
+	Vec toCenter;
+	vsub(toCenter, light->p, *point);
+	const float sin2ThetaMax = light->rad * light->rad / vdot(toCenter, toCenter);
+	if (sin2ThetaMax >= 1.f)
+		return 0.f;
+
+	// 1 - cos(thetaMax), without the cancellation of the small lights
+	const float cosThetaMaxComplement = sin2ThetaMax / (1.f + sqrt(1.f - sin2ThetaMax));
+
+	return SPHERE_POWER(*light) / (lightsPower * 2.f * FLOAT_PI * cosThetaMaxComplement);
+}
+
+// Samples a direction in the cone of the light seen from the point
+void SampleLight(__global const Sphere *light, const Vec *point,
+		const float u0, const float u1, Vec *dir) {
+	Vec w;
+	vsub(w, light->p, *point);
+	const float sin2ThetaMax = light->rad * light->rad / vdot(w, w);
+	const float cosThetaMaxComplement = sin2ThetaMax / (1.f + sqrt(1.f - sin2ThetaMax));
+	vnorm(w);
+
+	const float cosTheta = 1.f - u1 * cosThetaMaxComplement;
+	const float sinTheta = sqrt(fmax(1.f - cosTheta * cosTheta, 0.f));
+	const float phi = 2.f * FLOAT_PI * u0;
+
+	Vec u, v;
+	CoordinateSystem(&w, &u, &v);
+
+	dir->x = cos(phi) * sinTheta * u.x + sin(phi) * sinTheta * v.x + cosTheta * w.x;
+	dir->y = cos(phi) * sinTheta * u.y + sin(phi) * sinTheta * v.y + cosTheta * w.y;
+	dir->z = cos(phi) * sinTheta * u.z + sin(phi) * sinTheta * v.z + cosTheta * w.z;
+}
+
+// The solid angle pdf of sampling the direction wo with SampleMaterial() at a
+// MATTE or GLOSSY hit (0 for the other materials and below the surface)
+float MaterialPdf(__global const Sphere *obj, const Vec *wi, const Vec *shadeNormal, const Vec *wo) {
+	const float cosNormal = vdot(*wo, *shadeNormal);
+	if (cosNormal <= 0.f)
+		return 0.f;
+
+	switch (obj->matType) {
+		case MATTE:
+			return cosNormal / FLOAT_PI;
+		case GLOSSY: {
+			Vec specDir;
+			SpecularReflection(wi, &specDir, shadeNormal);
+			const float cosTheta = vdot(*wo, specDir);
+			if (cosTheta <= 0.f)
+				return 0.f;
+
+			// GlossyReflection() samples sin(theta) = (1 - u1)^exponent
+			const float exponent = obj->glossy.exponent;
+			const float sinTheta = sqrt(fmax(1.f - cosTheta * cosTheta, 1e-8f));
+			return cosTheta * pow(sinTheta, 1.f / exponent - 2.f) / (2.f * FLOAT_PI * exponent);
+		}
+		default:
+			return 0.f;
+	}
+}
+
+float PowerHeuristic(const float pdf0, const float pdf1) {
+	return (pdf0 * pdf0) / (pdf0 * pdf0 + pdf1 * pdf1);
+}
+
+// Next event estimation: adds the light of a point sampled on a light,
+// weighted by MIS with the sampling of the material
+void DirectLight(
+	__global const Sphere *spheres,
+	__global const BVHNode *bvhNodes,
+	__global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
+	__global const Sphere *obj,
+	const Vec *hitPoint, const Vec *wi, const Vec *shadeNormal,
+	const Vec *throughput,
+	const float currentSigmaS, const float currentSigmaT,
+	Vec *rad,
+	Sampler *sampler) {
+	const float u0 = GetRandom(sampler);
+	const float u1 = GetRandom(sampler);
+	const unsigned int lightIndex = PickLight(lights, lightCount, GetRandom(sampler));
+	__global const Sphere *light = &spheres[lightIndex];
+
+	const float lightPdf = LightPdf(light, lightsPower, hitPoint);
+	if (lightPdf == 0.f)
+		return;
+
+	Vec dir;
+	SampleLight(light, hitPoint, u0, u1, &dir);
+	const float materialPdf = MaterialPdf(obj, wi, shadeNormal, &dir);
+	if (materialPdf == 0.f)
+		return;
+
+	Ray shadowRay;
+	rinit(shadowRay, *hitPoint, dir);
+	float t;
+	unsigned int id = 0;
+	if (!Intersect(spheres, bvhNodes, bvhSphereIndices, &shadowRay, &t, &id) || (id != lightIndex))
+		return;
+
+	// The attenuation of the paths reaching the light through the volume
+	// without scattering (see ScatterVolume())
+	const float transmittance = (currentSigmaS > 0.f) ?
+		exp(-currentSigmaS * (t - EPSILON) - currentSigmaT * t) : exp(-currentSigmaT * t);
+
+	// SampleMaterial() multiplies the throughput by the color of the material,
+	// so the material times the cosine is the color times the pdf. All
+	// materials have the color as first field.
+	const float k = materialPdf * PowerHeuristic(lightPdf, materialPdf) * transmittance / lightPdf;
+	Vec eCol;
+	vmul(eCol, *throughput, obj->matte.c);
+	vmul(eCol, eCol, light->e);
+	vsmul(eCol, k, eCol);
+	vadd(*rad, *rad, eCol);
+}
+
+// The weight of the light emitted by a sphere hit by a ray sampled at
+// rayOrigin with a pdf of lastMaterialPdf: the MIS weight if DirectLight()
+// was used at rayOrigin (lastMaterialPdf isn't 0), 1 otherwise
+float EmissionWeight(__global const Sphere *light, const float lightsPower,
+		const Vec *rayOrigin, const float lastMaterialPdf) {
+	if (lastMaterialPdf == 0.f)
+		return 1.f;
+
+	return PowerHeuristic(lastMaterialPdf, LightPdf(light, lightsPower, rayOrigin));
+}
+
+// Shades a hit of a not emissive sphere: adds the direct light (MATTE and
+// GLOSSY hits only) and samples the next ray of the path. Returns false if
+// the path ends there.
+bool ShadeHit(
+	__global const Sphere *spheres,
+	__global const BVHNode *bvhNodes,
+	__global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
+	__global const Sphere *obj,
+	const Vec *hitPoint,
+	const Vec *normal,
+	Ray *currentRay,
+	Vec *throughput,
+	Vec *rad,
+	float *currentSigmaS, float *currentSigmaA,
+	float *lastMaterialPdf,
+	Sampler *sampler) {
+	const Vec wi = currentRay->d;
+	Vec shadeNormal;
+	vsmul(shadeNormal, (vdot(*normal, wi) < 0.f) ? 1.f : -1.f, *normal);
+
+	const bool nextEvent = (lightCount > 0) && ((obj->matType == MATTE) || (obj->matType == GLOSSY));
+	if (nextEvent) {
+		SamplerSetOffset(sampler, SAMPLER_LIGHT_OFFSET);
+		DirectLight(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+				obj, hitPoint, &wi, &shadeNormal, throughput,
+				*currentSigmaS, *currentSigmaS + *currentSigmaA, rad, sampler);
+	}
+
+	SamplerSetOffset(sampler, SAMPLER_MATERIAL_OFFSET);
+	if (!SampleMaterial(obj, hitPoint, normal, currentRay, throughput,
+			currentSigmaS, currentSigmaA, sampler))
+		return false;
+
+	*lastMaterialPdf = nextEvent ? MaterialPdf(obj, &wi, &shadeNormal, &currentRay->d) : 0.f;
+	return true;
+}
+
+// Traces one segment of the path and adds the emitted light it hits.
+// Returns false if the path ends there.
+bool PathBounce(
+	__global const Sphere *spheres,
+	__global const BVHNode *bvhNodes,
+	__global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
+	Ray *currentRay,
+	Vec *throughput,
+	Vec *rad,
+	float *currentSigmaS, float *currentSigmaA,
+	float *lastMaterialPdf,
+	Sampler *sampler) {
+	const float currentSigmaT = *currentSigmaS + *currentSigmaA;
+
+	float t; /* distance to intersection */
+	unsigned int id = 0; /* id of intersected object */
+	const bool hit = Intersect(spheres, bvhNodes, bvhSphereIndices, currentRay, &t, &id);
+
+	SamplerSetOffset(sampler, SAMPLER_VOLUME_OFFSET);
+	if ((*currentSigmaS > 0.f) && ScatterVolume(currentRay, hit ? t : 999.f, throughput,
+			*currentSigmaS, currentSigmaT, sampler)) {
+		*lastMaterialPdf = 0.f;
+		return true;
+	}
+
+	if (!hit)
+		return false; /* if miss, return */
+
+	// Absorption
+	const float absorption = exp(-currentSigmaT * t);
+	vsmul(*throughput, absorption, *throughput);
+
+	__global const Sphere *obj = &spheres[id]; /* the hit object */
+
+	Vec hitPoint;
+	vsmul(hitPoint, t, currentRay->d);
+	vadd(hitPoint, currentRay->o, hitPoint);
+
+	Vec normal;
+	vsub(normal, hitPoint, obj->p);
+	vnorm(normal);
+
+	/* Add emitted light */
+	Vec eCol; vassign(eCol, obj->e);
+	if (!viszero(eCol)) {
+		vmul(eCol, *throughput, eCol);
+		vsmul(eCol, EmissionWeight(obj, lightsPower, &currentRay->o, *lastMaterialPdf), eCol);
+		vadd(*rad, *rad, eCol);
+
+		return false;
+	}
+
+	return ShadeHit(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+			obj, &hitPoint, &normal, currentRay, throughput, rad,
+			currentSigmaS, currentSigmaA, lastMaterialPdf, sampler);
+}
+
+void Radiance(
+	__global const Sphere *spheres,
+	__global const BVHNode *bvhNodes,
+	__global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
+	const Ray *startRay,
+	Sampler *sampler,
+	Vec *result) {
+	float currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+	float currentSigmaA = PARAM_DEFAULT_SIGMA_A;
+	float lastMaterialPdf = 0.f;
+
+	Ray currentRay; rassign(currentRay, *startRay);
+	Vec rad; vinit(rad, 0.f, 0.f, 0.f);
+
+	Vec throughput; vinit(throughput, 1.f, 1.f, 1.f);
+
+	// Removed Russian Roulette in order to improve execution on SIMT (see
+	// SmallPTGPUPersistent)
+	for (unsigned int depth = 0; depth <= PARAM_MAX_DEPTH; ++depth) {
+		SamplerStartBounce(sampler, depth);
+		if (!PathBounce(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+				&currentRay, &throughput, &rad, &currentSigmaS, &currentSigmaA, &lastMaterialPdf,
+				sampler))
+			break;
+	}
+
+	*result = rad;
+}
+
+#endif
+
 void GenerateCameraRay(__global const Camera *camera,
-		unsigned int *seed0, unsigned int *seed1,
+		Sampler *sampler,
 		const int width, const int height, const int x, const int y, Ray *ray) {
 	const float invWidth = 1.f / width;
 	const float invHeight = 1.f / height;
-	const float r1 = GetRandom(seed0, seed1) - .5f;
-	const float r2 = GetRandom(seed0, seed1) - .5f;
+	const float r1 = GetRandom(sampler) - .5f;
+	const float r2 = GetRandom(sampler) - .5f;
 	const float kcx = (x + r1) * invWidth - .5f;
 	const float kcy = (y + r2) * invHeight - .5f;
 
@@ -467,9 +886,11 @@ void GenerateCameraRay(__global const Camera *camera,
 }
 
 __kernel void SmallPTGPU(
-    __global Vec *samples, __global unsigned int *seedsInput,
+    __global Vec *samples, const unsigned int seed,
 	__global const Camera *camera,
-	const unsigned int sphereCount, __global const Sphere *sphere,
+	__global const Sphere *sphere,
+	__global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
 	const unsigned int width, const unsigned int height,
 	const unsigned int currentSample) {
 	const int gid = get_global_id(0);
@@ -480,15 +901,15 @@ __kernel void SmallPTGPU(
 	const int scrX = gid % width;
 	const int scrY = gid / width;
 
-	/* LordCRC: move seed to local store */
-	unsigned int seed0 = seedsInput[2 * gid];
-	unsigned int seed1 = seedsInput[2 * gid + 1];
+	Sampler sampler;
+	InitSampler(&sampler, seed, gid, width * height, currentSample);
 
 	Ray ray;
-	GenerateCameraRay(camera, &seed0, &seed1, width, height, scrX, scrY, &ray);
+	GenerateCameraRay(camera, &sampler, width, height, scrX, scrY, &ray);
 
 	Vec r;
-	Radiance(sphere, sphereCount, &ray, &seed0, &seed1, &r);
+	Radiance(sphere, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+			&ray, &sampler, &r);
 
 	__global Vec *sample = &samples[gid];
 	if (currentSample == 0)
@@ -500,9 +921,6 @@ __kernel void SmallPTGPU(
 		sample->y = (sample->y * k1  + r.y) * k2;
 		sample->z = (sample->z * k1  + r.z) * k2;
 	}
-
-	seedsInput[2 * gid] = seed0;
-	seedsInput[2 * gid + 1] = seed1;
 }
 
 #define toColor(x) (pow(clamp(x, 0.f, 1.f), 1.f / 2.2f))
@@ -522,6 +940,45 @@ __kernel void ToneMapping(
 	pixel->z = toColor(sample->z);
 }
 
+// Adds the samples of a device to the merged samples of all devices (used
+// only when the devices share the same context)
+__kernel void MergeSamples(
+	__global Vec *samples, __global Vec *mergedSamples,
+	const unsigned int width, const unsigned int height, const int first,
+	const float weight) {
+	const int gid = get_global_id(0);
+	// Check if we have to do something
+	if (gid >= width * height)
+		return;
+
+	__global Vec *sample = &samples[gid];
+	__global Vec *mergedSample = &mergedSamples[gid];
+	if (first) {
+		mergedSample->x = weight * sample->x;
+		mergedSample->y = weight * sample->y;
+		mergedSample->z = weight * sample->z;
+	} else {
+		mergedSample->x += weight * sample->x;
+		mergedSample->y += weight * sample->y;
+		mergedSample->z += weight * sample->z;
+	}
+}
+
+__kernel void MergeToneMapping(
+	__global Vec *mergedSamples, __global Vec *pixels,
+	const unsigned int width, const unsigned int height, const float scale) {
+	const int gid = get_global_id(0);
+	// Check if we have to do something
+	if (gid >= width * height)
+		return;
+
+	__global Vec *sample = &mergedSamples[gid];
+	__global Vec *pixel = &pixels[gid];
+	pixel->x = toColor(scale * sample->x);
+	pixel->y = toColor(scale * sample->y);
+	pixel->z = toColor(scale * sample->z);
+}
+
 __kernel void WebCLToneMapping(
 	__global Vec *samples, __global int *pixels,
 	const unsigned int width, const unsigned int height) {
@@ -543,3 +1000,340 @@ __kernel void WebCLToneMapping(
 	const int ub = (int)(b * 255.f + .5f);
 	*pixel = ur | (ug << 8) | (ub << 16) | (0xff << 24);
 }
+
+#if !defined(PARAM_PREVIEW)
+
+// The depth where SmallPTGPUPersistent starts the Russian roulette
+#define PERSISTENT_RR_DEPTH 3
+
+// A variant of the SmallPTGPU kernel with persistent threads: only enough work
+// items to fill the device are run and each one starts the path of the next
+// pixel (taken from an atomic counter) as soon as its path ends, so no work
+// item is idle while the others are still tracing their paths. The paths are
+// terminated by Russian roulette too.
+//
+// The run uses the counter workCounterIndex and clears the other one for the
+// next run.
+__kernel void SmallPTGPUPersistent(
+    __global Vec *samples, const unsigned int seed,
+	__global const Camera *camera,
+	__global const Sphere *sphere,
+	__global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
+	const unsigned int width, const unsigned int height,
+	const unsigned int currentSample,
+	__global unsigned int *workCounters, const unsigned int workCounterIndex) {
+	if (get_global_id(0) == 0)
+		workCounters[1 - workCounterIndex] = 0;
+
+	const unsigned int pixelCount = width * height;
+	__global unsigned int *workCounter = &workCounters[workCounterIndex];
+
+	unsigned int pixel = atomic_inc(workCounter);
+	if (pixel >= pixelCount)
+		return;
+
+	Sampler sampler;
+	Ray currentRay;
+	Vec throughput, rad;
+	float currentSigmaS, currentSigmaA, lastMaterialPdf;
+	unsigned int depth;
+	bool newPath = true;
+	for (;;) {
+		if (newPath) {
+			InitSampler(&sampler, seed, pixel, pixelCount, currentSample);
+			GenerateCameraRay(camera, &sampler, width, height, pixel % width, pixel / width, &currentRay);
+			vinit(throughput, 1.f, 1.f, 1.f);
+			vclr(rad);
+			currentSigmaS = PARAM_DEFAULT_SIGMA_S;
+			currentSigmaA = PARAM_DEFAULT_SIGMA_A;
+			lastMaterialPdf = 0.f;
+			depth = 0;
+			newPath = false;
+		}
+
+		SamplerStartBounce(&sampler, depth);
+		bool pathEnd = !PathBounce(sphere, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+				&currentRay, &throughput, &rad, &currentSigmaS, &currentSigmaA, &lastMaterialPdf,
+				&sampler);
+		++depth;
+
+		if (!pathEnd && (depth >= PERSISTENT_RR_DEPTH)) {
+			// Russian roulette
+			SamplerSetOffset(&sampler, SAMPLER_RR_OFFSET);
+			const float p = fmin(fmax(throughput.x, fmax(throughput.y, throughput.z)), 1.f);
+			if (GetRandom(&sampler) < p) {
+				vsmul(throughput, 1.f / p, throughput);
+			} else
+				pathEnd = true;
+		}
+
+		if (pathEnd || (depth > PARAM_MAX_DEPTH)) {
+			__global Vec *sample = &samples[pixel];
+			if (currentSample == 0)
+				*sample = rad;
+			else {
+				const float k1 = currentSample;
+				const float k2 = 1.f / (currentSample + 1.f);
+				sample->x = (sample->x * k1  + rad.x) * k2;
+				sample->y = (sample->y * k1  + rad.y) * k2;
+				sample->z = (sample->z * k1  + rad.z) * k2;
+			}
+
+			// Start the path of the next pixel
+			pixel = atomic_inc(workCounter);
+			if (pixel >= pixelCount)
+				return;
+			newPath = true;
+		}
+	}
+}
+
+//------------------------------------------------------------------------------
+// Wavefront path tracing: the SmallPTGPU kernel split in stages. The state of
+// the path of each pixel is stored in arrays indexed by the pixel. The stages
+// process queues of the indices of the paths, compacted with atomic counters:
+// two ray queues (one is read while the other is written) and one queue for
+// each material, so all work items of a shade kernel run the same code.
+//------------------------------------------------------------------------------
+
+// The counters of queueCounters
+#define RAY_QUEUE_COUNTER(q) (q)
+#define MATERIAL_QUEUE_COUNTER(m) (2 + (m))
+
+__kernel void WavefrontGenerate(
+	const unsigned int seed,
+	__global const Camera *camera,
+	const unsigned int width, const unsigned int height,
+	__global Vec *pathOrigins, __global Vec *pathDirections,
+	__global Vec *pathThroughputs, __global Vec *pathRadiances,
+	__global float *pathSigmas, __global float *pathMaterialPdfs,
+	__global unsigned int *rayQueues, __global unsigned int *queueCounters,
+	const unsigned int currentSample) {
+	const int gid = get_global_id(0);
+	// Check if we have to do something
+	if (gid >= width * height)
+		return;
+
+	// All paths start in the ray queue 0
+	if (gid == 0)
+		queueCounters[RAY_QUEUE_COUNTER(0)] = width * height;
+
+	const int scrX = gid % width;
+	const int scrY = gid / width;
+
+	Sampler sampler;
+	InitSampler(&sampler, seed, gid, width * height, currentSample);
+
+	Ray ray;
+	GenerateCameraRay(camera, &sampler, width, height, scrX, scrY, &ray);
+
+	pathOrigins[gid] = ray.o;
+	pathDirections[gid] = ray.d;
+	vinit(pathThroughputs[gid], 1.f, 1.f, 1.f);
+	vclr(pathRadiances[gid]);
+	pathSigmas[2 * gid] = PARAM_DEFAULT_SIGMA_S;
+	pathSigmas[2 * gid + 1] = PARAM_DEFAULT_SIGMA_A;
+	pathMaterialPdfs[gid] = 0.f;
+	rayQueues[gid] = gid;
+}
+
+// Empties the queues written by the next WavefrontIntersect
+__kernel void WavefrontResetQueues(
+	__global unsigned int *queueCounters, const unsigned int outputQueue) {
+	if (get_global_id(0) == 0) {
+		queueCounters[RAY_QUEUE_COUNTER(outputQueue)] = 0;
+		for (unsigned int i = 0; i < MATERIAL_COUNT; ++i)
+			queueCounters[MATERIAL_QUEUE_COUNTER(i)] = 0;
+	}
+}
+
+// Traces the rays of the input queue: the paths scattered by the volume go
+// back in the output ray queue, the paths hitting a not emissive sphere go in
+// the queue of its material and the others end
+__kernel void WavefrontIntersect(
+	const unsigned int seed,
+	__global const Sphere *spheres,
+	__global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+	const float lightsPower,
+	const unsigned int width, const unsigned int height,
+	__global Vec *pathOrigins, __global Vec *pathDirections,
+	__global Vec *pathThroughputs, __global Vec *pathRadiances,
+	__global float *pathSigmas, __global float *pathMaterialPdfs,
+	__global float *pathHitDistances, __global unsigned int *pathHitSpheres,
+	__global unsigned int *rayQueues, __global unsigned int *materialQueues,
+	__global unsigned int *queueCounters, const unsigned int inputQueue,
+	const unsigned int currentSample, const unsigned int depth) {
+	const int gid = get_global_id(0);
+	// Check if we have to do something
+	if (gid >= queueCounters[RAY_QUEUE_COUNTER(inputQueue)])
+		return;
+
+	const unsigned int pathCount = width * height;
+	const unsigned int outputQueue = 1 - inputQueue;
+	const unsigned int pathIndex = rayQueues[inputQueue * pathCount + gid];
+
+	Sampler sampler;
+	InitSampler(&sampler, seed, pathIndex, pathCount, currentSample);
+	SamplerStartBounce(&sampler, depth);
+	SamplerSetOffset(&sampler, SAMPLER_VOLUME_OFFSET);
+
+	Ray currentRay;
+	rinit(currentRay, pathOrigins[pathIndex], pathDirections[pathIndex]);
+	Vec throughput = pathThroughputs[pathIndex];
+	const float currentSigmaS = pathSigmas[2 * pathIndex];
+	const float currentSigmaT = currentSigmaS + pathSigmas[2 * pathIndex + 1];
+
+	float t; /* distance to intersection */
+	unsigned int id = 0; /* id of intersected object */
+	const bool hit = Intersect(spheres, bvhNodes, bvhSphereIndices, &currentRay, &t, &id);
+
+	if ((currentSigmaS > 0.f) && ScatterVolume(&currentRay, hit ? t : 999.f, &throughput,
+			currentSigmaS, currentSigmaT, &sampler)) {
+		pathOrigins[pathIndex] = currentRay.o;
+		pathDirections[pathIndex] = currentRay.d;
+		pathThroughputs[pathIndex] = throughput;
+		pathMaterialPdfs[pathIndex] = 0.f;
+
+		rayQueues[outputQueue * pathCount + atomic_inc(&queueCounters[RAY_QUEUE_COUNTER(outputQueue)])] = pathIndex;
+	} else if (hit) {
+		// Absorption
+		const float absorption = exp(-currentSigmaT * t);
+		vsmul(throughput, absorption, throughput);
+
+		__global const Sphere *obj = &spheres[id]; /* the hit object */
+
+		/* Add emitted light */
+		Vec eCol; vassign(eCol, obj->e);
+		if (!viszero(eCol)) {
+			vmul(eCol, throughput, eCol);
+			vsmul(eCol, EmissionWeight(obj, lightsPower, &currentRay.o, pathMaterialPdfs[pathIndex]), eCol);
+			vadd(pathRadiances[pathIndex], pathRadiances[pathIndex], eCol);
+		} else if (obj->matType < MATERIAL_COUNT) {
+			pathThroughputs[pathIndex] = throughput;
+			pathHitDistances[pathIndex] = t;
+			pathHitSpheres[pathIndex] = id;
+
+			materialQueues[obj->matType * pathCount + atomic_inc(&queueCounters[MATERIAL_QUEUE_COUNTER(obj->matType)])] = pathIndex;
+		}
+	}
+}
+
+// Samples the next ray of the paths in the queue of a material and puts the
+// paths going on in the output ray queue
+void WavefrontShade(
+	const MaterialType matType,
+	const unsigned int seed,
+	__global const Sphere *spheres,
+	__global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices,
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower,
+	const unsigned int width, const unsigned int height,
+	__global Vec *pathOrigins, __global Vec *pathDirections,
+	__global Vec *pathThroughputs, __global Vec *pathRadiances,
+	__global float *pathSigmas, __global float *pathMaterialPdfs,
+	__global const float *pathHitDistances, __global const unsigned int *pathHitSpheres,
+	__global unsigned int *rayQueues, __global const unsigned int *materialQueues,
+	__global unsigned int *queueCounters, const unsigned int outputQueue,
+	const unsigned int currentSample, const unsigned int depth) {
+	const int gid = get_global_id(0);
+	// Check if we have to do something
+	if (gid >= queueCounters[MATERIAL_QUEUE_COUNTER(matType)])
+		return;
+
+	const unsigned int pathCount = width * height;
+	const unsigned int pathIndex = materialQueues[matType * pathCount + gid];
+
+	Sampler sampler;
+	InitSampler(&sampler, seed, pathIndex, pathCount, currentSample);
+	SamplerStartBounce(&sampler, depth);
+
+	Ray currentRay;
+	rinit(currentRay, pathOrigins[pathIndex], pathDirections[pathIndex]);
+	Vec throughput = pathThroughputs[pathIndex];
+	Vec rad = pathRadiances[pathIndex];
+	float currentSigmaS = pathSigmas[2 * pathIndex];
+	float currentSigmaA = pathSigmas[2 * pathIndex + 1];
+	float lastMaterialPdf = 0.f;
+
+	__global const Sphere *obj = &spheres[pathHitSpheres[pathIndex]]; /* the hit object */
+
+	Vec hitPoint;
+	vsmul(hitPoint, pathHitDistances[pathIndex], currentRay.d);
+	vadd(hitPoint, currentRay.o, hitPoint);
+
+	Vec normal;
+	vsub(normal, hitPoint, obj->p);
+	vnorm(normal);
+
+	const bool pathContinues = ShadeHit(spheres, bvhNodes, bvhSphereIndices, lights, lightCount, lightsPower,
+			obj, &hitPoint, &normal, &currentRay, &throughput, &rad,
+			&currentSigmaS, &currentSigmaA, &lastMaterialPdf, &sampler);
+	pathRadiances[pathIndex] = rad;
+
+	if (pathContinues) {
+		pathOrigins[pathIndex] = currentRay.o;
+		pathDirections[pathIndex] = currentRay.d;
+		pathThroughputs[pathIndex] = throughput;
+		pathSigmas[2 * pathIndex] = currentSigmaS;
+		pathSigmas[2 * pathIndex + 1] = currentSigmaA;
+		pathMaterialPdfs[pathIndex] = lastMaterialPdf;
+
+		rayQueues[outputQueue * pathCount + atomic_inc(&queueCounters[RAY_QUEUE_COUNTER(outputQueue)])] = pathIndex;
+	}
+}
+
+// One shade kernel for each material (the material is a constant so each
+// kernel is compiled only with the code of its material)
+#define WAVEFRONT_SHADE_KERNEL(name, matType) \
+__kernel void name( \
+	const unsigned int seed, \
+	__global const Sphere *spheres, \
+	__global const BVHNode *bvhNodes, __global const unsigned int *bvhSphereIndices, \
+	__global const Light *lights, const unsigned int lightCount, const float lightsPower, \
+	const unsigned int width, const unsigned int height, \
+	__global Vec *pathOrigins, __global Vec *pathDirections, \
+	__global Vec *pathThroughputs, __global Vec *pathRadiances, \
+	__global float *pathSigmas, __global float *pathMaterialPdfs, \
+	__global const float *pathHitDistances, __global const unsigned int *pathHitSpheres, \
+	__global unsigned int *rayQueues, __global const unsigned int *materialQueues, \
+	__global unsigned int *queueCounters, const unsigned int outputQueue, \
+	const unsigned int currentSample, const unsigned int depth) { \
+	WavefrontShade(matType, seed, spheres, bvhNodes, bvhSphereIndices, \
+			lights, lightCount, lightsPower, width, height, \
+			pathOrigins, pathDirections, pathThroughputs, pathRadiances, \
+			pathSigmas, pathMaterialPdfs, \
+			pathHitDistances, pathHitSpheres, rayQueues, materialQueues, \
+			queueCounters, outputQueue, currentSample, depth); \
+}
+
+WAVEFRONT_SHADE_KERNEL(WavefrontShadeMatte, MATTE)
+WAVEFRONT_SHADE_KERNEL(WavefrontShadeMirror, MIRROR)
+WAVEFRONT_SHADE_KERNEL(WavefrontShadeGlass, GLASS)
+WAVEFRONT_SHADE_KERNEL(WavefrontShadeMatteTranslucent, MATTETRANSLUCENT)
+WAVEFRONT_SHADE_KERNEL(WavefrontShadeGlossy, GLOSSY)
+WAVEFRONT_SHADE_KERNEL(WavefrontShadeGlossyTranslucent, GLOSSYTRANSLUCENT)
+
+// Adds the radiance of the paths to the samples, like the SmallPTGPU kernel
+__kernel void WavefrontAccumulate(
+	__global Vec *samples, __global const Vec *pathRadiances,
+	const unsigned int width, const unsigned int height,
+	const unsigned int currentSample) {
+	const int gid = get_global_id(0);
+	// Check if we have to do something
+	if (gid >= width * height)
+		return;
+
+	const Vec r = pathRadiances[gid];
+	__global Vec *sample = &samples[gid];
+	if (currentSample == 0)
+		*sample = r;
+	else {
+		const float k1 = currentSample;
+		const float k2 = 1.f / (currentSample + 1.f);
+		sample->x = (sample->x * k1  + r.x) * k2;
+		sample->y = (sample->y * k1  + r.y) * k2;
+		sample->z = (sample->z * k1  + r.z) * k2;
+	}
+}
+
+#endif
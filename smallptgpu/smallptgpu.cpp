@@ -27,6 +27,7 @@
 #include "ocltoy.h"
 #include "camera.h"
 #include "geom.h"
+#include "spherebvh.h"
 
 #include <cmath>
 #include <iostream>
@@ -38,24 +39,91 @@
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 #define GAMMA_TABLE_SIZE 1024
 
+// The kernels rendering the samples: the SmallPTGPU kernel, the wavefront
+// pipeline or the SmallPTGPUPersistent kernel
+typedef enum {
+	MEGAKERNEL_RENDERING, WAVEFRONT_RENDERING, PERSISTENT_RENDERING
+} RenderingMode;
+
+#define RENDERING_MODE_COUNT 3
+
+static const char *renderingModeNames[RENDERING_MODE_COUNT] = {
+	"SmallPTGPU kernel",
+	"wavefront pipeline",
+	"SmallPTGPUPersistent kernel"
+};
+
+// The number of work groups of SmallPTGPUPersistent run on each compute unit
+#define PERSISTENT_GROUPS_PER_UNIT 8
+
+// The names of the shade kernels of the wavefront pipeline, in MaterialType order
+static const char *wavefrontShadeKernelNames[MATERIAL_COUNT] = {
+	"WavefrontShadeMatte",
+	"WavefrontShadeMirror",
+	"WavefrontShadeGlass",
+	"WavefrontShadeMatteTranslucent",
+	"WavefrontShadeGlossy",
+	"WavefrontShadeGlossyTranslucent"
+};
+
+// The path states, the path queues and the kernels of the wavefront pipeline
+// of a device (see the Wavefront kernels in rendering_kernel.cl). The buffers
+// are allocated only while the pipeline is in use.
+class WavefrontPipeline {
+public:
+	WavefrontPipeline() : pathOriginsBuff(NULL), pathDirectionsBuff(NULL),
+		pathThroughputsBuff(NULL), pathRadiancesBuff(NULL), pathSigmasBuff(NULL),
+		pathMaterialPdfsBuff(NULL), pathHitDistancesBuff(NULL), pathHitSpheresBuff(NULL), rayQueuesBuff(NULL),
+		materialQueuesBuff(NULL), queueCountersBuff(NULL), kernelGenerate(NULL),
+		kernelResetQueues(NULL), kernelIntersect(NULL), kernelAccumulate(NULL),
+		maxWorkGroupSize(0) {
+		for (unsigned int i = 0; i < MATERIAL_COUNT; ++i)
+			kernelsShade[i] = NULL;
+	}
+
+	cl::Buffer *pathOriginsBuff;
+	cl::Buffer *pathDirectionsBuff;
+	cl::Buffer *pathThroughputsBuff;
+	cl::Buffer *pathRadiancesBuff;
+	cl::Buffer *pathSigmasBuff;
+	cl::Buffer *pathMaterialPdfsBuff;
+	cl::Buffer *pathHitDistancesBuff;
+	cl::Buffer *pathHitSpheresBuff;
+	cl::Buffer *rayQueuesBuff;
+	cl::Buffer *materialQueuesBuff;
+	cl::Buffer *queueCountersBuff;
+
+	cl::Kernel *kernelGenerate;
+	cl::Kernel *kernelResetQueues;
+	cl::Kernel *kernelIntersect;
+	cl::Kernel *kernelsShade[MATERIAL_COUNT];
+	cl::Kernel *kernelAccumulate;
+	// The smallest CL_KERNEL_WORK_GROUP_SIZE of the kernels
+	size_t maxWorkGroupSize;
+};
+
 class SmallPTGPU : public OCLToy {
 public:
 	SmallPTGPU() : OCLToy("SmallPTGPU v" OCLTOYS_VERSION_MAJOR "." OCLTOYS_VERSION_MINOR " (OCLToys: http://code.google.com/p/ocltoys)") {
 		millisTimerFunc = 100;
 		kernelToneMapping = NULL;
 		mergedPixels = NULL;
+		deviceMerge = false;
+		mergeSamplesBuff = NULL;
+		mergePixelsBuff = NULL;
+		renderingMode = MEGAKERNEL_RENDERING;
 
 		currentSphere = 0;
 		maxDepth = 6;
 		defaultVolumeSigmaS = 0.f;
 		defaultVolumeSigmaA = 0.f;
+		lightsPower = 0.f;
 
-		pixelsBuff = NULL;
-		
 		const float gamma = 2.2f;
 		float x = 0.f;
 		const float dx = 1.f / GAMMA_TABLE_SIZE;
@@ -65,9 +133,19 @@ public:
 
 	virtual ~SmallPTGPU() {
 		FreeBuffers();
-		
+
+		for (unsigned int i = 0; i < programBuilds.size(); ++i)
+			delete programBuilds[i];
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i)
 			delete kernelsSmallPT[i];
+		for (unsigned int i = 0; i < wavefronts.size(); ++i)
+			DeleteWavefrontKernels(i);
+		for (unsigned int i = 0; i < kernelsPersistent.size(); ++i)
+			delete kernelsPersistent[i];
+		for (unsigned int i = 0; i < kernelsMergeSamples.size(); ++i) {
+			delete kernelsMergeSamples[i];
+			delete kernelsMergeToneMapping[i];
+		}
 		delete kernelToneMapping;
 	}
 
@@ -78,6 +156,12 @@ protected:
 		opts.add_options()
 			("kernel,k", boost::program_options::value<std::string>()->default_value("preprocessed_rendering_kernel.cl"),
 				"OpenCL kernel file name")
+			("previewkernel", boost::program_options::value<std::string>()->default_value("preprocessed_preview_rendering_kernel.cl"),
+				"OpenCL kernel file name of the preview rendered while the kernel is compiling")
+			("nopreview", "Don't render the preview while the kernel is compiling")
+			("wavefront", "Render with the wavefront pipeline instead of the SmallPTGPU kernel (the m key switches the rendering mode)")
+			("persistent", "Render with the persistent threads kernel instead of the SmallPTGPU kernel (the m key switches the rendering mode)")
+			("sobol", "Use Owen scrambled Sobol samples for the camera and the first bounce")
 			("scene,n", boost::program_options::value<std::string>()->default_value("scenes/cornell.scn"),
 				"Filename of the scene to render")
 			("workgroupsize,z", boost::program_options::value<size_t>(), "OpenCL workgroup size");
@@ -87,17 +171,56 @@ protected:
 
 	virtual int RunToy() {
 		samplesBuff.resize(selectedDevices.size(), NULL);
-		seedsBuff.resize(selectedDevices.size(), NULL);
 		cameraBuff.resize(selectedDevices.size(), NULL);
 		spheresBuff.resize(selectedDevices.size(), NULL);
+		bvhNodesBuff.resize(selectedDevices.size(), NULL);
+		bvhIndicesBuff.resize(selectedDevices.size(), NULL);
+		lightsBuff.resize(selectedDevices.size(), NULL);
 
 		pixels.resize(selectedDevices.size(), NULL);
+		pixelsSamples.resize(selectedDevices.size(), 0);
+		for (unsigned int i = 0; i < 2; ++i) {
+			readbackBuff[i].resize(selectedDevices.size(), NULL);
+			readbackPixels[i].resize(selectedDevices.size(), NULL);
+			readbackStaging[i].resize(selectedDevices.size(), NULL);
+			readbackSamples[i].resize(selectedDevices.size(), 0);
+		}
+		readbackEvents.resize(selectedDevices.size());
+		failedDevices.resize(selectedDevices.size(), 0);
+
+		// With a context shared by all devices, the frames are merged on a
+		// device instead of being read back and merged by the host
+		deviceMerge = (selectedDevices.size() > 1);
+		for (unsigned int i = 1; i < selectedDevices.size(); ++i)
+			deviceMerge = deviceMerge && IsContextShared(0, i);
+		if (deviceMerge) {
+			OCLTOY_LOG("Merging the frames of the devices on the device");
+			kernelsMergeSamples.resize(selectedDevices.size(), NULL);
+			kernelsMergeToneMapping.resize(selectedDevices.size(), NULL);
+			snapshotSlots.resize(selectedDevices.size(), -1);
+			snapshotEvents.resize(selectedDevices.size());
+			for (unsigned int i = 0; i < 2; ++i)
+				mergeEvents[i].resize(selectedDevices.size());
+		}
 		sampleSec.resize(selectedDevices.size(), 0.0);
 		currentSample.resize(selectedDevices.size(), 0);
+		wavefronts.resize(selectedDevices.size());
+		kernelsPersistent.resize(selectedDevices.size(), NULL);
+		persistentMaxWorkGroupSize.resize(selectedDevices.size(), 0);
+		workCountersBuff.resize(selectedDevices.size(), NULL);
+		persistentRuns.resize(selectedDevices.size(), 0);
+		if (commandLineOpts.count("wavefront") && commandLineOpts.count("persistent"))
+			throw std::runtime_error("The --wavefront and --persistent options can't be used together");
+		else if (commandLineOpts.count("wavefront"))
+			renderingMode = WAVEFRONT_RENDERING;
+		else if (commandLineOpts.count("persistent"))
+			renderingMode = PERSISTENT_RENDERING;
 
 		ReadScene(commandLineOpts["scene"].as<std::string>());
 
 		SetUpOpenCL();
+		if (headless)
+			return RunHeadless();
 		StartRendering();
 
 		glutMainLoop();
@@ -114,19 +237,7 @@ protected:
 		if (selectedDevices.size() == 1)
 			glDrawPixels(windowWidth, windowHeight, GL_RGB, GL_FLOAT, pixels[0]);
 		else {
-			// Multiple devices, I have to merge the results and to apply tone mapping
-			const unsigned count = windowWidth * windowHeight * 3;
-			std::copy(pixels[0], pixels[0] + count, mergedPixels);
-
-			for (unsigned int i = 1; i < selectedDevices.size(); ++i) {
-				for (unsigned int j = 0; j < count; ++j)
-					mergedPixels[j] += pixels[i][j];
-			}
-
-			const float scale = 1.f / selectedDevices.size();
-			for (unsigned int i = 0; i < count; ++i)
-				mergedPixels[i] = Radiance2PixelFloat(scale * mergedPixels[i]);
-
+			MergePixels();
 			glDrawPixels(windowWidth, windowHeight, GL_RGB, GL_FLOAT, mergedPixels);
 		}
 
@@ -151,8 +262,9 @@ protected:
 			globalPass += currentSample[i] + 1;
 		}
 		
-		const std::string captionString = boost::str(boost::format("[Pass %d][%.1fM Sample/sec]") %
-				globalPass % (globalSampleSec / 1000000.0));
+		static const char *modeCaptions[RENDERING_MODE_COUNT] = { "", "[Wavefront]", "[Persistent]" };
+		const std::string captionString = boost::str(boost::format("[Pass %d][%.1fM Sample/sec]%s") %
+				globalPass % (globalSampleSec / 1000000.0) % modeCaptions[renderingMode]);
 
 		glColor3f(1.f, 1.f, 1.f);
 		glRasterPos2i(4, 5);
@@ -205,40 +317,15 @@ protected:
 		bool needRedisplay = true;
 
 		switch (key) {
-			case 'p': {
-				// Write image to PPM file
-				std::ofstream f("image.ppm", std::ofstream::trunc);
-				if (!f.good()) {
-					OCLTOY_LOG("Failed to open image file: image.ppm");
-				} else {
-					f << "P3" << std::endl;
-					f << windowWidth << " " << windowHeight << std::endl;
-					f << "255" << std::endl;
-
-					const float *img = (selectedDevices.size() == 1) ? pixels[0] : mergedPixels;
-					for (int y = (int)windowHeight - 1; y >= 0; --y) {
-						const float *p = &img[y * windowWidth * 3];
-						for (int x = 0; x < (int)windowWidth; ++x) {
-							const float rv = std::min(std::max(*p++, 0.f), 1.f);
-							const std::string r = boost::lexical_cast<std::string>((int)(rv * 255.f + .5f));
-							const float gv = std::min(std::max(*p++, 0.f), 1.f);
-							const std::string g = boost::lexical_cast<std::string>((int)(gv * 255.f + .5f));
-							const float bv = std::min(std::max(*p++, 0.f), 1.f);
-							const std::string b = boost::lexical_cast<std::string>((int)(bv * 255.f + .5f));
-							f << r << " " << g << " " << b << std::endl;
-						}
-					}
-				}
-				f.close();
-				OCLTOY_LOG("Saved framebuffer in image.ppm");
-
+			case 'p':
+				SaveImage("image.ppm");
 				needRedisplay = false;
 				break;
-			}
 			case 27: // Escape key
 			case 'q':
 			case 'Q':
 				StopRendering();
+				Done();
 				OCLTOY_LOG("Done");
 
 				exit(EXIT_SUCCESS);
@@ -250,6 +337,11 @@ protected:
 			case 'h':
 				printHelp = (!printHelp);
 				break;
+			case 'm': // Switch to the next rendering mode
+				StopRendering();
+				SetRenderingMode((RenderingMode)((renderingMode + 1) % RENDERING_MODE_COUNT));
+				StartRendering();
+				break;
 			case 'a': {
 				Vec dir = camera.x;
 				vnorm(dir);
@@ -437,6 +529,110 @@ protected:
 		glutTimerFunc(millisTimerFunc, &OCLToy::GlutTimerFunc, 0);
 	}
 
+	//--------------------------------------------------------------------------
+	// Headless mode related code
+	//--------------------------------------------------------------------------
+
+	virtual double HeadlessPass() {
+		// Start to render on each device as soon as its kernels are compiled
+		unsigned int renderingDeviceCount;
+		for (;;) {
+			renderingDeviceCount = 0;
+			for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+				SwapCompiledKernels(i, false);
+				if (kernelsSmallPT[i])
+					++renderingDeviceCount;
+			}
+
+			if (renderingDeviceCount > 0)
+				break;
+			boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+		}
+
+		// The devices too slow to be worth it are left idle
+		renderingDeviceCount = 0;
+		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+			if (kernelsSmallPT[i] && (GetDeviceWeight(i) > 0.0)) {
+				EnqueueKernels(i, 1);
+				++renderingDeviceCount;
+			}
+		}
+		for (unsigned int i = 0; i < selectedDevices.size(); ++i)
+			deviceQueues[i].finish();
+
+		return renderingDeviceCount * windowWidth * windowHeight;
+	}
+
+	virtual void SaveImage(const std::string &fileName) {
+		if (headless && deviceMerge) {
+			// The snapshots are merged on the device by MergePixels()
+			for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+				if (!kernelsSmallPT[i])
+					continue;
+
+				cl::Event snapshotEvent;
+				EnqueueSharedFrameSnapshot(i, 0, &snapshotEvent);
+			}
+		} else if (headless) {
+			// In headless mode, the pixels are read back only when they are saved
+			for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+				if (!kernelsSmallPT[i])
+					continue;
+
+				cl::Event snapshotEvent;
+				EnqueueFrameSnapshot(i, 0, &snapshotEvent);
+				EnqueueReadFrame(i, 0, snapshotEvent, &readbackEvents[i]);
+			}
+			for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+				if (!kernelsSmallPT[i])
+					continue;
+
+				readbackEvents[i].wait();
+				pixels[i] = readbackPixels[0][i];
+				pixelsSamples[i] = readbackSamples[0][i];
+			}
+		}
+		if (selectedDevices.size() > 1)
+			MergePixels();
+
+		// Write image to PPM file
+		std::ofstream f(fileName.c_str(), std::ofstream::trunc);
+		if (!f.good()) {
+			OCLTOY_LOG_ERROR("Failed to open image file: " << fileName);
+		} else {
+			f << "P3" << std::endl;
+			f << windowWidth << " " << windowHeight << std::endl;
+			f << "255" << std::endl;
+
+			// The rows are encoded in parallel
+			const float *img = (selectedDevices.size() == 1) ? pixels[0] : mergedPixels;
+			std::vector<std::string> rows(windowHeight);
+			threadPool->ParallelFor(0, windowHeight, 16, boost::bind(&SmallPTGPU::EncodeImageRows,
+					this, img, &rows, _1, _2));
+			for (int y = (int)windowHeight - 1; y >= 0; --y)
+				f << rows[y];
+		}
+		f.close();
+		OCLTOY_LOG("Saved framebuffer in " << fileName);
+	}
+
+	void EncodeImageRows(const float *img, std::vector<std::string> *rows, const size_t begin, const size_t end) {
+		for (size_t y = begin; y < end; ++y) {
+			std::stringstream ss;
+			const float *p = &img[y * windowWidth * 3];
+			for (int x = 0; x < (int)windowWidth; ++x) {
+				const float rv = std::min(std::max(*p++, 0.f), 1.f);
+				const std::string r = boost::lexical_cast<std::string>((int)(rv * 255.f + .5f));
+				const float gv = std::min(std::max(*p++, 0.f), 1.f);
+				const std::string g = boost::lexical_cast<std::string>((int)(gv * 255.f + .5f));
+				const float bv = std::min(std::max(*p++, 0.f), 1.f);
+				const std::string b = boost::lexical_cast<std::string>((int)(bv * 255.f + .5f));
+				ss << r << " " << g << " " << b << std::endl;
+			}
+			(*rows)[y] = ss.str();
+		}
+	}
+
 	//--------------------------------------------------------------------------
 	// OpenCL related code
 	//--------------------------------------------------------------------------
@@ -445,8 +641,54 @@ protected:
 		return std::numeric_limits<unsigned int>::max();
 	}
 
+	virtual void RenderWithProgram(const unsigned int deviceIndex, cl::Program &program,
+			std::vector<float> *image) {
+		// The random numbers depend only on the sample index, so all builds
+		// render the same samples
+		cl::Kernel kernel(program, "SmallPTGPU");
+		kernel.setArg(0, *samplesBuff[deviceIndex]);
+		kernel.setArg(1, deviceIndex);
+		kernel.setArg(2, *cameraBuff[deviceIndex]);
+		kernel.setArg(3, *spheresBuff[deviceIndex]);
+		kernel.setArg(4, *bvhNodesBuff[deviceIndex]);
+		kernel.setArg(5, *bvhIndicesBuff[deviceIndex]);
+		kernel.setArg(6, *lightsBuff[deviceIndex]);
+		kernel.setArg(7, (unsigned int)lights.size());
+		kernel.setArg(8, lightsPower);
+		kernel.setArg(9, windowWidth);
+		kernel.setArg(10, windowHeight);
+
+		const size_t workGroupSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(selectedDevices[deviceIndex]);
+		const size_t globalThreads = RoundUp<size_t>(windowWidth * windowHeight, workGroupSize);
+		cl::CommandQueue &oclQueue = deviceQueues[deviceIndex];
+		for (unsigned int i = 0; i < 4; ++i) {
+			kernel.setArg(11, i);
+			oclQueue.enqueueNDRangeKernel(kernel, cl::NullRange,
+					cl::NDRange(globalThreads), cl::NDRange(workGroupSize),
+					NULL, ProfileEvent(deviceIndex, "SmallPTGPU", "kernel"));
+		}
+
+		if (image) {
+			const size_t size = windowWidth * windowHeight * 3;
+			std::vector<float> samples(size);
+			oclQueue.enqueueReadBuffer(*samplesBuff[deviceIndex], CL_TRUE, 0, size * sizeof(float), &samples[0],
+					NULL, ProfileEvent(deviceIndex, "SamplesBuffer", "read"));
+
+			image->resize(size);
+			for (size_t i = 0; i < size; ++i)
+				(*image)[i] = Radiance2PixelFloat(samples[i]);
+		} else
+			oclQueue.finish();
+	}
+
 private:
 	void SetUpOpenCL() {
+		//----------------------------------------------------------------------
+		// Allocate buffer
+		//----------------------------------------------------------------------
+
+		AllocateBuffers();
+
 		//----------------------------------------------------------------------
 		// Compile kernel
 		//----------------------------------------------------------------------
@@ -456,6 +698,7 @@ private:
 
 		// Read the kernel
 		const std::string kernelSource = ReadSources(kernelFileName, "smallptgpu");
+		const std::string kernelName = "SmallPTGPU";
 
 		// Kernel options
 		std::stringstream ss;
@@ -464,78 +707,206 @@ private:
 				"-DPARAM_MAX_DEPTH=" << maxDepth << " "
 				"-DPARAM_DEFAULT_SIGMA_S=" << defaultVolumeSigmaS << "f "
 				"-DPARAM_DEFAULT_SIGMA_A=" << defaultVolumeSigmaA << "f "
+				"-DPARAM_SOBOL=" << (commandLineOpts.count("sobol") ? 1 : 0) << " "
 				"-I. -I../common";
 		const std::string opts = ss.str();
 		OCLTOY_LOG("Kernel parameters: " << opts);
 
-		// Compile the kernel for each device
+		// Compile the kernel for all devices at the same time. The kernels of
+		// each device are set up by its rendering thread (or by HeadlessPass())
+		// when its compilation is done (see SwapCompiledKernels()), so the
+		// devices compiling faster can start to render while the others are
+		// still compiling.
 		kernelsSmallPT.resize(selectedDevices.size(), NULL);
 		kernelsWorkGroupSize.resize(selectedDevices.size(), 0);
-		cl::Program::Sources source(1, std::make_pair(kernelSource.c_str(), kernelSource.length()));
+		tuningKeys.resize(selectedDevices.size());
+		calibrationKeys.resize(selectedDevices.size());
+		programBuilds.resize(selectedDevices.size(), NULL);
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
-			// Create the kernel program
 			cl::Device &oclDevice = selectedDevices[i];
-			cl::Context &oclContext = deviceContexts[i];
-			cl::Program program = cl::Program(oclContext, source);
-			try {
-				VECTOR_CLASS<cl::Device> buildDevice;
-				buildDevice.push_back(oclDevice);
-				program.build(buildDevice, opts.c_str());
-			} catch (cl::Error err) {
-				cl::STRING_CLASS strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(oclDevice);
-				OCLTOY_LOG("Kernel compilation error:\n" << strError.c_str());
+			const std::string buildKey = OCLTuningStore::GetKey("buildoptions", oclDevice, kernelName, kernelSource, opts);
+			const std::string deviceOpts = TuneBuildOptions(i, kernelSource, opts, buildKey);
+
+			tuningKeys[i] = OCLTuningStore::GetKey("workgroupsize", oclDevice, kernelName, kernelSource, deviceOpts);
+			calibrationKeys[i] = OCLTuningStore::GetKey("calibration", oclDevice, kernelName, kernelSource, deviceOpts);
+			programBuilds[i] = CompileProgramAsync(i, kernelSource, deviceOpts);
+		}
 
-				throw err;
+		// In the meantime, the preview kernel (it compiles in a fraction of
+		// the time) is rendered. The headless mode renders only the full kernel.
+		if (!headless && !commandLineOpts.count("nopreview")) {
+			const std::string &previewFileName = commandLineOpts["previewkernel"].as<std::string>();
+			const std::string previewSource = ReadSources(previewFileName, "smallptgpu");
+
+			for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+				// The full kernel may be already available (i.e. in the cache)
+				if (programBuilds[i]->IsDone())
+					continue;
+
+				cl::Program program = CompileProgram(i, previewSource, opts);
+				SetUpDeviceKernels(i, program, true);
+				OCLTOY_LOG("Rendering the preview kernel (Device " << i << ")");
 			}
+		}
+
+		UpdateCameraBuffer();
+		UpdateSpheresBuffer();
+	}
 
-			kernelsSmallPT[i] = new cl::Kernel(program, "SmallPTGPU");
-			kernelsSmallPT[i]->getWorkGroupInfo<size_t>(oclDevice, CL_KERNEL_WORK_GROUP_SIZE, &kernelsWorkGroupSize[i]);
-			if (commandLineOpts.count("workgroupsize"))
-				kernelsWorkGroupSize[i] = commandLineOpts["workgroupsize"].as<size_t>();
-			OCLTOY_LOG("Using workgroup size (Device " + boost::lexical_cast<std::string>(i) + "): " << kernelsWorkGroupSize[i]);
+	// Replaces the kernels of the device (the preview kernel, if any) with the
+	// full kernel once its compilation is done. Returns false if the full
+	// kernel is not available yet (or it is already in use).
+	bool SwapCompiledKernels(const unsigned int deviceIndex, const bool wait) {
+		OCLAsyncProgramBuild *build = programBuilds[deviceIndex];
+		if (!build || (!wait && !build->IsDone()))
+			return false;
 
-			if ((selectedDevices.size() == 1) && (i == 0))
-				kernelToneMapping = new cl::Kernel(program, "ToneMapping");
+		cl::Program program;
+		try {
+			program = build->Wait();
+		} catch (...) {
+			// The device is dropped before the failed build is forgotten, so
+			// its preview is never taken for the full kernel
+			failedDevices[deviceIndex] = 1;
+			delete build;
+			programBuilds[deviceIndex] = NULL;
+			throw;
 		}
-		
-		//----------------------------------------------------------------------
-		// Allocate buffer
-		//----------------------------------------------------------------------
+		delete build;
+		programBuilds[deviceIndex] = NULL;
 
-		AllocateBuffers();
+		SetUpDeviceKernels(deviceIndex, program, false);
+		// Restart the accumulation of the samples
+		currentSample[deviceIndex] = 0;
 
-		//----------------------------------------------------------------------
-		// Set kernel arguments
-		//----------------------------------------------------------------------
+		return true;
+	}
 
-		UpdateKernelsArgs();
+	// Creates (or replaces) the kernels of the device once its program has
+	// been compiled
+	void SetUpDeviceKernels(const unsigned int deviceIndex, cl::Program &program, const bool preview) {
+		// The work group size autotuning and the tuning file are shared by
+		// all devices
+		boost::mutex::scoped_lock lock(setUpMutex);
+
+		cl::Kernel *kernel = new cl::Kernel(program, "SmallPTGPU");
+		if (preview) {
+			// The tuned work group size is the one of the full kernel
+			kernelsWorkGroupSize[deviceIndex] = commandLineOpts.count("workgroupsize") ?
+				commandLineOpts["workgroupsize"].as<size_t>() :
+				kernel->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(selectedDevices[deviceIndex]);
+		} else
+			kernelsWorkGroupSize[deviceIndex] = GetKernelWorkGroupSize(deviceIndex, *kernel, tuningKeys[deviceIndex]);
+		if (selectedDevices.size() == 1) {
+			delete kernelToneMapping;
+			kernelToneMapping = new cl::Kernel(program, "ToneMapping");
+		}
+		if (deviceMerge) {
+			delete kernelsMergeSamples[deviceIndex];
+			kernelsMergeSamples[deviceIndex] = new cl::Kernel(program, "MergeSamples");
+			delete kernelsMergeToneMapping[deviceIndex];
+			kernelsMergeToneMapping[deviceIndex] = new cl::Kernel(program, "MergeToneMapping");
+		}
 
-		UpdateCameraBuffer();
-		UpdateSpheresBuffer();
+		delete kernelsSmallPT[deviceIndex];
+		kernelsSmallPT[deviceIndex] = kernel;
+		// The preview program has only the SmallPTGPU kernel
+		if (!preview) {
+			SetUpWavefrontKernels(deviceIndex, program);
+			SetUpPersistentKernel(deviceIndex, program);
+		}
+		UpdateKernelArgs(deviceIndex);
+		if (preview)
+			return;
+
+		kernel->setArg(11, 0u);
+		kernelsWorkGroupSize[deviceIndex] = TuneKernelWorkGroupSize(deviceIndex, *kernel, tuningKeys[deviceIndex],
+				windowWidth * windowHeight, kernelsWorkGroupSize[deviceIndex]);
+		OCLTOY_LOG("Using workgroup size (Device " + boost::lexical_cast<std::string>(deviceIndex) + "): " << kernelsWorkGroupSize[deviceIndex]);
+
+		// The samples are merged according to the speed of the devices and
+		// the slowest ones are not used at all
+		CalibrateDevice(deviceIndex, calibrationKeys[deviceIndex],
+				boost::bind(&SmallPTGPU::RenderCalibrationFrame, this, deviceIndex), windowWidth * windowHeight);
+	}
+
+	void RenderCalibrationFrame(const unsigned int deviceIndex) {
+		EnqueueKernels(deviceIndex, 1);
+		deviceQueues[deviceIndex].finish();
 	}
 
 	void FreeBuffers() {
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
-			FreeOCLBuffer(0, &samplesBuff[i]);			
-			delete[] pixels[i];
+			FreeOCLBuffer(i, &samplesBuff[i]);
+			for (unsigned int j = 0; j < 2; ++j) {
+				FreeOCLBuffer(i, &readbackBuff[j][i]);
+				FreeOCLStagingBuffer(&readbackStaging[j][i]);
+				readbackPixels[j][i] = NULL;
+			}
 			pixels[i] = NULL;
-			FreeOCLBuffer(0, &seedsBuff[i]);
-			FreeOCLBuffer(0, &cameraBuff[i]);
-			FreeOCLBuffer(0, &spheresBuff[i]);
+			FreeOCLBuffer(i, &workCountersBuff[i]);
+			FreeWavefrontBuffers(i);
 		}
 
-		FreeOCLBuffer(0, &pixelsBuff);
+		// The scene buffers shared with a previous device are freed only once
+		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+			if (GetSceneDevice(i) == i) {
+				FreeOCLBuffer(i, &cameraBuff[i]);
+				FreeOCLBuffer(i, &spheresBuff[i]);
+				FreeOCLBuffer(i, &bvhNodesBuff[i]);
+				FreeOCLBuffer(i, &bvhIndicesBuff[i]);
+				FreeOCLBuffer(i, &lightsBuff[i]);
+			} else {
+				cameraBuff[i] = NULL;
+				spheresBuff[i] = NULL;
+				bvhNodesBuff[i] = NULL;
+				bvhIndicesBuff[i] = NULL;
+				lightsBuff[i] = NULL;
+			}
+		}
 
+		FreeOCLBuffer(0, &mergeSamplesBuff);
+		FreeOCLBuffer(0, &mergePixelsBuff);
 		delete[] mergedPixels;
 		mergedPixels = NULL;
 	}
 
+	// Returns the device with the scene buffers used by the device: the first
+	// device sharing its context
+	unsigned int GetSceneDevice(const unsigned int deviceIndex) const {
+		unsigned int sceneDevice = 0;
+		while (!IsContextShared(sceneDevice, deviceIndex))
+			++sceneDevice;
+
+		return sceneDevice;
+	}
+
 	void AllocateBuffers() {
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+			// The devices sharing the same context share the scene buffers too
+			const unsigned int sceneDevice = GetSceneDevice(i);
+			if (sceneDevice != i) {
+				cameraBuff[i] = cameraBuff[sceneDevice];
+				spheresBuff[i] = spheresBuff[sceneDevice];
+				bvhNodesBuff[i] = bvhNodesBuff[sceneDevice];
+				bvhIndicesBuff[i] = bvhIndicesBuff[sceneDevice];
+				lightsBuff[i] = lightsBuff[sceneDevice];
+				continue;
+			}
+
 			AllocOCLBufferRO(i, &cameraBuff[i], &camera, sizeof(Camera),
 					"CameraBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
 			AllocOCLBufferRO(i, &spheresBuff[i], &spheres[0], sizeof(Sphere) * spheres.size(),
 					"SpheresBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
+			AllocOCLBufferRO(i, &bvhNodesBuff[i], (void *)&bvh.GetNodes()[0], sizeof(BVHNode) * bvh.GetNodes().size(),
+					"BVHNodesBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
+			AllocOCLBufferRO(i, &bvhIndicesBuff[i], (void *)&bvh.GetSphereIndices()[0], sizeof(unsigned int) * bvh.GetSphereIndices().size(),
+					"BVHIndicesBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
+			// A scene without lights has a dummy light, the kernels never read it
+			const Light noLight = { 0, 1.f };
+			AllocOCLBufferRO(i, &lightsBuff[i], lights.empty() ? (void *)&noLight : (void *)&lights[0],
+					sizeof(Light) * std::max<size_t>(lights.size(), 1),
+					"LightsBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
 		}
 
 		// Allocate the frame buffer
@@ -633,11 +1004,13 @@ private:
 			throw std::runtime_error("Failed to parse sphere count");
 		
 		const unsigned int sphereCount = boost::lexical_cast<unsigned int>(sizeArgs[1]);
+		if (sphereCount == 0)
+			throw std::runtime_error("The scene has no spheres");
 		spheres.resize(sphereCount);
 
 		// Read all spheres
 		for (unsigned int i = 0; i < sphereCount; i++) {
-			OCLTOY_LOG("  Parsing sphere " << i << "...");
+			OCLTOY_LOG_DEBUG("  Parsing sphere " << i << "...");
 
 			// Read the sphere definition
 			std::string sphereLine;
@@ -738,6 +1111,36 @@ private:
 		}
 
 		f.close();
+
+		// The emissive spheres end the paths, they are never shaded
+		std::fill(sceneMaterials, sceneMaterials + MATERIAL_COUNT, false);
+		for (unsigned int i = 0; i < sphereCount; ++i) {
+			if (viszero(spheres[i].e) && (spheres[i].matType < MATERIAL_COUNT))
+				sceneMaterials[spheres[i].matType] = true;
+		}
+
+		// The emissive spheres are sampled according to their power
+		lights.clear();
+		lightsPower = 0.f;
+		for (unsigned int i = 0; i < sphereCount; ++i) {
+			if (viszero(spheres[i].e))
+				continue;
+
+			const Light light = { i, 0.f };
+			lights.push_back(light);
+			lightsPower += SPHERE_POWER(spheres[i]);
+		}
+		float cdf = 0.f;
+		for (unsigned int i = 0; i < lights.size(); ++i) {
+			cdf += SPHERE_POWER(spheres[lights[i].sphereIndex]) / lightsPower;
+			lights[i].cdf = cdf;
+		}
+		if (!lights.empty())
+			lights.back().cdf = 1.f;
+		OCLTOY_LOG("Light count: " << lights.size());
+
+		bvh.Build(spheres);
+		OCLTOY_LOG("BVH nodes: " << bvh.GetNodes().size() << " (depth " << bvh.GetDepth() << ")");
 	}
 
 	void UpdateCamera() {
@@ -758,80 +1161,145 @@ private:
 	void ResizeFrameBuffer() {
 		const unsigned int pixelCount = windowWidth * windowHeight;
 
-		unsigned int *seeds = new unsigned int[pixelCount * 2];
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
-			cl::CommandQueue &oclQueue = deviceQueues[i];
-
 			// Allocate the sample buffer
 			AllocOCLBufferRW(i, &samplesBuff[i], pixelCount * sizeof(float) * 3,
 					"SamplesBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
 
-			// Allocate the frame buffer
-			delete[] pixels[i];
-			pixels[i] = new float[pixelCount * 3];
-			std::fill(pixels[i], pixels[i] + pixelCount * 3, 0.f);
-
-			// Allocate the seeds for random number generator
-			AllocOCLBufferRW(i, &seedsBuff[i], pixelCount * sizeof(unsigned int) * 2,
-					"SeedsBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
-
-			for (unsigned int j = 0; j < pixelCount * 2; j++)
-				seeds[j] = 2 + 2 * i * pixelCount + j;
-
-			oclQueue.enqueueWriteBuffer(*seedsBuff[i],
-					CL_TRUE,
-					0,
-					seedsBuff[i]->getInfo<CL_MEM_SIZE>(),
-					seeds);
+			// Allocate the double-buffered readback buffers (they are read by
+			// the merge kernel too, with the device side merge)
+			for (unsigned int j = 0; j < 2; ++j) {
+				AllocOCLBuffer(i, &readbackBuff[j][i], deviceMerge ? CL_MEM_READ_WRITE : CL_MEM_WRITE_ONLY,
+						pixelCount * sizeof(float) * 3,
+						"ReadbackBuffer " + boost::lexical_cast<std::string>(j) +
+						" (Device " + boost::lexical_cast<std::string>(i) + ")");
+
+				readbackPixels[j][i] = (float *)AllocOCLReadbackMemory(i, readbackBuff[j][i], &readbackStaging[j][i],
+						"ReadbackBuffer " + boost::lexical_cast<std::string>(j) +
+						" (Device " + boost::lexical_cast<std::string>(i) + ")");
+				std::fill(readbackPixels[j][i], readbackPixels[j][i] + pixelCount * 3, 0.f);
+			}
+			pixels[i] = readbackPixels[0][i];
+			pixelsSamples[i] = 0;
+
+			// Allocate the work counters of SmallPTGPUPersistent
+			AllocOCLBufferRW(i, &workCountersBuff[i], sizeof(unsigned int) * 2,
+					"WorkCountersBuffer (Device " + boost::lexical_cast<std::string>(i) + ")");
+			const unsigned int workCounters[2] = { 0, 0 };
+			deviceQueues[i].enqueueWriteBuffer(*workCountersBuff[i], CL_TRUE, 0, sizeof(workCounters), workCounters,
+					NULL, ProfileEvent(i, "WorkCountersBuffer", "write"));
+
+			if (renderingMode == WAVEFRONT_RENDERING)
+				AllocateWavefrontBuffers(i);
 		}
-		delete[] seeds;
 
-		if (selectedDevices.size() == 1)
-			AllocOCLBufferWO(0, &pixelsBuff, pixelCount * sizeof(float) * 3, "PixelsBuffer");
-		else {
+		if (selectedDevices.size() > 1) {
 			delete[] mergedPixels;
 			mergedPixels = new float[pixelCount * 3];
 		}
+
+		if (deviceMerge) {
+			AllocOCLBufferRW(0, &mergeSamplesBuff, pixelCount * sizeof(float) * 3, "MergeSamplesBuffer");
+			AllocOCLBufferWO(0, &mergePixelsBuff, pixelCount * sizeof(float) * 3, "MergePixelsBuffer");
+
+			// The snapshots of the previous size are gone
+			for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+				snapshotSlots[i] = -1;
+				snapshotEvents[i] = cl::Event();
+				mergeEvents[0][i] = cl::Event();
+				mergeEvents[1][i] = cl::Event();
+			}
+		}
 	}
 
 	void UpdateKernelsArgs() {
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
-			kernelsSmallPT[i]->setArg(0, *samplesBuff[i]);
-			kernelsSmallPT[i]->setArg(1, *seedsBuff[i]);
-			kernelsSmallPT[i]->setArg(2, *cameraBuff[i]);
-			kernelsSmallPT[i]->setArg(3, (unsigned int)spheres.size());
-			kernelsSmallPT[i]->setArg(4, *spheresBuff[i]);
-			kernelsSmallPT[i]->setArg(5, windowWidth);
-			kernelsSmallPT[i]->setArg(6, windowHeight);
+			// The kernels of the devices still compiling are set up later
+			if (kernelsSmallPT[i])
+				UpdateKernelArgs(i);
 		}
+	}
+
+	void UpdateKernelArgs(const unsigned int deviceIndex) {
+		cl::Kernel *kernel = kernelsSmallPT[deviceIndex];
+		kernel->setArg(0, *samplesBuff[deviceIndex]);
+		kernel->setArg(1, deviceIndex);
+		kernel->setArg(2, *cameraBuff[deviceIndex]);
+		kernel->setArg(3, *spheresBuff[deviceIndex]);
+		kernel->setArg(4, *bvhNodesBuff[deviceIndex]);
+		kernel->setArg(5, *bvhIndicesBuff[deviceIndex]);
+		kernel->setArg(6, *lightsBuff[deviceIndex]);
+		kernel->setArg(7, (unsigned int)lights.size());
+		kernel->setArg(8, lightsPower);
+		kernel->setArg(9, windowWidth);
+		kernel->setArg(10, windowHeight);
 
 		if (selectedDevices.size() == 1) {
+			// The argument 1 (the output buffer) is set for each frame
 			kernelToneMapping->setArg(0, *samplesBuff[0]);
-			kernelToneMapping->setArg(1, *pixelsBuff);
 			kernelToneMapping->setArg(2, windowWidth);
 			kernelToneMapping->setArg(3, windowHeight);
 		}
+
+		if (wavefronts[deviceIndex].kernelGenerate && wavefronts[deviceIndex].pathOriginsBuff)
+			UpdateWavefrontKernelArgs(deviceIndex);
+
+		// The persistent kernel has the same arguments plus the work counters
+		if (kernelsPersistent[deviceIndex]) {
+			kernel = kernelsPersistent[deviceIndex];
+			kernel->setArg(0, *samplesBuff[deviceIndex]);
+			kernel->setArg(1, deviceIndex);
+			kernel->setArg(2, *cameraBuff[deviceIndex]);
+			kernel->setArg(3, *spheresBuff[deviceIndex]);
+			kernel->setArg(4, *bvhNodesBuff[deviceIndex]);
+			kernel->setArg(5, *bvhIndicesBuff[deviceIndex]);
+			kernel->setArg(6, *lightsBuff[deviceIndex]);
+			kernel->setArg(7, (unsigned int)lights.size());
+			kernel->setArg(8, lightsPower);
+			kernel->setArg(9, windowWidth);
+			kernel->setArg(10, windowHeight);
+			kernel->setArg(12, *workCountersBuff[deviceIndex]);
+		}
 	}
 
 	void UpdateCameraBuffer() {
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
-			cl::CommandQueue &oclQueue = deviceQueues[i];
-			oclQueue.enqueueWriteBuffer(*cameraBuff[i],
-					CL_FALSE,
-					0,
-					cameraBuff[i]->getInfo<CL_MEM_SIZE>(),
-					&camera);
+			if (GetSceneDevice(i) == i)
+				UploadOCLBuffer(i, *cameraBuff[i], &camera, sizeof(Camera), "CameraBuffer");
 		}
+		ShareSceneBuffers();
 	}
 
 	void UpdateSpheresBuffer() {
+		// The spheres can only be moved, the BVH is refitted instead of rebuilt
+		bvh.Refit(spheres);
+
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
-			cl::CommandQueue &oclQueue = deviceQueues[i];
-			oclQueue.enqueueWriteBuffer(*spheresBuff[i],
-					CL_FALSE,
-					0,
-					spheresBuff[i]->getInfo<CL_MEM_SIZE>(),
-					&spheres[0]);
+			if (GetSceneDevice(i) == i) {
+				UploadOCLBuffer(i, *spheresBuff[i], &spheres[0], sizeof(Sphere) * spheres.size(), "SpheresBuffer");
+				UploadOCLBuffer(i, *bvhNodesBuff[i], &bvh.GetNodes()[0], sizeof(BVHNode) * bvh.GetNodes().size(), "BVHNodesBuffer");
+			}
+		}
+		ShareSceneBuffers();
+	}
+
+	// Moves the scene buffers uploaded by a device to the other devices of the
+	// same context (the rendering is stopped while the scene is updated)
+	void ShareSceneBuffers() {
+		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+			const unsigned int sceneDevice = GetSceneDevice(i);
+			if (sceneDevice == i)
+				continue;
+
+			deviceQueues[sceneDevice].finish();
+
+			VECTOR_CLASS<cl::Memory> buffs;
+			buffs.push_back(*cameraBuff[i]);
+			buffs.push_back(*spheresBuff[i]);
+			buffs.push_back(*bvhNodesBuff[i]);
+			buffs.push_back(*bvhIndicesBuff[i]);
+			buffs.push_back(*lightsBuff[i]);
+			EnqueueMigrateOCLBuffers(i, deviceQueues[i], buffs, NULL, NULL);
 		}
 	}
 
@@ -868,6 +1336,8 @@ private:
 		fontOffset -= 17;
 		PrintHelpString(60, fontOffset, "space", "restart rendering");
 		fontOffset -= 17;
+		PrintHelpString(60, fontOffset, "m", "switch between the megakernel, wavefront and persistent rendering");
+		fontOffset -= 17;
 
 		// Print device specific information
 		glColor3f(1.f, .5f, 0.f);
@@ -887,6 +1357,135 @@ private:
 		glDisable(GL_BLEND);
 	}
 
+	// True if the full kernel is rendering on at least one device
+	bool IsFullKernelRendering() const {
+		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+			if (kernelsSmallPT[i] && !programBuilds[i] && !failedDevices[i])
+				return true;
+		}
+
+		return false;
+	}
+
+	// The frames of a device are merged if it is rendering. Once the full
+	// kernel is rendering somewhere, the devices still rendering the preview
+	// are left out, or their flat shading would be blended in the image.
+	bool IsMergedDevice(const unsigned int deviceIndex, const bool fullKernelRendering) const {
+		return kernelsSmallPT[deviceIndex] && !failedDevices[deviceIndex] &&
+				(!fullKernelRendering || !programBuilds[deviceIndex]);
+	}
+
+	void MergePixels() {
+		OCLScopedTimer timer("MergePixels");
+
+		if (deviceMerge) {
+			MergeDevicePixels();
+			return;
+		}
+
+		// Multiple devices, I have to merge the results and to apply tone mapping
+		const unsigned count = windowWidth * windowHeight * 3;
+
+		// Only the devices with their kernels compiled are rendering. Each
+		// frame is an average of its samples, so it is weighted by their count.
+		const bool fullKernelRendering = IsFullKernelRendering();
+		std::vector<unsigned int> mergeDevices;
+		unsigned int sampleCount = 0;
+		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+			if (!IsMergedDevice(i, fullKernelRendering) || !pixelsSamples[i] || !(GetDeviceWeight(i) > 0.0))
+				continue;
+
+			mergeDevices.push_back(i);
+			sampleCount += pixelsSamples[i];
+		}
+
+		const float scale = 1.f / std::max(sampleCount, 1u);
+		threadPool->ParallelFor(0, count, 64 * 1024, boost::bind(&SmallPTGPU::MergePixelsRange,
+				this, boost::cref(mergeDevices), scale, _1, _2));
+	}
+
+	void MergePixelsRange(const std::vector<unsigned int> &mergeDevices, const float scale,
+			const size_t begin, const size_t end) {
+		for (size_t j = begin; j < end; ++j) {
+			float pixel = 0.f;
+			for (size_t i = 0; i < mergeDevices.size(); ++i)
+				pixel += pixelsSamples[mergeDevices[i]] * pixels[mergeDevices[i]][j];
+
+			mergedPixels[j] = Radiance2PixelFloat(scale * pixel);
+		}
+	}
+
+	// Merges the last frame snapshot of each device and applies the tone
+	// mapping on the first device with its kernels compiled. The snapshots are
+	// migrated to that device, so only the merged frame is read back.
+	void MergeDevicePixels() {
+		// The merge kernels are replaced when the full kernels are set up
+		boost::mutex::scoped_lock setUpLock(setUpMutex);
+
+		const unsigned count = windowWidth * windowHeight * 3;
+		const bool fullKernelRendering = IsFullKernelRendering();
+		unsigned int mergeDevice = 0;
+		while ((mergeDevice < selectedDevices.size()) && !IsMergedDevice(mergeDevice, fullKernelRendering))
+			++mergeDevice;
+		if (mergeDevice == selectedDevices.size()) {
+			std::fill(mergedPixels, mergedPixels + count, 0.f);
+			return;
+		}
+
+		cl::CommandQueue &oclQueue = deviceTransferQueues[mergeDevice];
+		const cl::NDRange globalThreads(GetGlobalThreads(mergeDevice));
+		const cl::NDRange workGroupSize(kernelsWorkGroupSize[mergeDevice]);
+
+		unsigned int snapshotCount = 0;
+		unsigned int sampleCount = 0;
+		{
+			boost::mutex::scoped_lock lock(snapshotMutex);
+
+			cl::Kernel *kernel = kernelsMergeSamples[mergeDevice];
+			kernel->setArg(1, *mergeSamplesBuff);
+			kernel->setArg(2, windowWidth);
+			kernel->setArg(3, windowHeight);
+			for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+				if ((snapshotSlots[i] < 0) || !IsMergedDevice(i, fullKernelRendering) ||
+						!(GetDeviceWeight(i) > 0.0))
+					continue;
+
+				const int slot = snapshotSlots[i];
+				if (!readbackSamples[slot][i])
+					continue;
+				VECTOR_CLASS<cl::Memory> buffs(1, *readbackBuff[slot][i]);
+				VECTOR_CLASS<cl::Event> waitEvents(1, snapshotEvents[i]);
+				EnqueueMigrateOCLBuffers(mergeDevice, oclQueue, buffs, &waitEvents, NULL);
+
+				kernel->setArg(0, *readbackBuff[slot][i]);
+				kernel->setArg(4, (snapshotCount == 0) ? 1 : 0);
+				// Each snapshot is an average of its samples
+				kernel->setArg(5, (float)readbackSamples[slot][i]);
+				// The device doesn't overwrite the snapshot until the merge is done
+				oclQueue.enqueueNDRangeKernel(*kernel, cl::NullRange, globalThreads, workGroupSize,
+						NULL, &mergeEvents[slot][i]);
+				ProfileEvent(mergeDevice, mergeEvents[slot][i], "MergeSamples", "kernel", 1);
+				++snapshotCount;
+				sampleCount += readbackSamples[slot][i];
+			}
+		}
+		if (snapshotCount == 0) {
+			std::fill(mergedPixels, mergedPixels + count, 0.f);
+			return;
+		}
+
+		cl::Kernel *kernel = kernelsMergeToneMapping[mergeDevice];
+		kernel->setArg(0, *mergeSamplesBuff);
+		kernel->setArg(1, *mergePixelsBuff);
+		kernel->setArg(2, windowWidth);
+		kernel->setArg(3, windowHeight);
+		kernel->setArg(4, 1.f / sampleCount);
+		oclQueue.enqueueNDRangeKernel(*kernel, cl::NullRange, globalThreads, workGroupSize,
+				NULL, ProfileEvent(mergeDevice, "MergeToneMapping", "kernel", 1));
+		oclQueue.enqueueReadBuffer(*mergePixelsBuff, CL_TRUE, 0, count * sizeof(float), mergedPixels,
+				NULL, ProfileEvent(mergeDevice, "MergedPixels", "read", 1));
+	}
+
 	float Radiance2PixelFloat(const float x) const {
 		// Very slow !
 		// return powf(x, 1.f / 2.2f);
@@ -901,62 +1500,420 @@ private:
 	// Rendering thread related methods
 	//--------------------------------------------------------------------------
 
+	// The rendering loop of each device runs in a task of the thread pool
+	// until StopRendering() cancels it
 	void StartRendering() {
-		renderThreads.resize(selectedDevices.size());
+		renderCancellation = OCLCancellationToken();
+		renderTasks.resize(selectedDevices.size());
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i)
-			renderThreads[i] = new boost::thread(RenderThreadImpl, this, i);
+			renderTasks[i] = threadPool->Submit(boost::bind(RenderThreadImpl, this, i, renderCancellation),
+					renderCancellation);
 	}
 
 	void StopRendering() {
+		renderCancellation.Cancel();
 		for (unsigned int i = 0; i < selectedDevices.size(); ++i)
-			renderThreads[i]->interrupt();
-		for (unsigned int i = 0; i < selectedDevices.size(); ++i)
-			renderThreads[i]->join();
+			renderTasks[i].Wait();
+	}
+
+	size_t GetGlobalThreads(const unsigned int deviceIndex) const {
+		size_t globalThreads = windowWidth * windowHeight;
+		if (globalThreads % kernelsWorkGroupSize[deviceIndex] != 0)
+			globalThreads = (globalThreads / kernelsWorkGroupSize[deviceIndex] + 1) * kernelsWorkGroupSize[deviceIndex];
+
+		return globalThreads;
 	}
 
-	static void RenderThreadImpl(SmallPTGPU *smallptgpu, const unsigned int threadIndex) {
+	void EnqueueKernels(const unsigned int deviceIndex, const unsigned int kernelIterations) {
+		OCLScopedTimer timer("Kernel enqueue");
+
+		const size_t globalThreads = GetGlobalThreads(deviceIndex);
+
+		cl::CommandQueue &oclQueue = deviceQueues[deviceIndex];
+		for (unsigned int i = 0; i < kernelIterations; ++i) {
+			if ((renderingMode == WAVEFRONT_RENDERING) && wavefronts[deviceIndex].kernelGenerate) {
+				EnqueueWavefrontSample(deviceIndex);
+				continue;
+			}
+			if ((renderingMode == PERSISTENT_RENDERING) && kernelsPersistent[deviceIndex]) {
+				EnqueuePersistentSample(deviceIndex);
+				continue;
+			}
+
+			// Set kernel arguments
+			kernelsSmallPT[deviceIndex]->setArg(11, currentSample[deviceIndex]++);
+
+			// Enqueue a kernel run
+			oclQueue.enqueueNDRangeKernel(*(kernelsSmallPT[deviceIndex]), cl::NullRange,
+					cl::NDRange(globalThreads), cl::NDRange(kernelsWorkGroupSize[deviceIndex]),
+					NULL, ProfileEvent(deviceIndex, "SmallPTGPU", "kernel"));
+		}
+	}
+
+	//--------------------------------------------------------------------------
+	// Persistent threads kernel
+	//--------------------------------------------------------------------------
+
+	void SetUpPersistentKernel(const unsigned int deviceIndex, cl::Program &program) {
+		delete kernelsPersistent[deviceIndex];
+		kernelsPersistent[deviceIndex] = new cl::Kernel(program, "SmallPTGPUPersistent");
+		persistentMaxWorkGroupSize[deviceIndex] =
+				kernelsPersistent[deviceIndex]->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(selectedDevices[deviceIndex]);
+	}
+
+	// Renders one sample of each pixel with SmallPTGPUPersistent: it runs
+	// only PERSISTENT_GROUPS_PER_UNIT work groups for each compute unit
+	void EnqueuePersistentSample(const unsigned int deviceIndex) {
+		const size_t workGroupSize = std::min(kernelsWorkGroupSize[deviceIndex], persistentMaxWorkGroupSize[deviceIndex]);
+		const size_t globalThreads = std::min(RoundUp<size_t>(windowWidth * windowHeight, workGroupSize),
+				selectedDevices[deviceIndex].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * PERSISTENT_GROUPS_PER_UNIT * workGroupSize);
+
+		cl::Kernel *kernel = kernelsPersistent[deviceIndex];
+		kernel->setArg(11, currentSample[deviceIndex]++);
+		kernel->setArg(13, persistentRuns[deviceIndex]++ % 2);
+
+		deviceQueues[deviceIndex].enqueueNDRangeKernel(*kernel, cl::NullRange,
+				cl::NDRange(globalThreads), cl::NDRange(workGroupSize),
+				NULL, ProfileEvent(deviceIndex, "SmallPTGPUPersistent", "kernel"));
+	}
+
+	//--------------------------------------------------------------------------
+	// Wavefront pipeline
+	//--------------------------------------------------------------------------
+
+	void SetRenderingMode(const RenderingMode mode) {
+		renderingMode = mode;
+		OCLTOY_LOG("Rendering with the " << renderingModeNames[renderingMode]);
+
+		for (unsigned int i = 0; i < selectedDevices.size(); ++i) {
+			if (renderingMode == WAVEFRONT_RENDERING)
+				AllocateWavefrontBuffers(i);
+			else
+				FreeWavefrontBuffers(i);
+		}
+		UpdateKernelsArgs();
+	}
+
+	void AllocateWavefrontBuffers(const unsigned int deviceIndex) {
+		const unsigned int pixelCount = windowWidth * windowHeight;
+		const std::string device = " (Device " + boost::lexical_cast<std::string>(deviceIndex) + ")";
+		WavefrontPipeline &wf = wavefronts[deviceIndex];
+
+		AllocOCLBufferRW(deviceIndex, &wf.pathOriginsBuff, pixelCount * sizeof(Vec), "PathOriginsBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.pathDirectionsBuff, pixelCount * sizeof(Vec), "PathDirectionsBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.pathThroughputsBuff, pixelCount * sizeof(Vec), "PathThroughputsBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.pathRadiancesBuff, pixelCount * sizeof(Vec), "PathRadiancesBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.pathSigmasBuff, pixelCount * sizeof(float) * 2, "PathSigmasBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.pathMaterialPdfsBuff, pixelCount * sizeof(float), "PathMaterialPdfsBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.pathHitDistancesBuff, pixelCount * sizeof(float), "PathHitDistancesBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.pathHitSpheresBuff, pixelCount * sizeof(unsigned int), "PathHitSpheresBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.rayQueuesBuff, pixelCount * sizeof(unsigned int) * 2, "RayQueuesBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.materialQueuesBuff, pixelCount * sizeof(unsigned int) * MATERIAL_COUNT,
+				"MaterialQueuesBuffer" + device);
+		AllocOCLBufferRW(deviceIndex, &wf.queueCountersBuff, sizeof(unsigned int) * (2 + MATERIAL_COUNT),
+				"QueueCountersBuffer" + device);
+	}
+
+	void FreeWavefrontBuffers(const unsigned int deviceIndex) {
+		WavefrontPipeline &wf = wavefronts[deviceIndex];
+
+		FreeOCLBuffer(deviceIndex, &wf.pathOriginsBuff);
+		FreeOCLBuffer(deviceIndex, &wf.pathDirectionsBuff);
+		FreeOCLBuffer(deviceIndex, &wf.pathThroughputsBuff);
+		FreeOCLBuffer(deviceIndex, &wf.pathRadiancesBuff);
+		FreeOCLBuffer(deviceIndex, &wf.pathSigmasBuff);
+		FreeOCLBuffer(deviceIndex, &wf.pathMaterialPdfsBuff);
+		FreeOCLBuffer(deviceIndex, &wf.pathHitDistancesBuff);
+		FreeOCLBuffer(deviceIndex, &wf.pathHitSpheresBuff);
+		FreeOCLBuffer(deviceIndex, &wf.rayQueuesBuff);
+		FreeOCLBuffer(deviceIndex, &wf.materialQueuesBuff);
+		FreeOCLBuffer(deviceIndex, &wf.queueCountersBuff);
+	}
+
+	void SetUpWavefrontKernels(const unsigned int deviceIndex, cl::Program &program) {
+		DeleteWavefrontKernels(deviceIndex);
+
+		WavefrontPipeline &wf = wavefronts[deviceIndex];
+		wf.kernelGenerate = new cl::Kernel(program, "WavefrontGenerate");
+		wf.kernelResetQueues = new cl::Kernel(program, "WavefrontResetQueues");
+		wf.kernelIntersect = new cl::Kernel(program, "WavefrontIntersect");
+		for (unsigned int i = 0; i < MATERIAL_COUNT; ++i)
+			wf.kernelsShade[i] = new cl::Kernel(program, wavefrontShadeKernelNames[i]);
+		wf.kernelAccumulate = new cl::Kernel(program, "WavefrontAccumulate");
+
+		cl::Device &oclDevice = selectedDevices[deviceIndex];
+		wf.maxWorkGroupSize = std::min(wf.kernelGenerate->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(oclDevice),
+				wf.kernelIntersect->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(oclDevice));
+		for (unsigned int i = 0; i < MATERIAL_COUNT; ++i)
+			wf.maxWorkGroupSize = std::min(wf.maxWorkGroupSize,
+					wf.kernelsShade[i]->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(oclDevice));
+		wf.maxWorkGroupSize = std::min(wf.maxWorkGroupSize,
+				wf.kernelAccumulate->getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(oclDevice));
+	}
+
+	void DeleteWavefrontKernels(const unsigned int deviceIndex) {
+		WavefrontPipeline &wf = wavefronts[deviceIndex];
+
+		delete wf.kernelGenerate;
+		wf.kernelGenerate = NULL;
+		delete wf.kernelResetQueues;
+		wf.kernelResetQueues = NULL;
+		delete wf.kernelIntersect;
+		wf.kernelIntersect = NULL;
+		for (unsigned int i = 0; i < MATERIAL_COUNT; ++i) {
+			delete wf.kernelsShade[i];
+			wf.kernelsShade[i] = NULL;
+		}
+		delete wf.kernelAccumulate;
+		wf.kernelAccumulate = NULL;
+	}
+
+	// Sets all the arguments but the queue indices and the current sample,
+	// set for each run
+	void UpdateWavefrontKernelArgs(const unsigned int deviceIndex) {
+		WavefrontPipeline &wf = wavefronts[deviceIndex];
+
+		cl::Kernel *kernel = wf.kernelGenerate;
+		kernel->setArg(0, deviceIndex);
+		kernel->setArg(1, *cameraBuff[deviceIndex]);
+		kernel->setArg(2, windowWidth);
+		kernel->setArg(3, windowHeight);
+		kernel->setArg(4, *wf.pathOriginsBuff);
+		kernel->setArg(5, *wf.pathDirectionsBuff);
+		kernel->setArg(6, *wf.pathThroughputsBuff);
+		kernel->setArg(7, *wf.pathRadiancesBuff);
+		kernel->setArg(8, *wf.pathSigmasBuff);
+		kernel->setArg(9, *wf.pathMaterialPdfsBuff);
+		kernel->setArg(10, *wf.rayQueuesBuff);
+		kernel->setArg(11, *wf.queueCountersBuff);
+
+		wf.kernelResetQueues->setArg(0, *wf.queueCountersBuff);
+
+		kernel = wf.kernelIntersect;
+		kernel->setArg(0, deviceIndex);
+		kernel->setArg(1, *spheresBuff[deviceIndex]);
+		kernel->setArg(2, *bvhNodesBuff[deviceIndex]);
+		kernel->setArg(3, *bvhIndicesBuff[deviceIndex]);
+		kernel->setArg(4, lightsPower);
+		kernel->setArg(5, windowWidth);
+		kernel->setArg(6, windowHeight);
+		kernel->setArg(7, *wf.pathOriginsBuff);
+		kernel->setArg(8, *wf.pathDirectionsBuff);
+		kernel->setArg(9, *wf.pathThroughputsBuff);
+		kernel->setArg(10, *wf.pathRadiancesBuff);
+		kernel->setArg(11, *wf.pathSigmasBuff);
+		kernel->setArg(12, *wf.pathMaterialPdfsBuff);
+		kernel->setArg(13, *wf.pathHitDistancesBuff);
+		kernel->setArg(14, *wf.pathHitSpheresBuff);
+		kernel->setArg(15, *wf.rayQueuesBuff);
+		kernel->setArg(16, *wf.materialQueuesBuff);
+		kernel->setArg(17, *wf.queueCountersBuff);
+
+		for (unsigned int i = 0; i < MATERIAL_COUNT; ++i) {
+			kernel = wf.kernelsShade[i];
+			kernel->setArg(0, deviceIndex);
+			kernel->setArg(1, *spheresBuff[deviceIndex]);
+			kernel->setArg(2, *bvhNodesBuff[deviceIndex]);
+			kernel->setArg(3, *bvhIndicesBuff[deviceIndex]);
+			kernel->setArg(4, *lightsBuff[deviceIndex]);
+			kernel->setArg(5, (unsigned int)lights.size());
+			kernel->setArg(6, lightsPower);
+			kernel->setArg(7, windowWidth);
+			kernel->setArg(8, windowHeight);
+			kernel->setArg(9, *wf.pathOriginsBuff);
+			kernel->setArg(10, *wf.pathDirectionsBuff);
+			kernel->setArg(11, *wf.pathThroughputsBuff);
+			kernel->setArg(12, *wf.pathRadiancesBuff);
+			kernel->setArg(13, *wf.pathSigmasBuff);
+			kernel->setArg(14, *wf.pathMaterialPdfsBuff);
+			kernel->setArg(15, *wf.pathHitDistancesBuff);
+			kernel->setArg(16, *wf.pathHitSpheresBuff);
+			kernel->setArg(17, *wf.rayQueuesBuff);
+			kernel->setArg(18, *wf.materialQueuesBuff);
+			kernel->setArg(19, *wf.queueCountersBuff);
+		}
+
+		kernel = wf.kernelAccumulate;
+		kernel->setArg(0, *samplesBuff[deviceIndex]);
+		kernel->setArg(1, *wf.pathRadiancesBuff);
+		kernel->setArg(2, windowWidth);
+		kernel->setArg(3, windowHeight);
+	}
+
+	// Renders one sample of each pixel with the wavefront pipeline: each
+	// bounce traces the rays of a queue and then shades the queue of each
+	// material of the scene. The queue sizes are never read back, all kernels
+	// run a work item for each pixel and the ones past the end of their queue
+	// return immediately.
+	void EnqueueWavefrontSample(const unsigned int deviceIndex) {
+		WavefrontPipeline &wf = wavefronts[deviceIndex];
+		const size_t workGroupSize = std::min(kernelsWorkGroupSize[deviceIndex], wf.maxWorkGroupSize);
+		const cl::NDRange globalThreads(RoundUp<size_t>(windowWidth * windowHeight, workGroupSize));
+		const cl::NDRange localThreads(workGroupSize);
+
+		const unsigned int sample = currentSample[deviceIndex]++;
+		wf.kernelGenerate->setArg(12, sample);
+		wf.kernelIntersect->setArg(19, sample);
+		for (unsigned int i = 0; i < MATERIAL_COUNT; ++i)
+			wf.kernelsShade[i]->setArg(21, sample);
+
+		cl::CommandQueue &oclQueue = deviceQueues[deviceIndex];
+		oclQueue.enqueueNDRangeKernel(*wf.kernelGenerate, cl::NullRange, globalThreads, localThreads,
+				NULL, ProfileEvent(deviceIndex, "WavefrontGenerate", "kernel"));
+
+		// The same number of bounces of the SmallPTGPU kernel
+		for (unsigned int depth = 0; depth <= maxDepth; ++depth) {
+			const unsigned int inputQueue = depth % 2;
+			const unsigned int outputQueue = 1 - inputQueue;
+
+			wf.kernelResetQueues->setArg(1, outputQueue);
+			oclQueue.enqueueNDRangeKernel(*wf.kernelResetQueues, cl::NullRange, cl::NDRange(1), cl::NDRange(1),
+					NULL, ProfileEvent(deviceIndex, "WavefrontResetQueues", "kernel"));
+
+			wf.kernelIntersect->setArg(18, inputQueue);
+			wf.kernelIntersect->setArg(20, depth);
+			oclQueue.enqueueNDRangeKernel(*wf.kernelIntersect, cl::NullRange, globalThreads, localThreads,
+					NULL, ProfileEvent(deviceIndex, "WavefrontIntersect", "kernel"));
+
+			for (unsigned int i = 0; i < MATERIAL_COUNT; ++i) {
+				if (!sceneMaterials[i])
+					continue;
+
+				wf.kernelsShade[i]->setArg(20, outputQueue);
+				wf.kernelsShade[i]->setArg(22, depth);
+				oclQueue.enqueueNDRangeKernel(*wf.kernelsShade[i], cl::NullRange, globalThreads, localThreads,
+						NULL, ProfileEvent(deviceIndex, wavefrontShadeKernelNames[i], "kernel"));
+			}
+		}
+
+		wf.kernelAccumulate->setArg(4, sample);
+		oclQueue.enqueueNDRangeKernel(*wf.kernelAccumulate, cl::NullRange, globalThreads, localThreads,
+				NULL, ProfileEvent(deviceIndex, "WavefrontAccumulate", "kernel"));
+	}
+
+	// Copies (or tone maps, if one single device has been selected) the current
+	// frame in the readback buffer of the slot
+	void EnqueueFrameSnapshot(const unsigned int deviceIndex, const unsigned int slot, cl::Event *event,
+			const VECTOR_CLASS<cl::Event> *waitEvents = NULL) {
+		// The tone mapping (or the copy of the samples) of the frame
+		OCLScopedTimer timer("Frame snapshot enqueue");
+
+		cl::CommandQueue &oclQueue = deviceQueues[deviceIndex];
+		readbackSamples[slot][deviceIndex] = currentSample[deviceIndex];
+
+		if (selectedDevices.size() == 1) {
+			// Image tone mapping
+			kernelToneMapping->setArg(1, *readbackBuff[slot][deviceIndex]);
+			oclQueue.enqueueNDRangeKernel(*kernelToneMapping, cl::NullRange,
+						cl::NDRange(GetGlobalThreads(deviceIndex)), cl::NDRange(kernelsWorkGroupSize[deviceIndex]),
+						NULL, event);
+			ProfileEvent(deviceIndex, *event, "ToneMapping", "kernel");
+		} else {
+			oclQueue.enqueueCopyBuffer(
+					*(samplesBuff[deviceIndex]),
+					*(readbackBuff[slot][deviceIndex]),
+					0,
+					0,
+					samplesBuff[deviceIndex]->getInfo<CL_MEM_SIZE>(),
+					waitEvents, event);
+			ProfileEvent(deviceIndex, *event, "SamplesBuffer", "copy");
+		}
+
+		// The transfer queue waits for this event so it must be submitted
+		oclQueue.flush();
+	}
+
+	// Takes the snapshot of the frame merged by MergeDevicePixels(), after the
+	// end of the merge of the previous snapshot of the same slot
+	void EnqueueSharedFrameSnapshot(const unsigned int deviceIndex, const unsigned int slot, cl::Event *event) {
+		boost::mutex::scoped_lock lock(snapshotMutex);
+
+		VECTOR_CLASS<cl::Event> waitEvents;
+		if (mergeEvents[slot][deviceIndex]())
+			waitEvents.push_back(mergeEvents[slot][deviceIndex]);
+		EnqueueFrameSnapshot(deviceIndex, slot, event, &waitEvents);
+
+		snapshotSlots[deviceIndex] = slot;
+		snapshotEvents[deviceIndex] = *event;
+	}
+
+	// Reads back the readback buffer of the slot on the transfer queue, after
+	// the snapshot, so the kernels of the next frame can run in the meantime
+	void EnqueueReadFrame(const unsigned int deviceIndex, const unsigned int slot,
+			const cl::Event &snapshotEvent, cl::Event *event) {
+		cl::CommandQueue &oclQueue = deviceTransferQueues[deviceIndex];
+
+		VECTOR_CLASS<cl::Event> waitEvents(1, snapshotEvent);
+		EnqueueReadOCLBuffer(deviceIndex, oclQueue, readbackBuff[slot][deviceIndex], CL_FALSE,
+				readbackPixels[slot][deviceIndex], &waitEvents, event);
+		ProfileEvent(deviceIndex, *event, "ReadbackBuffer", "read", 1);
+
+		oclQueue.flush();
+	}
+
+	static void RenderThreadImpl(SmallPTGPU *smallptgpu, const unsigned int threadIndex,
+			const OCLCancellationToken &cancellation) {
+		// A device stops for good after an error
+		if (smallptgpu->failedDevices[threadIndex])
+			return;
+
 		try {
-			size_t globalThreads = smallptgpu->windowWidth * smallptgpu->windowHeight;
-			if (globalThreads % smallptgpu->kernelsWorkGroupSize[threadIndex] != 0)
-				globalThreads = (globalThreads / smallptgpu->kernelsWorkGroupSize[threadIndex] + 1) * smallptgpu->kernelsWorkGroupSize[threadIndex];
+			// Wait for the compilation of the kernels of this device
+			while (!smallptgpu->kernelsSmallPT[threadIndex]) {
+				if (cancellation.IsCancelled())
+					return;
+				if (!smallptgpu->SwapCompiledKernels(threadIndex, false))
+					boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+			}
 
 			unsigned int kernelIterations = 1;
 			smallptgpu->sampleSec[threadIndex] = 0.0;
 			smallptgpu->currentSample[threadIndex] = 0;
-			while (!boost::this_thread::interruption_requested()) {
-				const double startTime = WallClockTime();
-
-				cl::CommandQueue &oclQueue = smallptgpu->deviceQueues[threadIndex];
-				for (unsigned int i = 0; i < kernelIterations; ++i) {
-					// Set kernel arguments
-					smallptgpu->kernelsSmallPT[threadIndex]->setArg(7, smallptgpu->currentSample[threadIndex]++);
 
-					// Enqueue a kernel run
-					oclQueue.enqueueNDRangeKernel(*(smallptgpu->kernelsSmallPT[threadIndex]), cl::NullRange,
-							cl::NDRange(globalThreads), cl::NDRange(smallptgpu->kernelsWorkGroupSize[threadIndex]));
+			// Frame N is read back on the transfer queue while the kernels
+			// of frame N + 1 run on the compute queue
+			unsigned int slot = 0;
+			cl::Event &readbackEvent = smallptgpu->readbackEvents[threadIndex];
+			readbackEvent = cl::Event();
+			while (!cancellation.IsCancelled()) {
+				// Switch from the preview to the full kernel when it is compiled
+				if (smallptgpu->SwapCompiledKernels(threadIndex, false))
+					kernelIterations = 1;
+
+				// The devices too slow to be worth it are left idle
+				if (!(smallptgpu->GetDeviceWeight(threadIndex) > 0.0)) {
+					smallptgpu->sampleSec[threadIndex] = 0.0;
+					boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+					continue;
 				}
 
-				if (smallptgpu->selectedDevices.size() == 1) {
-					// Image tone mapping
-					oclQueue.enqueueNDRangeKernel(*(smallptgpu->kernelToneMapping), cl::NullRange,
-								cl::NDRange(globalThreads), cl::NDRange(smallptgpu->kernelsWorkGroupSize[threadIndex]));
-
-					// Read back the result
-					oclQueue.enqueueReadBuffer(
-							*(smallptgpu->pixelsBuff),
-							CL_TRUE,
-							0,
-							smallptgpu->pixelsBuff->getInfo<CL_MEM_SIZE>(),
-							smallptgpu->pixels[0]);
+				const double startTime = WallClockTime();
+
+				smallptgpu->EnqueueKernels(threadIndex, kernelIterations);
+				cl::Event snapshotEvent;
+				if (smallptgpu->deviceMerge) {
+					// The snapshot is merged on the device, there is nothing to
+					// read back but the previous frame is still waited for
+					smallptgpu->EnqueueSharedFrameSnapshot(threadIndex, slot, &snapshotEvent);
+					if (readbackEvent()) {
+						OCLScopedTimer timer("Readback wait");
+						readbackEvent.wait();
+					}
+					readbackEvent = snapshotEvent;
 				} else {
-					// Read back the result
-					oclQueue.enqueueReadBuffer(
-							*(smallptgpu->samplesBuff[threadIndex]),
-							CL_TRUE,
-							0,
-							smallptgpu->samplesBuff[threadIndex]->getInfo<CL_MEM_SIZE>(),
-							smallptgpu->pixels[threadIndex]);
+					smallptgpu->EnqueueFrameSnapshot(threadIndex, slot, &snapshotEvent);
+
+					// Wait for the previous frame before reusing its host buffer
+					if (readbackEvent()) {
+						OCLScopedTimer timer("Readback wait");
+						readbackEvent.wait();
+						smallptgpu->pixels[threadIndex] = smallptgpu->readbackPixels[1 - slot][threadIndex];
+						smallptgpu->pixelsSamples[threadIndex] = smallptgpu->readbackSamples[1 - slot][threadIndex];
+					}
+
+					smallptgpu->EnqueueReadFrame(threadIndex, slot, snapshotEvent, &readbackEvent);
 				}
+				slot = 1 - slot;
 
 				const double elapsedTime = WallClockTime() - startTime;
 
@@ -973,34 +1930,106 @@ private:
 					kernelIterations = std::max(kernelIterations - 1u, 1u);
 				}
 			}
+
+			// Wait for the last frame
+			if (readbackEvent()) {
+				readbackEvent.wait();
+				smallptgpu->pixels[threadIndex] = smallptgpu->readbackPixels[1 - slot][threadIndex];
+				smallptgpu->pixelsSamples[threadIndex] = smallptgpu->readbackSamples[1 - slot][threadIndex];
+				readbackEvent = cl::Event();
+			}
 		} catch (cl::Error err) {
-			OCLTOY_LOG("RenderThreadImpl OpenCL ERROR: " << err.what() << "(" << OCLErrorString(err.err()) << ")");
+			OCLTOY_LOG_ERROR("RenderThreadImpl OpenCL ERROR: " << err.what() << "(" << OCLErrorString(err.err()) << ")");
+			smallptgpu->StopDevice(threadIndex);
 		} catch (std::runtime_error err) {
-			OCLTOY_LOG("RenderThreadImpl RUNTIME ERROR: " << err.what());
+			OCLTOY_LOG_ERROR("RenderThreadImpl RUNTIME ERROR: " << err.what());
+			smallptgpu->StopDevice(threadIndex);
 		} catch (std::exception err) {
-			OCLTOY_LOG("RenderThreadImpl ERROR: " << err.what());
+			OCLTOY_LOG_ERROR("RenderThreadImpl ERROR: " << err.what());
+			smallptgpu->StopDevice(threadIndex);
 		}
 	}
 
+	// Drops a device from the rendering (and from the merge of the frames)
+	// after an error in its rendering loop
+	void StopDevice(const unsigned int deviceIndex) {
+		failedDevices[deviceIndex] = 1;
+		sampleSec[deviceIndex] = 0.0;
+		OCLTOY_LOG_ERROR("Device " << deviceIndex << " has stopped rendering");
+	}
+
 	std::vector<cl::Buffer *> samplesBuff;
-	std::vector<cl::Buffer *> seedsBuff;
 	std::vector<cl::Buffer *> cameraBuff;
 	std::vector<cl::Buffer *> spheresBuff;
-
+	std::vector<cl::Buffer *> bvhNodesBuff;
+	std::vector<cl::Buffer *> bvhIndicesBuff;
+	std::vector<cl::Buffer *> lightsBuff;
+
+	RenderingMode renderingMode;
+	std::vector<WavefrontPipeline> wavefronts;
+	// The SmallPTGPUPersistent kernels (NULL until the full kernel has been
+	// compiled), their CL_KERNEL_WORK_GROUP_SIZE and their 2 work counters
+	std::vector<cl::Kernel *> kernelsPersistent;
+	std::vector<size_t> persistentMaxWorkGroupSize;
+	std::vector<cl::Buffer *> workCountersBuff;
+	// The number of runs of SmallPTGPUPersistent of each device: the parity
+	// selects the work counter
+	std::vector<unsigned int> persistentRuns;
+	// The materials of the not emissive spheres: the shade kernels of the
+	// other materials are not enqueued
+	bool sceneMaterials[MATERIAL_COUNT];
+
+	// The kernels of a device are NULL until its program has been compiled
 	std::vector<cl::Kernel *> kernelsSmallPT;
 	std::vector<size_t> kernelsWorkGroupSize;
+	std::vector<std::string> tuningKeys;
+	std::vector<std::string> calibrationKeys;
+	std::vector<OCLAsyncProgramBuild *> programBuilds;
+	// 1 if the rendering of the device has stopped after an error (i.e. the
+	// compilation of its full kernel has failed)
+	std::vector<int> failedDevices;
+	boost::mutex setUpMutex;
 	// This kernel is compiled and used only if one single device has been selected
 	cl::Kernel *kernelToneMapping;
 
 	float gammaTable[GAMMA_TABLE_SIZE];
+	// The last frame read back from each device (it points to one of the readbackPixels)
 	std::vector<float *> pixels;
-	// Used only when one single device is selected
-	cl::Buffer *pixelsBuff;
+	// The number of samples of each pixel of the frames
+	std::vector<unsigned int> pixelsSamples;
+	// Double-buffered readback: with one single device, they hold the tone
+	// mapped pixels otherwise a copy of the samples
+	std::vector<cl::Buffer *> readbackBuff[2];
+	// The host side of the readback, in pinned memory (or the memory of
+	// readbackBuff with zero-copy devices)
+	std::vector<OCLStagingBuffer *> readbackStaging[2];
+	std::vector<float *> readbackPixels[2];
+	std::vector<unsigned int> readbackSamples[2];
+	std::vector<cl::Event> readbackEvents;
 	// Used only when multiple devices are selected
 	float *mergedPixels;
 
+	// Set if all devices share the same context: the last frame snapshot of
+	// each device (the readback buffer of snapshotSlots, -1 if there is none)
+	// is merged on the device in mergeSamplesBuff and tone mapped in
+	// mergePixelsBuff (both allocated by the first device)
+	bool deviceMerge;
+	std::vector<cl::Kernel *> kernelsMergeSamples;
+	std::vector<cl::Kernel *> kernelsMergeToneMapping;
+	cl::Buffer *mergeSamplesBuff;
+	cl::Buffer *mergePixelsBuff;
+	boost::mutex snapshotMutex;
+	std::vector<int> snapshotSlots;
+	std::vector<cl::Event> snapshotEvents;
+	// The last merge of the readback buffer of each slot and device
+	std::vector<cl::Event> mergeEvents[2];
+
 	Camera camera;
 	std::vector<Sphere> spheres;
+	SphereBVH bvh;
+	// The emissive spheres with the cdf of their power, and the total power
+	std::vector<Light> lights;
+	float lightsPower;
 	unsigned int maxDepth;
 	float defaultVolumeSigmaS, defaultVolumeSigmaA;
 
@@ -1010,7 +2039,8 @@ private:
 	std::vector<double> sampleSec;
 	std::vector<unsigned int> currentSample;
 
-	std::vector<boost::thread *> renderThreads;
+	OCLCancellationToken renderCancellation;
+	std::vector<OCLTaskFuture> renderTasks;
 };
 
 int main(int argc, char **argv) {
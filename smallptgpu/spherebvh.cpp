@@ -0,0 +1,158 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#include "spherebvh.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <boost/lexical_cast.hpp>
+
+namespace {
+
+void BBoxInit(BVHNode *node) {
+	const float inf = std::numeric_limits<float>::infinity();
+	vinit(node->bboxMin, inf, inf, inf);
+	vinit(node->bboxMax, -inf, -inf, -inf);
+}
+
+void BBoxAddSphere(BVHNode *node, const Sphere &s) {
+	node->bboxMin.x = std::min(node->bboxMin.x, s.p.x - s.rad);
+	node->bboxMin.y = std::min(node->bboxMin.y, s.p.y - s.rad);
+	node->bboxMin.z = std::min(node->bboxMin.z, s.p.z - s.rad);
+	node->bboxMax.x = std::max(node->bboxMax.x, s.p.x + s.rad);
+	node->bboxMax.y = std::max(node->bboxMax.y, s.p.y + s.rad);
+	node->bboxMax.z = std::max(node->bboxMax.z, s.p.z + s.rad);
+}
+
+void BBoxAddNode(BVHNode *node, const BVHNode &n) {
+	node->bboxMin.x = std::min(node->bboxMin.x, n.bboxMin.x);
+	node->bboxMin.y = std::min(node->bboxMin.y, n.bboxMin.y);
+	node->bboxMin.z = std::min(node->bboxMin.z, n.bboxMin.z);
+	node->bboxMax.x = std::max(node->bboxMax.x, n.bboxMax.x);
+	node->bboxMax.y = std::max(node->bboxMax.y, n.bboxMax.y);
+	node->bboxMax.z = std::max(node->bboxMax.z, n.bboxMax.z);
+}
+
+float GetCoordinate(const Vec &v, const unsigned int axis) {
+	return (axis == 0) ? v.x : ((axis == 1) ? v.y : v.z);
+}
+
+// Orders the sphere indices along an axis of the sphere centers
+class SphereCenterLess {
+public:
+	SphereCenterLess(const std::vector<Sphere> &s, const unsigned int a) :
+		spheres(s), axis(a) { }
+
+	bool operator()(const unsigned int i0, const unsigned int i1) const {
+		return GetCoordinate(spheres[i0].p, axis) < GetCoordinate(spheres[i1].p, axis);
+	}
+
+private:
+	const std::vector<Sphere> &spheres;
+	unsigned int axis;
+};
+
+}
+
+void SphereBVH::Build(const std::vector<Sphere> &spheres) {
+	// An empty leaf would look like an inner node (count is 0)
+	if (spheres.size() == 0)
+		throw std::runtime_error("The sphere BVH needs at least one sphere");
+
+	nodes.clear();
+	sphereIndices.resize(spheres.size());
+	for (unsigned int i = 0; i < spheres.size(); ++i)
+		sphereIndices[i] = i;
+	depth = 0;
+
+	// A balanced tree has less than 2 * spheres / BVH_MAX_LEAF_SIZE nodes
+	nodes.reserve(std::max<size_t>(1, 2 * spheres.size() / BVH_MAX_LEAF_SIZE + 1));
+	BuildNode(spheres, 0, (unsigned int)spheres.size(), 1);
+
+	if (depth > BVH_STACK_SIZE)
+		throw std::runtime_error("The sphere BVH is too deep: " + boost::lexical_cast<std::string>(depth));
+}
+
+// Splits the spheres at the median of the longest axis of their centers, so
+// the depth of the tree is always about log2(spheres / BVH_MAX_LEAF_SIZE)
+unsigned int SphereBVH::BuildNode(const std::vector<Sphere> &spheres,
+		const unsigned int begin, const unsigned int end, const unsigned int level) {
+	depth = std::max(depth, level);
+
+	const unsigned int nodeIndex = (unsigned int)nodes.size();
+	nodes.push_back(BVHNode());
+
+	BVHNode node;
+	BBoxInit(&node);
+	BVHNode centers;
+	BBoxInit(&centers);
+	for (unsigned int i = begin; i < end; ++i) {
+		const Sphere &s = spheres[sphereIndices[i]];
+		BBoxAddSphere(&node, s);
+		vinit(centers.bboxMin, std::min(centers.bboxMin.x, s.p.x),
+				std::min(centers.bboxMin.y, s.p.y), std::min(centers.bboxMin.z, s.p.z));
+		vinit(centers.bboxMax, std::max(centers.bboxMax.x, s.p.x),
+				std::max(centers.bboxMax.y, s.p.y), std::max(centers.bboxMax.z, s.p.z));
+	}
+
+	if (end - begin <= BVH_MAX_LEAF_SIZE) {
+		node.first = begin;
+		node.count = end - begin;
+		nodes[nodeIndex] = node;
+
+		return nodeIndex;
+	}
+
+	Vec extent;
+	vsub(extent, centers.bboxMax, centers.bboxMin);
+	const unsigned int axis = ((extent.x > extent.y) && (extent.x > extent.z)) ? 0 :
+		((extent.y > extent.z) ? 1 : 2);
+
+	const unsigned int middle = (begin + end) / 2;
+	std::nth_element(sphereIndices.begin() + begin, sphereIndices.begin() + middle,
+			sphereIndices.begin() + end, SphereCenterLess(spheres, axis));
+
+	// The left child is always the next node
+	BuildNode(spheres, begin, middle, level + 1);
+	node.first = BuildNode(spheres, middle, end, level + 1);
+	node.count = 0;
+	nodes[nodeIndex] = node;
+
+	return nodeIndex;
+}
+
+void SphereBVH::Refit(const std::vector<Sphere> &spheres) {
+	// The children are always after their parent
+	for (size_t i = nodes.size(); i-- > 0;) {
+		BVHNode &node = nodes[i];
+		BBoxInit(&node);
+
+		if (node.count) {
+			for (unsigned int j = node.first; j < node.first + node.count; ++j)
+				BBoxAddSphere(&node, spheres[sphereIndices[j]]);
+		} else {
+			BBoxAddNode(&node, nodes[i + 1]);
+			BBoxAddNode(&node, nodes[node.first]);
+		}
+	}
+}
@@ -0,0 +1,59 @@
+/***************************************************************************
+ *   Copyright (C) 1998-2013 by authors (see AUTHORS.txt )                 *
+ *                                                                         *
+ *   This file is part of OCLToys.                                         *
+ *                                                                         *
+ *   OCLToys is free software; you can redistribute it and/or modify       *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 3 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   OCLToys is distributed in the hope that it will be useful,            *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>. *
+ *                                                                         *
+ *   OCLToys website: http://code.google.com/p/ocltoys                     *
+ ***************************************************************************/
+
+
+#ifndef _SPHEREBVH_H
+#define	_SPHEREBVH_H
+
+#include <vector>
+
+#include "geom.h"
+
+// The max. number of spheres in a BVH leaf
+#define BVH_MAX_LEAF_SIZE 4
+
+// A bounding volume hierarchy of the spheres, built on the host and traversed
+// by the rendering kernel
+class SphereBVH {
+public:
+	SphereBVH() : depth(0) { }
+
+	// Builds the tree from scratch (the number of spheres has changed). There
+	// must be at least one sphere.
+	void Build(const std::vector<Sphere> &spheres);
+	// Updates the bounding boxes of the nodes when the spheres have moved,
+	// the topology of the tree is left unchanged
+	void Refit(const std::vector<Sphere> &spheres);
+
+	const std::vector<BVHNode> &GetNodes() const { return nodes; }
+	const std::vector<unsigned int> &GetSphereIndices() const { return sphereIndices; }
+	unsigned int GetDepth() const { return depth; }
+
+private:
+	unsigned int BuildNode(const std::vector<Sphere> &spheres,
+		const unsigned int begin, const unsigned int end, const unsigned int level);
+
+	std::vector<BVHNode> nodes;
+	std::vector<unsigned int> sphereIndices;
+	unsigned int depth;
+};
+
+#endif	/* _SPHEREBVH_H */